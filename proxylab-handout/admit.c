@@ -0,0 +1,300 @@
+/*
+ * admit.c - admission control
+ *
+ * Every engine asks the same questions before it takes on work, and
+ * turns away what it cannot serve in time with a canned response rather
+ * than letting it queue:
+ *
+ *   - admit_conn() caps the client connections open at once (-C). One
+ *     over the cap is answered 503 and closed as soon as it is accepted,
+ *     so overload costs an accept and a write rather than a worker.
+ *   - admit_late() sheds a connection that waited longer than the queue
+ *     target (-Q) before anything looked at it: in the threaded engine
+ *     the time it sat in the connection queue, in the event engines how
+ *     long the loop's last batch took. A client that waited that long
+ *     is better off hearing at once that it should retry.
+ *   - admit_request() charges each request to a token bucket for the
+ *     client's address (-r rate[,burst]) and answers 429 when it is
+ *     empty, so one client cannot take every worker from the others.
+ *   - admit_fetch() caps the requests waiting on an origin at once (-F).
+ *     Hits are always served; a miss over the cap gets a 503.
+ *
+ * The caps are single atomic counters, kept whether or not a cap is
+ * set so that admit_init() can change the caps while the proxy runs and
+ * admit_open_conns() can tell a draining proxy when it is done. Buckets
+ * live in a fixed table of ADMIT_CLIENTS, ADMIT_WAYS to a set, each set
+ * guarded by one of ADMIT_LOCKS striped mutexes; a new client takes the
+ * set's least recently used bucket, so a client whose bucket was taken
+ * starts again with a full one. Everything is off until admit_init()
+ * turns it on.
+ */
+#include <stdatomic.h>
+#include "csapp.h"
+#include "admit.h"
+#include "metrics.h"
+
+typedef struct {
+    uint64_t client;           /* 0 if unused */
+    double tokens;
+    long long last;            /* When tokens was last topped up */
+} admit_bucket_t;
+
+static int admit_max_conns = 0;
+static int admit_max_fetches = 0;
+static double admit_rate = 0;
+static double admit_burst = 0;
+static long long admit_queue_ns = 0;
+
+static atomic_int admit_conns;
+static atomic_int admit_fetches;
+static admit_bucket_t *admit_buckets;
+static pthread_mutex_t admit_locks[ADMIT_LOCKS];
+
+/*
+ * admit_init - Cap client connections at max_conns and fetches from
+ *     origins at max_fetches, let each client make rate requests a
+ *     second with bursts of up to burst, and shed connections that wait
+ *     more than queue_ms. A zero turns the corresponding limit off.
+ *     Called again, on a reload, it changes the limits in place; a rate
+ *     limit turned on then applies to connections opened afterwards.
+ */
+void admit_init(int max_conns, int max_fetches, double rate, double burst,
+                long long queue_ms)
+{
+    int i;
+
+    admit_max_conns = max_conns;
+    admit_max_fetches = max_fetches;
+    admit_queue_ns = queue_ms * 1000000;
+    if (rate > 0 && !admit_buckets) {
+        for (i = 0; i < ADMIT_LOCKS; i++) {
+            pthread_mutex_init(&admit_locks[i], NULL);
+        }
+        admit_buckets = Calloc(ADMIT_CLIENTS, sizeof(admit_bucket_t));
+    }
+    admit_burst = burst >= 1 ? burst : 1;
+    admit_rate = rate;
+}
+
+/*
+ * admit_parse_rate - Parse -r's "rate[,burst]", the burst defaulting
+ *     to ADMIT_BURST_SECS of rate. Returns -1 if s is not one.
+ */
+int admit_parse_rate(const char *s, double *rate, double *burst)
+{
+    char *end;
+
+    *rate = strtod(s, &end);
+    if (end == s || *rate < 0) {
+        return -1;
+    }
+    if (*end == ',') {
+        s = end + 1;
+        *burst = strtod(s, &end);
+        if (end == s || *burst < 0) {
+            return -1;
+        }
+    } else {
+        *burst = *rate * ADMIT_BURST_SECS;
+    }
+    return *end ? -1 : 0;
+}
+
+/* Take one of count's slots unless max, if set, are taken already */
+static int admit_take(atomic_int *count, int max)
+{
+    if (atomic_fetch_add_explicit(count, 1, memory_order_relaxed) >= max && max > 0) {
+        atomic_fetch_sub_explicit(count, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+static void admit_give(atomic_int *count)
+{
+    atomic_fetch_sub_explicit(count, 1, memory_order_relaxed);
+}
+
+/*
+ * admit_conn - Whether a connection just accepted may be served. If it
+ *     may, admit_conn_done() must be called once it is closed; if not,
+ *     the caller sheds it with admit_shed().
+ */
+int admit_conn(void)
+{
+    if (!admit_take(&admit_conns, admit_max_conns)) {
+        metrics_count(METRIC_SHED_CONNS);
+        return 0;
+    }
+    return 1;
+}
+
+void admit_conn_done(void)
+{
+    admit_give(&admit_conns);
+}
+
+/* admit_open_conns - Client connections admitted and not yet closed */
+int admit_open_conns(void)
+{
+    return atomic_load_explicit(&admit_conns, memory_order_relaxed);
+}
+
+/*
+ * admit_late - Whether a connection that waited waited nanoseconds to
+ *     be looked at should be shed rather than served
+ */
+int admit_late(long long waited)
+{
+    if (admit_queue_ns > 0 && waited > admit_queue_ns) {
+        metrics_count(METRIC_SHED_QUEUED);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * admit_shed - Answer the connection fd, before its request has been
+ *     read, with a 503 and close it. Never blocks. What the client has
+ *     sent already is read first, so that closing does not reset the
+ *     connection before the 503 reaches it.
+ */
+void admit_shed(int fd)
+{
+    char buf[MAXLINE];
+    size_t len;
+    char *resp = admit_response(503, &len);
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+    if (send(fd, resp, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+        shutdown(fd, SHUT_WR);
+    }
+    Free(resp);
+    Close(fd);
+}
+
+/*
+ * admit_client - The key admit_request() knows the client connected on
+ *     fd by: its address, hashed, or 0 if rate limits are off or the
+ *     address cannot be had. IPv4 clients over IPv6 count as IPv4 ones.
+ */
+uint64_t admit_client(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    const unsigned char *p;
+    size_t n, i;
+    uint64_t h = 14695981039346656037ULL;
+
+    if (!admit_buckets || getpeername(fd, (SA *)&addr, &len) < 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        p = (const unsigned char *)&((struct sockaddr_in *)&addr)->sin_addr;
+        n = 4;
+    } else if (addr.ss_family == AF_INET6) {
+        struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+
+        p = (const unsigned char *)a;
+        n = 16;
+        if (IN6_IS_ADDR_V4MAPPED(a)) {
+            p += 12;
+            n = 4;
+        }
+    } else {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;     /* FNV-1a */
+    }
+    return h ? h : 1;
+}
+
+/*
+ * admit_request - Charge a request to client, a key from admit_client().
+ *     Returns 0 if its bucket is empty and the request should be
+ *     answered 429 instead, else 1.
+ */
+int admit_request(uint64_t client)
+{
+    size_t set = (size_t)(client % (ADMIT_CLIENTS / ADMIT_WAYS));
+    admit_bucket_t *b = &admit_buckets[set * ADMIT_WAYS];
+    admit_bucket_t *found = NULL, *oldest = b;
+    pthread_mutex_t *lock = &admit_locks[set % ADMIT_LOCKS];
+    long long now;
+    int i, ok;
+
+    if (!client || admit_rate <= 0) {
+        return 1;
+    }
+    now = metrics_now();
+    pthread_mutex_lock(lock);
+    for (i = 0; i < ADMIT_WAYS; i++) {
+        if (b[i].client == client) {
+            found = &b[i];
+            break;
+        }
+        if (b[i].last < oldest->last) {
+            oldest = &b[i];
+        }
+    }
+    if (!found) {
+        found = oldest;
+        found->client = client;
+        found->tokens = admit_burst;
+    } else {
+        found->tokens += (double)(now - found->last) / 1e9 * admit_rate;
+        if (found->tokens > admit_burst) {
+            found->tokens = admit_burst;
+        }
+    }
+    found->last = now;
+    if ((ok = found->tokens >= 1)) {
+        found->tokens -= 1;
+    }
+    pthread_mutex_unlock(lock);
+
+    if (!ok) {
+        metrics_count(METRIC_RATE_LIMITED);
+    }
+    return ok;
+}
+
+/*
+ * admit_fetch - Whether a request may go to its origin. If it may,
+ *     admit_fetch_done() must be called once it is answered; if not, it
+ *     should be answered 503.
+ */
+int admit_fetch(void)
+{
+    if (!admit_take(&admit_fetches, admit_max_fetches)) {
+        metrics_count(METRIC_SHED_FETCHES);
+        return 0;
+    }
+    return 1;
+}
+
+void admit_fetch_done(void)
+{
+    admit_give(&admit_fetches);
+}
+
+/*
+ * admit_response - Build, in a Malloc()ed buffer, the response the
+ *     proxy refuses a request with: 429 or 503, asking the client to
+ *     retry in a second, and closing the connection
+ */
+char *admit_response(int status, size_t *len)
+{
+    const char *reason = status == 429 ? "Too Many Requests" : "Service Unavailable";
+    const char *body = status == 429 ? "Too many requests\n" : "Proxy overloaded\n";
+    char *resp = Malloc(MAXLINE);
+    int n = snprintf(resp, MAXLINE,
+                     "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\nRetry-After: 1\r\nConnection: close\r\n\r\n%s",
+                     status, reason, strlen(body), body);
+
+    *len = (size_t)n;
+    return resp;
+}
@@ -0,0 +1,33 @@
+/*
+ * admit.h - admission control: connection and fetch caps, per-client
+ *     rate limits and shedding of work that queued for too long
+ */
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <stdint.h>
+
+#define ADMIT_CLIENTS 4096             /* Client buckets remembered */
+#define ADMIT_WAYS 4                   /* Buckets a client may take */
+#define ADMIT_LOCKS 64
+#define ADMIT_BURST_SECS 2             /* Default burst, in seconds of rate */
+
+void admit_init(int max_conns, int max_fetches, double rate, double burst,
+                long long queue_ms);
+int admit_parse_rate(const char *s, double *rate, double *burst);
+
+int admit_conn(void);
+void admit_conn_done(void);
+int admit_open_conns(void);
+int admit_late(long long waited);
+void admit_shed(int fd);
+
+uint64_t admit_client(int fd);
+int admit_request(uint64_t client);
+
+int admit_fetch(void);
+void admit_fetch_done(void);
+
+char *admit_response(int status, size_t *len);
+
+#endif /* __ADMIT_H__ */
@@ -0,0 +1,343 @@
+/*
+ * balance.c - choice among an origin's addresses
+ *
+ * A name with several addresses used to send every connection to the
+ * first one that answered. balance_order() now decides the order in
+ * which a request tries them, from what the proxy has seen of each:
+ *
+ *   - Every address keeps the requests in flight to it and an EWMA of
+ *     how long it took to answer. Its score is the EWMA scaled by one
+ *     more than the requests in flight and by one more than its
+ *     failures since it last answered; an address not yet timed counts
+ *     as being as fast as the fastest.
+ *   - The first address is the better scoring of two picked at random
+ *     from the healthy ones (power of two choices), which spreads load
+ *     without herding every request onto the one that looked best a
+ *     moment ago. The rest follow, best first.
+ *   - BALANCE_TRIP failures in a row break an address's circuit: it is
+ *     only tried after every healthy one for BALANCE_COOLDOWN seconds.
+ *     Then one request probes it first, and an answer closes the
+ *     circuit again while a failure keeps it open for another cooldown.
+ *
+ * Callers bracket each request to an address with balance_begin() and
+ * balance_done(), the latter when the first byte of the response
+ * arrives or the attempt fails. Connects give up after -O milliseconds
+ * (BALANCE_CONNECT_TIMEOUT_MS by default) rather than the kernel's
+ * couple of minutes, so a blackholed address costs a bounded wait.
+ *
+ * Statistics live in a fixed table laid out like admit.c's buckets:
+ * BALANCE_SLOTS slots, BALANCE_WAYS to a set, under striped locks, a
+ * new address taking its set's least recently used slot.
+ */
+#include <poll.h>
+#include <stdint.h>
+#include "csapp.h"
+#include "balance.h"
+#include "metrics.h"
+
+#define BALANCE_EWMA_WEIGHT 0.2
+
+typedef struct {
+    uint64_t key;              /* 0 if unused */
+    int inflight;
+    int fails;                 /* Failures since the last answer */
+    long long broken_until;    /* While its circuit is open, else 0 */
+    double ewma;               /* Time to answer in ns, 0 before the first */
+    long long last;            /* When it was last used */
+} balance_stat_t;
+
+static balance_stat_t balance_stats[BALANCE_SLOTS];
+static pthread_mutex_t balance_locks[BALANCE_LOCKS];
+static pthread_once_t balance_once = PTHREAD_ONCE_INIT;
+static int balance_timeout_ms = BALANCE_CONNECT_TIMEOUT_MS;
+static __thread uint64_t balance_rng = 0;
+
+static void balance_init_locks(void)
+{
+    int i;
+
+    for (i = 0; i < BALANCE_LOCKS; i++) {
+        pthread_mutex_init(&balance_locks[i], NULL);
+    }
+}
+
+/* balance_set_connect_timeout - Give up on connects after ms milliseconds */
+void balance_set_connect_timeout(int ms)
+{
+    balance_timeout_ms = ms;
+}
+
+int balance_connect_timeout(void)
+{
+    return balance_timeout_ms;
+}
+
+/* balance_peer - Remember the address ai in peer */
+void balance_peer(balance_peer_t *peer, const struct addrinfo *ai)
+{
+    memcpy(&peer->addr, ai->ai_addr, ai->ai_addrlen);
+    peer->len = ai->ai_addrlen;
+}
+
+static uint64_t balance_key(const struct sockaddr *sa, socklen_t len)
+{
+    const unsigned char *p = (const unsigned char *)sa;
+    uint64_t h = 14695981039346656037ULL;
+    socklen_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;     /* FNV-1a */
+    }
+    return h ? h : 1;
+}
+
+/*
+ * balance_stat - Find the slot for key, locking its set, or with create
+ *     set, take one for it. Returns NULL, with the set unlocked, if key
+ *     has no slot.
+ */
+static balance_stat_t *balance_stat(uint64_t key, int create, long long now)
+{
+    size_t set = (size_t)(key % (BALANCE_SLOTS / BALANCE_WAYS));
+    balance_stat_t *s = &balance_stats[set * BALANCE_WAYS];
+    balance_stat_t *oldest = s;
+    int i;
+
+    pthread_once(&balance_once, balance_init_locks);
+    pthread_mutex_lock(&balance_locks[set % BALANCE_LOCKS]);
+    for (i = 0; i < BALANCE_WAYS; i++) {
+        if (s[i].key == key) {
+            return &s[i];
+        }
+        if (s[i].last < oldest->last) {
+            oldest = &s[i];
+        }
+    }
+    if (!create) {
+        pthread_mutex_unlock(&balance_locks[set % BALANCE_LOCKS]);
+        return NULL;
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->key = key;
+    oldest->last = now;
+    return oldest;
+}
+
+static void balance_unlock(uint64_t key)
+{
+    pthread_mutex_unlock(&balance_locks[(key % (BALANCE_SLOTS / BALANCE_WAYS)) % BALANCE_LOCKS]);
+}
+
+static uint64_t balance_random(void)
+{
+    uint64_t x = balance_rng;
+
+    if (!x) {
+        x = (uint64_t)metrics_now() ^ (uint64_t)(uintptr_t)&balance_rng;
+        x = x ? x : 1;
+    }
+    x ^= x << 13;              /* xorshift64 */
+    x ^= x >> 7;
+    x ^= x << 17;
+    balance_rng = x;
+    return x;
+}
+
+/*
+ * balance_order - Fill order with the addresses in list, at most
+ *     BALANCE_MAX_ADDRS of them, in the order a request should try them.
+ *     Returns how many there are.
+ */
+int balance_order(struct addrinfo *list, struct addrinfo **order)
+{
+    struct addrinfo *healthy[BALANCE_MAX_ADDRS], *broken[BALANCE_MAX_ADDRS];
+    double score[BALANCE_MAX_ADDRS], fastest = 0;
+    long long until[BALANCE_MAX_ADDRS];
+    int inflight[BALANCE_MAX_ADDRS], fails[BALANCE_MAX_ADDRS];
+    struct addrinfo *probe = NULL, *p;
+    long long now = metrics_now();
+    int nhealthy = 0, nbroken = 0, n = 0, i, j;
+
+    for (p = list; p && nhealthy + nbroken + (probe != NULL) < BALANCE_MAX_ADDRS; p = p->ai_next) {
+        uint64_t key = balance_key(p->ai_addr, p->ai_addrlen);
+        balance_stat_t *s = balance_stat(key, 0, now);
+        double ewma = 0;
+        long long b = 0;
+        int busy = 0, failed = 0;
+
+        if (s) {
+            b = s->broken_until;
+            if (b && now >= b && !probe) {
+                s->broken_until = now + BALANCE_COOLDOWN * 1000000000LL;
+                b = 0;
+                probe = p;
+            }
+            ewma = s->ewma;
+            busy = s->inflight;
+            failed = s->fails;
+            balance_unlock(key);
+        }
+        if (p == probe) {
+            continue;
+        }
+        if (b) {
+            /* Soonest to be probed first, by insertion */
+            for (i = nbroken; i > 0 && until[i - 1] > b; i--) {
+                broken[i] = broken[i - 1];
+                until[i] = until[i - 1];
+            }
+            broken[i] = p;
+            until[i] = b;
+            nbroken++;
+            continue;
+        }
+        if (ewma > 0 && (fastest == 0 || ewma < fastest)) {
+            fastest = ewma;
+        }
+        healthy[nhealthy] = p;
+        score[nhealthy] = ewma;
+        inflight[nhealthy] = busy;
+        fails[nhealthy] = failed;
+        nhealthy++;
+    }
+
+    /* Untimed addresses count as the fastest, then sort best first */
+    for (i = 0; i < nhealthy; i++) {
+        struct addrinfo *a = healthy[i];
+        double sc = (score[i] > 0 ? score[i] : fastest > 0 ? fastest : 1) *
+                    (inflight[i] + 1) * (fails[i] + 1);
+
+        for (j = i; j > 0 && score[j - 1] > sc; j--) {
+            healthy[j] = healthy[j - 1];
+            score[j] = score[j - 1];
+        }
+        healthy[j] = a;
+        score[j] = sc;
+    }
+
+    if (probe) {
+        order[n++] = probe;
+    }
+    if (nhealthy > 1) {
+        /* The better of two random picks leads; it is the lower index */
+        int a = (int)(balance_random() % nhealthy);
+        int b = (int)(balance_random() % (nhealthy - 1));
+        int first = b >= a ? a : b;
+
+        order[n++] = healthy[first];
+        for (i = 0; i < nhealthy; i++) {
+            if (i != first) {
+                order[n++] = healthy[i];
+            }
+        }
+    } else if (nhealthy == 1) {
+        order[n++] = healthy[0];
+    }
+    for (i = 0; i < nbroken; i++) {
+        order[n++] = broken[i];
+    }
+    return n;
+}
+
+/* balance_begin - A request to peer is starting */
+void balance_begin(const balance_peer_t *peer)
+{
+    uint64_t key = balance_key((const struct sockaddr *)&peer->addr, peer->len);
+    long long now = metrics_now();
+    balance_stat_t *s = balance_stat(key, 1, now);
+
+    s->inflight++;
+    s->last = now;
+    balance_unlock(key);
+}
+
+/*
+ * balance_done - A request to peer that balance_begin() announced has
+ *     ended with outcome, the origin answering latency nanoseconds after
+ *     it started if outcome is BALANCE_OK
+ */
+void balance_done(const balance_peer_t *peer, int outcome, long long latency)
+{
+    uint64_t key = balance_key((const struct sockaddr *)&peer->addr, peer->len);
+    long long now = metrics_now();
+    balance_stat_t *s = balance_stat(key, 0, now);
+
+    if (!s) {
+        return;                 /* Its slot went to another address */
+    }
+    if (s->inflight > 0) {
+        s->inflight--;
+    }
+    if (outcome == BALANCE_OK) {
+        s->fails = 0;
+        s->broken_until = 0;
+        s->ewma = s->ewma > 0 ? s->ewma + BALANCE_EWMA_WEIGHT * ((double)latency - s->ewma)
+                              : (double)latency;
+    } else if (outcome == BALANCE_FAILED && ++s->fails >= BALANCE_TRIP) {
+        if (!s->broken_until) {
+            metrics_count(METRIC_ORIGIN_BROKEN);
+        }
+        s->broken_until = now + BALANCE_COOLDOWN * 1000000000LL;
+    }
+    balance_unlock(key);
+}
+
+/*
+ * balance_dial - Connect to p, giving up after the connect timeout.
+ *     Returns a blocking descriptor, or -1.
+ */
+static int balance_dial(const struct addrinfo *p)
+{
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int fd, err = 0, rc;
+
+    if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0) {
+        return -1;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        while ((rc = poll(&pfd, 1, balance_timeout_ms)) < 0 && errno == EINTR) {
+        }
+        if (rc == 0) {
+            metrics_count(METRIC_CONNECT_TIMEOUTS);
+        }
+        if (rc <= 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * balance_connect - Connect to the best address in list that accepts
+ *     in time, as open_clientfd_addrs() would to the first. Returns the
+ *     descriptor, with the request begun on the address left in peer,
+ *     or -1 if none does.
+ */
+int balance_connect(struct addrinfo *list, balance_peer_t *peer)
+{
+    struct addrinfo *order[BALANCE_MAX_ADDRS];
+    int n = balance_order(list, order);
+    int i, fd;
+
+    for (i = 0; i < n; i++) {
+        balance_peer(peer, order[i]);
+        balance_begin(peer);
+        if ((fd = balance_dial(order[i])) >= 0) {
+            return fd;
+        }
+        balance_done(peer, BALANCE_FAILED, 0);
+    }
+    return -1;
+}
@@ -0,0 +1,40 @@
+/*
+ * balance.h - choice among an origin's addresses, with per-address
+ *     health and latency
+ */
+#ifndef __BALANCE_H__
+#define __BALANCE_H__
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define BALANCE_MAX_ADDRS 16           /* Addresses of one name tried */
+#define BALANCE_SLOTS 4096             /* Addresses remembered */
+#define BALANCE_WAYS 4                 /* Slots an address may take */
+#define BALANCE_LOCKS 64
+#define BALANCE_TRIP 3                 /* Failures in a row that break an address */
+#define BALANCE_COOLDOWN 10            /* Seconds before a broken one is probed */
+#define BALANCE_CONNECT_TIMEOUT_MS 3000
+
+/* The address a connection to an origin went to */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t len;
+} balance_peer_t;
+
+/* How a request to an address ended, for balance_done() */
+enum {
+    BALANCE_OK,                /* The origin answered */
+    BALANCE_FAILED,            /* It could not be reached or did not answer */
+    BALANCE_DROPPED            /* Given up for reasons of our own */
+};
+
+void balance_set_connect_timeout(int ms);
+int balance_connect_timeout(void);
+int balance_order(struct addrinfo *list, struct addrinfo **order);
+void balance_peer(balance_peer_t *peer, const struct addrinfo *ai);
+void balance_begin(const balance_peer_t *peer);
+void balance_done(const balance_peer_t *peer, int outcome, long long latency);
+int balance_connect(struct addrinfo *list, balance_peer_t *peer);
+
+#endif /* __BALANCE_H__ */
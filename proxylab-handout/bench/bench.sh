@@ -0,0 +1,123 @@
+#!/bin/bash
+#
+# bench.sh - Benchmark the proxy across connection counts, hit ratios
+#     and object sizes, and optionally gate against an earlier run.
+#
+#     usage: ./bench/bench.sh [baseline]
+#
+#     Each cell of the matrix is run twice. A closed-loop run finds the
+#     peak request rate; an open-loop run at BENCH_LOAD percent of that
+#     rate then measures latency, counted from when each request was due.
+#     With a baseline, the open-loop run uses the baseline's rate instead,
+#     so both runs' latencies are for the same offered load, and the
+#     script exits 1 if any cell lost more than BENCH_TOLERANCE percent
+#     of its peak rate, or its p99 grew by more than BENCH_P99_TOLERANCE
+#     percent (and 0.1ms), or any request failed.
+#
+#     Results are written one line per cell to BENCH_OUT, which can be
+#     the baseline of a later run. The proxy runs as ./proxy $PROXY_ARGS
+#     with a cache large enough for the hot objects.
+#
+
+BENCH_DIR=`dirname $0`
+BENCH_CONNS=${BENCH_CONNS:-"16 64 256"}
+BENCH_HITS=${BENCH_HITS:-"0 0.5 0.95"}
+BENCH_SIZES=${BENCH_SIZES:-"small mixed large"}
+BENCH_SECS=${BENCH_SECS:-5}
+BENCH_HOT=${BENCH_HOT:-200}
+BENCH_LOAD=${BENCH_LOAD:-70}
+BENCH_TOLERANCE=${BENCH_TOLERANCE:-10}
+BENCH_P99_TOLERANCE=${BENCH_P99_TOLERANCE:-25}
+BENCH_OUT=${BENCH_OUT:-bench.out}
+BASELINE=$1
+
+# Object size mix for each name in BENCH_SIZES
+function size_mix {
+    case $1 in
+        small) echo "512:50,4k:50" ;;
+        mixed) echo "1k:60,16k:30,256k:10" ;;
+        large) echo "256k:50,1m:50" ;;
+        *) echo $1 ;;
+    esac
+}
+
+# The value of key in a line of key=value pairs
+function field {
+    echo "$1" | tr ' ' '\n' | grep "^$2=" | cut -d= -f2
+}
+
+function wait_for_port {
+    for i in `seq 50`; do
+        netstat --numeric-ports --numeric-hosts -l --protocol=tcpip | grep -q ":$1 " && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port $1"
+    return 1
+}
+
+function cleanup {
+    kill $proxy_pid $origin_pid 2> /dev/null
+}
+
+if [ -n "${BASELINE}" ] && [ ! -r "${BASELINE}" ]; then
+    echo "Error: cannot read baseline ${BASELINE}"
+    exit 2
+fi
+if [ ! -x ./proxy ] || [ ! -x ${BENCH_DIR}/loadgen ] || [ ! -x ${BENCH_DIR}/origin ]; then
+    echo "Error: build with \"make bench\" first"
+    exit 2
+fi
+
+trap cleanup EXIT
+origin_port=`bash ./free-port.sh`
+${BENCH_DIR}/origin ${origin_port} &
+origin_pid=$!
+wait_for_port ${origin_port} || exit 2
+proxy_port=`bash ./free-port.sh`
+./proxy ${PROXY_ARGS} -c 1G -m 2M ${proxy_port} &
+proxy_pid=$!
+wait_for_port ${proxy_port} || exit 2
+
+run="${BENCH_DIR}/loadgen -p 127.0.0.1:${proxy_port} -o 127.0.0.1:${origin_port} -d ${BENCH_SECS} -n ${BENCH_HOT}"
+failed=0
+> ${BENCH_OUT}
+for size in ${BENCH_SIZES}; do
+    for hit in ${BENCH_HITS}; do
+        for conns in ${BENCH_CONNS}; do
+            label="${size}-h${hit}-c${conns}"
+            args="-c ${conns} -H ${hit} -s `size_mix ${size}` -l ${label}"
+
+            peak=`${run} ${args}`
+            peak_rps=`field "${peak}" rps`
+            old=""
+            [ -n "${BASELINE}" ] && old=`grep "^label=${label} " ${BASELINE}`
+            if [ -n "${old}" ]; then
+                rate=`field "${old}" rate`
+            else
+                rate=`echo "${peak_rps} ${BENCH_LOAD}" | awk '{ printf "%.0f", $1 * $2 / 100 }'`
+            fi
+            open=`${run} ${args} -r ${rate}`
+            errors=$((`field "${peak}" errors` + `field "${open}" errors`))
+
+            line="label=${label} peak_rps=${peak_rps} rate=${rate} `echo ${open} | \
+                tr ' ' '\n' | grep -E '^(rps|mbps|p50_ms|p99_ms|p999_ms)=' | tr '\n' ' '`errors=${errors}"
+            echo "${line}" | tee -a ${BENCH_OUT}
+
+            if [ ${errors} -gt 0 ]; then
+                echo "REGRESSION ${label}: ${errors} requests failed"
+                failed=1
+            fi
+            [ -z "${old}" ] && continue
+            echo "`field "${old}" peak_rps` ${peak_rps} `field "${old}" p99_ms` `field "${line}" p99_ms` \
+                ${BENCH_TOLERANCE} ${BENCH_P99_TOLERANCE}" | awk -v label=${label} '
+                $2 < $1 * (1 - $5 / 100) {
+                    printf "REGRESSION %s: peak %.0f rps, was %.0f\n", label, $2, $1; bad = 1
+                }
+                $4 > $3 * (1 + $6 / 100) && $4 - $3 > 0.1 {
+                    printf "REGRESSION %s: p99 %.3f ms, was %.3f\n", label, $4, $3; bad = 1
+                }
+                END { exit bad }' || failed=1
+        done
+    done
+done
+exit ${failed}
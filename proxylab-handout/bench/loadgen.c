@@ -0,0 +1,481 @@
+/*
+ * loadgen.c - open-loop HTTP load generator for benchmarking the proxy
+ *
+ * usage: loadgen -p proxy_host:port -o origin_host:port [-c conns]
+ *                [-r rate] [-d secs] [-H hit_ratio] [-n hot_objects]
+ *                [-s sizes] [-l label]
+ *
+ * Each of conns connections has its own thread and one request in
+ * flight. With -r, requests are scheduled at a fixed total rate and
+ * each latency is measured from when its request was due, not from
+ * when it was sent: a stall delays every request queued behind it
+ * and all of that delay is counted, so there is no coordinated
+ * omission. Without -r each connection sends as fast as it is
+ * answered, which measures peak throughput but understates the tail.
+ *
+ * A request is for one of n hot objects with probability hit_ratio,
+ * and otherwise for an object no one has asked for before. The hot
+ * objects are fetched once before the run, so with a cache big enough
+ * for them hit_ratio is the hit ratio the proxy sees. Object sizes are
+ * drawn from sizes, a list of size:weight pairs such as
+ * "1k:60,16k:30,256k:10", or a single size.
+ *
+ * The run prints one line of key=value pairs: requests per second
+ * achieved, megabytes per second of bodies, latency percentiles in
+ * milliseconds and the number of failed requests.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SIZES 16
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)
+
+typedef struct {
+    size_t size;
+    double weight;                     /* Cumulative, up to 1 */
+} size_class_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    unsigned long long seed;
+    unsigned long long hist[HIST_BUCKETS];
+    unsigned long long done;           /* Requests completed in the run */
+    unsigned long long bytes;          /* Body bytes received in the run */
+    unsigned long long errors;
+} worker_t;
+
+static const char *proxy_host, *proxy_port, *origin;
+static int nconns = 16;
+static double rate = 0;                /* Requests per second, 0 if closed loop */
+static double duration = 10;
+static double hit_ratio = 0;
+static int nhot = 1000;
+static size_class_t sizes[MAX_SIZES];
+static int nsizes;
+static const char *label = "run";
+static long long run_id;               /* Keeps misses unique across runs */
+static long long start_ns, end_ns;     /* The measured run */
+static pthread_barrier_t ready;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000000LL;
+    ts.tv_nsec = t % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/* xorshift64*, one state per worker */
+static unsigned long long next_random(unsigned long long *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static double next_unit(unsigned long long *s)
+{
+    return (next_random(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t pick_size(double u)
+{
+    int i;
+
+    for (i = 0; i < nsizes - 1 && u >= sizes[i].weight; i++) {
+    }
+    return sizes[i].size;
+}
+
+/* Hot objects keep their size from run to run */
+static size_t hot_size(int id)
+{
+    unsigned long long s = 0x9e3779b97f4a7c15ULL * (id + 1);
+
+    return pick_size(next_unit(&s));
+}
+
+static int hist_bucket(unsigned long long v)
+{
+    int e, i;
+
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    e = 63 - __builtin_clzll(v);
+    i = (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+static unsigned long long hist_upper(int i)
+{
+    if (i < HIST_SUB) {
+        return i + 1;
+    }
+    return (unsigned long long)(HIST_SUB + (i & (HIST_SUB - 1)) + 1) << (i / HIST_SUB - 1);
+}
+
+static double hist_quantile(const unsigned long long *hist, unsigned long long total, double q)
+{
+    unsigned long long rank = (unsigned long long)(q * total + 0.999999), seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS - 1 && seen + hist[i] < rank; i++) {
+        seen += hist[i];
+    }
+    return total ? hist_upper(i) / 1e6 : 0.0;
+}
+
+static int connect_proxy(void)
+{
+    struct addrinfo hints, *res, *p;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(proxy_host, proxy_port, &hints, &res) != 0) {
+        return -1;
+    }
+    for (p = res; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t m = write(fd, p, n);
+
+        if (m < 0 && errno == EINTR) {
+            continue;
+        }
+        if (m <= 0) {
+            return -1;
+        }
+        p += m;
+        n -= m;
+    }
+    return 0;
+}
+
+/*
+ * fetch - Send the request in req on *fd, connecting first if *fd is
+ *     -1, and read the whole response. Returns its body length, or -1
+ *     if it failed or was not a 200, in which case *fd is closed. Like
+ *     any client reusing connections, it sends the request again on a
+ *     new one if the proxy closed the old one before answering.
+ */
+static long long fetch(int *fd, const char *req, size_t req_len)
+{
+    static __thread char buf[65536];
+    long long body = -1, got;
+    size_t len = 0;
+    char *end = NULL, *p;
+    int keep = 1, reused = *fd >= 0;
+
+retry:
+    if (*fd < 0 && (*fd = connect_proxy()) < 0) {
+        return -1;
+    }
+    if (write_all(*fd, req, req_len) < 0) {
+        goto closed;
+    }
+    while (!end) {
+        ssize_t n = read(*fd, buf + len, sizeof(buf) - 1 - len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            goto closed;
+        }
+        len += n;
+        buf[len] = '\0';
+        if (!(end = strstr(buf, "\r\n\r\n")) && len == sizeof(buf) - 1) {
+            goto fail;
+        }
+    }
+    if (strncmp(buf, "HTTP/1.", 7) || strncmp(buf + 8, " 200", 4)) {
+        goto fail;
+    }
+    for (p = strstr(buf, "\r\n"); p && p < end; p = strstr(p + 2, "\r\n")) {
+        if (!strncasecmp(p + 2, "Content-Length:", 15)) {
+            body = strtoll(p + 17, NULL, 10);
+        } else if (!strncasecmp(p + 2, "Connection: close", 17)) {
+            keep = 0;
+        }
+    }
+    if (body < 0) {
+        goto fail;
+    }
+
+    got = len - (end + 4 - buf);
+    while (got < body) {
+        ssize_t n = read(*fd, buf, body - got < (long long)sizeof(buf) ? body - got : sizeof(buf));
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            goto fail;
+        }
+        got += n;
+    }
+    if (!keep) {
+        close(*fd);
+        *fd = -1;
+    }
+    return body;
+
+closed:
+    if (len == 0 && reused) {
+        close(*fd);
+        *fd = -1;
+        reused = 0;
+        goto retry;
+    }
+fail:
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static size_t build_request(char *req, size_t size, int hot, worker_t *w, long long seq)
+{
+    if (hot >= 0) {
+        return snprintf(req, size, "GET http://%s/sz/%zu/h%d HTTP/1.1\r\nHost: %s\r\n\r\n",
+                        origin, hot_size(hot), hot, origin);
+    }
+    return snprintf(req, size, "GET http://%s/sz/%zu/m%lld-%d-%lld HTTP/1.1\r\nHost: %s\r\n\r\n",
+                    origin, pick_size(next_unit(&w->seed)), run_id, w->id, seq, origin);
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    long long interval = rate > 0 ? (long long)(1e9 * nconns / rate) : 0;
+    long long due, seq = 0;
+    char req[1024];
+    int fd = -1, i;
+
+    /* Warm the cache with this worker's share of the hot objects */
+    for (i = w->id; i < nhot && hit_ratio > 0; i += nconns) {
+        size_t n = build_request(req, sizeof(req), i, w, 0);
+
+        fetch(&fd, req, n);
+    }
+    pthread_barrier_wait(&ready);
+    pthread_barrier_wait(&ready);
+
+    /* Spread the connections' schedules evenly over one interval */
+    due = start_ns + interval * w->id / nconns;
+    while (due < end_ns) {
+        int hot = next_unit(&w->seed) < hit_ratio ? (int)(next_random(&w->seed) % nhot) : -1;
+        size_t n = build_request(req, sizeof(req), hot, w, seq++);
+        long long body, t;
+
+        if (interval) {
+            sleep_until(due);
+        } else {
+            due = now_ns();
+        }
+        body = fetch(&fd, req, n);
+        t = now_ns();
+        if (body < 0) {
+            w->errors++;
+        } else {
+            w->hist[hist_bucket(t - due)]++;
+            w->done++;
+            w->bytes += body;
+        }
+        due = interval ? due + interval : t;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/* parse_size - A byte count with an optional k, m or g suffix */
+static size_t parse_size(const char *s, char **end)
+{
+    size_t n = strtoull(s, end, 10);
+
+    switch (**end) {
+    case 'k': case 'K':
+        n <<= 10;
+        (*end)++;
+        break;
+    case 'm': case 'M':
+        n <<= 20;
+        (*end)++;
+        break;
+    case 'g': case 'G':
+        n <<= 30;
+        (*end)++;
+        break;
+    }
+    return n;
+}
+
+/* parse_sizes - Fill sizes from "size[:weight],..." */
+static int parse_sizes(const char *spec)
+{
+    const char *s = spec;
+    double total = 0, sum = 0;
+    int i;
+
+    nsizes = 0;
+    while (*s && nsizes < MAX_SIZES) {
+        char *end;
+
+        sizes[nsizes].size = parse_size(s, &end);
+        sizes[nsizes].weight = 1;
+        if (end == s) {
+            return -1;
+        }
+        if (*end == ':') {
+            sizes[nsizes].weight = strtod(end + 1, &end);
+        }
+        total += sizes[nsizes++].weight;
+        if (*end && *end != ',') {
+            return -1;
+        }
+        s = *end ? end + 1 : end;
+    }
+    for (i = 0; i < nsizes; i++) {
+        sum += sizes[i].weight;
+        sizes[i].weight = sum / total;
+    }
+    return nsizes > 0 && total > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -p proxy_host:port -o origin_host:port [-c conns] [-r rate]\n"
+            "       [-d secs] [-H hit_ratio] [-n hot_objects] [-s sizes] [-l label]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long hist[HIST_BUCKETS] = { 0 };
+    unsigned long long done = 0, bytes = 0, errors = 0;
+    const char *size_spec = "1k";
+    worker_t *workers;
+    char *colon;
+    double secs;
+    int opt, i, j;
+
+    while ((opt = getopt(argc, argv, "p:o:c:r:d:H:n:s:l:")) != -1) {
+        switch (opt) {
+        case 'p':
+            proxy_host = strdup(optarg);
+            break;
+        case 'o':
+            origin = optarg;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'H':
+            hit_ratio = atof(optarg);
+            break;
+        case 'n':
+            nhot = atoi(optarg);
+            break;
+        case 's':
+            size_spec = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!proxy_host || !origin || !(colon = strrchr(proxy_host, ':')) || nconns <= 0 ||
+        rate < 0 || duration <= 0 || hit_ratio < 0 || hit_ratio > 1 || nhot <= 0 ||
+        parse_sizes(size_spec) < 0) {
+        usage(argv[0]);
+    }
+    *colon = '\0';
+    proxy_port = colon + 1;
+    signal(SIGPIPE, SIG_IGN);
+    run_id = (long long)getpid() << 20 ^ now_ns() / 1000000;
+
+    workers = calloc(nconns, sizeof(worker_t));
+    pthread_barrier_init(&ready, NULL, nconns + 1);
+    for (i = 0; i < nconns; i++) {
+        workers[i].id = i;
+        workers[i].seed = 0x2545f4914f6cdd1dULL * (i + 1) ^ run_id;
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&ready);
+    start_ns = now_ns() + 10000000;
+    end_ns = start_ns + (long long)(duration * 1e9);
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; i < nconns; i++) {
+        pthread_join(workers[i].tid, NULL);
+        for (j = 0; j < HIST_BUCKETS; j++) {
+            hist[j] += workers[i].hist[j];
+        }
+        done += workers[i].done;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+    }
+    /* Requests still in flight at the end finish late, not in the run */
+    secs = (now_ns() - start_ns) / 1e9;
+
+    printf("label=%s conns=%d rate=%.0f hit=%.2f sizes=%s rps=%.1f mbps=%.1f "
+           "p50_ms=%.3f p99_ms=%.3f p999_ms=%.3f errors=%llu\n",
+           label, nconns, rate, hit_ratio, size_spec, done / secs, bytes / secs / 1e6,
+           hist_quantile(hist, done, 0.5), hist_quantile(hist, done, 0.99),
+           hist_quantile(hist, done, 0.999), errors);
+    return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * origin.c - fast multithreaded origin server for benchmarking the proxy
+ *
+ * usage: origin [-t threads] <port>
+ *
+ * GET /sz/<bytes>/<anything> is answered with a body of <bytes> bytes,
+ * anything else with a short one. Every response carries a
+ * Content-Length and connections stay open for as long as the client
+ * keeps them, so the origin is never what limits a run.
+ *
+ * Each of the threads runs its own epoll loop over its own
+ * SO_REUSEPORT listening socket. Bodies are written straight from one
+ * shared buffer, so a response costs a writev() or two and no copying.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define ORIGIN_MAX_BODY (64 << 20)      /* Larger bodies are cut to this */
+#define ORIGIN_MAX_EVENTS 256
+#define ORIGIN_IN_SIZE 16384
+
+typedef struct {
+    int fd;
+    char in[ORIGIN_IN_SIZE];            /* Request bytes not yet answered */
+    size_t in_len;
+    char head[256];                     /* Head of the response being sent */
+    size_t head_len;
+    size_t head_off;
+    size_t body_len;                    /* Bytes of body still to send */
+    size_t body_off;
+} oconn_t;
+
+static char *body;                      /* ORIGIN_MAX_BODY bytes of pattern */
+static int port;
+
+static int open_listener(void)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+/* start_response - Queue the answer to the request line at the head of in */
+static void start_response(oconn_t *c)
+{
+    size_t size = 12;
+    char *p;
+
+    if (!strncmp(c->in, "GET /sz/", 8)) {
+        size = strtoul(c->in + 8, &p, 10);
+        if (size > ORIGIN_MAX_BODY) {
+            size = ORIGIN_MAX_BODY;
+        }
+    }
+    c->head_len = snprintf(c->head, sizeof(c->head),
+                           "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                           "Content-Length: %zu\r\n\r\n", size);
+    c->head_off = 0;
+    c->body_len = size;
+    c->body_off = 0;
+}
+
+/* send_response - Write what the socket takes. Returns -1 on error. */
+static int send_response(oconn_t *c)
+{
+    while (c->head_off < c->head_len || c->body_off < c->body_len) {
+        struct iovec iov[2];
+        ssize_t n;
+
+        iov[0].iov_base = c->head + c->head_off;
+        iov[0].iov_len = c->head_len - c->head_off;
+        iov[1].iov_base = body + c->body_off;
+        iov[1].iov_len = c->body_len - c->body_off;
+        if ((n = writev(c->fd, iov, 2)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if ((size_t)n <= iov[0].iov_len) {
+            c->head_off += n;
+        } else {
+            c->body_off += n - iov[0].iov_len;
+            c->head_off = c->head_len;
+        }
+    }
+    return 0;
+}
+
+static int responding(const oconn_t *c)
+{
+    return c->head_off < c->head_len || c->body_off < c->body_len;
+}
+
+/*
+ * serve - Answer every complete request buffered in c, in order, as far
+ *     as the socket allows. Returns -1 once c should be closed.
+ */
+static int serve(oconn_t *c)
+{
+    while (!responding(c)) {
+        char *end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+        size_t used;
+        ssize_t n;
+
+        if (!end) {
+            if (c->in_len == sizeof(c->in)) {
+                return -1;
+            }
+            if ((n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len)) < 0) {
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+            }
+            if (n == 0) {
+                return -1;
+            }
+            c->in_len += n;
+            continue;
+        }
+        used = end + 4 - c->in;
+        start_response(c);
+        memmove(c->in, c->in + used, c->in_len - used);
+        c->in_len -= used;
+        if (send_response(c) < 0) {
+            return -1;
+        }
+    }
+    return send_response(c);
+}
+
+static void *origin_loop(void *arg)
+{
+    struct epoll_event ev, events[ORIGIN_MAX_EVENTS];
+    int listenfd = open_listener();
+    int epfd = epoll_create1(0);
+    int i, n;
+
+    (void)arg;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    while (1) {
+        if ((n = epoll_wait(epfd, events, ORIGIN_MAX_EVENTS, -1)) < 0) {
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            oconn_t *c = events[i].data.ptr;
+            int fd, one = 1;
+
+            if (!c) {
+                while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    c = calloc(1, sizeof(oconn_t));
+                    c->fd = fd;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+            if (serve(c) < 0) {
+                close(c->fd);
+                free(c);
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t tid;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't' || (nthreads = atoi(optarg)) <= 0) {
+            fprintf(stderr, "usage: %s [-t threads] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t threads] <port>\n", argv[0]);
+        exit(1);
+    }
+    port = atoi(argv[optind]);
+    signal(SIGPIPE, SIG_IGN);
+
+    body = malloc(ORIGIN_MAX_BODY);
+    for (i = 0; i < ORIGIN_MAX_BODY; i++) {
+        body[i] = 'a' + i % 26;
+    }
+    for (i = 0; i < nthreads - 1; i++) {
+        pthread_create(&tid, NULL, origin_loop, NULL);
+    }
+    origin_loop(NULL);
+    return 0;
+}
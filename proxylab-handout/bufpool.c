@@ -0,0 +1,153 @@
+/*
+ * bufpool.c - shared pool of power-of-two I/O buffers
+ *
+ * Connections take their read and relay buffers from here instead of
+ * embedding them. Every buffer is a power of two between the smallest
+ * and largest sizes given to bufpool_init(); a connection starts with
+ * the smallest, trades up with bufpool_grow() while a transfer keeps
+ * filling what it has, and gives its buffers back while it sits idle.
+ *
+ * Each size keeps a short free list under its own lock, so steady
+ * traffic recycles the same buffers while a burst does not pin its
+ * memory for good. Buffers are plain Malloc() blocks: one of any other
+ * size, such as one the caller has Realloc()ed, is just freed when it
+ * is given back.
+ */
+#include "csapp.h"
+#include "bufpool.h"
+
+#define BUFPOOL_CLASSES 24
+#define BUFPOOL_KEEP 64         /* Free buffers kept per size */
+
+typedef struct freebuf {
+    struct freebuf *next;
+} freebuf_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    freebuf_t *free;
+    int nfree;
+} __attribute__((aligned(64))) bufpool_class_t;
+
+static bufpool_class_t pool_classes[BUFPOOL_CLASSES];
+static size_t pool_min = BUFPOOL_MIN_DEFAULT;
+static size_t pool_max = BUFPOOL_MAX_DEFAULT;
+static int pool_nclasses;
+
+static size_t round_pow2(size_t n)
+{
+    size_t p = BUFPOOL_SMALLEST;
+
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/* The class holding buffers of exactly cap bytes, or -1 */
+static int bufpool_class(size_t cap)
+{
+    int i;
+
+    for (i = 0; i < pool_nclasses; i++) {
+        if (pool_min << i == cap) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * bufpool_init - Hand out buffers from min up to max bytes, each rounded
+ *     up to a power of two. Called before any thread takes a buffer.
+ */
+void bufpool_init(size_t min, size_t max)
+{
+    int i;
+
+    pool_min = round_pow2(min);
+    pool_max = round_pow2(max < min ? min : max);
+    pool_nclasses = 1;
+    while ((pool_min << (pool_nclasses - 1)) < pool_max && pool_nclasses < BUFPOOL_CLASSES) {
+        pool_nclasses++;
+    }
+    pool_max = pool_min << (pool_nclasses - 1);
+    for (i = 0; i < pool_nclasses; i++) {
+        pthread_mutex_init(&pool_classes[i].lock, NULL);
+        pool_classes[i].free = NULL;
+        pool_classes[i].nfree = 0;
+    }
+}
+
+size_t bufpool_min(void)
+{
+    return pool_min;
+}
+
+size_t bufpool_max(void)
+{
+    return pool_max;
+}
+
+/*
+ * bufpool_get - Return a buffer of at least size bytes, though never
+ *     more than the pool's largest, and set *cap to its size
+ */
+char *bufpool_get(size_t size, size_t *cap)
+{
+    bufpool_class_t *c;
+    freebuf_t *b;
+    int i;
+
+    for (i = 0; i < pool_nclasses - 1 && (pool_min << i) < size; i++) {
+    }
+    c = &pool_classes[i];
+    *cap = pool_min << i;
+
+    pthread_mutex_lock(&c->lock);
+    if ((b = c->free) != NULL) {
+        c->free = b->next;
+        c->nfree--;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return b ? (char *)b : Malloc(*cap);
+}
+
+/* bufpool_put - Give back a buffer of cap bytes; NULL is ignored */
+void bufpool_put(char *buf, size_t cap)
+{
+    bufpool_class_t *c;
+    int i;
+
+    if (!buf) {
+        return;
+    }
+    if ((i = bufpool_class(cap)) < 0) {
+        Free(buf);
+        return;
+    }
+    c = &pool_classes[i];
+
+    pthread_mutex_lock(&c->lock);
+    if (c->nfree < BUFPOOL_KEEP) {
+        ((freebuf_t *)buf)->next = c->free;
+        c->free = (freebuf_t *)buf;
+        c->nfree++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+    Free(buf);
+}
+
+/*
+ * bufpool_grow - Trade the empty buffer *buf of *cap bytes for one twice
+ *     as large, unless it already is the largest. Its contents are lost.
+ */
+void bufpool_grow(char **buf, size_t *cap)
+{
+    if (*cap >= pool_max) {
+        return;
+    }
+    bufpool_put(*buf, *cap);
+    *buf = bufpool_get(*cap * 2, cap);
+}
@@ -0,0 +1,21 @@
+/*
+ * bufpool.h - shared pool of power-of-two I/O buffers
+ */
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+/* Sizes connections start at and bulk transfers may grow to */
+#define BUFPOOL_MIN_DEFAULT 8192
+#define BUFPOOL_MAX_DEFAULT (256 * 1024)
+#define BUFPOOL_SMALLEST 1024
+
+void bufpool_init(size_t min, size_t max);
+size_t bufpool_min(void);
+size_t bufpool_max(void);
+char *bufpool_get(size_t size, size_t *cap);
+void bufpool_put(char *buf, size_t cap);
+void bufpool_grow(char **buf, size_t *cap);
+
+#endif /* __BUFPOOL_H__ */
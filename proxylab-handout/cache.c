@@ -0,0 +1,1553 @@
+/*
+ * cache.c - sharded, hashed web object cache with pluggable replacement
+ *
+ * Keys are hashed with FNV-1a. The high bits of the hash pick one of
+ * nshards independently locked shards; the low bits pick a bucket in
+ * that shard's chained hash table. Every shard keeps its own policy
+ * state and a 1/nshards slice of the total byte budget, so lookups
+ * and inserts are O(1) and threads touching different shards never
+ * share a lock.
+ *
+ * Lookups only take the shard's read lock. Which objects are evicted,
+ * and whether a miss is admitted at all, is up to the policy chosen
+ * with cache_set_policy() (see policy.c); a policy records hits with
+ * relaxed atomics, so only inserts and evictions take the write lock.
+ * Every shard counts its lookups, hits and the bytes served from and
+ * fetched for the cache, for comparing policies on real traffic.
+ *
+ * Objects are refcounted, so a hit pins the object, drops the lock and
+ * streams straight from the cached bytes; an evicted object is
+ * reclaimed when its last reader lets go.
+ *
+ * Objects are filled as the response streams in. The first miss on a
+ * key indexes an empty object and becomes its filler; later requests
+ * for the key find that object and read it as it grows, so a burst of
+ * requests for one uncached URL costs the origin one fetch. Storage is
+ * a chain of chunks of up to CACHE_CHUNK_SIZE bytes, charged to the
+ * shard as they are allocated. An object that outgrows the per-object
+ * limit, or the shard, leaves the index but keeps filling for the
+ * readers it already has. Objects being filled are never evicted.
+ *
+ * Objects, with their keys, and chunks are slab blocks from an arena
+ * preallocated to the cache budget, and a shard is charged the size of
+ * every block it holds, so its byte count is the memory it really
+ * uses. Chunks are sized to slab classes rather than the other way
+ * round. Blocks are allocated before and freed after the shard lock is
+ * held; evictions only collect their victims under the lock. Objects
+ * that are not in the index, because they outgrew it or the arena had
+ * no room for them, are kept on the heap until their readers finish.
+ *
+ * With a disk tier (see disk.c), complete objects the policy evicts are
+ * written there once the lock is dropped, and a miss is refilled from
+ * the tier when it holds the object, as if it were being fetched, so
+ * requests arriving meanwhile are coalesced onto it the same way.
+ *
+ * Every object carries the time it goes stale, worked out from the
+ * response head when the fill starts; responses that must not be kept
+ * are never indexed. A stale object is not served. The lookup that
+ * finds it indexes a fresh object in its place, as for a miss, and
+ * hands the stale one to the filler, which asks the origin whether it
+ * changed. If not, the filler copies the stale object into the new
+ * one, so the requests coalesced onto it meanwhile are answered from
+ * the cache, and serves the stale object itself.
+ *
+ * With a refresher set (see cache_set_refresher()), an object read
+ * often that is close to going stale, or one gone stale less than its
+ * grace ago, is refreshed in the background instead. The lookup that
+ * notices indexes the new object in its place as above, but hands it to
+ * the refresher and is served the old one, as is every lookup until the
+ * refresh is done or the old object's grace runs out. The index holding
+ * one object per key is what keeps a second refresh from starting.
+ *
+ * With an encoder set (see cache_set_encoder()), every object that
+ * completes while indexed is handed to it, and it may attach compressed
+ * variants. A variant is filled like an unindexed object, then charged
+ * to its object, which keeps it until it is freed itself; a lookup finds
+ * it only through that object, so the object's freshness is its own. An
+ * object revalidated with a 304 takes the stale one's variants along.
+ *
+ * In front of the shards every thread keeps an L1: a small direct-mapped
+ * table of references to objects it keeps hitting, so most hits on a
+ * hot object touch no lock and no shard counter. Each time a shard
+ * indexes an object, it gives the object the shard's next generation
+ * number, and taking the object out of the index, whether evicted,
+ * dropped or replaced by a refresh or revalidation, sets it to 0. An
+ * L1 slot remembers the generation it saw, so a changed number means
+ * the slot is stale. Slots are also only good until the object is due for
+ * a refresh, when the shards get to decide again. A thread gives up
+ * its reference to a stale slot's object when it next looks at that
+ * slot, and every L1 lookup looks at one more slot in turn.
+ */
+#include <stdint.h>
+#include <time.h>
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+#include "slab.h"
+#include "disk.h"
+
+#define CACHE_INIT_BUCKETS 64
+#define CACHE_FIRST_CHUNK 1024     /* First chunk when the size is unknown */
+#define CACHE_CHUNK_HDR offsetof(cache_chunk_t, data)
+#define CACHE_SLAB_TRIES 8         /* Evictions to free a block of one class */
+
+static cache_shard_t cache_shards[CACHE_MAX_SHARDS];
+static int cache_nshards = 1;
+static int cache_shard_shift = 64;
+static size_t cache_max_object = MAX_OBJECT_SIZE;
+static const cache_policy_t *cache_policy;
+static void (*cache_refresher)(cache_object_t *fill);
+static void (*cache_encoder)(cache_object_t *obj);
+
+/*
+ * One slot of a thread's L1. Only the owning thread puts objects there,
+ * but whoever takes an object out of the index takes it out of every L1
+ * too, so idle threads do not keep evicted objects' memory.
+ */
+typedef struct {
+    _Atomic(cache_object_t *) obj; /* Holds a reference, NULL if empty */
+    uint64_t gen;               /* obj->gen when it was put here */
+    long long until;            /* When lookups must go to the shard again */
+} cache_l1_slot_t;
+
+/* A thread's L1 and the counters it keeps instead of the shards' */
+typedef struct cache_local {
+    cache_l1_slot_t *slots;     /* NULL if the L1 is off */
+    size_t sweep;               /* Next slot checked for staleness */
+    unsigned touches;           /* L1 hits, for sampling them to the policy */
+    atomic_ullong l1_hits;      /* Only the owning thread writes these */
+    atomic_ullong bytes_hit;
+    struct cache_local *next;
+} cache_local_t;
+
+static size_t cache_l1_slots = CACHE_L1_SLOTS;
+static pthread_mutex_t cache_locals_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_local_t *cache_locals = NULL;
+static __thread cache_local_t *cache_self = NULL;
+
+/* What a lookup does with the object it found, see cache_found() */
+enum {
+    CACHE_FOUND_FRESH,          /* Serve it */
+    CACHE_FOUND_REFRESH,        /* Serve it and refresh it in the background */
+    CACHE_FOUND_STALE           /* Revalidate it before serving anything */
+};
+
+static uint64_t cache_hash(const char *key)
+{
+    uint64_t h = 1469598103934665603ULL;
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static cache_shard_t *cache_shard_for(uint64_t hash)
+{
+    if (cache_nshards == 1) {
+        return &cache_shards[0];
+    }
+    return &cache_shards[hash >> cache_shard_shift];
+}
+
+/*
+ * cache_init - Split capacity over as many shards as possible while
+ *     still letting every shard hold one max_object sized object.
+ */
+void cache_init(size_t capacity, size_t max_object)
+{
+    int i;
+    int bits = 0;
+
+    while ((1 << (bits + 1)) <= CACHE_MAX_SHARDS &&
+           capacity / (1 << (bits + 1)) >= max_object) {
+        bits++;
+    }
+    cache_nshards = 1 << bits;
+    cache_shard_shift = 64 - bits;
+    cache_max_object = max_object;
+    if (!cache_policy) {
+        cache_policy = cache_policy_find("clock");
+    }
+    slab_init(capacity);
+
+    for (i = 0; i < cache_nshards; i++) {
+        cache_shard_t *s = &cache_shards[i];
+
+        pthread_rwlock_init(&s->lock, NULL);
+        s->nbuckets = CACHE_INIT_BUCKETS;
+        s->buckets = Calloc(s->nbuckets, sizeof(cache_object_t *));
+        s->nentries = 0;
+        s->bytes = 0;
+        s->capacity = capacity / cache_nshards;
+        s->policy = cache_policy;
+        s->policy->init(s);
+    }
+}
+
+/*
+ * cache_set_policy - Choose the replacement policy by name before
+ *     cache_init(). Returns -1 if there is no such policy.
+ */
+int cache_set_policy(const char *name)
+{
+    const cache_policy_t *p = cache_policy_find(name);
+
+    if (!p) {
+        return -1;
+    }
+    cache_policy = p;
+    return 0;
+}
+
+/*
+ * cache_set_refresher - Hand the fills that refresh objects in the
+ *     background to refresh(), which takes over the filler's reference
+ *     and must not block. Without a refresher nothing is refreshed
+ *     early or served stale.
+ */
+void cache_set_refresher(void (*refresh)(cache_object_t *fill))
+{
+    cache_refresher = refresh;
+}
+
+/*
+ * cache_set_encoder - Hand every object that completes in the index to
+ *     encode(), with a reference for it to drop, to make variants of.
+ *     encode() must not block.
+ */
+void cache_set_encoder(void (*encode)(cache_object_t *obj))
+{
+    cache_encoder = encode;
+}
+
+/*
+ * cache_set_l1 - Give every thread an L1 of slots objects, rounded down
+ *     to a power of two, or none if slots is 0, before the first lookup
+ */
+void cache_set_l1(size_t slots)
+{
+    size_t n = 1;
+
+    while (n * 2 <= slots) {
+        n *= 2;
+    }
+    cache_l1_slots = slots ? n : 0;
+}
+
+/* The calling thread's L1 and counters, made and linked on first use */
+static cache_local_t *cache_local(void)
+{
+    cache_local_t *l = cache_self;
+
+    if (!l) {
+        l = Calloc(1, sizeof(cache_local_t));
+        if (cache_l1_slots) {
+            l->slots = Calloc(cache_l1_slots, sizeof(cache_l1_slot_t));
+        }
+        pthread_mutex_lock(&cache_locals_lock);
+        l->next = cache_locals;
+        cache_locals = l;
+        pthread_mutex_unlock(&cache_locals_lock);
+        cache_self = l;
+    }
+    return l;
+}
+
+/* Add n to a counter only this thread writes */
+static void cache_bump(atomic_ullong *v, unsigned long long n)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/* cache_get_stats - Sum the counters of all shards and threads */
+void cache_get_stats(cache_stats_t *st)
+{
+    cache_local_t *l;
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    st->policy = cache_policy ? cache_policy->name : "clock";
+    for (i = 0; i < cache_nshards; i++) {
+        cache_shard_t *s = &cache_shards[i];
+
+        st->lookups += atomic_load_explicit(&s->lookups, memory_order_relaxed);
+        st->hits += atomic_load_explicit(&s->hits, memory_order_relaxed);
+        st->bytes_hit += atomic_load_explicit(&s->bytes_hit, memory_order_relaxed);
+        st->bytes_missed += atomic_load_explicit(&s->bytes_missed, memory_order_relaxed);
+        st->evictions += atomic_load_explicit(&s->evictions, memory_order_relaxed);
+        st->rejected += atomic_load_explicit(&s->rejected, memory_order_relaxed);
+        st->disk_hits += atomic_load_explicit(&s->disk_hits, memory_order_relaxed);
+        st->revalidations += atomic_load_explicit(&s->revalidations, memory_order_relaxed);
+        st->not_modified += atomic_load_explicit(&s->not_modified, memory_order_relaxed);
+        st->refreshes += atomic_load_explicit(&s->refreshes, memory_order_relaxed);
+        st->stale_hits += atomic_load_explicit(&s->stale_hits, memory_order_relaxed);
+        st->variants += atomic_load_explicit(&s->variants, memory_order_relaxed);
+        st->variant_hits += atomic_load_explicit(&s->variant_hits, memory_order_relaxed);
+        pthread_rwlock_rdlock(&s->lock);
+        st->entries += s->nentries;
+        st->bytes += s->bytes;
+        st->capacity += s->capacity;
+        pthread_rwlock_unlock(&s->lock);
+    }
+    pthread_mutex_lock(&cache_locals_lock);
+    for (l = cache_locals; l; l = l->next) {
+        unsigned long long hits = atomic_load_explicit(&l->l1_hits, memory_order_relaxed);
+
+        st->l1_hits += hits;
+        st->lookups += hits;
+        st->hits += hits;
+        st->bytes_hit += atomic_load_explicit(&l->bytes_hit, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cache_locals_lock);
+}
+
+/* cache_served - Count n bytes sent from the cache to a client that hit it */
+void cache_served(size_t n)
+{
+    cache_bump(&cache_local()->bytes_hit, n);
+}
+
+static cache_object_t *cache_find(cache_shard_t *s, const char *key, uint64_t hash)
+{
+    cache_object_t *cur = s->buckets[hash & (s->nbuckets - 1)];
+
+    while (cur) {
+        if (cur->hash == hash && !strcmp(cur->key, key)) {
+            return cur;
+        }
+        cur = cur->hnext;
+    }
+    return NULL;
+}
+
+static void cache_grow(cache_shard_t *s)
+{
+    size_t nbuckets = s->nbuckets * 2;
+    cache_object_t **buckets = Calloc(nbuckets, sizeof(cache_object_t *));
+    size_t i;
+
+    for (i = 0; i < s->nbuckets; i++) {
+        cache_object_t *cur = s->buckets[i];
+        while (cur) {
+            cache_object_t *next = cur->hnext;
+            size_t b = cur->hash & (nbuckets - 1);
+            cur->hnext = buckets[b];
+            buckets[b] = cur;
+            cur = next;
+        }
+    }
+    Free(s->buckets);
+    s->buckets = buckets;
+    s->nbuckets = nbuckets;
+}
+
+static void cache_free_chunks(cache_object_t *obj)
+{
+    cache_chunk_t *ch = obj->chunks;
+
+    while (ch) {
+        cache_chunk_t *next = ch->next;
+        slab_free(ch);
+        ch = next;
+    }
+    obj->chunks = NULL;
+    obj->tail = NULL;
+}
+
+static void cache_free(cache_object_t *obj)
+{
+    int i;
+
+    for (i = 0; i < CACHE_MAX_VARIANTS; i++) {
+        cache_object_t *v = atomic_load_explicit(&obj->variants[i], memory_order_acquire);
+
+        if (v) {
+            cache_release(v);
+        }
+    }
+    cache_free_chunks(obj);
+    pthread_mutex_destroy(&obj->lock);
+    slab_free(obj);
+}
+
+/*
+ * cache_release - Drop a reference obtained from cache_lookup() or
+ *     cache_lookup_fill()
+ */
+void cache_release(cache_object_t *obj)
+{
+    if (atomic_fetch_sub_explicit(&obj->refcnt, 1, memory_order_acq_rel) == 1) {
+        cache_free(obj);
+    }
+}
+
+/*
+ * cache_remove_obj - Take obj out of the index and queue the index's
+ *     reference on reap, to be dropped by cache_reap() after the lock
+ */
+static void cache_remove_obj(cache_shard_t *s, cache_object_t *obj, cache_object_t **reap)
+{
+    cache_object_t **pp = &s->buckets[obj->hash & (s->nbuckets - 1)];
+
+    while (*pp != obj) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = obj->hnext;
+
+    s->policy->remove(s, obj);
+    s->nentries--;
+    s->bytes -= obj->charged;
+    obj->charged = 0;
+    obj->indexed = 0;
+    atomic_store_explicit(&obj->gen, 0, memory_order_release);
+    obj->hnext = *reap;
+    *reap = obj;
+}
+
+/*
+ * cache_l1_forget - Drop the references any thread's L1 holds to the
+ *     objects on reap, which have left the index. Each can only be in
+ *     the one slot its hash picks.
+ */
+static void cache_l1_forget(cache_object_t *reap)
+{
+    cache_local_t *l;
+    cache_object_t *obj;
+
+    if (!reap || !cache_l1_slots) {
+        return;
+    }
+    pthread_mutex_lock(&cache_locals_lock);
+    for (l = cache_locals; l; l = l->next) {
+        for (obj = reap; obj; obj = obj->hnext) {
+            cache_object_t *expect = obj;
+
+            /* reap still holds a reference, so this cannot free obj */
+            if (atomic_compare_exchange_strong(&l->slots[obj->hash & (cache_l1_slots - 1)].obj,
+                                               &expect, NULL)) {
+                cache_release(obj);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_locals_lock);
+}
+
+/* Write a complete object to the disk tier */
+static void cache_spill(cache_object_t *obj)
+{
+    size_t size = atomic_load_explicit(&obj->size, memory_order_acquire);
+    cache_cursor_t cur = { NULL, 0, 0 };
+    struct iovec *iov;
+    disk_meta_t meta;
+    cache_chunk_t *ch;
+    int n = 0;
+
+    for (ch = obj->chunks; ch; ch = ch->next) {
+        n++;
+    }
+    iov = Malloc(sizeof(struct iovec) * (n ? n : 1));
+    n = cache_object_iov(obj, &cur, size, iov, n);
+    meta.size = size;
+    meta.hdr_len = obj->hdr_len;
+    meta.delimited = obj->delimited;
+    meta.expires = obj->expires;
+    meta.stale_until = obj->stale_until;
+    disk_put(obj->key, obj->hash, &meta, iov, n);
+    Free(iov);
+}
+
+static void cache_reap(cache_object_t *reap)
+{
+    cache_l1_forget(reap);
+    while (reap) {
+        cache_object_t *next = reap->hnext;
+
+        if (reap->evicted && disk_enabled()) {
+            cache_spill(reap);
+        }
+        cache_release(reap);
+        reap = next;
+    }
+}
+
+/*
+ * cache_evict_until_fit - Evict the policy's victims until needed more
+ *     bytes fit or nothing can be evicted
+ */
+static void cache_evict_until_fit(cache_shard_t *s, size_t needed, cache_object_t **reap)
+{
+    while ((s->bytes + needed) > s->capacity) {
+        cache_object_t *victim = s->policy->evict(s);
+
+        if (!victim) {
+            break;
+        }
+        /* Only complete objects are ever evicted */
+        victim->evicted = 1;
+        cache_remove_obj(s, victim, reap);
+        atomic_fetch_add_explicit(&s->evictions, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * cache_slab_alloc - Allocate a block for shard s. While the arena has
+ *     none of that class free, evict a few of the policy's victims: their
+ *     blocks free whole pages once the rest of those pages go too, so a
+ *     class can take pages back from the others as sizes shift.
+ */
+static void *cache_slab_alloc(cache_shard_t *s, size_t block)
+{
+    void *p;
+    int tries;
+
+    for (tries = 0; (p = slab_alloc(block)) == NULL && tries < CACHE_SLAB_TRIES; tries++) {
+        cache_object_t *reap = NULL;
+        cache_object_t *victim;
+
+        pthread_rwlock_wrlock(&s->lock);
+        if ((victim = s->policy->evict(s)) != NULL) {
+            victim->evicted = 1;
+            cache_remove_obj(s, victim, &reap);
+            atomic_fetch_add_explicit(&s->evictions, 1, memory_order_relaxed);
+        }
+        pthread_rwlock_unlock(&s->lock);
+        if (!reap) {
+            break;
+        }
+        cache_reap(reap);
+    }
+    return p;
+}
+
+/*
+ * cache_admit - Ask the policy whether obj may evict others to make
+ *     room for block more bytes. It is asked once per object, the first
+ *     time the object does not fit without evicting.
+ */
+static int cache_admit(cache_shard_t *s, cache_object_t *obj, size_t block)
+{
+    if (obj->admitted || s->bytes + block <= s->capacity || !s->policy->admit) {
+        return 1;
+    }
+    if (!s->policy->admit(s, obj->hash)) {
+        atomic_fetch_add_explicit(&s->rejected, 1, memory_order_relaxed);
+        return 0;
+    }
+    obj->admitted = 1;
+    return 1;
+}
+
+/*
+ * cache_fill_from_disk - Fill the new object obj from the disk tier as
+ *     its filler would, and turn the filler's reference into the caller's.
+ *     Returns 0, leaving obj untouched, if the tier does not hold it, or
+ *     only a stale copy.
+ */
+static int cache_fill_from_disk(cache_object_t *obj, long long now)
+{
+    disk_meta_t meta;
+    size_t head;
+    char *data;
+
+    if ((data = disk_get(obj->key, obj->hash, &meta)) == NULL) {
+        return 0;
+    }
+    if (meta.expires <= now) {
+        Free(data);
+        return 0;
+    }
+    head = (size_t)meta.hdr_len + 2;
+    if (head > meta.size) {
+        head = meta.size;
+    }
+
+    /* Keep the bytes stored even if nobody else is reading yet */
+    atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+    cache_fill_append(obj, data, head);
+    cache_fill_head(obj, meta.hdr_len, meta.delimited, meta.size - head, meta.expires,
+                    meta.stale_until - meta.expires);
+    cache_fill_append(obj, data + head, meta.size - head);
+    obj->received = 0;          /* None of it came from an origin */
+    cache_fill_end(obj, 1);
+    Free(data);
+    return 1;
+}
+
+/*
+ * cache_found - Decide what a lookup does with *objp, the object the
+ *     index holds for its key. An object refreshed in the background is
+ *     replaced with the one it is filling behind, while that may still
+ *     be served. Caller holds the shard lock.
+ */
+static int cache_found(cache_object_t **objp, long long now)
+{
+    cache_object_t *obj = *objp;
+    long long ahead;
+
+    if (obj->behind && now < obj->behind->stale_until) {
+        *objp = obj->behind;
+        return CACHE_FOUND_FRESH;
+    }
+    if (atomic_load_explicit(&obj->state, memory_order_acquire) != CACHE_COMPLETE) {
+        return CACHE_FOUND_FRESH;
+    }
+    if (obj->expires <= now) {
+        return cache_refresher && now < obj->stale_until ? CACHE_FOUND_REFRESH
+                                                         : CACHE_FOUND_STALE;
+    }
+    ahead = (obj->expires - obj->fresh_since) / CACHE_REFRESH_AHEAD;
+    if (cache_refresher && ahead > 0 && now >= obj->expires - ahead &&
+        atomic_load_explicit(&obj->hits, memory_order_relaxed) >= CACHE_REFRESH_HITS) {
+        return CACHE_FOUND_REFRESH;
+    }
+    return CACHE_FOUND_FRESH;
+}
+
+/*
+ * cache_lookup_hash - Find key in its shard and pin what the lookup is
+ *     to serve, setting *found as cache_found() does and *gen to the
+ *     object's generation if that is the indexed object itself, else 0
+ */
+static cache_object_t *cache_lookup_hash(cache_shard_t *s, const char *key, uint64_t hash,
+                                         long long now, int *found, uint64_t *gen)
+{
+    cache_object_t *cur;
+
+    pthread_rwlock_rdlock(&s->lock);
+    cur = cache_find(s, key, hash);
+    if (cur) {
+        cache_object_t *indexed = cur;
+
+        s->policy->hit(s, cur);
+        *found = cache_found(&cur, now);
+        *gen = cur == indexed ? atomic_load_explicit(&cur->gen, memory_order_relaxed) : 0;
+        atomic_fetch_add_explicit(&cur->refcnt, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cur->hits, 1, memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return cur;
+}
+
+/*
+ * cache_lookup - Return a pinned reference to the object for key, or
+ *     NULL on a miss. The object may still be filling, or stale. The
+ *     caller must cache_release() it when done.
+ */
+cache_object_t *cache_lookup(const char *key)
+{
+    uint64_t hash = cache_hash(key);
+    uint64_t gen;
+    int found;
+
+    return cache_lookup_hash(cache_shard_for(hash), key, hash, (long long)time(NULL), &found,
+                             &gen);
+}
+
+/*
+ * cache_alloc_fill - Allocate an object for key outside the lock, from
+ *     the arena if possible; it goes back with slab_free() if it turns out
+ *     not to be needed. Sets *block to its slab block, 0 if it is on the
+ *     heap.
+ */
+static cache_object_t *cache_alloc_fill(cache_shard_t *s, const char *key, size_t *block)
+{
+    size_t size = sizeof(cache_object_t) + strlen(key) + 1;
+    cache_object_t *obj;
+
+    *block = slab_block_size(size);
+    if (!*block || (obj = cache_slab_alloc(s, *block)) == NULL) {
+        obj = Malloc(size);
+        *block = 0;
+    }
+    return obj;
+}
+
+/*
+ * cache_start_fill - Make obj an empty object for key, filled to
+ *     revalidate stale unless that is NULL, and index it if it can be
+ *     made to fit. Caller holds the write lock, unless block is 0 and obj
+ *     is never to be indexed.
+ */
+static void cache_start_fill(cache_shard_t *s, cache_object_t *obj, size_t block,
+                             const char *key, uint64_t hash, cache_object_t *stale,
+                             cache_object_t **reap)
+{
+    size_t b;
+
+    memset(obj, 0, sizeof(cache_object_t));
+    obj->key = (char *)(obj + 1);
+    strcpy(obj->key, key);
+    atomic_init(&obj->size, 0);
+    atomic_init(&obj->state, CACHE_FILLING);
+    atomic_init(&obj->refcnt, 1);   /* The filler's */
+    atomic_init(&obj->freq, 0);
+    atomic_init(&obj->hits, 0);
+    atomic_init(&obj->gen, 0);
+    obj->hash = hash;
+    pthread_mutex_init(&obj->lock, NULL);
+    obj->expect = -1;
+    obj->storing = 1;
+    obj->stale = stale;
+    obj->admitted = stale != NULL;  /* It was let in once already */
+
+    if (block && !cache_admit(s, obj, block)) {
+        block = 0;
+    }
+    if (block) {
+        cache_evict_until_fit(s, block, reap);
+    }
+    if (block && s->bytes + block <= s->capacity) {
+        if (s->nentries >= s->nbuckets) {
+            cache_grow(s);
+        }
+        b = hash & (s->nbuckets - 1);
+        obj->hnext = s->buckets[b];
+        s->buckets[b] = obj;
+        s->nentries++;
+        s->bytes += block;
+        obj->charged = block;
+        obj->indexed = 1;
+        atomic_store_explicit(&obj->gen, ++s->generation, memory_order_relaxed);
+        s->policy->insert(s, obj);
+        atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * cache_refresh - Hand a fill refreshing obj, which the caller holds a
+ *     reference to, to the refresher, unless obj has left the index
+ *     or is already being refreshed
+ */
+static void cache_refresh(cache_shard_t *s, cache_object_t *obj)
+{
+    cache_object_t *reap = NULL;
+    cache_object_t *fill;
+    size_t block;
+
+    fill = cache_alloc_fill(s, obj->key, &block);
+    pthread_rwlock_wrlock(&s->lock);
+    if (!obj->indexed) {
+        pthread_rwlock_unlock(&s->lock);
+        slab_free(fill);
+        return;
+    }
+    /* The fill's reference to obj stands in for the index's */
+    atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+    cache_remove_obj(s, obj, &reap);
+    cache_start_fill(s, fill, block, obj->key, obj->hash, obj, &reap);
+    fill->behind = obj;
+    atomic_fetch_add_explicit(&s->refreshes, 1, memory_order_relaxed);
+    pthread_rwlock_unlock(&s->lock);
+    cache_reap(reap);
+    cache_refresher(fill);
+}
+
+/* Count a lookup of key that obj answers */
+static void cache_count_hit(cache_shard_t *s, cache_object_t *obj, long long now)
+{
+    atomic_fetch_add_explicit(&s->hits, 1, memory_order_relaxed);
+    if (atomic_load_explicit(&obj->state, memory_order_acquire) == CACHE_COMPLETE &&
+        obj->expires <= now) {
+        atomic_fetch_add_explicit(&s->stale_hits, 1, memory_order_relaxed);
+    }
+}
+
+/* A slot is stale once its object left the index or is due for a refresh */
+static int cache_l1_stale(const cache_l1_slot_t *sl, cache_object_t *obj, long long now)
+{
+    return sl->gen != atomic_load(&obj->gen) || now >= sl->until;
+}
+
+/*
+ * cache_l1_keep - Put back obj, whose reference the calling thread took
+ *     out of its slot sl, unless it left the index meanwhile. Whoever
+ *     removed it then either finds it back in sl or has made it stale.
+ */
+static void cache_l1_keep(cache_l1_slot_t *sl, cache_object_t *obj)
+{
+    cache_object_t *expect = obj;
+
+    atomic_store(&sl->obj, obj);
+    if (sl->gen != atomic_load(&obj->gen) &&
+        atomic_compare_exchange_strong(&sl->obj, &expect, NULL)) {
+        cache_release(obj);
+    }
+}
+
+/*
+ * cache_l1_find - Pin and return the object the calling thread's L1
+ *     holds for key, or NULL if it has none or only a stale one
+ */
+static cache_object_t *cache_l1_find(cache_local_t *l, const char *key, uint64_t hash,
+                                     long long now)
+{
+    cache_l1_slot_t *sl = &l->slots[hash & (cache_l1_slots - 1)];
+    cache_l1_slot_t *sw = &l->slots[l->sweep++ & (cache_l1_slots - 1)];
+    cache_object_t *obj;
+
+    /* Lets go of objects due for a refresh a slot at a time, even unused ones */
+    if (sw != sl && (obj = atomic_exchange(&sw->obj, NULL)) != NULL) {
+        if (cache_l1_stale(sw, obj, now)) {
+            cache_release(obj);
+        } else {
+            cache_l1_keep(sw, obj);
+        }
+    }
+    /* Taking the slot's reference keeps cache_l1_forget() from dropping it */
+    if (!(obj = atomic_exchange(&sl->obj, NULL))) {
+        return NULL;
+    }
+    if (cache_l1_stale(sl, obj, now)) {
+        cache_release(obj);
+        return NULL;
+    }
+    if (obj->hash != hash || strcmp(obj->key, key)) {
+        cache_l1_keep(sl, obj);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+    cache_l1_keep(sl, obj);
+    if (++l->touches % CACHE_L1_TOUCH == 0) {
+        cache_shard_for(hash)->policy->hit(cache_shard_for(hash), obj);
+    }
+    cache_bump(&l->l1_hits, 1);
+    return obj;
+}
+
+/*
+ * cache_l1_put - Put obj, which a shard just answered a lookup with at
+ *     generation gen, in the calling thread's L1 if it is complete,
+ *     still indexed and hit often enough, in place of what the slot held
+ */
+static void cache_l1_put(cache_local_t *l, cache_object_t *obj, uint64_t gen, long long now)
+{
+    cache_l1_slot_t *sl = &l->slots[obj->hash & (cache_l1_slots - 1)];
+    long long ahead = (obj->expires - obj->fresh_since) / CACHE_REFRESH_AHEAD;
+    long long until = cache_refresher && ahead > 0 ? obj->expires - ahead : obj->expires;
+    cache_object_t *old;
+
+    if (!gen || until <= now ||
+        atomic_load_explicit(&obj->state, memory_order_acquire) != CACHE_COMPLETE ||
+        atomic_load_explicit(&obj->hits, memory_order_relaxed) < CACHE_L1_HITS) {
+        return;
+    }
+    if ((old = atomic_exchange(&sl->obj, NULL)) != NULL && old != obj) {
+        cache_release(old);
+        old = NULL;
+    }
+    if (!old) {
+        atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+    }
+    sl->gen = gen;
+    sl->until = until;
+    cache_l1_keep(sl, obj);
+}
+
+/*
+ * cache_lookup_fill - Look key up like cache_lookup(), but on a miss
+ *     index a new, empty object for it, set *fill and return it. The
+ *     caller is then its filler and must finish it with cache_fill_end().
+ *     If the object cannot be made to fit it is returned unindexed. A
+ *     stale object counts as a miss, but the new object's filler is to
+ *     revalidate it, see cache_fill_stale(), unless the refresher can
+ *     do that while the stale object is served.
+ */
+cache_object_t *cache_lookup_fill(const char *key, int *fill)
+{
+    uint64_t hash = cache_hash(key);
+    cache_shard_t *s = cache_shard_for(hash);
+    long long now = (long long)time(NULL);
+    cache_local_t *l = cache_local();
+    cache_object_t *obj, *spare, *stale = NULL;
+    cache_object_t *reap = NULL;
+    size_t block;
+    uint64_t gen;
+    int found;
+
+    *fill = 0;
+    if (l->slots && (obj = cache_l1_find(l, key, hash, now)) != NULL) {
+        return obj;
+    }
+    atomic_fetch_add_explicit(&s->lookups, 1, memory_order_relaxed);
+    if ((obj = cache_lookup_hash(s, key, hash, now, &found, &gen)) != NULL) {
+        if (found != CACHE_FOUND_STALE) {
+            cache_count_hit(s, obj, now);
+            if (found == CACHE_FOUND_REFRESH) {
+                cache_refresh(s, obj);
+            } else if (l->slots) {
+                cache_l1_put(l, obj, gen, now);
+            }
+            return obj;
+        }
+        cache_release(obj);
+    }
+    if (s->policy->miss) {
+        s->policy->miss(s, hash);
+    }
+
+    /* Allocate outside the lock; it goes back if somebody beats us */
+    spare = cache_alloc_fill(s, key, &block);
+
+    pthread_rwlock_wrlock(&s->lock);
+
+    /* Somebody may have started filling it since the read lock */
+    if ((obj = cache_find(s, key, hash)) != NULL) {
+        found = cache_found(&obj, now);
+        atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+        if (found != CACHE_FOUND_STALE) {
+            pthread_rwlock_unlock(&s->lock);
+            slab_free(spare);
+            return obj;
+        }
+        /* Requests arriving while it is revalidated wait for the new one */
+        stale = obj;
+        cache_remove_obj(s, stale, &reap);
+        atomic_fetch_add_explicit(&s->revalidations, 1, memory_order_relaxed);
+    }
+
+    obj = spare;
+    cache_start_fill(s, obj, block, key, hash, stale, &reap);
+
+    pthread_rwlock_unlock(&s->lock);
+    cache_reap(reap);
+    if (!stale && disk_enabled() && cache_fill_from_disk(obj, now)) {
+        atomic_fetch_add_explicit(&s->hits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->disk_hits, 1, memory_order_relaxed);
+        return obj;
+    }
+    *fill = 1;
+    return obj;
+}
+
+/*
+ * cache_flush - Write every complete object in the cache to the disk
+ *     tier, so a restart finds them there
+ */
+void cache_flush(void)
+{
+    int i;
+
+    if (!disk_enabled()) {
+        return;
+    }
+    for (i = 0; i < cache_nshards; i++) {
+        cache_shard_t *s = &cache_shards[i];
+        cache_object_t **objs;
+        size_t n = 0, j, b;
+
+        pthread_rwlock_rdlock(&s->lock);
+        objs = Malloc(sizeof(cache_object_t *) * (s->nentries ? s->nentries : 1));
+        for (b = 0; b < s->nbuckets; b++) {
+            cache_object_t *cur;
+
+            for (cur = s->buckets[b]; cur; cur = cur->hnext) {
+                if (atomic_load_explicit(&cur->state, memory_order_acquire) ==
+                    CACHE_COMPLETE) {
+                    atomic_fetch_add_explicit(&cur->refcnt, 1, memory_order_relaxed);
+                    objs[n++] = cur;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&s->lock);
+
+        for (j = 0; j < n; j++) {
+            cache_spill(objs[j]);
+            cache_release(objs[j]);
+        }
+        Free(objs);
+    }
+}
+
+static void cache_wake_all(cache_object_t *obj)
+{
+    cache_waiter_t *w;
+
+    pthread_mutex_lock(&obj->lock);
+    w = obj->waiters;
+    obj->waiters = NULL;
+    pthread_mutex_unlock(&obj->lock);
+
+    while (w) {
+        /* A woken waiter may be gone as soon as wake() returns */
+        cache_waiter_t *next = w->next;
+        w->wake(w);
+        w = next;
+    }
+}
+
+/* Make everything written so far visible to readers */
+static void cache_publish(cache_object_t *obj)
+{
+    atomic_store_explicit(&obj->size, obj->written, memory_order_release);
+    cache_wake_all(obj);
+}
+
+/*
+ * cache_fill_drop - obj will not stay in the cache. Take it out of the
+ *     index and stop storing it unless somebody is already reading it.
+ */
+static void cache_fill_drop(cache_shard_t *s, cache_object_t *obj)
+{
+    if (obj->indexed) {
+        cache_object_t *reap = NULL;
+
+        pthread_rwlock_wrlock(&s->lock);
+        cache_remove_obj(s, obj, &reap);
+        pthread_rwlock_unlock(&s->lock);
+        cache_reap(reap);
+    }
+
+    /* Out of the index, nobody new can take a reference */
+    if (atomic_load_explicit(&obj->refcnt, memory_order_acquire) == 1) {
+        obj->storing = 0;
+        cache_free_chunks(obj);
+    }
+}
+
+/* Charge a block to the shard, evicting to make room for it */
+static int cache_charge(cache_shard_t *s, cache_object_t *obj, size_t block)
+{
+    cache_object_t *reap = NULL;
+    int rc = -1;
+
+    pthread_rwlock_wrlock(&s->lock);
+    if (obj->indexed && cache_admit(s, obj, block)) {
+        cache_evict_until_fit(s, block, &reap);
+        if (s->bytes + block <= s->capacity) {
+            s->bytes += block;
+            obj->charged += block;
+            if (s->policy->charge) {
+                s->policy->charge(s, obj, (long long)block);
+            }
+            rc = 0;
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+    cache_reap(reap);
+    return rc;
+}
+
+static void cache_uncharge(cache_shard_t *s, cache_object_t *obj, size_t block)
+{
+    pthread_rwlock_wrlock(&s->lock);
+    if (obj->indexed) {
+        s->bytes -= block;
+        obj->charged -= block;
+        if (s->policy->charge) {
+            s->policy->charge(s, obj, -(long long)block);
+        }
+    }
+    pthread_rwlock_unlock(&s->lock);
+}
+
+/*
+ * cache_chunk_block - Pick the next chunk's slab block: the largest one
+ *     the rest of the expected size fills, else twice the last chunk.
+ */
+static size_t cache_chunk_block(const cache_object_t *obj)
+{
+    size_t want, block;
+
+    if (obj->expect >= 0 && (size_t)obj->expect > obj->written) {
+        want = obj->expect - obj->written + CACHE_CHUNK_HDR;
+    } else if (obj->tail) {
+        want = (obj->tail->cap + CACHE_CHUNK_HDR) * 2;
+    } else {
+        want = CACHE_FIRST_CHUNK;
+    }
+    if (want > CACHE_CHUNK_SIZE) {
+        want = CACHE_CHUNK_SIZE;
+    }
+    block = slab_block_below(want);
+    return block ? block : slab_block_size(want);
+}
+
+/*
+ * cache_chunk_alloc - Allocate and charge a chunk for an indexed
+ *     object, or take one from the heap for an unindexed one. Returns
+ *     NULL if an indexed object has no room for it.
+ */
+static cache_chunk_t *cache_chunk_alloc(cache_shard_t *s, cache_object_t *obj, size_t block)
+{
+    cache_chunk_t *ch;
+
+    if (!obj->indexed) {
+        return Malloc(block);
+    }
+    if (cache_charge(s, obj, block) < 0) {
+        return NULL;
+    }
+    if ((ch = cache_slab_alloc(s, block)) == NULL) {
+        /* The arena is too fragmented for this class just now */
+        cache_uncharge(s, obj, block);
+    }
+    return ch;
+}
+
+/*
+ * cache_fill_append - Add n response bytes to an object being filled.
+ *     Bytes appended before cache_fill_head() are held back from
+ *     readers until the head is complete.
+ */
+void cache_fill_append(cache_object_t *obj, const void *data, size_t n)
+{
+    cache_shard_t *s = cache_shard_for(obj->hash);
+    const char *p = data;
+
+    obj->received += n;
+    if (!obj->storing) {
+        return;
+    }
+    if (obj->indexed ? obj->written + n > cache_max_object
+                     : atomic_load_explicit(&obj->refcnt, memory_order_acquire) == 1) {
+        cache_fill_drop(s, obj);
+        if (!obj->storing) {
+            return;
+        }
+    }
+
+    while (n > 0) {
+        size_t m;
+
+        if (!obj->tail || obj->tail_len == obj->tail->cap) {
+            size_t block = cache_chunk_block(obj);
+            cache_chunk_t *ch;
+
+            if ((ch = cache_chunk_alloc(s, obj, block)) == NULL) {
+                cache_fill_drop(s, obj);
+                if (!obj->storing) {
+                    return;
+                }
+                ch = Malloc(block);
+            }
+            ch->next = NULL;
+            ch->cap = block - CACHE_CHUNK_HDR;
+            if (obj->tail) {
+                obj->tail->next = ch;
+            } else {
+                obj->chunks = ch;
+            }
+            obj->tail = ch;
+            obj->tail_len = 0;
+        }
+
+        m = obj->tail->cap - obj->tail_len;
+        if (m > n) {
+            m = n;
+        }
+        memcpy(obj->tail->data + obj->tail_len, p, m);
+        obj->tail_len += m;
+        obj->written += m;
+        p += m;
+        n -= m;
+    }
+
+    if (obj->head_done) {
+        cache_publish(obj);
+    }
+}
+
+/*
+ * cache_fill_storing - Whether cache_fill_append() would still keep
+ *     bytes for obj. Once it is 0 nobody reads obj and it never turns
+ *     back on, so the filler may relay the rest without it.
+ */
+int cache_fill_storing(cache_object_t *obj)
+{
+    return obj->storing;
+}
+
+/* cache_fill_skip - Count n response bytes relayed past obj unstored */
+void cache_fill_skip(cache_object_t *obj, size_t n)
+{
+    obj->received += n;
+}
+
+/*
+ * cache_fill_pass - The response obj is filled with must not be kept or
+ *     shared. Take it out of the index and stop storing it, and let the
+ *     readers waiting for it fetch their own.
+ */
+static void cache_fill_pass(cache_shard_t *s, cache_object_t *obj)
+{
+    cache_fill_drop(s, obj);
+    if (obj->storing) {
+        /* Readers have seen none of it, so none can be using the chunks */
+        obj->storing = 0;
+        cache_free_chunks(obj);
+        atomic_store_explicit(&obj->state, CACHE_ABORTED, memory_order_release);
+        cache_wake_all(obj);
+    }
+}
+
+/*
+ * cache_fill_head - Everything appended so far is the head, hdr_len
+ *     bytes plus the blank line, and maybe the start of the body.
+ *     body_len is the Content-Length, or -1 if unknown. expires is when
+ *     the response goes stale, or -1 if it must not be stored, in which
+ *     case nobody else is given it either, and grace how long after that
+ *     it may be served while it is refreshed. Publishes the head to
+ *     readers.
+ */
+void cache_fill_head(cache_object_t *obj, int hdr_len, int delimited, long long body_len,
+                     long long expires, long long grace)
+{
+    cache_shard_t *s = cache_shard_for(obj->hash);
+
+    obj->hdr_len = hdr_len;
+    obj->delimited = delimited;
+    obj->expires = expires;
+    obj->stale_until = expires + grace;
+    obj->fresh_since = (long long)time(NULL);
+    obj->head_done = 1;
+    if (expires < 0) {
+        cache_fill_pass(s, obj);
+        return;
+    }
+    if (body_len >= 0) {
+        obj->expect = hdr_len + 2 + body_len;
+        if ((size_t)obj->expect > cache_max_object) {
+            cache_fill_drop(s, obj);
+        }
+    }
+    if (obj->storing) {
+        cache_publish(obj);
+    }
+}
+
+/*
+ * cache_fill_stale - The stale object obj's filler is revalidating, or
+ *     NULL if it is filling an object the cache did not hold
+ */
+cache_object_t *cache_fill_stale(cache_object_t *obj)
+{
+    return obj->stale;
+}
+
+/* Bytes of memory v takes up, itself and its chunks */
+static size_t cache_object_bytes(cache_object_t *v)
+{
+    size_t n = sizeof(cache_object_t) + strlen(v->key) + 1;
+    cache_chunk_t *ch;
+
+    for (ch = v->chunks; ch; ch = ch->next) {
+        n += CACHE_CHUNK_HDR + ch->cap;
+    }
+    return n;
+}
+
+static int cache_has_variants(cache_object_t *obj)
+{
+    int i;
+
+    for (i = 0; i < CACHE_MAX_VARIANTS; i++) {
+        if (atomic_load_explicit(&obj->variants[i], memory_order_acquire)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * cache_variant_attach - Make the complete object v obj's variant,
+ *     taking over the caller's reference, if obj is still indexed, has no
+ *     such variant yet and its shard can make room for v. Returns -1,
+ *     dropping v, if not.
+ */
+static int cache_variant_attach(cache_object_t *obj, int variant, cache_object_t *v)
+{
+    cache_shard_t *s = cache_shard_for(obj->hash);
+    size_t bytes = cache_object_bytes(v);
+    cache_object_t *reap = NULL;
+    cache_object_t *none = NULL;
+    int rc = -1;
+
+    pthread_rwlock_wrlock(&s->lock);
+    if (obj->indexed) {
+        cache_evict_until_fit(s, bytes, &reap);
+    }
+    /* The evictions may have taken obj itself */
+    if (obj->indexed && s->bytes + bytes <= s->capacity &&
+        atomic_compare_exchange_strong(&obj->variants[variant], &none, v)) {
+        s->bytes += bytes;
+        obj->charged += bytes;
+        if (s->policy->charge) {
+            s->policy->charge(s, obj, (long long)bytes);
+        }
+        rc = 0;
+    }
+    pthread_rwlock_unlock(&s->lock);
+    cache_reap(reap);
+    if (rc < 0) {
+        cache_release(v);
+    }
+    return rc;
+}
+
+/*
+ * cache_variant - Return a pinned reference to obj's variant, or NULL if
+ *     it has none. The caller must cache_release() it when done.
+ */
+cache_object_t *cache_variant(cache_object_t *obj, int variant)
+{
+    cache_object_t *v = atomic_load_explicit(&obj->variants[variant], memory_order_acquire);
+
+    if (v) {
+        atomic_fetch_add_explicit(&v->refcnt, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cache_shard_for(obj->hash)->variant_hits, 1,
+                                  memory_order_relaxed);
+    }
+    return v;
+}
+
+/*
+ * cache_variant_begin - Start an object to make a variant of obj in,
+ *     which the caller fills with cache_fill_append() and
+ *     cache_fill_head() and then hands to cache_variant_end()
+ */
+cache_object_t *cache_variant_begin(cache_object_t *obj)
+{
+    cache_shard_t *s = cache_shard_for(obj->hash);
+    cache_object_t *v = Malloc(sizeof(cache_object_t) + strlen(obj->key) + 1);
+
+    cache_start_fill(s, v, 0, obj->key, obj->hash, NULL, NULL);
+    /* Keep the bytes stored although nobody is reading them yet */
+    atomic_fetch_add_explicit(&v->refcnt, 1, memory_order_relaxed);
+    return v;
+}
+
+/*
+ * cache_variant_end - Finish the variant v of obj and attach it as
+ *     variant number variant. Returns 0, or -1 if it did not fit and was
+ *     dropped.
+ */
+int cache_variant_end(cache_object_t *obj, int variant, cache_object_t *v)
+{
+    v->received = 0;            /* None of it came from an origin */
+    cache_fill_end(v, 1);
+    if (atomic_load_explicit(&v->state, memory_order_acquire) != CACHE_COMPLETE) {
+        cache_release(v);
+        return -1;
+    }
+    if (cache_variant_attach(obj, variant, v) < 0) {
+        return -1;
+    }
+    atomic_fetch_add_explicit(&cache_shard_for(obj->hash)->variants, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Append bytes [from, to) of src to the object being filled */
+static void cache_fill_copy(cache_object_t *obj, cache_object_t *src, size_t from, size_t to)
+{
+    cache_cursor_t cur = { NULL, 0, 0 };
+    struct iovec iov[CACHE_IOV_MAX];
+
+    cache_cursor_advance(src, &cur, from);
+    while (cur.off < to) {
+        int n = cache_object_iov(src, &cur, to, iov, CACHE_IOV_MAX);
+        int i;
+
+        for (i = 0; i < n; i++) {
+            cache_fill_append(obj, iov[i].iov_base, iov[i].iov_len);
+            cache_cursor_advance(src, &cur, iov[i].iov_len);
+        }
+    }
+}
+
+/*
+ * cache_fill_revalidated - The origin says obj's stale object has not
+ *     changed. Fill obj with the stale body under head, the hdr_len
+ *     byte head the 304 updated, going stale at expires with grace as in
+ *     cache_fill_head(), or if it must not be stored any longer (expires
+ *     -1) give obj up, and end the fill. The stale object's variants
+ *     describe the old head, so they stay behind and obj is compressed
+ *     anew. Returns obj if it was stored, else the stale object, for the
+ *     caller to serve and cache_release().
+ */
+cache_object_t *cache_fill_revalidated(cache_object_t *obj, const char *head, int hdr_len,
+                                       long long expires, long long grace)
+{
+    cache_object_t *stale = obj->stale;
+    size_t size = atomic_load_explicit(&stale->size, memory_order_acquire);
+    size_t body = (size_t)stale->hdr_len + 2;
+
+    atomic_fetch_add_explicit(&cache_shard_for(obj->hash)->not_modified, 1,
+                              memory_order_relaxed);
+    obj->stale = NULL;
+    cache_fill_append(obj, head, hdr_len);
+    cache_fill_append(obj, "\r\n", 2);
+    cache_fill_head(obj, hdr_len, stale->delimited, (long long)(size - body), expires, grace);
+    if (obj->storing) {
+        cache_fill_copy(obj, stale, body, size);
+    }
+    obj->received = 0;          /* None of it came from the origin */
+    if (obj->storing) {
+        atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+        cache_release(stale);
+        stale = obj;
+    }
+    cache_fill_end(obj, 1);
+    return stale;
+}
+
+/*
+ * cache_fill_end - The filler is done with obj: ok if the whole
+ *     response was appended, else the object is aborted and leaves the
+ *     cache. Wakes all readers and drops the filler's reference.
+ */
+void cache_fill_end(cache_object_t *obj, int ok)
+{
+    cache_shard_t *s = cache_shard_for(obj->hash);
+
+    atomic_fetch_add_explicit(&s->bytes_missed, obj->received, memory_order_relaxed);
+    if (!obj->storing || !obj->head_done) {
+        ok = 0;
+    }
+    if (ok) {
+        atomic_store_explicit(&obj->state, CACHE_COMPLETE, memory_order_release);
+    } else {
+        atomic_store_explicit(&obj->state, CACHE_ABORTED, memory_order_release);
+        if (obj->indexed) {
+            cache_object_t *reap = NULL;
+
+            pthread_rwlock_wrlock(&s->lock);
+            cache_remove_obj(s, obj, &reap);
+            pthread_rwlock_unlock(&s->lock);
+            cache_reap(reap);
+        }
+    }
+    if (obj->behind) {
+        /* Lookups get obj itself from now on, before behind can be freed */
+        pthread_rwlock_wrlock(&s->lock);
+        obj->behind = NULL;
+        pthread_rwlock_unlock(&s->lock);
+    }
+    if (obj->stale) {
+        cache_release(obj->stale);
+        obj->stale = NULL;
+    }
+    cache_wake_all(obj);
+    if (ok && obj->indexed && cache_encoder && !cache_has_variants(obj)) {
+        atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+        cache_encoder(obj);
+    }
+    cache_release(obj);
+}
+
+/*
+ * cache_available - Bytes of obj readers may use now. *state tells
+ *     whether more are coming; once it reads CACHE_COMPLETE the size is
+ *     final.
+ */
+size_t cache_available(cache_object_t *obj, int *state)
+{
+    *state = atomic_load_explicit(&obj->state, memory_order_acquire);
+    return atomic_load_explicit(&obj->size, memory_order_acquire);
+}
+
+/*
+ * cache_wait - Queue w to be woken when obj grows past seen bytes or
+ *     its fill ends. Returns 1 if w was queued, 0 if that has already
+ *     happened and the caller should look again instead.
+ */
+int cache_wait(cache_object_t *obj, size_t seen, cache_waiter_t *w)
+{
+    int queued = 0;
+
+    pthread_mutex_lock(&obj->lock);
+    if (atomic_load_explicit(&obj->size, memory_order_acquire) == seen &&
+        atomic_load_explicit(&obj->state, memory_order_acquire) == CACHE_FILLING) {
+        w->next = obj->waiters;
+        obj->waiters = w;
+        queued = 1;
+    }
+    pthread_mutex_unlock(&obj->lock);
+    return queued;
+}
+
+/*
+ * cache_object_iov - Describe the bytes of obj from cur up to end, which
+ *     must not exceed cache_available(), in at most maxiov iovecs.
+ *     Returns the number of iovecs used.
+ */
+int cache_object_iov(cache_object_t *obj, const cache_cursor_t *cur, size_t end,
+                     struct iovec *iov, int maxiov)
+{
+    cache_chunk_t *ch = cur->chunk ? cur->chunk : obj->chunks;
+    size_t coff = cur->chunk_off;
+    size_t off = cur->off;
+    int n = 0;
+
+    while (n < maxiov && off < end) {
+        size_t len;
+
+        if (coff == ch->cap) {
+            ch = ch->next;
+            coff = 0;
+        }
+        len = ch->cap - coff;
+        if (len > end - off) {
+            len = end - off;
+        }
+        iov[n].iov_base = ch->data + coff;
+        iov[n].iov_len = len;
+        n++;
+        coff += len;
+        off += len;
+    }
+    return n;
+}
+
+/*
+ * cache_object_head - Copy obj's stored head, without the blank line,
+ *     to buf as a string, cut to size - 1 bytes. Returns its length.
+ */
+size_t cache_object_head(cache_object_t *obj, char *buf, size_t size)
+{
+    cache_cursor_t cur = { NULL, 0, 0 };
+    struct iovec iov[CACHE_IOV_MAX];
+    size_t end = (size_t)obj->hdr_len < size - 1 ? (size_t)obj->hdr_len : size - 1;
+    size_t len = 0;
+
+    if (end > atomic_load_explicit(&obj->size, memory_order_acquire)) {
+        end = 0;
+    }
+    while (len < end) {
+        int n = cache_object_iov(obj, &cur, end, iov, CACHE_IOV_MAX);
+        int i;
+
+        for (i = 0; i < n; i++) {
+            memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        cache_cursor_advance(obj, &cur, len - cur.off);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* cache_cursor_advance - Move cur past n bytes that have been sent */
+void cache_cursor_advance(cache_object_t *obj, cache_cursor_t *cur, size_t n)
+{
+    if (!cur->chunk) {
+        cur->chunk = obj->chunks;
+    }
+    while (n > 0) {
+        size_t len;
+
+        if (cur->chunk_off == cur->chunk->cap) {
+            cur->chunk = cur->chunk->next;
+            cur->chunk_off = 0;
+        }
+        len = cur->chunk->cap - cur->chunk_off;
+        if (len > n) {
+            len = n;
+        }
+        cur->chunk_off += len;
+        cur->off += len;
+        n -= len;
+    }
+}
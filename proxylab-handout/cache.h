@@ -0,0 +1,196 @@
+/*
+ * cache.h - sharded, hashed web object cache for the proxy
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/* Recommended max cache and object sizes, the defaults for -c and -m */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Upper bound on the number of independently locked shards */
+#define CACHE_MAX_SHARDS 64
+
+/* Objects are stored in chunks of at most this many bytes, header included */
+#define CACHE_CHUNK_SIZE 16384
+
+/*
+ * An object read at least CACHE_REFRESH_HITS times is refreshed in the
+ * background once it is in the last 1/CACHE_REFRESH_AHEAD of its lifetime
+ */
+#define CACHE_REFRESH_HITS 2
+#define CACHE_REFRESH_AHEAD 10
+
+/*
+ * Every thread keeps references to up to CACHE_L1_SLOTS objects (the
+ * default for -L) in a direct-mapped L1 of its own, checked before the
+ * shards. An object moves there once the shards have answered
+ * CACHE_L1_HITS lookups for it, and one in CACHE_L1_TOUCH of its L1
+ * hits is passed on to the replacement policy. Only indexed objects are
+ * held: one that leaves the index is taken out of every L1 at once.
+ */
+#define CACHE_L1_SLOTS 64
+#define CACHE_L1_HITS 2
+#define CACHE_L1_TOUCH 8
+
+/* Compressed variants an object can carry, see cache_variant() */
+#define CACHE_MAX_VARIANTS 2
+
+/* Most iovecs cache_object_iov() is asked to fill at once */
+#define CACHE_IOV_MAX 16
+
+/* Fill states */
+enum {
+    CACHE_FILLING,              /* Still arriving from the origin */
+    CACHE_COMPLETE,
+    CACHE_ABORTED               /* The fill failed; the object is unusable */
+};
+
+/*
+ * A request waiting for an object that is still being filled. wake()
+ * is called exactly once, from the filling thread, when more of the
+ * object is available or the fill has ended.
+ */
+typedef struct cache_waiter {
+    void (*wake)(struct cache_waiter *w);
+    struct cache_waiter *next;
+} cache_waiter_t;
+
+typedef struct cache_chunk {
+    struct cache_chunk *next;
+    size_t cap;                 /* Filled completely before the next */
+    char data[];
+} cache_chunk_t;
+
+/*
+ * A cached web object, stored as a chain of chunks. One thread fills an
+ * object; the bytes it has published never change, so readers holding
+ * a reference use them without any lock, even while later bytes are
+ * still arriving. The cache index owns one reference; the object is
+ * freed when the last reference is dropped with cache_release().
+ *
+ * The stored response is the origin's head without its connection
+ * headers (hdr_len bytes), the blank line and the body. hdr_len,
+ * delimited and expires are valid once any bytes have been published.
+ *
+ * A lookup that finds a complete object past expires takes it out of
+ * the index and fills a new one in its place, its filler revalidating
+ * the stale object, which it holds as stale, with the origin. While a
+ * fill refreshes an object in the background, lookups are given the
+ * object it replaces, its behind, instead, until stale_until.
+ *
+ * A complete object may carry variants: unindexed objects holding the
+ * same response compressed, each with a head of its own. They are
+ * charged to it and live as long as it does.
+ */
+typedef struct cache_object {
+    char *key;                  /* Stored just after the object */
+    cache_chunk_t *chunks;
+    atomic_size_t size;         /* Bytes published to readers */
+    atomic_int state;
+    int hdr_len;
+    int delimited;              /* The body's end shows without EOF */
+    long long expires;          /* When it goes stale, seconds since the epoch */
+    long long stale_until;      /* Until when it may be served stale */
+    long long fresh_since;      /* When it was filled */
+    atomic_int hits;            /* Lookups that found it */
+    atomic_ullong gen;          /* Set while indexed, 0 once it leaves */
+    atomic_int refcnt;
+    atomic_int freq;            /* The policy's hit count or reference bit */
+    int queue;                  /* The policy's queue holding it */
+    uint64_t hash;
+    struct cache_object *hnext; /* Next object in the same bucket */
+    struct cache_object *prev;  /* Neighbours in the policy's ring or queue */
+    struct cache_object *next;
+
+    pthread_mutex_t lock;       /* Protects waiters */
+    cache_waiter_t *waiters;
+
+    _Atomic(struct cache_object *) variants[CACHE_MAX_VARIANTS]; /* Set once each */
+
+    /* Owned by the shard lock */
+    int indexed;                /* Reachable through the index */
+    size_t charged;             /* Bytes counted against the shard */
+    int admitted;               /* The policy let it evict others */
+    int evicted;                /* Removed by the policy, not dropped */
+    struct cache_object *behind; /* Served in its place while it fills */
+
+    /* Owned by the filling thread */
+    cache_chunk_t *tail;
+    size_t tail_len;
+    size_t written;             /* Bytes stored, published or not */
+    size_t received;            /* Bytes appended, stored or not */
+    long long expect;           /* Expected total size, or -1 */
+    int head_done;
+    int storing;                /* Cleared when nobody will read the rest */
+    struct cache_object *stale; /* The object this fill revalidates, or NULL */
+} cache_object_t;
+
+/* A reader's position in an object */
+typedef struct {
+    cache_chunk_t *chunk;       /* Chunk holding byte off, NULL at first */
+    size_t chunk_off;
+    size_t off;
+} cache_cursor_t;
+
+/* Counters summed over all shards, see cache_get_stats() */
+typedef struct {
+    const char *policy;
+    unsigned long long lookups;      /* Requests that consulted the cache */
+    unsigned long long hits;
+    unsigned long long bytes_hit;    /* Response bytes served from the cache */
+    unsigned long long bytes_missed; /* Response bytes fetched on misses */
+    unsigned long long evictions;
+    unsigned long long rejected;     /* Misses the policy did not admit */
+    unsigned long long disk_hits;    /* Hits found only in the disk tier */
+    unsigned long long revalidations; /* Stale objects checked with the origin */
+    unsigned long long not_modified;  /* Of those, the ones still good */
+    unsigned long long refreshes;    /* Revalidations run in the background */
+    unsigned long long stale_hits;   /* Hits served stale meanwhile */
+    unsigned long long variants;     /* Compressed variants made */
+    unsigned long long variant_hits; /* Hits served one */
+    unsigned long long l1_hits;      /* Hits answered by a thread's own L1 */
+    size_t entries;
+    size_t bytes;
+    size_t capacity;
+} cache_stats_t;
+
+int cache_set_policy(const char *name);
+void cache_set_refresher(void (*refresh)(cache_object_t *fill));
+void cache_set_encoder(void (*encode)(cache_object_t *obj));
+void cache_set_l1(size_t slots);
+void cache_init(size_t capacity, size_t max_object);
+void cache_get_stats(cache_stats_t *st);
+void cache_served(size_t n);
+cache_object_t *cache_lookup(const char *key);
+cache_object_t *cache_lookup_fill(const char *key, int *fill);
+void cache_release(cache_object_t *obj);
+void cache_flush(void);
+
+void cache_fill_append(cache_object_t *obj, const void *data, size_t n);
+int cache_fill_storing(cache_object_t *obj);
+void cache_fill_skip(cache_object_t *obj, size_t n);
+void cache_fill_head(cache_object_t *obj, int hdr_len, int delimited, long long body_len,
+                     long long expires, long long grace);
+void cache_fill_end(cache_object_t *obj, int ok);
+cache_object_t *cache_fill_stale(cache_object_t *obj);
+cache_object_t *cache_fill_revalidated(cache_object_t *obj, const char *head, int hdr_len,
+                                       long long expires, long long grace);
+size_t cache_object_head(cache_object_t *obj, char *buf, size_t size);
+cache_object_t *cache_variant(cache_object_t *obj, int variant);
+cache_object_t *cache_variant_begin(cache_object_t *obj);
+int cache_variant_end(cache_object_t *obj, int variant, cache_object_t *v);
+
+size_t cache_available(cache_object_t *obj, int *state);
+int cache_wait(cache_object_t *obj, size_t seen, cache_waiter_t *w);
+int cache_object_iov(cache_object_t *obj, const cache_cursor_t *cur, size_t end,
+                     struct iovec *iov, int maxiov);
+void cache_cursor_advance(cache_object_t *obj, cache_cursor_t *cur, size_t n);
+
+#endif /* __CACHE_H__ */
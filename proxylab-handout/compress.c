@@ -0,0 +1,323 @@
+/*
+ * compress.c - compressed variants of cached responses
+ *
+ * The cache hands every object that completes filling to the compressor
+ * thread (see cache_set_encoder()). A 200 response with a text-like
+ * Content-Type and a body of at least COMPRESS_MIN_SIZE bytes, which is
+ * not encoded already, varies on nothing but Accept-Encoding and does
+ * not forbid transforms, is compressed once with each coding -z asked
+ * for. Each result that saves at least an eighth of the body is
+ * attached to the object as a variant, with the object's head rewritten
+ * to describe it. Hits then serve the variant the client's
+ * Accept-Encoding takes, preferring brotli, without compressing
+ * anything: compression costs CPU once per fill rather than once per
+ * response. Misses, and hits before the compressor is done, get the
+ * identity body, which carries Vary: Accept-Encoding too (see
+ * response_vary_encoding()).
+ *
+ * Chunked bodies are stored with their framing, so they are not
+ * compressed; neither is anything the cache does not keep.
+ */
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "csapp.h"
+#include "compress.h"
+
+_Static_assert(HTTP_NENCODINGS <= CACHE_MAX_VARIANTS, "a variant per coding");
+
+static const char *compress_names[HTTP_NENCODINGS] = { "gzip", "br" };
+
+typedef struct compress_job {
+    cache_object_t *obj;
+    struct compress_job *next;
+} compress_job_t;
+
+static int compress_encodings = 0;
+static compress_job_t *compress_head = NULL;
+static compress_job_t *compress_tail = NULL;
+static pthread_mutex_t compress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_queued = PTHREAD_COND_INITIALIZER;
+
+/*
+ * compress_parse - The HTTP_ENC_* bits of a comma separated list of
+ *     coding names, or -1 if it names one the proxy cannot produce
+ */
+int compress_parse(const char *list)
+{
+    int encodings = 0;
+
+    while (*list) {
+        size_t n = strcspn(list, ",");
+        int i;
+
+        for (i = 0; i < HTTP_NENCODINGS; i++) {
+            if (strlen(compress_names[i]) == n && !strncmp(list, compress_names[i], n)) {
+                break;
+            }
+        }
+        if (i == HTTP_NENCODINGS) {
+            return -1;
+        }
+        encodings |= 1 << i;
+        list += n + (list[n] == ',');
+    }
+    return encodings;
+}
+
+/* gzip n bytes of in into a Malloc()ed buffer, setting *len */
+static char *compress_gzip(const char *in, size_t n, size_t *len)
+{
+    z_stream zs;
+    char *out;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 more window bits ask for a gzip wrapper rather than zlib's */
+    if (deflateInit2(&zs, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    *len = deflateBound(&zs, n);
+    out = Malloc(*len);
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = n;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = *len;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        Free(out);
+        return NULL;
+    }
+    *len = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+/* Brotli-compress n bytes of in into a Malloc()ed buffer, setting *len */
+static char *compress_br(const char *in, size_t n, size_t *len)
+{
+    char *out;
+
+    *len = BrotliEncoderMaxCompressedSize(n);
+    out = Malloc(*len ? *len : 1);
+    if (!*len || !BrotliEncoderCompress(COMPRESS_BR_QUALITY, BROTLI_DEFAULT_WINDOW,
+                                        BROTLI_MODE_TEXT, n, (const uint8_t *)in, len,
+                                        (uint8_t *)out)) {
+        Free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * variant_head - Write to out the head of the variant compressed with
+ *     coding enc to body_len bytes: the object's head without its
+ *     Content-Length and Vary, its ETag told apart from the identity
+ *     one's, and the variant's own Content-Encoding, Vary and
+ *     Content-Length. Returns its length, or 0 if it does not fit in
+ *     size bytes.
+ */
+static size_t variant_head(const char *head, size_t len, int enc, size_t body_len,
+                           char *out, size_t size)
+{
+    const char *p = head;
+    const char *end = head + len;
+    size_t n = 0;
+    int m;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t line = nl ? (size_t)(nl + 1 - p) : (size_t)(end - p);
+        const char *q = p + line;
+
+        if (starts_with_icase(p, "etag:")) {
+            while (q > p && q[-1] != '"') {
+                q--;
+            }
+        }
+        if (starts_with_icase(p, "content-length:") || starts_with_icase(p, "vary:") ||
+            q == p) {
+            /*
+             * Both are written anew below; an ETag that is not quoted
+             * cannot be told apart, so drop it
+             */
+            p += line;
+            continue;
+        }
+        if (starts_with_icase(p, "etag:")) {
+            /* "tag" becomes "tag-gzip", keeping any W/ */
+            q--;
+            m = snprintf(out + n, size - n, "%.*s-%s%.*s", (int)(q - p), p,
+                         compress_names[enc], (int)(p + line - q), q);
+        } else {
+            m = snprintf(out + n, size - n, "%.*s", (int)line, p);
+        }
+        if (m < 0 || (size_t)m >= size - n) {
+            return 0;
+        }
+        n += m;
+        p += line;
+    }
+    m = snprintf(out + n, size - n,
+                 "Content-Encoding: %s\r\n" VARY_ENCODING_HDR "Content-Length: %zu\r\n",
+                 compress_names[enc], body_len);
+    if (m < 0 || (size_t)m >= size - n) {
+        return 0;
+    }
+    return n + m;
+}
+
+/* Copy bytes [from, to) of the complete object obj to buf */
+static void object_copy(cache_object_t *obj, size_t from, size_t to, char *buf)
+{
+    cache_cursor_t cur = { NULL, 0, 0 };
+    struct iovec iov[CACHE_IOV_MAX];
+
+    cache_cursor_advance(obj, &cur, from);
+    while (cur.off < to) {
+        int n = cache_object_iov(obj, &cur, to, iov, CACHE_IOV_MAX);
+        int i;
+
+        for (i = 0; i < n; i++) {
+            memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+            buf += iov[i].iov_len;
+            cache_cursor_advance(obj, &cur, iov[i].iov_len);
+        }
+    }
+}
+
+/* compress_object - Make obj's variants, if it is worth compressing */
+static void compress_object(cache_object_t *obj)
+{
+    char head[MAXBUF];
+    char vhead[MAXBUF];
+    http_response_t resp;
+    size_t len, size, body_len;
+    char *body;
+    int state, enc;
+
+    size = cache_available(obj, &state);
+    if (state != CACHE_COMPLETE || (size_t)obj->hdr_len + 2 > size ||
+        (len = cache_object_head(obj, head, sizeof(head))) != (size_t)obj->hdr_len) {
+        return;
+    }
+    parse_response_head(head, len, &resp);
+    body_len = size - len - 2;
+    if (resp.status != 200 || !resp.compressible || resp.encoded || resp.varies ||
+        resp.no_transform || resp.chunked || body_len < COMPRESS_MIN_SIZE) {
+        return;
+    }
+
+    body = Malloc(body_len);
+    object_copy(obj, len + 2, size, body);
+    for (enc = 0; enc < HTTP_NENCODINGS; enc++) {
+        cache_object_t *v;
+        size_t zlen, vlen;
+        char *z;
+
+        if (!(compress_encodings & (1 << enc))) {
+            continue;
+        }
+        z = enc == HTTP_ENC_GZIP ? compress_gzip(body, body_len, &zlen)
+                                 : compress_br(body, body_len, &zlen);
+        if (!z) {
+            continue;
+        }
+        if (zlen <= body_len - body_len / 8 &&
+            (vlen = variant_head(head, len, enc, zlen, vhead, sizeof(vhead))) > 0) {
+            v = cache_variant_begin(obj);
+            cache_fill_append(v, vhead, vlen);
+            cache_fill_append(v, "\r\n", 2);
+            cache_fill_head(v, (int)vlen, 1, (long long)zlen, obj->expires,
+                            obj->stale_until - obj->expires);
+            cache_fill_append(v, z, zlen);
+            cache_variant_end(obj, enc, v);
+        }
+        Free(z);
+    }
+    Free(body);
+}
+
+static void *compress_main(void *arg)
+{
+    Pthread_detach(Pthread_self());
+    while (1) {
+        compress_job_t *job;
+
+        pthread_mutex_lock(&compress_mutex);
+        while (!compress_head) {
+            pthread_cond_wait(&compress_queued, &compress_mutex);
+        }
+        job = compress_head;
+        compress_head = job->next;
+        if (!compress_head) {
+            compress_tail = NULL;
+        }
+        pthread_mutex_unlock(&compress_mutex);
+
+        compress_object(job->obj);
+        cache_release(job->obj);
+        Free(job);
+    }
+    return NULL;
+}
+
+/* Queue an object the cache completed for the compressor threads */
+static void compress_submit(cache_object_t *obj)
+{
+    compress_job_t *job = Malloc(sizeof(compress_job_t));
+
+    job->obj = obj;
+    job->next = NULL;
+    pthread_mutex_lock(&compress_mutex);
+    if (compress_tail) {
+        compress_tail->next = job;
+    } else {
+        compress_head = job;
+    }
+    compress_tail = job;
+    pthread_cond_signal(&compress_queued);
+    pthread_mutex_unlock(&compress_mutex);
+}
+
+/*
+ * compress_init - Make variants with the codings in encodings, a mask
+ *     of HTTP_ENC_* bits, of what the cache stores from now on
+ */
+void compress_init(int encodings)
+{
+    pthread_t tid;
+    int i;
+
+    compress_encodings = encodings;
+    http_set_compression(COMPRESS_MIN_SIZE);
+    cache_set_encoder(compress_submit);
+    for (i = 0; i < COMPRESS_THREADS; i++) {
+        Pthread_create(&tid, NULL, compress_main, NULL);
+    }
+}
+
+/*
+ * compress_variant - What to serve for the cached object obj to a
+ *     client taking the codings in accept_encodings, as parsed from its
+ *     Accept-Encoding: the variant it takes, brotli first, if obj has one,
+ *     else obj. Passes the caller's reference on.
+ */
+cache_object_t *compress_variant(cache_object_t *obj, int accept_encodings)
+{
+    static const int prefer[] = { HTTP_ENC_BR, HTTP_ENC_GZIP };
+    size_t i;
+
+    if (!compress_encodings) {
+        return obj;
+    }
+    for (i = 0; i < sizeof(prefer) / sizeof(prefer[0]); i++) {
+        cache_object_t *v;
+
+        if ((accept_encodings & (1 << prefer[i])) &&
+            (v = cache_variant(obj, prefer[i])) != NULL) {
+            cache_release(obj);
+            return v;
+        }
+    }
+    return obj;
+}
@@ -0,0 +1,19 @@
+/*
+ * compress.h - compressed variants of cached responses
+ */
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include "cache.h"
+#include "http.h"
+
+#define COMPRESS_MIN_SIZE 1024         /* Smaller bodies are not compressed */
+#define COMPRESS_GZIP_LEVEL 6
+#define COMPRESS_BR_QUALITY 5
+#define COMPRESS_THREADS 1
+
+int compress_parse(const char *list);
+void compress_init(int encodings);
+cache_object_t *compress_variant(cache_object_t *obj, int accept_encodings);
+
+#endif /* __COMPRESS_H__ */
@@ -0,0 +1,255 @@
+/*
+ * config.c - runtime configuration file
+ *
+ * With -k, the proxy reads its tuning knobs from a file of "name value"
+ * lines, where # starts a comment, after the command line, so the file
+ * has the last word. SIGHUP reads the file again and applies it without
+ * dropping a connection or a cached object:
+ *
+ *   - Freshness defaults, admission limits, the origin connect timeout
+ *     and trace sampling are plain settings the request paths read, and
+ *     change at once.
+ *   - The listen backlog changes by calling listen() again on the
+ *     listening sockets, which Linux allows on a listening socket.
+ *   - The cache and buffer pool sizes are carved up at startup, so a new
+ *     value for one is reported and left for the next restart, which a
+ *     graceful handoff (SIGUSR2, see handoff.c) makes without downtime.
+ *
+ * A file that does not parse changes nothing. A setting taken out of the
+ * file keeps the value it has.
+ */
+#include <stddef.h>
+#include "csapp.h"
+#include "config.h"
+#include "cache.h"
+#include "bufpool.h"
+#include "http.h"
+#include "admit.h"
+#include "balance.h"
+#include "trace.h"
+
+/* How a knob's value is written */
+enum {
+    CONFIG_SIZE,               /* Bytes, with an optional K, M or G */
+    CONFIG_NUMBER,
+    CONFIG_RATE,               /* rate[,burst], as for -r */
+    CONFIG_SAMPLE              /* sample[,slow_ms], as for -S */
+};
+
+typedef struct {
+    const char *name;
+    int type;
+    size_t offset;             /* Of its field in config_t */
+    long long min;
+    int reloadable;
+} config_knob_t;
+
+static const config_knob_t config_knobs[] = {
+    { "cache_bytes",    CONFIG_SIZE,   offsetof(config_t, cache_bytes),    0, 0 },
+    { "object_bytes",   CONFIG_SIZE,   offsetof(config_t, object_bytes),   0, 0 },
+    { "buf_bytes",      CONFIG_SIZE,   offsetof(config_t, buf_bytes),      1, 0 },
+    { "buf_max_bytes",  CONFIG_SIZE,   offsetof(config_t, buf_max_bytes),  1, 0 },
+    { "listen_backlog", CONFIG_NUMBER, offsetof(config_t, listen_backlog), 1, 1 },
+    { "default_ttl",    CONFIG_NUMBER, offsetof(config_t, default_ttl),    0, 1 },
+    { "grace",          CONFIG_NUMBER, offsetof(config_t, grace),          0, 1 },
+    { "max_conns",      CONFIG_NUMBER, offsetof(config_t, max_conns),      0, 1 },
+    { "max_fetches",    CONFIG_NUMBER, offsetof(config_t, max_fetches),    0, 1 },
+    { "rate",           CONFIG_RATE,   offsetof(config_t, rate),           0, 1 },
+    { "queue_ms",       CONFIG_NUMBER, offsetof(config_t, queue_ms),       0, 1 },
+    { "connect_ms",     CONFIG_NUMBER, offsetof(config_t, connect_ms),     1, 1 },
+    { "trace_sample",   CONFIG_SAMPLE, offsetof(config_t, trace_sample),   0, 1 },
+};
+
+#define CONFIG_NKNOBS (sizeof(config_knobs) / sizeof(config_knobs[0]))
+
+static char *config_path = NULL;
+static config_t config_current;
+static int *config_listenfds;
+static int config_nlisten;
+
+/* config_defaults - Fill cfg with the compiled-in defaults */
+void config_defaults(config_t *cfg)
+{
+    cfg->cache_bytes = MAX_CACHE_SIZE;
+    cfg->object_bytes = MAX_OBJECT_SIZE;
+    cfg->buf_bytes = BUFPOOL_MIN_DEFAULT;
+    cfg->buf_max_bytes = BUFPOOL_MAX_DEFAULT;
+    cfg->listen_backlog = LISTENQ;
+    cfg->default_ttl = HTTP_DEFAULT_TTL;
+    cfg->grace = HTTP_DEFAULT_GRACE;
+    cfg->max_conns = 0;
+    cfg->max_fetches = 0;
+    cfg->rate = 0;
+    cfg->burst = 0;
+    cfg->queue_ms = 0;
+    cfg->connect_ms = BALANCE_CONNECT_TIMEOUT_MS;
+    cfg->trace_sample = 1;
+    cfg->trace_slow_ms = 0;
+}
+
+/* config_parse_size - Parse a byte count with an optional K, M or G suffix */
+long long config_parse_size(const char *s)
+{
+    char *end;
+    long long n = strtoll(s, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K':
+        n <<= 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        n <<= 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        n <<= 30;
+        end++;
+        break;
+    }
+    return (end == s || *end) ? -1 : n;
+}
+
+/* Set the knob name in cfg to value. Returns -1 if either is bad. */
+static int config_set(config_t *cfg, const char *name, const char *value)
+{
+    const config_knob_t *k;
+    long long *field;
+    char *end;
+    size_t i;
+
+    for (i = 0; i < CONFIG_NKNOBS && strcmp(config_knobs[i].name, name); i++) {
+    }
+    if (i == CONFIG_NKNOBS) {
+        return -1;
+    }
+    k = &config_knobs[i];
+    field = (long long *)((char *)cfg + k->offset);
+
+    switch (k->type) {
+    case CONFIG_SIZE:
+        *field = config_parse_size(value);
+        return *field < k->min ? -1 : 0;
+    case CONFIG_NUMBER:
+        *field = strtoll(value, &end, 10);
+        return end == value || *end || *field < k->min ? -1 : 0;
+    case CONFIG_RATE:
+        return admit_parse_rate(value, &cfg->rate, &cfg->burst);
+    default:
+        return trace_parse(value, &cfg->trace_sample, &cfg->trace_slow_ms);
+    }
+}
+
+/*
+ * config_load - Apply the settings in the file at path to cfg. Returns
+ *     -1, with cfg as it was, if the file cannot be read or has a bad
+ *     line.
+ */
+int config_load(const char *path, config_t *cfg)
+{
+    config_t next = *cfg;
+    char line[MAXLINE], name[MAXLINE], value[MAXLINE], extra;
+    FILE *fp = fopen(path, "r");
+    int lineno = 0;
+
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, '#');
+        int n;
+
+        lineno++;
+        if (comment) {
+            *comment = '\0';
+        }
+        if ((n = sscanf(line, "%s %s %c", name, value, &extra)) <= 0) {
+            continue;           /* Blank */
+        }
+        if (n != 2 || config_set(&next, name, value) < 0) {
+            fprintf(stderr, "%s:%d: bad setting: %s", path, lineno, line);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    if (next.buf_max_bytes < next.buf_bytes) {
+        fprintf(stderr, "%s: buf_max_bytes is below buf_bytes\n", path);
+        return -1;
+    }
+    *cfg = next;
+    return 0;
+}
+
+/* Give the listening sockets a backlog of n */
+static void config_listen(long long n)
+{
+    int i;
+
+    for (i = 0; i < config_nlisten; i++) {
+        if (listen(config_listenfds[i], (int)n) < 0) {
+            fprintf(stderr, "listen backlog %lld: %s\n", n, strerror(errno));
+        }
+    }
+}
+
+/*
+ * config_init - The proxy runs with cfg, read from the file at path, or
+ *     from no file if path is NULL, and listens on the nlisten sockets
+ *     in listenfds. Gives them cfg's backlog, as they may have been
+ *     opened with another, or by another process.
+ */
+void config_init(const char *path, const config_t *cfg, const int *listenfds, int nlisten)
+{
+    if (path) {
+        config_path = Malloc(strlen(path) + 1);
+        strcpy(config_path, path);
+    }
+    config_current = *cfg;
+    config_listenfds = Malloc(sizeof(int) * nlisten);
+    memcpy(config_listenfds, listenfds, sizeof(int) * nlisten);
+    config_nlisten = nlisten;
+    config_listen(cfg->listen_backlog);
+}
+
+/*
+ * config_reload - Read the configuration file again and apply what can
+ *     change while the proxy runs
+ */
+void config_reload(void)
+{
+    config_t next = config_current;
+    size_t i;
+
+    if (!config_path) {
+        fprintf(stderr, "no configuration file to reload, see -k\n");
+        return;
+    }
+    if (config_load(config_path, &next) < 0) {
+        fprintf(stderr, "keeping the running configuration\n");
+        return;
+    }
+    for (i = 0; i < CONFIG_NKNOBS; i++) {
+        const config_knob_t *k = &config_knobs[i];
+        long long *now = (long long *)((char *)&config_current + k->offset);
+        long long *want = (long long *)((char *)&next + k->offset);
+
+        if (!k->reloadable && *want != *now) {
+            fprintf(stderr, "%s changes on the next restart\n", k->name);
+            *want = *now;
+        }
+    }
+
+    if (next.listen_backlog != config_current.listen_backlog) {
+        config_listen(next.listen_backlog);
+    }
+    http_set_default_ttl(next.default_ttl);
+    http_set_default_grace(next.grace);
+    admit_init((int)next.max_conns, (int)next.max_fetches, next.rate, next.burst,
+               next.queue_ms);
+    balance_set_connect_timeout((int)next.connect_ms);
+    trace_set_sample(next.trace_sample, next.trace_slow_ms);
+    config_current = next;
+    fprintf(stderr, "configuration reloaded from %s\n", config_path);
+}
@@ -0,0 +1,36 @@
+/*
+ * config.h - runtime configuration file, reloaded on SIGHUP
+ */
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+/*
+ * The knobs a configuration file may set. The first group is only read
+ * at startup; the rest a reload changes in the running proxy.
+ */
+typedef struct {
+    long long cache_bytes;
+    long long object_bytes;
+    long long buf_bytes;
+    long long buf_max_bytes;
+
+    long long listen_backlog;
+    long long default_ttl;
+    long long grace;
+    long long max_conns;
+    long long max_fetches;
+    double rate;
+    double burst;
+    long long queue_ms;
+    long long connect_ms;
+    unsigned trace_sample;
+    long long trace_slow_ms;
+} config_t;
+
+void config_defaults(config_t *cfg);
+long long config_parse_size(const char *s);
+int config_load(const char *path, config_t *cfg);
+void config_init(const char *path, const config_t *cfg, const int *listenfds, int nlisten);
+void config_reload(void);
+
+#endif /* __CONFIG_H__ */
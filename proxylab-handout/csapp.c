@@ -728,8 +728,10 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value)
 
 void P(sem_t *sem) 
 {
-    if (sem_wait(sem) < 0)
-	unix_error("P error");
+    /* A signal handler, such as a handoff's wakeup, may interrupt it */
+    while (sem_wait(sem) < 0)
+	if (errno != EINTR)
+	    unix_error("P error");
 }
 
 void V(sem_t *sem) 
@@ -792,6 +794,39 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write every byte described by iov (unbuffered).
+ *     The iovec array is consumed in the process.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	total += iov[i].iov_len;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -807,8 +842,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* Interrupted by sig handler return */
 		return -1;
@@ -831,17 +865,39 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 /* $end rio_read */
 
 /*
- * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
+ * rio_readinitb - Associate a descriptor with a read buffer and reset
+ *    buffer. The buffer itself is supplied with rio_setbuf() before the
+ *    first read.
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
+    rp->rio_buf = NULL;
+    rp->rio_bufsize = 0;
     rp->rio_bufptr = rp->rio_buf;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_setbuf - Make buf, of size bytes, the internal buffer, moving any
+ *    unread bytes into it, and return the previous one. size must hold
+ *    those bytes; a NULL buf of size 0 detaches an empty buffer.
+ */
+char *rio_setbuf(rio_t *rp, char *buf, size_t size)
+{
+    char *old = rp->rio_buf;
+
+    if (rp->rio_cnt > 0) {
+        memmove(buf, rp->rio_bufptr, rp->rio_cnt);
+    }
+    rp->rio_buf = buf;
+    rp->rio_bufsize = size;
+    rp->rio_bufptr = buf;
+    return old;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -864,6 +920,24 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read up to n bytes with at most one read(). Buffered
+ *    bytes are returned first; with none buffered, a request at least
+ *    as large as the internal buffer reads straight into usrbuf.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t nread;
+
+    if (rp->rio_cnt > 0 || n < rp->rio_bufsize)
+	return rio_read(rp, usrbuf, n);
+    while ((nread = read(rp->rio_fd, usrbuf, n)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    return nread;
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
  */
@@ -949,7 +1023,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
     int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    struct addrinfo hints, *listp;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -960,7 +1034,24 @@ int open_clientfd(char *hostname, char *port) {
         fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
         return -2;
     }
-  
+
+    clientfd = open_clientfd_addrs(listp);
+
+    /* Clean up */
+    freeaddrinfo(listp);
+    return clientfd;
+}
+
+/*
+ * open_clientfd_addrs - Connect to the first address in listp that
+ *     accepts, for callers that resolved the name themselves.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int open_clientfd_addrs(struct addrinfo *listp) {
+    int clientfd;
+    struct addrinfo *p;
+
     /* Walk the list for one that we can successfully connect to */
     for (p = listp; p; p = p->ai_next) {
         /* Create a socket descriptor */
@@ -976,8 +1067,6 @@ int open_clientfd(char *hostname, char *port) {
         } 
     } 
 
-    /* Clean up */
-    freeaddrinfo(listp);
     if (!p) /* All connects failed */
         return -1;
     else    /* The last connect succeeded */
@@ -994,7 +1083,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_common(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1019,6 +1108,13 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Let several sockets bind the same port, kernel balances them */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1041,6 +1137,20 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port)
+{
+    return open_listenfd_common(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but sets SO_REUSEPORT
+ *     so that each caller gets its own socket on the same port.
+ */
+int open_reuseport_listenfd(char *port)
+{
+    return open_listenfd_common(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1064,6 +1174,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port)
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+	unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
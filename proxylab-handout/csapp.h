@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -42,12 +43,12 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal buffer, set with rio_setbuf() */
+    size_t rio_bufsize;        /* Its size */
 } rio_t;
 /* $end rio_t */
 
@@ -64,6 +65,10 @@ extern char **environ; /* Defined by libc */
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
+#ifdef _GNU_SOURCE
+/* glibc declares its own gai_error() for getaddrinfo_a() */
+#define gai_error csapp_gai_error
+#endif
 void gai_error(int code, char *msg);
 void app_error(char *msg);
 
@@ -175,8 +180,11 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
+char *rio_setbuf(rio_t *rp, char *buf, size_t size);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for Rio package */
@@ -188,11 +196,14 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_addrs(struct addrinfo *listp);
 int open_listenfd(char *port);
+int open_reuseport_listenfd(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_reuseport_listenfd(char *port);
 
 
 #endif /* __CSAPP_H__ */
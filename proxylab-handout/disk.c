@@ -0,0 +1,315 @@
+/*
+ * disk.c - memory-mapped second cache tier that survives restarts
+ *
+ * The tier is one file, mapped shared in full: a header, a table of
+ * index slots and a circular log of records. A record holds one object,
+ * its key and what the cache needs to serve it again. Records are only
+ * ever appended at the log's tail, which wraps to the start when a
+ * record would not fit before the end, so the oldest records are the
+ * ones overwritten.
+ *
+ * Log positions only grow; a record's place in the file is its position
+ * modulo the log size. The index is an open-addressed table keyed by
+ * the cache's hash whose slots hold a record's position, so a slot is
+ * stale, and free for reuse, exactly when the tail has moved a whole
+ * log past it. Nothing has to be found and unlinked when the log wraps.
+ *
+ * Because the index lives in the file, a restart only maps the file
+ * and checks its header; records are paged in as they are asked for.
+ * Records are written before the tail moves, and the tail before the
+ * slot pointing at them, and every record repeats its hash and position,
+ * so a slot left over from a crash that points at anything else is
+ * ignored.
+ *
+ * One rwlock covers the tier. Lookups copy the record out under the
+ * read lock, so the caller can refill the RAM cache without holding it.
+ * disk_close() takes the write lock to unmap the tier while requests
+ * are still being served, so a successor process can map it instead.
+ */
+#include <stdint.h>
+#include <sys/mman.h>
+#include "csapp.h"
+#include "disk.h"
+
+#define DISK_MAGIC 0x3350414d59585250ULL  /* "PRXYMAP3" */
+#define DISK_RECORD_MAGIC 0x64726f63       /* "cord" */
+#define DISK_HDR_SIZE 4096
+#define DISK_ALIGN 64
+#define DISK_MAX_PROBE 16
+#define DISK_MIN_SLOTS 1024
+#define DISK_BYTES_PER_SLOT 2048
+
+typedef struct {
+    uint64_t magic;             /* Written last when the file is made */
+    uint64_t nslots;
+    uint64_t log_size;
+    uint64_t tail;              /* Log position of the next record */
+} disk_header_t;
+
+typedef struct {
+    uint64_t hash;              /* 0 if the slot was never used */
+    uint64_t pos;
+    uint64_t len;
+} disk_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t key_len;           /* Including the NUL */
+    uint64_t hash;
+    uint64_t pos;
+    uint64_t size;
+    int32_t hdr_len;
+    int32_t delimited;
+    int64_t expires;
+    int64_t stale_until;
+} disk_record_t;                /* Followed by the key, then the object */
+
+static pthread_rwlock_t disk_lock = PTHREAD_RWLOCK_INITIALIZER;
+static disk_header_t *disk_hdr = NULL;
+static disk_slot_t *disk_slots;
+static char *disk_log;
+static size_t disk_map_size;
+static char *disk_path = NULL;         /* For disk_reopen() */
+static size_t disk_size;
+
+/* Hash 0 marks an empty slot, so keys hashing to it are moved aside */
+static uint64_t disk_hash(uint64_t hash)
+{
+    return hash ? hash : 1;
+}
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+static int disk_slot_live(const disk_slot_t *sl)
+{
+    return sl->hash && disk_hdr->tail <= sl->pos + disk_hdr->log_size;
+}
+
+/* The record a live slot points to, if it really is the one for key */
+static disk_record_t *disk_record_for(const disk_slot_t *sl, const char *key, uint64_t hash)
+{
+    disk_record_t *rec = (disk_record_t *)(disk_log + sl->pos % disk_hdr->log_size);
+
+    if (rec->magic != DISK_RECORD_MAGIC || rec->pos != sl->pos || rec->hash != hash ||
+        sizeof(*rec) + rec->key_len + rec->size > sl->len ||
+        strcmp((char *)(rec + 1), key)) {
+        return NULL;
+    }
+    return rec;
+}
+
+/*
+ * disk_probe - Find key's slot. Returns its live record, if any, and
+ *     sets *slot to that slot, else to the slot a new record should take:
+ *     the first free or stale one, or failing that the oldest.
+ */
+static disk_record_t *disk_probe(const char *key, uint64_t hash, disk_slot_t **slot)
+{
+    size_t mask = disk_hdr->nslots - 1;
+    disk_slot_t *reuse = NULL, *oldest = NULL;
+    int i;
+
+    for (i = 0; i < DISK_MAX_PROBE; i++) {
+        disk_slot_t *sl = &disk_slots[(hash + i) & mask];
+        disk_record_t *rec;
+
+        if (!disk_slot_live(sl)) {
+            if (!reuse) {
+                reuse = sl;
+            }
+            if (!sl->hash) {
+                break;          /* Nothing was ever stored past here */
+            }
+            continue;
+        }
+        if (sl->hash == hash && (rec = disk_record_for(sl, key, hash)) != NULL) {
+            *slot = sl;
+            return rec;
+        }
+        if (!oldest || sl->pos < oldest->pos) {
+            oldest = sl;
+        }
+    }
+    *slot = reuse ? reuse : oldest;
+    return NULL;
+}
+
+/*
+ * disk_init - Map the tier at path with a log of about size bytes,
+ *     creating the file, or starting it over if it was made with another
+ *     size or is not a tier at all. Everything it held stays reachable.
+ */
+void disk_init(const char *path, size_t size)
+{
+    size_t log_size = round_up(size, DISK_HDR_SIZE);
+    size_t nslots = DISK_MIN_SLOTS;
+    size_t file_size;
+    struct stat st;
+    disk_header_t *hdr;
+    int fd;
+
+    while (nslots < log_size / DISK_BYTES_PER_SLOT) {
+        nslots <<= 1;
+    }
+    file_size = DISK_HDR_SIZE + round_up(nslots * sizeof(disk_slot_t), DISK_HDR_SIZE) +
+                log_size;
+
+    fd = Open(path, O_RDWR | O_CREAT, 0600);
+    Fstat(fd, &st);
+    if ((size_t)st.st_size == file_size) {
+        hdr = Mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (hdr->magic != DISK_MAGIC || hdr->nslots != nslots || hdr->log_size != log_size) {
+            Munmap(hdr, file_size);
+            hdr = NULL;
+        }
+    } else {
+        hdr = NULL;
+    }
+    if (!hdr) {
+        /* Truncating first zeroes every slot without writing them */
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, file_size) < 0) {
+            unix_error("ftruncate error");
+        }
+        hdr = Mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        hdr->nslots = nslots;
+        hdr->log_size = log_size;
+        hdr->tail = 0;
+        hdr->magic = DISK_MAGIC;
+    }
+    Close(fd);
+
+    pthread_rwlock_wrlock(&disk_lock);
+    disk_slots = (disk_slot_t *)((char *)hdr + DISK_HDR_SIZE);
+    disk_log = (char *)hdr + file_size - log_size;
+    disk_map_size = file_size;
+    disk_hdr = hdr;
+    pthread_rwlock_unlock(&disk_lock);
+    if (!disk_path) {
+        disk_path = Malloc(strlen(path) + 1);
+        strcpy(disk_path, path);
+        disk_size = size;
+    }
+}
+
+/*
+ * disk_close - Stop using the tier and unmap it. Lookups miss and
+ *     stores are dropped from then on; what it holds stays in the file.
+ */
+void disk_close(void)
+{
+    pthread_rwlock_wrlock(&disk_lock);
+    if (disk_hdr) {
+        Munmap(disk_hdr, disk_map_size);
+        disk_hdr = NULL;
+    }
+    pthread_rwlock_unlock(&disk_lock);
+}
+
+/* disk_reopen - Map the tier disk_close() closed again */
+void disk_reopen(void)
+{
+    if (disk_path && !disk_hdr) {
+        disk_init(disk_path, disk_size);
+    }
+}
+
+/* disk_enabled - Whether disk_init() was called */
+int disk_enabled(void)
+{
+    return disk_hdr != NULL;
+}
+
+/*
+ * disk_get - Return a Malloc()ed copy of the object stored for key and
+ *     its metadata, or NULL if the tier does not hold it
+ */
+char *disk_get(const char *key, uint64_t hash, disk_meta_t *meta)
+{
+    disk_record_t *rec;
+    disk_slot_t *sl;
+    char *data = NULL;
+
+    if (!disk_hdr) {
+        return NULL;
+    }
+    hash = disk_hash(hash);
+
+    pthread_rwlock_rdlock(&disk_lock);
+    if (disk_hdr && (rec = disk_probe(key, hash, &sl)) != NULL) {
+        meta->size = rec->size;
+        meta->hdr_len = rec->hdr_len;
+        meta->delimited = rec->delimited;
+        meta->expires = rec->expires;
+        meta->stale_until = rec->stale_until;
+        data = Malloc(rec->size ? rec->size : 1);
+        memcpy(data, (char *)(rec + 1) + rec->key_len, rec->size);
+    }
+    pthread_rwlock_unlock(&disk_lock);
+    return data;
+}
+
+/*
+ * disk_put - Append the object in iov to the log as the record for key,
+ *     unless the tier already holds it. Objects over a quarter of the log
+ *     are not kept, so one cannot wipe out most of the others.
+ */
+void disk_put(const char *key, uint64_t hash, const disk_meta_t *meta,
+              const struct iovec *iov, int iovcnt)
+{
+    size_t key_len = strlen(key) + 1;
+    size_t len = round_up(sizeof(disk_record_t) + key_len + meta->size, DISK_ALIGN);
+    disk_record_t *rec;
+    disk_slot_t *sl;
+    uint64_t pos;
+    char *p;
+    int i;
+
+    if (!disk_hdr) {
+        return;
+    }
+    hash = disk_hash(hash);
+
+    pthread_rwlock_wrlock(&disk_lock);
+    if (!disk_hdr || len > disk_hdr->log_size / 4) {
+        pthread_rwlock_unlock(&disk_lock);
+        return;
+    }
+    if ((rec = disk_probe(key, hash, &sl)) != NULL && rec->size == meta->size) {
+        pthread_rwlock_unlock(&disk_lock);
+        return;
+    }
+
+    pos = disk_hdr->tail;
+    if (pos % disk_hdr->log_size + len > disk_hdr->log_size) {
+        pos += disk_hdr->log_size - pos % disk_hdr->log_size;
+    }
+
+    rec = (disk_record_t *)(disk_log + pos % disk_hdr->log_size);
+    rec->magic = DISK_RECORD_MAGIC;
+    rec->key_len = key_len;
+    rec->hash = hash;
+    rec->pos = pos;
+    rec->size = meta->size;
+    rec->hdr_len = meta->hdr_len;
+    rec->delimited = meta->delimited;
+    rec->expires = meta->expires;
+    rec->stale_until = meta->stale_until;
+    p = (char *)(rec + 1);
+    memcpy(p, key, key_len);
+    p += key_len;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    disk_hdr->tail = pos + len;
+
+    /* The record may have overwritten what the chosen slot pointed to */
+    disk_probe(key, hash, &sl);
+    sl->pos = pos;
+    sl->len = len;
+    sl->hash = hash;
+    pthread_rwlock_unlock(&disk_lock);
+}
@@ -0,0 +1,30 @@
+/*
+ * disk.h - memory-mapped second cache tier that survives restarts
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define DISK_SIZE_DEFAULT (64 << 20)   /* Record log size for -D */
+
+/* What the disk tier keeps about a stored object besides its bytes */
+typedef struct {
+    size_t size;
+    int hdr_len;
+    int delimited;
+    long long expires;          /* When it goes stale, see cache_object_t */
+    long long stale_until;
+} disk_meta_t;
+
+void disk_init(const char *path, size_t size);
+void disk_close(void);
+void disk_reopen(void);
+int disk_enabled(void);
+char *disk_get(const char *key, uint64_t hash, disk_meta_t *meta);
+void disk_put(const char *key, uint64_t hash, const disk_meta_t *meta,
+              const struct iovec *iov, int iovcnt);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,256 @@
+/*
+ * dns.c - caching, coalescing name resolver for origin servers
+ *
+ * Every host:port the proxy connects to gets an entry holding the most
+ * recent getaddrinfo() result. Successful lookups are trusted for
+ * DNS_TTL seconds and failures for DNS_NEGATIVE_TTL seconds, so a
+ * broken name costs one resolver round trip per interval rather than
+ * one per request. getaddrinfo() does not report record TTLs, so these
+ * fixed lifetimes stand in for them.
+ *
+ * Only one lookup per name is ever in flight: threads that want a name
+ * somebody is already resolving wait for that answer. A name that is
+ * used within DNS_REFRESH_AHEAD seconds of expiring is handed to the
+ * refresher threads, which resolve it again in the background while
+ * the old answer keeps being served, so names in steady use never
+ * block a request. A failed refresh keeps the old answer until it
+ * expires.
+ */
+#include <time.h>
+#include "csapp.h"
+#include "dns.h"
+
+#define DNS_BUCKETS 256
+
+typedef struct dns_entry {
+    char *key;                 /* "host:port" */
+    char *hostname;
+    char *port;
+    dns_addrs_t *addrs;        /* Latest answer, NULL before the first */
+    time_t expires;
+    int resolving;             /* A lookup is in flight or queued */
+    int waiters;               /* Threads waiting for that lookup */
+    struct dns_entry *next;    /* Next entry in the same bucket */
+    struct dns_entry *qnext;   /* Next entry in the refresh queue */
+} dns_entry_t;
+
+static dns_entry_t *dns_buckets[DNS_BUCKETS];
+static int dns_nentries = 0;
+static dns_entry_t *dns_queue_head = NULL;
+static dns_entry_t *dns_queue_tail = NULL;
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_resolved = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dns_queued = PTHREAD_COND_INITIALIZER;
+
+static unsigned dns_hash(const char *s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void dns_release(dns_addrs_t *addrs)
+{
+    if (atomic_fetch_sub_explicit(&addrs->refcnt, 1, memory_order_acq_rel) == 1) {
+        if (addrs->list) {
+            freeaddrinfo(addrs->list);
+        }
+        Free(addrs);
+    }
+}
+
+/* Forget expired names nobody is resolving. Caller holds the lock */
+static void dns_prune(time_t now)
+{
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        dns_entry_t **pp = &dns_buckets[i];
+        while (*pp) {
+            dns_entry_t *e = *pp;
+            if (!e->resolving && !e->waiters && now >= e->expires) {
+                *pp = e->next;
+                if (e->addrs) {
+                    dns_release(e->addrs);
+                }
+                Free(e->key);
+                Free(e->hostname);
+                Free(e->port);
+                Free(e);
+                dns_nentries--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+/* Find or add the entry for hostname:port. Caller holds the lock */
+static dns_entry_t *dns_entry(const char *hostname, const char *port)
+{
+    char key[MAXLINE];
+    dns_entry_t **bucket;
+    dns_entry_t *e;
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    bucket = &dns_buckets[dns_hash(key) % DNS_BUCKETS];
+    for (e = *bucket; e; e = e->next) {
+        if (!strcmp(e->key, key)) {
+            return e;
+        }
+    }
+
+    if (dns_nentries >= DNS_MAX_ENTRIES) {
+        dns_prune(time(NULL));
+    }
+    e = Calloc(1, sizeof(dns_entry_t));
+    e->key = Malloc(strlen(key) + 1);
+    strcpy(e->key, key);
+    e->hostname = Malloc(strlen(hostname) + 1);
+    strcpy(e->hostname, hostname);
+    e->port = Malloc(strlen(port) + 1);
+    strcpy(e->port, port);
+    e->next = *bucket;
+    *bucket = e;
+    dns_nentries++;
+    return e;
+}
+
+/* Run one blocking lookup, with the same hints as open_clientfd() */
+static dns_addrs_t *dns_resolve(const char *hostname, const char *port)
+{
+    struct addrinfo hints;
+    dns_addrs_t *addrs = Malloc(sizeof(dns_addrs_t));
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((addrs->err = getaddrinfo(hostname, port, &hints, &addrs->list)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port,
+                gai_strerror(addrs->err));
+        addrs->list = NULL;
+    }
+    atomic_init(&addrs->refcnt, 1);
+    return addrs;
+}
+
+/*
+ * dns_install - Publish a finished lookup for e and wake its waiters.
+ *     Caller holds the lock; the entry takes over the reference.
+ */
+static void dns_install(dns_entry_t *e, dns_addrs_t *addrs)
+{
+    time_t now = time(NULL);
+
+    e->resolving = 0;
+    pthread_cond_broadcast(&dns_resolved);
+
+    if (addrs->err && e->addrs && !e->addrs->err && now < e->expires) {
+        /* A failed refresh: keep serving the old answer */
+        dns_release(addrs);
+        return;
+    }
+    if (e->addrs) {
+        dns_release(e->addrs);
+    }
+    e->addrs = addrs;
+    e->expires = now + (addrs->err ? DNS_NEGATIVE_TTL : DNS_TTL);
+}
+
+static void *dns_refresher(void *arg)
+{
+    Pthread_detach(Pthread_self());
+    while (1) {
+        dns_entry_t *e;
+        dns_addrs_t *addrs;
+
+        pthread_mutex_lock(&dns_mutex);
+        while (!dns_queue_head) {
+            pthread_cond_wait(&dns_queued, &dns_mutex);
+        }
+        e = dns_queue_head;
+        dns_queue_head = e->qnext;
+        if (!dns_queue_head) {
+            dns_queue_tail = NULL;
+        }
+        e->qnext = NULL;
+        pthread_mutex_unlock(&dns_mutex);
+
+        /* e cannot be pruned while it is marked resolving */
+        addrs = dns_resolve(e->hostname, e->port);
+
+        pthread_mutex_lock(&dns_mutex);
+        dns_install(e, addrs);
+        pthread_mutex_unlock(&dns_mutex);
+    }
+    return NULL;
+}
+
+void dns_init(void)
+{
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < DNS_REFRESH_THREADS; i++) {
+        Pthread_create(&tid, NULL, dns_refresher, NULL);
+    }
+}
+
+/*
+ * dns_lookup - Return the addresses of hostname:port, resolving the
+ *     name only if no current answer is cached. A failed lookup is
+ *     returned too, with err set and an empty list. The caller must
+ *     dns_release() the result when done with it.
+ */
+dns_addrs_t *dns_lookup(const char *hostname, const char *port)
+{
+    dns_entry_t *e;
+    dns_addrs_t *addrs;
+
+    pthread_mutex_lock(&dns_mutex);
+    e = dns_entry(hostname, port);
+    while (1) {
+        time_t now = time(NULL);
+
+        if (e->addrs && now < e->expires) {
+            if (!e->resolving && !e->addrs->err &&
+                now >= e->expires - DNS_REFRESH_AHEAD) {
+                e->resolving = 1;
+                if (dns_queue_tail) {
+                    dns_queue_tail->qnext = e;
+                } else {
+                    dns_queue_head = e;
+                }
+                dns_queue_tail = e;
+                pthread_cond_signal(&dns_queued);
+            }
+            addrs = e->addrs;
+            atomic_fetch_add_explicit(&addrs->refcnt, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&dns_mutex);
+            return addrs;
+        }
+        if (!e->resolving) {
+            break;
+        }
+
+        /* Somebody is resolving it already; share their answer */
+        e->waiters++;
+        pthread_cond_wait(&dns_resolved, &dns_mutex);
+        e->waiters--;
+    }
+
+    e->resolving = 1;
+    pthread_mutex_unlock(&dns_mutex);
+
+    addrs = dns_resolve(hostname, port);
+
+    pthread_mutex_lock(&dns_mutex);
+    atomic_fetch_add_explicit(&addrs->refcnt, 1, memory_order_relaxed);
+    dns_install(e, addrs);
+    pthread_mutex_unlock(&dns_mutex);
+    return addrs;
+}
@@ -0,0 +1,33 @@
+/*
+ * dns.h - caching, coalescing name resolver for origin servers
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <stdatomic.h>
+#include <netdb.h>
+
+/* Cache lifetimes, in seconds */
+#define DNS_TTL 60             /* How long a resolved name is trusted */
+#define DNS_NEGATIVE_TTL 5     /* How long a failed lookup is remembered */
+#define DNS_REFRESH_AHEAD 10   /* Re-resolve names used this close to expiry */
+
+#define DNS_MAX_ENTRIES 1024   /* Soft limit; expired names are pruned first */
+#define DNS_REFRESH_THREADS 2
+
+/*
+ * The result of one lookup, shared by everyone who asked for the name
+ * while it was current. It is never modified, so the address list may
+ * be walked without any lock; drop the reference with dns_release().
+ */
+typedef struct dns_addrs {
+    struct addrinfo *list;     /* NULL if the lookup failed */
+    int err;                   /* getaddrinfo() return code */
+    atomic_int refcnt;
+} dns_addrs_t;
+
+void dns_init(void);
+dns_addrs_t *dns_lookup(const char *hostname, const char *port);
+void dns_release(dns_addrs_t *addrs);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,1538 @@
+/*
+ * event.c - non-blocking, epoll based proxy engine
+ *
+ * Each event loop owns an epoll instance and runs on its own thread.
+ * Loops are spread round-robin over the listening sockets; loops that
+ * share a socket watch it with EPOLLEXCLUSIVE, so the kernel wakes one
+ * of them per incoming connection. With one SO_REUSEPORT socket per
+ * loop the kernel does the balancing and no socket is shared at all.
+ * A connection stays on the loop that accepted it.
+ *
+ * A connection is a small state machine driven by readiness events:
+ *
+ *   CONN_READ_REQ   buffer the client request until the blank line
+ *   CONN_WRITE_HIT  stream a pinned cache object to the client
+ *   CONN_CONNECT    wait for the non-blocking connect to the origin
+ *   CONN_SEND_REQ   write the rewritten request to the origin
+ *   CONN_RELAY      copy the response from origin to client
+ *
+ * Client connections persist when the client asks for it and the
+ * response is self-delimiting: after a response the connection goes
+ * back to CONN_READ_REQ and serves any pipelined requests in order.
+ * Connections waiting for a request sit on the loop's idle list,
+ * oldest first, and are closed after KEEPALIVE_TIMEOUT_MS. Those
+ * connecting to an origin sit on its connecting list, and move on to
+ * the next address balance.c ordered for them once the connect
+ * timeout passes.
+ *
+ * Origin connections come from the pool in upstream.c, shared with the
+ * other engines, and go back to it once a response has ended where its
+ * Content-Length or chunked framing says. A request the origin drops on
+ * a pooled connection before answering is sent again on a new one.
+ *
+ * A relayed response fills the cache as it streams through. A hit on an
+ * object that is still filling sends what has arrived and then parks
+ * in CONN_WRITE_HIT with no interest in the client socket. The thread
+ * that adds to the object, possibly another loop's, queues the waiter
+ * on its own loop and signals the loop's eventfd.
+ *
+ * Request parsing, header filtering, the cache, the DNS cache and
+ * admission control are the same code the threaded engine uses. A
+ * connection accepted after a batch that took longer than the queue
+ * target is shed, as one that queued that long for a worker would be.
+ * Only a name missing from the DNS cache blocks the loop thread while
+ * it is resolved.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+#include "http.h"
+#include "proxy.h"
+#include "event.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "compress.h"
+#include "admit.h"
+#include "balance.h"
+#include "trace.h"
+#include "handoff.h"
+#include "upstream.h"
+
+#define EV_MAX_EVENTS 256
+#define EV_TICK_MS 1000
+#define EV_INIT_HDRS 2048
+#define EV_MAX_HDRS HTTP_MAX_HEAD
+
+enum {
+    CONN_READ_REQ,
+    CONN_WRITE_HIT,
+    CONN_CONNECT,
+    CONN_SEND_REQ,
+    CONN_RELAY
+};
+
+typedef struct conn conn_t;
+typedef struct ev_loop ev_loop_t;
+
+/* One descriptor registered with epoll; conn is NULL for the listener */
+typedef struct {
+    conn_t *conn;
+    int fd;
+    unsigned events;           /* Current interest set, 0 if unregistered */
+} ev_handle_t;
+
+/* Membership in one of the loop's intrusive connection lists */
+typedef struct {
+    conn_t *prev;
+    conn_t *next;
+    int linked;
+} conn_link_t;
+
+typedef struct {
+    conn_t *head;
+    conn_t *tail;
+} conn_list_t;
+
+struct conn {
+    ev_handle_t client;
+    ev_handle_t server;
+    ev_loop_t *loop;
+    int state;
+    int closed;
+    conn_t *next_dead;
+    conn_link_t idle;          /* Waiting for a request */
+    conn_link_t ready;         /* Has a pipelined request buffered */
+    conn_link_t connecting;    /* Waiting for a connect to an origin */
+    long long idle_since;
+    long long connect_deadline;
+
+    char *in;                  /* Request bytes read from the client */
+    size_t in_len;
+    size_t in_cap;
+    size_t req_len;            /* Bytes of in taken by the current request */
+    int keepalive;             /* Keep the client connection afterwards */
+    int accept_encodings;      /* The request's, for picking a variant */
+    long long t_start;         /* When the request was parsed, see metrics.h */
+    long long t_stage;         /* When its current stage began */
+
+    char *out;                 /* Origin request, then relay buffer */
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    int out_filled;            /* The last body read filled out */
+
+    cache_object_t *hit;       /* Pinned object on a cache hit */
+    cache_cursor_t cur;        /* Next byte of hit to send */
+    int head_sent;             /* hit's head and the proxy's headers are out */
+    struct iovec iov[CACHE_IOV_MAX + 1]; /* Batch being sent from hit */
+    int iovcnt;                /* Unsent iovecs, from iov + iov_idx */
+    int iov_idx;
+    size_t batch_len;          /* Bytes of hit in the batch */
+    char hdrs[MAX_CACHED_HDRS];
+    cache_waiter_t waiter;     /* Queued on hit while it fills */
+    conn_t *next_woken;
+    int bypass;                /* Fetch without the cache */
+    uint64_t client_key;       /* Rate limit key, see admit.c */
+    int fetching;              /* Holds one of admit_fetch()'s slots */
+    trace_record_t trace;      /* The request's access log record */
+
+    cache_object_t *fill;      /* Object this response fills, or NULL */
+    char *host;                /* The origin, whose pool its connection joins */
+    char *port;
+    int reused;                /* The origin connection came from the pool */
+    char *sent;                /* The request, kept while a reused one may fail */
+    size_t sent_len;
+    dns_addrs_t *addrs;        /* Origin addresses, in order to try */
+    struct addrinfo *order[BALANCE_MAX_ADDRS];
+    int naddrs;
+    int next_addr;
+    balance_peer_t peer;       /* The address being tried */
+    int balancing;             /* peer's request is begun, not done */
+    long long t_origin;        /* When that was */
+
+    char *head;                /* Response head as read from the origin */
+    size_t head_len;
+    size_t head_cap;
+    int head_done;             /* Head rewritten and queued for the client */
+    int parsed;                /* Origin answered with an HTTP/1.x head */
+    int resp_done;             /* Whole response read from the origin */
+    http_response_t resp;
+    long long body_len;        /* Body bytes read so far */
+    http_chunked_t chunks;     /* Where a chunked body ends */
+    int overrun;               /* The origin sent more than the response */
+    int pipe[2];               /* Splices bodies the cache skips, or -1 */
+    size_t piped;              /* Body bytes in pipe not yet sent */
+};
+
+struct ev_loop {
+    int epfd;
+    int cpu;                   /* CPU to pin the loop to, or -1 */
+    ev_handle_t listener;
+    ev_handle_t waker;         /* eventfd signalled when objects grow */
+    pthread_mutex_t woken_lock;
+    conn_t *woken;             /* Hits whose object has grown or ended */
+    conn_list_t idle;          /* Ordered by idle_since */
+    conn_list_t ready;
+    conn_list_t connecting;    /* Ordered by connect_deadline */
+    conn_t *dead;              /* Closed this round, freed after the batch */
+    int splice_broken;         /* splice() is not available */
+    long long lag;             /* How long the last batch took, in ns */
+};
+
+#define IDLE_LINK offsetof(conn_t, idle)
+#define READY_LINK offsetof(conn_t, ready)
+#define CONNECTING_LINK offsetof(conn_t, connecting)
+
+static void conn_flush(ev_loop_t *loop, conn_t *c);
+static int conn_retry(ev_loop_t *loop, conn_t *c);
+static long long conn_body_left(conn_t *c);
+static size_t conn_body_scan(conn_t *c, const char *p, size_t n);
+static int conn_scan_request(ev_loop_t *loop, conn_t *c);
+static void conn_wake(cache_waiter_t *w);
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static conn_link_t *conn_link(conn_t *c, size_t off)
+{
+    return (conn_link_t *)((char *)c + off);
+}
+
+static void list_append(conn_list_t *l, conn_t *c, size_t off)
+{
+    conn_link_t *lk = conn_link(c, off);
+
+    if (lk->linked) {
+        return;
+    }
+    lk->linked = 1;
+    lk->next = NULL;
+    lk->prev = l->tail;
+    if (l->tail) {
+        conn_link(l->tail, off)->next = c;
+    } else {
+        l->head = c;
+    }
+    l->tail = c;
+}
+
+static void list_remove(conn_list_t *l, conn_t *c, size_t off)
+{
+    conn_link_t *lk = conn_link(c, off);
+
+    if (!lk->linked) {
+        return;
+    }
+    if (lk->prev) {
+        conn_link(lk->prev, off)->next = lk->next;
+    } else {
+        l->head = lk->next;
+    }
+    if (lk->next) {
+        conn_link(lk->next, off)->prev = lk->prev;
+    } else {
+        l->tail = lk->prev;
+    }
+    lk->linked = 0;
+    lk->prev = NULL;
+    lk->next = NULL;
+}
+
+/*
+ * conn_out_reserve - Make room for n more bytes in out, trading it for
+ *     a larger buffer from the pool, or past the pool's largest, from
+ *     the heap
+ */
+static void conn_out_reserve(conn_t *c, size_t n)
+{
+    size_t need = c->out_len + n;
+    size_t cap;
+    char *out;
+
+    if (need <= c->out_cap) {
+        return;
+    }
+    if (need > bufpool_max()) {
+        c->out = Realloc(c->out, need);
+        c->out_cap = need;
+        return;
+    }
+    out = bufpool_get(need, &cap);
+    memcpy(out, c->out, c->out_len);
+    bufpool_put(c->out, c->out_cap);
+    c->out = out;
+    c->out_cap = cap;
+}
+
+static void conn_out_append(conn_t *c, const void *data, size_t n)
+{
+    conn_out_reserve(c, n);
+    memcpy(c->out + c->out_len, data, n);
+    c->out_len += n;
+}
+
+/* Add response bytes to the object being filled, if any */
+static void conn_cache_append(conn_t *c, const void *data, size_t n)
+{
+    if (c->fill) {
+        cache_fill_append(c->fill, data, n);
+    }
+}
+
+/* conn_uncache - Give up filling the cache with this response */
+static void conn_uncache(conn_t *c)
+{
+    if (c->fill) {
+        cache_fill_end(c->fill, 0);
+        c->fill = NULL;
+    }
+}
+
+static void ev_watch(ev_loop_t *loop, ev_handle_t *h, unsigned events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (h->events == events || h->fd < 0) {
+        return;
+    }
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (h->events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(loop->epfd, op, h->fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    h->events = events;
+}
+
+/* conn_origin_done - Tell balance.c how the request to c->peer ended */
+static void conn_origin_done(conn_t *c, int outcome)
+{
+    if (c->balancing) {
+        balance_done(&c->peer, outcome, metrics_now() - c->t_origin);
+        c->balancing = 0;
+    }
+}
+
+static void conn_close_server(ev_loop_t *loop, conn_t *c)
+{
+    list_remove(&loop->connecting, c, CONNECTING_LINK);
+    if (c->server.fd >= 0) {
+        ev_watch(loop, &c->server, 0);
+        Close(c->server.fd);
+        c->server.fd = -1;
+    }
+}
+
+/*
+ * conn_release_server - Done with the origin connection: back to the
+ *     pool if the response ended where its framing said, with nothing
+ *     after it, and the origin keeps the connection open, else closed
+ */
+static void conn_release_server(ev_loop_t *loop, conn_t *c)
+{
+    if (c->server.fd < 0 || !c->resp_done || c->overrun || !c->parsed ||
+        !response_keepalive(&c->resp)) {
+        conn_close_server(loop, c);
+        return;
+    }
+    ev_watch(loop, &c->server, 0);
+    upstream_release(c->host, c->port, c->server.fd, &c->peer, 1);
+    c->server.fd = -1;
+}
+
+/* conn_reset_request - Drop all state belonging to the current request */
+static void conn_reset_request(ev_loop_t *loop, conn_t *c)
+{
+    conn_origin_done(c, BALANCE_DROPPED);
+    conn_close_server(loop, c);
+    if (c->hit) {
+        cache_served(c->cur.off);
+        cache_release(c->hit);
+        c->hit = NULL;
+    }
+    memset(&c->cur, 0, sizeof(c->cur));
+    c->head_sent = 0;
+    c->iovcnt = 0;
+    c->bypass = 0;
+    if (c->addrs) {
+        dns_release(c->addrs);
+        c->addrs = NULL;
+        c->naddrs = c->next_addr = 0;
+    }
+    conn_uncache(c);
+    if (c->fetching) {
+        admit_fetch_done();
+        c->fetching = 0;
+    }
+    bufpool_put(c->out, c->out_cap);
+    Free(c->head);
+    Free(c->sent);
+    Free(c->host);
+    Free(c->port);
+    c->out = NULL;
+    c->out_len = c->out_off = c->out_cap = 0;
+    c->out_filled = 0;
+    c->head = NULL;
+    c->head_len = c->head_cap = 0;
+    c->head_done = c->parsed = c->resp_done = 0;
+    c->body_len = 0;
+    c->sent = c->host = c->port = NULL;
+    c->reused = c->overrun = 0;
+    memset(&c->chunks, 0, sizeof(c->chunks));
+}
+
+static void conn_close(ev_loop_t *loop, conn_t *c)
+{
+    if (c->closed) {
+        return;
+    }
+    c->closed = 1;
+    trace_end(&c->trace);
+    admit_conn_done();
+    metrics_count(METRIC_CONNS_CLOSED);
+
+    conn_reset_request(loop, c);
+    /* Closing a descriptor also drops it from the epoll set */
+    Close(c->client.fd);
+    if (c->pipe[0] >= 0) {
+        Close(c->pipe[0]);
+        Close(c->pipe[1]);
+    }
+    Free(c->in);
+    list_remove(&loop->idle, c, IDLE_LINK);
+    list_remove(&loop->ready, c, READY_LINK);
+
+    /* Another event for c may still be pending in this batch */
+    c->next_dead = loop->dead;
+    loop->dead = c;
+}
+
+/*
+ * conn_wait_request - Park c on the idle list until a request arrives,
+ *     shrinking a request buffer that a large head left behind
+ */
+static void conn_wait_request(ev_loop_t *loop, conn_t *c)
+{
+    if (c->in_len == 0 && c->in_cap > EV_INIT_HDRS) {
+        Free(c->in);
+        c->in_cap = EV_INIT_HDRS;
+        c->in = Malloc(c->in_cap);
+    }
+    c->state = CONN_READ_REQ;
+    c->idle_since = now_ms();
+    list_append(&loop->idle, c, IDLE_LINK);
+    ev_watch(loop, &c->client, EPOLLIN);
+}
+
+static void conn_accept(ev_loop_t *loop)
+{
+    while (1) {
+        conn_t *c;
+        int connfd = accept4(loop->listener.fd, NULL, NULL, SOCK_NONBLOCK);
+
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                fprintf(stderr, "accept4 failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+        if (!admit_conn()) {
+            admit_shed(connfd);
+            continue;
+        }
+        if (admit_late(loop->lag)) {
+            admit_conn_done();
+            admit_shed(connfd);
+            continue;
+        }
+
+        c = Calloc(1, sizeof(conn_t));
+        c->client.conn = c;
+        c->client.fd = connfd;
+        c->server.conn = c;
+        c->server.fd = -1;
+        c->pipe[0] = c->pipe[1] = -1;
+        c->loop = loop;
+        c->waiter.wake = conn_wake;
+        c->in_cap = EV_INIT_HDRS;
+        c->in = Malloc(c->in_cap);
+        c->client_key = admit_client(connfd);
+        metrics_count(METRIC_CONNS_OPENED);
+        conn_wait_request(loop, c);
+    }
+}
+
+/*
+ * conn_next_request - The response has been sent. Close the connection
+ *     or keep it for the next request, which may already be buffered.
+ */
+static void conn_next_request(ev_loop_t *loop, conn_t *c)
+{
+    metrics_since(METRIC_TOTAL, c->t_start);
+    trace_end(&c->trace);
+    if (!c->keepalive || (handoff_draining() && c->in_len == c->req_len)) {
+        conn_close(loop, c);
+        return;
+    }
+    conn_reset_request(loop, c);
+
+    memmove(c->in, c->in + c->req_len, c->in_len - c->req_len);
+    c->in_len -= c->req_len;
+    c->req_len = 0;
+
+    conn_wait_request(loop, c);
+    if (c->in_len > 0) {
+        /* Started from the loop rather than here to keep the stack flat */
+        list_append(&loop->ready, c, READY_LINK);
+    }
+}
+
+/* conn_hit_batch - Queue the next run of hit's available bytes */
+static void conn_hit_batch(conn_t *c, size_t avail, int state)
+{
+    /* The proxy's headers go between the head and the rest */
+    size_t end = c->head_sent ? avail : (size_t)c->hit->hdr_len;
+    int n = cache_object_iov(c->hit, &c->cur, end, c->iov, CACHE_IOV_MAX);
+    int i;
+
+    c->batch_len = 0;
+    for (i = 0; i < n; i++) {
+        c->batch_len += c->iov[i].iov_len;
+    }
+    if (!c->head_sent && c->cur.off + c->batch_len == end) {
+        long long body_len = state == CACHE_COMPLETE ? (long long)(avail - end - 2) : -1;
+        cache_cursor_t rest = c->cur;
+        int m;
+
+        c->keepalive = c->keepalive && (c->hit->delimited || body_len >= 0);
+        c->iov[n].iov_base = c->hdrs;
+        c->iov[n].iov_len = cached_head_hdrs(c->hdrs, sizeof(c->hdrs), c->hit->delimited,
+                                             body_len, c->keepalive);
+        n++;
+        c->head_sent = 1;
+
+        cache_cursor_advance(c->hit, &rest, c->batch_len);
+        m = cache_object_iov(c->hit, &rest, avail, c->iov + n, CACHE_IOV_MAX + 1 - n);
+        for (i = n; i < n + m; i++) {
+            c->batch_len += c->iov[i].iov_len;
+        }
+        n += m;
+    }
+    c->iovcnt = n;
+    c->iov_idx = 0;
+}
+
+/*
+ * conn_write_hit - Send hit to the client as far as it has arrived and
+ *     the socket takes it. While the client is slow, wait for EPOLLOUT;
+ *     while the object is, wait in hit's waiter list for conn_wake().
+ */
+static void conn_write_hit(ev_loop_t *loop, conn_t *c)
+{
+    while (1) {
+        size_t avail;
+        int state;
+
+        while (c->iovcnt > 0) {
+            struct iovec *iov = &c->iov[c->iov_idx];
+            ssize_t n = writev(c->client.fd, iov, c->iovcnt);
+
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    ev_watch(loop, &c->client, EPOLLOUT);
+                    return;
+                }
+                conn_close(loop, c);
+                return;
+            }
+            trace_bytes(n);
+            while (c->iovcnt > 0 && (size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                c->iov_idx++;
+                c->iovcnt--;
+            }
+            if (c->iovcnt > 0) {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+        cache_cursor_advance(c->hit, &c->cur, c->batch_len);
+        c->batch_len = 0;
+
+        avail = cache_available(c->hit, &state);
+        if (state == CACHE_ABORTED) {
+            if (c->head_sent) {
+                conn_close(loop, c);
+                return;
+            }
+            /* Its fill failed before anything was sent; fetch it uncached */
+            cache_release(c->hit);
+            c->hit = NULL;
+            memset(&c->cur, 0, sizeof(c->cur));
+            c->bypass = 1;
+            conn_scan_request(loop, c);
+            return;
+        }
+        if (avail > 0 && (c->cur.off < avail || !c->head_sent)) {
+            conn_hit_batch(c, avail, state);
+            continue;
+        }
+        if (state == CACHE_COMPLETE) {
+            conn_next_request(loop, c);
+            return;
+        }
+        if (cache_wait(c->hit, avail, &c->waiter)) {
+            ev_watch(loop, &c->client, 0);
+            return;
+        }
+    }
+}
+
+static void conn_serve_hit(ev_loop_t *loop, conn_t *c)
+{
+    c->state = CONN_WRITE_HIT;
+    conn_write_hit(loop, c);
+}
+
+/* conn_serve_metrics - Answer with the proxy's metrics, as if relayed */
+static void conn_serve_metrics(ev_loop_t *loop, conn_t *c)
+{
+    trace_outcome(TRACE_LOCAL);
+    c->out = metrics_response(c->keepalive, &c->out_len);
+    c->out_cap = c->out_len;
+    c->out_off = 0;
+    c->resp_done = 1;
+    c->state = CONN_RELAY;
+    conn_flush(loop, c);
+}
+
+/* conn_refuse - Answer with status, 429 or 503, and close afterwards */
+static void conn_refuse(ev_loop_t *loop, conn_t *c, int status)
+{
+    c->keepalive = 0;
+    trace_outcome(TRACE_REFUSED);
+    c->out = admit_response(status, &c->out_len);
+    c->out_cap = c->out_len;
+    c->out_off = 0;
+    c->resp_done = 1;
+    c->state = CONN_RELAY;
+    conn_flush(loop, c);
+}
+
+static void conn_send_request(ev_loop_t *loop, conn_t *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->server.fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_watch(loop, &c->server, EPOLLOUT);
+                return;
+            }
+            if (!conn_retry(loop, c)) {
+                conn_close(loop, c);
+            }
+            return;
+        }
+        c->out_off += n;
+    }
+
+    /* The request is out; relay through a buffer from the pool */
+    if (c->addrs) {
+        dns_release(c->addrs);
+        c->addrs = NULL;
+        c->naddrs = c->next_addr = 0;
+    }
+    if (c->reused) {
+        c->sent = c->out;
+        c->sent_len = c->out_len;
+    } else {
+        Free(c->out);
+    }
+    c->out = bufpool_get(bufpool_min(), &c->out_cap);
+    c->out_len = 0;
+    c->out_off = 0;
+    c->state = CONN_RELAY;
+    ev_watch(loop, &c->server, EPOLLIN);
+}
+
+/*
+ * conn_connect_next - Start a non-blocking connect to the next origin
+ *     address, closing the connection once every address has failed.
+ */
+static void conn_connect_next(ev_loop_t *loop, conn_t *c)
+{
+    while (c->next_addr < c->naddrs) {
+        struct addrinfo *p = c->order[c->next_addr++];
+        int fd;
+
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                         p->ai_protocol)) < 0) {
+            continue;
+        }
+        c->server.fd = fd;
+        c->server.events = 0;
+        balance_peer(&c->peer, p);
+        balance_begin(&c->peer);
+        trace_upstream(&c->peer);
+        c->balancing = 1;
+        c->t_origin = metrics_now();
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            c->t_stage = metrics_since(METRIC_CONNECT, c->t_stage);
+            c->state = CONN_SEND_REQ;
+            conn_send_request(loop, c);
+            return;
+        }
+        if (errno == EINPROGRESS) {
+            c->state = CONN_CONNECT;
+            c->connect_deadline = now_ms() + balance_connect_timeout();
+            list_append(&loop->connecting, c, CONNECTING_LINK);
+            ev_watch(loop, &c->server, EPOLLOUT);
+            return;
+        }
+        conn_origin_done(c, BALANCE_FAILED);
+        Close(fd);
+        c->server.fd = -1;
+    }
+    metrics_count(METRIC_CONNECT_FAILED);
+    conn_close(loop, c);
+}
+
+static void conn_connected(ev_loop_t *loop, conn_t *c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        conn_origin_done(c, BALANCE_FAILED);
+        conn_close_server(loop, c);
+        conn_connect_next(loop, c);
+        return;
+    }
+    list_remove(&loop->connecting, c, CONNECTING_LINK);
+    c->t_stage = metrics_since(METRIC_CONNECT, c->t_stage);
+    c->state = CONN_SEND_REQ;
+    conn_send_request(loop, c);
+}
+
+/*
+ * conn_connect_pooled - Send the request on an idle pooled connection to
+ *     the origin, if there is one. Returns 0 if a new one is needed.
+ */
+static int conn_connect_pooled(ev_loop_t *loop, conn_t *c)
+{
+    int fd = upstream_take(c->host, c->port, &c->peer, 1);
+
+    if (fd < 0) {
+        return 0;
+    }
+    c->server.fd = fd;
+    c->server.events = 0;
+    c->reused = 1;
+    trace_upstream(&c->peer);
+    c->balancing = 1;
+    c->t_origin = metrics_now();
+    c->t_stage = metrics_since(METRIC_CONNECT, c->t_stage);
+    c->state = CONN_SEND_REQ;
+    conn_send_request(loop, c);
+    return 1;
+}
+
+/*
+ * conn_retry - A pooled connection the origin closed before answering
+ *     says little about the origin, and nothing has reached the client,
+ *     so send the request again on a new connection. Returns 0 if the
+ *     connection was not a reused one, which leaves the failure to the
+ *     caller.
+ */
+static int conn_retry(ev_loop_t *loop, conn_t *c)
+{
+    if (!c->reused || c->head_len > 0) {
+        return 0;
+    }
+    conn_origin_done(c, BALANCE_DROPPED);
+    conn_close_server(loop, c);
+    c->reused = 0;
+    if (c->sent) {
+        bufpool_put(c->out, c->out_cap);
+        c->out = c->sent;
+        c->out_len = c->out_cap = c->sent_len;
+        c->sent = NULL;
+    }
+    c->out_off = 0;
+    c->addrs = dns_lookup(c->host, c->port);
+    c->naddrs = balance_order(c->addrs->list, c->order);
+    c->next_addr = 0;
+    conn_connect_next(loop, c);
+    return 1;
+}
+
+/*
+ * conn_start_request - Serve the request req parsed from the head of in,
+ *     from the cache, or start fetching it from the origin.
+ */
+static void conn_start_request(ev_loop_t *loop, conn_t *c, const http_request_t *req)
+{
+    char uri[MAXLINE];
+    char hostname[MAXLINE];
+    char port[MAXLINE];
+    char path[MAXLINE];
+    char host_hdr[MAXLINE];
+    char cache_key[MAXLINE];
+    char cond[MAX_CONDITIONAL_HDRS];
+    struct iovec iov[REQUEST_IOV_MAX];
+    int iovcnt, i;
+
+    list_remove(&loop->idle, c, IDLE_LINK);
+    ev_watch(loop, &c->client, 0);
+    c->keepalive = req->keepalive && !handoff_draining();
+    c->accept_encodings = req->accept_encodings;
+    if (!c->bypass) {
+        c->t_start = metrics_now();
+        metrics_count(METRIC_REQUESTS);
+        trace_begin(&c->trace);
+    }
+    if (metrics_request(req)) {
+        conn_serve_metrics(loop, c);
+        return;
+    }
+    if (!c->bypass && !admit_request(c->client_key)) {
+        conn_refuse(loop, c, 429);
+        return;
+    }
+
+    http_span_copy(uri, sizeof(uri), req->uri);
+    parse_uri(uri, hostname, port, path);
+    if (hostname[0] == '\0' && req->host.p) {
+        http_span_copy(host_hdr, sizeof(host_hdr), req->host);
+        normalize_host_from_header(host_hdr, hostname, port);
+    }
+    if (hostname[0] == '\0') {
+        conn_close(loop, c);
+        return;
+    }
+
+    build_cache_key(cache_key, hostname, port, path);
+    trace_key(cache_key);
+    if (!c->bypass) {
+        cache_object_t *obj;
+        int fill;
+
+        c->t_stage = metrics_now();
+        obj = cache_lookup_fill(cache_key, &fill);
+        metrics_since(METRIC_LOOKUP, c->t_stage);
+        if (!fill) {
+            trace_outcome(TRACE_HIT);
+            c->hit = compress_variant(obj, c->accept_encodings);
+            conn_serve_hit(loop, c);
+            return;
+        }
+        c->fill = obj;
+    }
+    if (!admit_fetch()) {
+        conn_uncache(c);
+        conn_refuse(loop, c, 503);
+        return;
+    }
+    c->fetching = 1;
+    trace_outcome(TRACE_MISS);
+
+    /* The request may go out after this returns, so gather it, once */
+    fill_conditional(c->fill, cond, sizeof(cond));
+    iovcnt = build_request_iov(iov, hostname, port, path, req, 1, c->fill ? cond : NULL);
+    c->out_len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        c->out_len += iov[i].iov_len;
+    }
+    c->out_cap = c->out_len;
+    c->out = Malloc(c->out_cap);
+    c->out_len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(c->out + c->out_len, iov[i].iov_base, iov[i].iov_len);
+        c->out_len += iov[i].iov_len;
+    }
+
+    c->host = Malloc(strlen(hostname) + 1);
+    strcpy(c->host, hostname);
+    c->port = Malloc(strlen(port) + 1);
+    strcpy(c->port, port);
+
+    c->t_stage = metrics_now();
+    if (conn_connect_pooled(loop, c)) {
+        return;
+    }
+    c->addrs = dns_lookup(hostname, port);
+    c->naddrs = balance_order(c->addrs->list, c->order);
+    c->next_addr = 0;
+    conn_connect_next(loop, c);
+}
+
+/* conn_scan_request - Start the request if in holds all of its head */
+static int conn_scan_request(ev_loop_t *loop, conn_t *c)
+{
+    http_request_t req;
+    long long t = metrics_now();
+    int n = http_parse_request(c->in, c->in_len, &req);
+
+    if (n == 0) {
+        return 0;
+    }
+    if (n < 0) {
+        conn_close(loop, c);
+        return 1;
+    }
+    metrics_since(METRIC_PARSE, t);
+    c->req_len = n;
+    conn_start_request(loop, c, &req);
+    return 1;
+}
+
+static void conn_read_request(ev_loop_t *loop, conn_t *c)
+{
+    while (1) {
+        ssize_t n;
+
+        if (c->in_len == c->in_cap) {
+            if (c->in_cap >= EV_MAX_HDRS) {
+                conn_close(loop, c);
+                return;
+            }
+            c->in_cap *= 2;
+            c->in = Realloc(c->in, c->in_cap);
+        }
+
+        n = read(c->client.fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            conn_close(loop, c);
+            return;
+        }
+
+        /* The head can only have ended if a line did */
+        c->in_len += n;
+        if (http_find_lf(c->in + c->in_len - n, c->in + c->in_len) &&
+            conn_scan_request(loop, c)) {
+            return;
+        }
+    }
+}
+
+/*
+ * conn_response_done - The origin is finished with the response. Complete
+ *     its cache object and move on to the next request.
+ */
+static void conn_response_done(ev_loop_t *loop, conn_t *c)
+{
+    int fetched = c->server.fd >= 0;
+
+    conn_release_server(loop, c);
+    if (c->parsed && !c->resp.chunked && c->resp.content_length >= 0 &&
+        response_has_body(&c->resp) && c->body_len < c->resp.content_length) {
+        /* Truncated by the origin; the client cannot reuse the connection */
+        conn_close(loop, c);
+        return;
+    }
+    if (fetched) {
+        metrics_since(METRIC_RELAY, c->t_stage);
+    }
+    if (c->fill) {
+        cache_fill_end(c->fill, 1);
+        c->fill = NULL;
+    }
+    conn_next_request(loop, c);
+}
+
+/*
+ * conn_rewrite_head - The response head occupies the first head_end
+ *     bytes of head. Queue it for the client with the origin's hop-by-hop
+ *     headers replaced by the proxy's Connection header, add it to the
+ *     cache object, and queue the body bytes that arrived with it.
+ *     Returns 0 if it was a 304 confirming the stale object c->fill
+ *     revalidates, which is then served under the head the 304 updates.
+ */
+static int conn_rewrite_head(ev_loop_t *loop, conn_t *c, size_t head_end)
+{
+    size_t rest = c->head_len - head_end;
+    size_t n;
+    int hdr_len;
+
+    conn_out_reserve(c, head_end + MAXLINE);
+    n = rewrite_response_head(c->head, head_end, &c->resp, &c->keepalive,
+                              c->out + c->out_len, &hdr_len);
+    if ((c->hit = fill_revalidated(c->fill, c->out + c->out_len, hdr_len, &c->resp)) != NULL) {
+        trace_outcome(TRACE_REVALIDATED);
+        c->hit = compress_variant(c->hit, c->accept_encodings);
+        c->fill = NULL;
+        c->resp_done = 1;
+        c->overrun = rest > 0;
+        conn_release_server(loop, c);
+        conn_serve_hit(loop, c);
+        return 0;
+    }
+    conn_cache_append(c, c->out + c->out_len, hdr_len);
+    conn_cache_append(c, "\r\n", 2);
+    c->out_len += n;
+    if (c->fill) {
+        long long body_len = !response_has_body(&c->resp) ? 0 :
+                             c->resp.chunked ? -1 : c->resp.content_length;
+        cache_fill_head(c->fill, hdr_len, response_delimited(&c->resp), body_len,
+                        response_expires(&c->resp), response_grace(&c->resp));
+    }
+
+    rest = conn_body_scan(c, c->head + head_end, rest);
+    conn_out_append(c, c->head + head_end, rest);
+    conn_cache_append(c, c->head + head_end, rest);
+    c->body_len = rest;
+    return 1;
+}
+
+/*
+ * conn_read_head - Buffer the response head until the blank line, then
+ *     rewrite it. Anything that is not HTTP/1.x is relayed untouched to
+ *     EOF and kept out of the cache, as in the threaded engine.
+ */
+static void conn_read_head(ev_loop_t *loop, conn_t *c)
+{
+    size_t from, scan;
+    char *nl;
+    ssize_t n;
+
+    if (c->head_len == c->head_cap) {
+        if (c->head_cap >= EV_MAX_HDRS) {
+            conn_close(loop, c);
+            return;
+        }
+        c->head_cap = c->head_cap ? c->head_cap * 2 : MAXBUF;
+        c->head = Realloc(c->head, c->head_cap);
+    }
+
+    n = read(c->server.fd, c->head + c->head_len, c->head_cap - c->head_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n <= 0) {
+        if (!conn_retry(loop, c)) {
+            conn_origin_done(c, BALANCE_FAILED);
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (c->head_len == 0) {
+        c->t_stage = metrics_since(METRIC_FIRST_BYTE, c->t_stage);
+        conn_origin_done(c, BALANCE_OK);
+        Free(c->sent);
+        c->sent = NULL;
+    }
+    from = c->head_len > 3 ? c->head_len - 3 : 0;
+    c->head_len += n;
+
+    if (!c->parsed && (nl = memchr(c->head, '\n', c->head_len)) != NULL) {
+        char line[MAXLINE];
+        size_t len = nl - c->head + 1;
+
+        if (len >= sizeof(line)) {
+            len = sizeof(line) - 1;
+        }
+        memcpy(line, c->head, len);
+        line[len] = '\0';
+        if (parse_status_line(line, &c->resp) < 0) {
+            conn_uncache(c);
+            c->keepalive = 0;
+            c->head_done = 1;
+            conn_out_append(c, c->head, c->head_len);
+            conn_flush(loop, c);
+            return;
+        }
+        c->parsed = 1;
+    }
+
+    for (scan = from; c->parsed && scan + 4 <= c->head_len; scan++) {
+        if (!memcmp(c->head + scan, "\r\n\r\n", 4)) {
+            c->head_done = 1;
+            if (conn_rewrite_head(loop, c, scan + 4)) {
+                conn_flush(loop, c);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Flush the relay buffer, then anything in the pipe, to the client,
+ * then go back to the origin
+ */
+static void conn_flush(ev_loop_t *loop, conn_t *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->client.fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_watch(loop, &c->server, 0);
+                ev_watch(loop, &c->client, EPOLLOUT);
+                return;
+            }
+            conn_close(loop, c);
+            return;
+        }
+        c->out_off += n;
+        trace_bytes(n);
+    }
+    c->out_len = 0;
+    c->out_off = 0;
+    while (c->piped > 0) {
+        int more = !c->resp_done && conn_body_left(c) > 0;
+        ssize_t n = splice(c->pipe[0], NULL, c->client.fd, NULL, c->piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (more ? SPLICE_F_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_watch(loop, &c->server, 0);
+                ev_watch(loop, &c->client, EPOLLOUT);
+                return;
+            }
+            conn_close(loop, c);
+            return;
+        }
+        c->piped -= n;
+        trace_bytes(n);
+    }
+    ev_watch(loop, &c->client, 0);
+    if (c->resp_done) {
+        conn_response_done(loop, c);
+        return;
+    }
+    ev_watch(loop, &c->server, EPOLLIN);
+}
+
+/* conn_body_left - Body bytes still to come, or -1 if it ends at EOF */
+static long long conn_body_left(conn_t *c)
+{
+    if (!c->parsed || c->resp.chunked || c->resp.content_length < 0) {
+        return -1;
+    }
+    return c->resp.content_length - c->body_len;
+}
+
+/*
+ * conn_body_scan - Of the n bytes p the origin sent after body_len
+ *     bytes of the body, the number that belong to the response. Marks
+ *     the response done once they complete it, and overrun if more
+ *     followed, which keeps the connection out of the pool.
+ */
+static size_t conn_body_scan(conn_t *c, const char *p, size_t n)
+{
+    long long left = response_has_body(&c->resp) ? conn_body_left(c) : 0;
+    size_t used = n;
+
+    if (c->resp.chunked && left) {
+        used = chunked_scan(&c->chunks, p, n);
+        c->resp_done = c->chunks.state == CHUNK_DONE;
+    } else if (left >= 0) {
+        used = (long long)n > left ? (size_t)left : n;
+        c->resp_done = (long long)used == left;
+    }
+    c->overrun = used < n;
+    return used;
+}
+
+/*
+ * conn_can_splice - Whether to splice the rest of the body: the cache
+ *     is not keeping it and enough of it is left. Makes c's pipe.
+ */
+static int conn_can_splice(ev_loop_t *loop, conn_t *c)
+{
+    long long left = conn_body_left(c);
+
+    /* A chunked body's end is only found by reading it */
+    if (loop->splice_broken || (c->fill && cache_fill_storing(c->fill)) || c->resp.chunked ||
+        (left >= 0 && left < SPLICE_MIN)) {
+        return 0;
+    }
+    if (c->pipe[0] < 0 && splice_pipe(c->pipe, O_NONBLOCK) < 0) {
+        loop->splice_broken = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * conn_splice - Move what the origin has sent of the body into c's
+ *     pipe, then on to the client, without copying it to user space
+ */
+static void conn_splice(ev_loop_t *loop, conn_t *c)
+{
+    long long left = conn_body_left(c);
+    size_t want = left >= 0 && left < SPLICE_PIPE_SIZE ? (size_t)left : SPLICE_PIPE_SIZE;
+    ssize_t n;
+
+    n = splice(c->server.fd, NULL, c->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno == EINVAL) {
+            loop->splice_broken = 1;    /* Read the body normally instead */
+        } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (n == 0) {
+        conn_response_done(loop, c);
+        return;
+    }
+
+    if (c->fill) {
+        cache_fill_skip(c->fill, n);
+    }
+    c->body_len += n;
+    if (conn_body_left(c) == 0) {
+        c->resp_done = 1;
+    }
+    c->piped = n;
+    conn_flush(loop, c);
+}
+
+static void conn_relay(ev_loop_t *loop, conn_t *c)
+{
+    long long left;
+    ssize_t n;
+
+    if (!c->head_done) {
+        conn_read_head(loop, c);
+        return;
+    }
+    if (conn_can_splice(loop, c)) {
+        conn_splice(loop, c);
+        return;
+    }
+
+    /* A body that keeps filling the buffer earns a larger one */
+    if (c->out_filled) {
+        bufpool_grow(&c->out, &c->out_cap);
+    }
+    /* Nothing past the response, which would belong to the next one */
+    left = conn_body_left(c);
+    n = read(c->server.fd, c->out,
+             left >= 0 && left < (long long)c->out_cap ? (size_t)left : c->out_cap);
+    if (n < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (n == 0) {
+        conn_response_done(loop, c);
+        return;
+    }
+
+    n = conn_body_scan(c, c->out, n);
+    conn_cache_append(c, c->out, n);
+    c->body_len += n;
+
+    c->out_filled = (size_t)n == c->out_cap;
+    c->out_len = n;
+    c->out_off = 0;
+    conn_flush(loop, c);
+}
+
+static void conn_event(ev_loop_t *loop, ev_handle_t *h)
+{
+    conn_t *c = h->conn;
+
+    if (c->closed) {
+        return;
+    }
+
+    trace_resume(&c->trace);
+    switch (c->state) {
+    case CONN_READ_REQ:
+        conn_read_request(loop, c);
+        break;
+    case CONN_WRITE_HIT:
+        conn_write_hit(loop, c);
+        break;
+    case CONN_CONNECT:
+        conn_connected(loop, c);
+        break;
+    case CONN_SEND_REQ:
+        conn_send_request(loop, c);
+        break;
+    case CONN_RELAY:
+        if (h == &c->server) {
+            conn_relay(loop, c);
+        } else {
+            conn_flush(loop, c);
+        }
+        break;
+    }
+    trace_resume(NULL);
+}
+
+/*
+ * conn_wake - Called from the thread filling the object c is waiting
+ *     for once it has grown or its fill has ended. Hand c back to its
+ *     own loop, which picks it up in event_run_woken().
+ */
+static void conn_wake(cache_waiter_t *w)
+{
+    conn_t *c = (conn_t *)((char *)w - offsetof(conn_t, waiter));
+    ev_loop_t *loop = c->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->woken_lock);
+    c->next_woken = loop->woken;
+    loop->woken = c;
+    pthread_mutex_unlock(&loop->woken_lock);
+
+    if (write(loop->waker.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        unix_error("eventfd write error");
+    }
+}
+
+/* event_run_woken - Carry on sending the objects woken hits wait for */
+static void event_run_woken(ev_loop_t *loop)
+{
+    uint64_t count;
+    conn_t *c;
+
+    if (read(loop->waker.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        unix_error("eventfd read error");
+    }
+    pthread_mutex_lock(&loop->woken_lock);
+    c = loop->woken;
+    loop->woken = NULL;
+    pthread_mutex_unlock(&loop->woken_lock);
+
+    while (c) {
+        conn_t *next = c->next_woken;
+
+        if (!c->closed && c->state == CONN_WRITE_HIT) {
+            trace_resume(&c->trace);
+            conn_write_hit(loop, c);
+            trace_resume(NULL);
+        }
+        c = next;
+    }
+}
+
+/*
+ * event_run_ready - Start the pipelined requests buffered by the end of
+ *     the batch. Connections that finish one of them in place rejoin at
+ *     the tail and wait for the next round.
+ */
+static void event_run_ready(ev_loop_t *loop)
+{
+    conn_t *last = loop->ready.tail;
+
+    while (loop->ready.head) {
+        conn_t *c = loop->ready.head;
+
+        list_remove(&loop->ready, c, READY_LINK);
+        if (c->state == CONN_READ_REQ) {
+            trace_resume(&c->trace);
+            conn_scan_request(loop, c);
+            trace_resume(NULL);
+        }
+        if (c == last) {
+            break;
+        }
+    }
+}
+
+/*
+ * event_drain - The sockets have been handed off. Stop accepting, and
+ *     close the connections waiting for another request; a response
+ *     leaves keepalive set on its connection, while one just accepted
+ *     still gets its first request answered. Requests being served
+ *     are answered with Connection: close.
+ */
+static void event_drain(ev_loop_t *loop)
+{
+    conn_t *c = loop->idle.head;
+
+    ev_watch(loop, &loop->listener, 0);
+    while (c) {
+        conn_t *next = c->idle.next;
+
+        if (c->keepalive && c->in_len == 0) {
+            conn_close(loop, c);
+        }
+        c = next;
+    }
+}
+
+static void event_expire_idle(ev_loop_t *loop)
+{
+    long long cutoff = now_ms() - KEEPALIVE_TIMEOUT_MS;
+
+    while (loop->idle.head && loop->idle.head->idle_since < cutoff) {
+        conn_close(loop, loop->idle.head);
+    }
+}
+
+/* event_expire_connects - Move connects past the timeout on */
+static void event_expire_connects(ev_loop_t *loop)
+{
+    long long now = now_ms();
+
+    while (loop->connecting.head && loop->connecting.head->connect_deadline <= now) {
+        conn_t *c = loop->connecting.head;
+
+        metrics_count(METRIC_CONNECT_TIMEOUTS);
+        trace_resume(&c->trace);
+        conn_origin_done(c, BALANCE_FAILED);
+        conn_close_server(loop, c);
+        conn_connect_next(loop, c);
+        trace_resume(NULL);
+    }
+}
+
+/* event_timeout - How long the loop may wait for events, in ms */
+static int event_timeout(ev_loop_t *loop)
+{
+    long long left;
+
+    if (loop->ready.head) {
+        return 0;
+    }
+    if (!loop->connecting.head) {
+        return EV_TICK_MS;
+    }
+    left = loop->connecting.head->connect_deadline - now_ms();
+    return left <= 0 ? 0 : left < EV_TICK_MS ? (int)left : EV_TICK_MS;
+}
+
+static void *event_loop(void *arg)
+{
+    ev_loop_t *loop = arg;
+    struct epoll_event events[EV_MAX_EVENTS];
+
+    pin_thread(loop->cpu);
+    while (1) {
+        int i;
+        int n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, event_timeout(loop));
+        long long t;
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        t = metrics_now();
+
+        /* Once the sockets are handed off, the new process accepts */
+        if (loop->listener.events && handoff_draining()) {
+            event_drain(loop);
+        }
+        for (i = 0; i < n; i++) {
+            ev_handle_t *h = events[i].data.ptr;
+            if (h == &loop->waker) {
+                event_run_woken(loop);
+            } else if (!h->conn) {
+                if (loop->listener.events) {
+                    conn_accept(loop);
+                }
+            } else {
+                conn_event(loop, h);
+            }
+        }
+        event_run_ready(loop);
+        event_expire_idle(loop);
+        event_expire_connects(loop);
+        loop->lag = metrics_now() - t;
+
+        while (loop->dead) {
+            conn_t *c = loop->dead;
+            loop->dead = c->next_dead;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * event_run - Run nloops event loops over the nlisten sockets in
+ *     listenfds, pinning loop i to CPU i if pin is set. The calling
+ *     thread becomes the last loop and never returns.
+ */
+void event_run(int *listenfds, int nlisten, int nloops, int pin)
+{
+    ev_loop_t *loops = Calloc(nloops, sizeof(ev_loop_t));
+    int flags, i;
+    pthread_t tid;
+
+    for (i = 0; i < nlisten; i++) {
+        if ((flags = fcntl(listenfds[i], F_GETFL, 0)) < 0 ||
+            fcntl(listenfds[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+            unix_error("fcntl error");
+        }
+    }
+
+    for (i = 0; i < nloops; i++) {
+        struct epoll_event ev;
+        ev_loop_t *loop = &loops[i];
+
+        if ((loop->epfd = epoll_create1(0)) < 0) {
+            unix_error("epoll_create1 error");
+        }
+        loop->cpu = pin ? i : -1;
+        loop->listener.conn = NULL;
+        loop->listener.fd = listenfds[i % nlisten];
+        loop->listener.events = EPOLLIN;
+        if (nloops > nlisten) {
+            loop->listener.events |= EPOLLEXCLUSIVE;
+        }
+        ev.events = loop->listener.events;
+        ev.data.ptr = &loop->listener;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listener.fd, &ev) < 0) {
+            unix_error("epoll_ctl error");
+        }
+
+        if ((loop->waker.fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            unix_error("eventfd error");
+        }
+        loop->waker.conn = NULL;
+        ev_watch(loop, &loop->waker, EPOLLIN);
+        pthread_mutex_init(&loop->woken_lock, NULL);
+    }
+
+    for (i = 0; i < nloops - 1; i++) {
+        Pthread_create(&tid, NULL, event_loop, &loops[i]);
+        Pthread_detach(tid);
+    }
+    event_loop(&loops[nloops - 1]);
+}
@@ -0,0 +1,9 @@
+/*
+ * event.h - non-blocking, epoll based proxy engine
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_run(int *listenfds, int nlisten, int nloops, int pin);
+
+#endif /* __EVENT_H__ */
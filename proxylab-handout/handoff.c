@@ -0,0 +1,287 @@
+/*
+ * handoff.c - graceful restart with the listening sockets handed over
+ *
+ * SIGUSR2 replaces the running proxy with a new one, say a new build,
+ * without refusing a connection or cutting one short:
+ *
+ *   - With a disk tier, the cache is written to it and it is unmapped,
+ *     so the new process maps it with everything the old one held and
+ *     starts warm. Until it exits, the old process serves from RAM.
+ *   - The proxy forks and execs its own command line again, leaving the
+ *     listening sockets open and their numbers in HANDOFF_ENV. A proxy
+ *     that finds them there listens on those instead of binding the
+ *     port, so connections queued on them are simply the new process's
+ *     to accept.
+ *   - Once the exec has succeeded the old process stops accepting. The
+ *     engines answer the requests they are serving with Connection:
+ *     close and close connections kept alive for another request, so
+ *     the old process exits as soon as its last response has gone out,
+ *     or HANDOFF_DRAIN_SECS after the handoff, whichever comes first.
+ *
+ * If the exec fails, the old process takes its disk tier back and
+ * carries on as before. The child closes every descriptor but the
+ * listening sockets before the exec, so the new process holds no
+ * client connection open on the old one's behalf.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "csapp.h"
+#include "handoff.h"
+#include "cache.h"
+#include "disk.h"
+#include "admit.h"
+#include "metrics.h"
+#include "trace.h"
+
+extern char **environ;
+
+static char **handoff_argv;
+static char *handoff_path;             /* What to exec, found on the PATH */
+static int *handoff_fds;
+static int handoff_nfds;
+static long handoff_maxfd;
+static atomic_int handoff_state;       /* Set once the handoff is done */
+static void (*handoff_stop)(void);
+
+/*
+ * handoff_inherit - Point *listenfds at the listening sockets a proxy
+ *     handing off left this one, and return how many there are, or 0 if
+ *     this proxy was started afresh
+ */
+int handoff_inherit(int **listenfds)
+{
+    const char *s = getenv(HANDOFF_ENV), *p;
+    int *fds, n = 1;
+
+    if (!s) {
+        return 0;
+    }
+    for (p = s; *p; p++) {
+        n += *p == ',';
+    }
+    fds = Malloc(sizeof(int) * n);
+    for (n = 0, p = s; *p; n++) {
+        struct stat st;
+        char *end;
+        long fd = strtol(p, &end, 10);
+
+        if (end == p || (*end && *end != ',') || fd < 0 || fd > INT_MAX ||
+            fstat((int)fd, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "ignoring %s=%s: not a list of sockets\n", HANDOFF_ENV, s);
+            Free(fds);
+            unsetenv(HANDOFF_ENV);
+            return 0;
+        }
+        fds[n] = (int)fd;
+        p = *end ? end + 1 : end;
+    }
+    unsetenv(HANDOFF_ENV);
+    *listenfds = fds;
+    return n;
+}
+
+/* handoff_find - The file execvp() would run for name */
+static char *handoff_find(const char *name)
+{
+    const char *path = getenv("PATH"), *p = path;
+    char buf[MAXLINE];
+    char *found;
+
+    if (!strchr(name, '/') && path) {
+        while (1) {
+            const char *next = strchr(p, ':');
+            int len = next ? (int)(next - p) : (int)strlen(p);
+
+            /* An empty entry means the current directory */
+            snprintf(buf, sizeof(buf), "%.*s/%s", len ? len : 1, len ? p : ".", name);
+            if (access(buf, X_OK) == 0) {
+                name = buf;
+                break;
+            }
+            if (!next) {
+                break;
+            }
+            p = next + 1;
+        }
+    }
+    found = Malloc(strlen(name) + 1);
+    strcpy(found, name);
+    return found;
+}
+
+static int handoff_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * handoff_init - Remember the command line, argv, a handoff runs again
+ *     and the nlisten listening sockets in listenfds it passes on
+ */
+void handoff_init(char **argv, const int *listenfds, int nlisten)
+{
+    handoff_argv = argv;
+    handoff_path = handoff_find(argv[0]);
+    handoff_fds = Malloc(sizeof(int) * nlisten);
+    memcpy(handoff_fds, listenfds, sizeof(int) * nlisten);
+    handoff_nfds = nlisten;
+    handoff_maxfd = sysconf(_SC_OPEN_MAX);
+}
+
+/* handoff_draining - Whether the listening sockets have been handed off */
+int handoff_draining(void)
+{
+    return atomic_load_explicit(&handoff_state, memory_order_relaxed);
+}
+
+/* Close descriptors lo to hi, as far as there can be any */
+static void handoff_close_range(int lo, int hi)
+{
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, (unsigned)lo, (unsigned)hi, 0) == 0) {
+        return;
+    }
+#endif
+    for (; lo <= hi && lo < handoff_maxfd; lo++) {
+        close(lo);
+    }
+}
+
+/*
+ * handoff_exec - In the child: close all but the sorted descriptors in
+ *     keep, and exec the proxy again. Only async-signal-safe calls, as
+ *     the parent has other threads. If the exec fails, its errno goes
+ *     down errfd.
+ */
+static void handoff_exec(char **envp, const int *keep, int nkeep, int errfd)
+{
+    sigset_t none;
+    int lo = 3, i, err;
+
+    /* The new process sets up its own signal handling */
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    for (i = 0; i < handoff_nfds; i++) {
+        fcntl(handoff_fds[i], F_SETFD, 0);
+    }
+    for (i = 0; i < nkeep; i++) {
+        if (keep[i] >= lo) {
+            if (keep[i] > lo) {
+                handoff_close_range(lo, keep[i] - 1);
+            }
+            lo = keep[i] + 1;
+        }
+    }
+    handoff_close_range(lo, INT_MAX);
+
+    execve(handoff_path, handoff_argv, envp);
+    err = errno;
+    while (write(errfd, &err, sizeof(err)) < 0 && errno == EINTR) {
+    }
+    _exit(127);
+}
+
+/* Wait for the old connections to finish, then exit */
+static void *handoff_drain(void *arg)
+{
+    long long deadline = metrics_now() + HANDOFF_DRAIN_SECS * 1000000000LL;
+    int open;
+
+    Pthread_detach(Pthread_self());
+    while ((open = admit_open_conns()) > 0 && metrics_now() < deadline) {
+        if (handoff_stop) {
+            handoff_stop();
+        }
+        usleep(HANDOFF_POLL_MS * 1000);
+    }
+    if (open > 0) {
+        fprintf(stderr, "drain timed out with %d connections open\n", open);
+    }
+    trace_flush();
+    exit(0);
+}
+
+/*
+ * handoff_begin - Start a new proxy on the listening sockets and drain
+ *     this one. Once the new one runs, stop, if not NULL, is called
+ *     every HANDOFF_POLL_MS until the drain is done, to make sure the
+ *     engine has stopped accepting. Returns -1 if there is no new proxy.
+ */
+int handoff_begin(void (*stop)(void))
+{
+    char fdlist[MAXLINE];
+    char **envp;
+    int *keep;
+    int errpipe[2];
+    int i, n, len, err = 0;
+    pthread_t tid;
+    pid_t pid;
+
+    if (handoff_draining() || !handoff_argv) {
+        return -1;
+    }
+
+    /* Everything the child needs is made here, as it may not allocate */
+    len = snprintf(fdlist, sizeof(fdlist), "%s=", HANDOFF_ENV);
+    for (i = 0; i < handoff_nfds && len < (int)sizeof(fdlist); i++) {
+        len += snprintf(fdlist + len, sizeof(fdlist) - len, i ? ",%d" : "%d", handoff_fds[i]);
+    }
+    for (n = 0; environ[n]; n++) {
+    }
+    envp = Malloc(sizeof(char *) * (n + 2));
+    for (i = n = 0; environ[i]; i++) {
+        if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV))) {
+            envp[n++] = environ[i];
+        }
+    }
+    envp[n++] = fdlist;
+    envp[n] = NULL;
+    if (pipe2(errpipe, O_CLOEXEC) < 0) {
+        fprintf(stderr, "handoff failed: %s\n", strerror(errno));
+        Free(envp);
+        return -1;
+    }
+    keep = Malloc(sizeof(int) * (handoff_nfds + 1));
+    memcpy(keep, handoff_fds, sizeof(int) * handoff_nfds);
+    keep[handoff_nfds] = errpipe[1];
+    qsort(keep, handoff_nfds + 1, sizeof(int), handoff_cmp);
+
+    /* The new process maps the disk tier once this one is done with it */
+    cache_flush();
+    disk_close();
+
+    if ((pid = fork()) == 0) {
+        handoff_exec(envp, keep, handoff_nfds + 1, errpipe[1]);
+    }
+    close(errpipe[1]);
+    if (pid < 0) {
+        err = errno;
+    } else {
+        /* End of file: the exec closed the pipe, so it succeeded */
+        while ((n = read(errpipe[0], &err, sizeof(err))) < 0 && errno == EINTR) {
+        }
+        if (n != sizeof(err)) {
+            err = 0;
+        }
+    }
+    close(errpipe[0]);
+    Free(keep);
+    Free(envp);
+    if (err) {
+        fprintf(stderr, "cannot start %s: %s\n", handoff_path, strerror(err));
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+        disk_reopen();
+        return -1;
+    }
+
+    fprintf(stderr, "listening sockets handed to process %d, draining\n", (int)pid);
+    handoff_stop = stop;
+    atomic_store_explicit(&handoff_state, 1, memory_order_relaxed);
+    Pthread_create(&tid, NULL, handoff_drain, NULL);
+    return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * handoff.h - graceful restart: listening sockets handed to a new
+ *     process, which the old one drains its connections behind
+ */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#define HANDOFF_ENV "PROXY_LISTEN_FDS"  /* Inherited listening descriptors */
+#define HANDOFF_DRAIN_SECS 30          /* Longest a drain may take */
+#define HANDOFF_POLL_MS 100            /* How often a drain checks on itself */
+
+int handoff_inherit(int **listenfds);
+void handoff_init(char **argv, const int *listenfds, int nlisten);
+int handoff_begin(void (*stop)(void));
+int handoff_draining(void);
+
+#endif /* __HANDOFF_H__ */
@@ -0,0 +1,1357 @@
+/*
+ * http.c - HTTP request parsing and rewriting shared by the proxy engines
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include "csapp.h"
+#include "http.h"
+#include "metrics.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/* You won't lose style points for including this long line in your code */
+static const char user_agent_hdr[] =
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+    "Gecko/20120305 Firefox/10.0.3\r\n";
+
+static long long http_default_ttl = HTTP_DEFAULT_TTL;
+static long long http_default_grace = HTTP_DEFAULT_GRACE;
+static size_t http_compression = 0;  /* Smallest body compressed, 0 if none */
+
+int starts_with_icase(const char *s, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return strncasecmp(s, prefix, n) == 0;
+}
+
+/*
+ * Line ends are found 32 or 16 bytes at a time with AVX2 or SSE2, the
+ * widest the CPU has, picked once by http_init(); other machines use
+ * the plain loop.
+ */
+typedef const char *(*lf_scan_t)(const char *p, const char *end);
+
+static const char *find_lf_scalar(const char *p, const char *end)
+{
+    while (p < end) {
+        if (*p == '\n') {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+#ifdef __SSE2__
+static const char *find_lf_sse2(const char *p, const char *end)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find_lf_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *find_lf_avx2(const char *p, const char *end)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return find_lf_sse2(p, end);
+}
+#endif
+
+static lf_scan_t find_lf = find_lf_scalar;
+
+/* http_init - Pick the fastest line scanner this CPU supports */
+void http_init(void)
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    find_lf = __builtin_cpu_supports("avx2") ? find_lf_avx2 : find_lf_sse2;
+#endif
+}
+
+/*
+ * http_set_default_ttl - How many seconds a response that states no
+ *     freshness of its own, nor when it was last modified, stays fresh
+ */
+void http_set_default_ttl(long long secs)
+{
+    http_default_ttl = secs;
+}
+
+/*
+ * http_set_default_grace - How many seconds past expiry a response that
+ *     does not say otherwise may be served stale while it is revalidated
+ */
+void http_set_default_grace(long long secs)
+{
+    http_default_grace = secs;
+}
+
+/*
+ * http_set_compression - The proxy compresses cached responses of
+ *     min_size bytes or more itself, so clients' Accept-Encoding is not
+ *     passed on and origins send identity bodies, which every client can
+ *     be given. 0 turns it off.
+ */
+void http_set_compression(size_t min_size)
+{
+    http_compression = min_size;
+}
+
+/* http_find_lf - The first '\n' in [p, end), or NULL */
+const char *http_find_lf(const char *p, const char *end)
+{
+    return find_lf(p, end);
+}
+
+/*
+ * The header names the proxy acts on, each in the slot its length plus
+ * its first and last letters pick, modulo 32. No two share a slot, so
+ * one comparison tells whether a name is one of them.
+ */
+#define HDR_SLOTS 32
+
+static const struct {
+    const char *name;
+    size_t len;
+    int id;
+} http_header_names[HDR_SLOTS] = {
+    [0] = { "host", 4, HDR_HOST },
+    [12] = { "transfer-encoding", 17, HDR_TRANSFER_ENCODING },
+    [14] = { "proxy-connection", 16, HDR_PROXY_CONNECTION },
+    [19] = { "user-agent", 10, HDR_USER_AGENT },
+    [23] = { "accept-encoding", 15, HDR_ACCEPT_ENCODING },
+    [25] = { "content-length", 14, HDR_CONTENT_LENGTH },
+    [26] = { "keep-alive", 10, HDR_KEEP_ALIVE },
+    [27] = { "connection", 10, HDR_CONNECTION },
+    [30] = { "if-none-match", 13, HDR_IF_NONE_MATCH },
+    [31] = { "if-modified-since", 17, HDR_IF_MODIFIED_SINCE },
+};
+
+/* http_header_id - Classify the len byte header name, in any case */
+int http_header_id(const char *name, size_t len)
+{
+    unsigned slot;
+
+    if (len == 0) {
+        return HDR_OTHER;
+    }
+    slot = (len + ((unsigned char)name[0] | 0x20) + ((unsigned char)name[len - 1] | 0x20)) &
+           (HDR_SLOTS - 1);
+    if (http_header_names[slot].len == len &&
+        !strncasecmp(http_header_names[slot].name, name, len)) {
+        return http_header_names[slot].id;
+    }
+    return HDR_OTHER;
+}
+
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* Does the len byte value list token among its comma separated elements? */
+static int header_has_token(const char *value, size_t len, const char *token)
+{
+    const char *end = value + len;
+    size_t n = strlen(token);
+
+    while (value < end) {
+        while (value < end && (is_blank(*value) || *value == ',')) {
+            value++;
+        }
+        if ((size_t)(end - value) >= n && !strncasecmp(value, token, n) &&
+            (value + n == end || value[n] == ',' || isspace((unsigned char)value[n]))) {
+            return 1;
+        }
+        while (value < end && *value != ',') {
+            value++;
+        }
+    }
+    return 0;
+}
+
+/* Does the Vary value name anything besides Accept-Encoding? */
+static int vary_other(const char *value)
+{
+    const char *end = value + strlen(value);
+
+    while (value < end) {
+        const char *tok;
+
+        while (value < end && (is_blank(*value) || *value == ',')) {
+            value++;
+        }
+        tok = value;
+        while (value < end && *value != ',' && !isspace((unsigned char)*value)) {
+            value++;
+        }
+        if (value > tok && (value - tok != 15 || strncasecmp(tok, "accept-encoding", 15))) {
+            return 1;
+        }
+        while (value < end && *value != ',') {
+            value++;
+        }
+    }
+    return 0;
+}
+
+/* Apply a Connection or Proxy-Connection value to *keepalive */
+static void connection_tokens(http_span_t value, int *keepalive)
+{
+    if (header_has_token(value.p, value.len, "close")) {
+        *keepalive = 0;
+    } else if (header_has_token(value.p, value.len, "keep-alive")) {
+        *keepalive = 1;
+    }
+}
+
+/* Whether the quality value at [p, end) is zero, i.e. "not acceptable" */
+static int zero_qvalue(const char *p, const char *end)
+{
+    while (p < end && is_blank(*p)) {
+        p++;
+    }
+    if (end - p < 2 || (p[0] | 0x20) != 'q' || p[1] != '=') {
+        return 0;
+    }
+    for (p += 2; p < end && !is_blank(*p); p++) {
+        if (*p != '0' && *p != '.') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * accept_encodings - The HTTP_ENC_* bits of the codings an Accept-Encoding
+ *     value takes: those it names, or all it does not name if it has a *,
+ *     less any given q=0
+ */
+static int accept_encodings(http_span_t value)
+{
+    const char *p = value.p;
+    const char *end = value.p + value.len;
+    int named = 0, taken = 0, any = 0;
+
+    while (p < end) {
+        const char *tok, *semi, *next;
+        size_t n;
+        int bit = 0, ok;
+
+        while (p < end && (is_blank(*p) || *p == ',')) {
+            p++;
+        }
+        tok = p;
+        while (p < end && *p != ',' && *p != ';' && !is_blank(*p)) {
+            p++;
+        }
+        n = p - tok;
+        if ((next = memchr(p, ',', end - p)) == NULL) {
+            next = end;
+        }
+        semi = memchr(p, ';', next - p);
+        ok = !semi || !zero_qvalue(semi + 1, next);
+
+        if ((n == 4 && !strncasecmp(tok, "gzip", 4)) ||
+            (n == 6 && !strncasecmp(tok, "x-gzip", 6))) {
+            bit = 1 << HTTP_ENC_GZIP;
+        } else if (n == 2 && !strncasecmp(tok, "br", 2)) {
+            bit = 1 << HTTP_ENC_BR;
+        } else if (n == 1 && *tok == '*') {
+            any = ok;
+        }
+        named |= bit;
+        if (ok) {
+            taken |= bit;
+        }
+        p = next;
+    }
+    if (any) {
+        taken |= ((1 << HTTP_NENCODINGS) - 1) & ~named;
+    }
+    return taken;
+}
+
+/* Cut the next blank separated word of [*p, end) */
+static http_span_t next_word(const char **p, const char *end)
+{
+    http_span_t w;
+
+    while (*p < end && is_blank(**p)) {
+        (*p)++;
+    }
+    w.p = *p;
+    while (*p < end && !isspace((unsigned char)**p)) {
+        (*p)++;
+    }
+    w.len = *p - w.p;
+    return w;
+}
+
+/*
+ * parse_request_line - Split "METHOD URI VERSION". keepalive starts out
+ *     as the version's default: persistent for HTTP/1.1, one request per
+ *     connection for HTTP/1.0. Only GET is served.
+ */
+static int parse_request_line(const char *p, const char *eol, http_request_t *req)
+{
+    req->method = next_word(&p, eol);
+    req->uri = next_word(&p, eol);
+    req->version = next_word(&p, eol);
+    if (!req->version.len || req->uri.len >= MAXLINE ||
+        req->method.len != 3 || strncasecmp(req->method.p, "GET", 3)) {
+        return -1;
+    }
+    req->keepalive = req->version.len != 8 || strncasecmp(req->version.p, "HTTP/1.0", 8);
+    return 0;
+}
+
+/*
+ * parse_request_header - Classify one header line. Host is captured,
+ *     the connection headers update keepalive, and the headers the proxy
+ *     supplies itself are not kept for forwarding.
+ */
+static void parse_request_header(const char *p, const char *eol, const char *next,
+                                 http_request_t *req)
+{
+    const char *colon = memchr(p, ':', eol - p);
+    http_header_t h;
+
+    h.line.p = p;
+    h.line.len = next - p;
+    h.id = HDR_OTHER;
+    h.value.p = eol;
+    h.value.len = 0;
+    if (colon) {
+        const char *v = colon + 1;
+        const char *e = eol;
+
+        while (v < e && is_blank(*v)) {
+            v++;
+        }
+        while (e > v && is_blank(e[-1])) {
+            e--;
+        }
+        h.id = http_header_id(p, colon - p);
+        h.value.p = v;
+        h.value.len = e - v;
+    }
+
+    switch (h.id) {
+    case HDR_HOST:
+        req->host = h.value;
+        return;
+    case HDR_CONNECTION:
+    case HDR_PROXY_CONNECTION:
+        connection_tokens(h.value, &req->keepalive);
+        return;
+    case HDR_USER_AGENT:
+    case HDR_KEEP_ALIVE:
+        return;
+    case HDR_ACCEPT_ENCODING:
+        req->accept_encodings = accept_encodings(h.value);
+        break;
+    }
+    if (req->nheaders < HTTP_MAX_HEADERS) {
+        req->headers[req->nheaders++] = h;
+    }
+}
+
+/*
+ * http_parse_request - Parse the request head at the start of the len
+ *     bytes at buf in one pass, without copying it. Returns the length
+ *     of the head, blank line included, 0 if the blank line has not
+ *     arrived yet, or -1 if the request is malformed or not a GET.
+ */
+int http_parse_request(const char *buf, size_t len, http_request_t *req)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *nl;
+    int first = 1;
+
+    req->nheaders = 0;
+    req->accept_encodings = 0;
+    req->host.p = NULL;
+    req->host.len = 0;
+
+    while ((nl = find_lf(p, end)) != NULL) {
+        const char *eol = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+
+        if (first) {
+            if (parse_request_line(p, eol, req) < 0) {
+                return -1;
+            }
+            first = 0;
+        } else if (eol == p) {
+            return nl + 1 - buf;
+        } else {
+            parse_request_header(p, eol, nl + 1, req);
+        }
+        p = nl + 1;
+    }
+    return 0;
+}
+
+/*
+ * read_request - Read the next request head from rp and parse it into
+ *     req. The head is parsed where it lies in rp's buffer, or, should it
+ *     outgrow that, in *spill, a Malloc()ed buffer the caller frees once
+ *     done with req. Bytes after the head stay buffered in rp. Returns 0
+ *     on success, -1 on EOF, error, or a malformed or oversized head.
+ */
+int read_request(rio_t *rp, http_request_t *req, char **spill)
+{
+    char *buf;
+    size_t len, cap;
+    long long t = metrics_now();
+    int n;
+
+    *spill = NULL;
+    if (rp->rio_cnt > 0 && (n = http_parse_request(rp->rio_bufptr, rp->rio_cnt, req)) != 0) {
+        if (n < 0) {
+            return -1;
+        }
+        metrics_since(METRIC_PARSE, t);
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        return 0;
+    }
+
+    /* Read on behind whatever part of the head is already buffered */
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+    buf = rp->rio_buf;
+    len = rp->rio_cnt;
+    cap = rp->rio_bufsize;
+
+    while (1) {
+        size_t want;
+        ssize_t r;
+
+        if (len == cap) {
+            if (cap >= HTTP_MAX_HEAD) {
+                return -1;
+            }
+            cap = cap * 2 < HTTP_MAX_HEAD ? cap * 2 : HTTP_MAX_HEAD;
+            if (!*spill) {
+                *spill = Malloc(cap);
+                memcpy(*spill, rp->rio_buf, len);
+            } else {
+                *spill = Realloc(*spill, cap);
+            }
+            buf = *spill;
+            rp->rio_cnt = 0;
+        }
+
+        /* At most a buffer's worth, so what follows the head fits back in rp */
+        want = cap - len < rp->rio_bufsize ? cap - len : rp->rio_bufsize;
+        if ((r = read(rp->rio_fd, buf + len, want)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        len += r;
+        if (!*spill) {
+            rp->rio_cnt = len;
+        }
+
+        /* The head can only have ended if a line did */
+        if (!find_lf(buf + len - r, buf + len)) {
+            continue;
+        }
+        t = metrics_now();
+        if ((n = http_parse_request(buf, len, req)) < 0) {
+            return -1;
+        }
+        if (n > 0) {
+            metrics_since(METRIC_PARSE, t);
+            break;
+        }
+    }
+
+    if (*spill) {
+        memcpy(rp->rio_buf, buf + n, len - n);
+        rp->rio_bufptr = rp->rio_buf;
+    } else {
+        rp->rio_bufptr = buf + n;
+    }
+    rp->rio_cnt = len - n;
+    return 0;
+}
+
+/* http_span_copy - Copy s into dst as a string, cut to size - 1 bytes */
+void http_span_copy(char *dst, size_t size, http_span_t s)
+{
+    size_t n = s.len < size - 1 ? s.len : size - 1;
+
+    memcpy(dst, s.p, n);
+    dst[n] = '\0';
+}
+
+void parse_uri(const char *uri, char *hostname, char *port, char *path)
+{
+    const char *p = uri;
+    const char *slash;
+    char hostport[MAXLINE];
+    const char *colon;
+    size_t hostport_len;
+
+    hostname[0] = '\0';
+    strcpy(port, "80");
+    strcpy(path, "/");
+
+    if (starts_with_icase(p, "http://")) {
+        p += 7;
+    }
+
+    if (*p == '/') {
+        strncpy(path, p, MAXLINE - 1);
+        path[MAXLINE - 1] = '\0';
+        return;
+    }
+
+    slash = strchr(p, '/');
+    if (slash) {
+        hostport_len = (size_t)(slash - p);
+        if (hostport_len >= sizeof(hostport)) {
+            hostport_len = sizeof(hostport) - 1;
+        }
+        memcpy(hostport, p, hostport_len);
+        hostport[hostport_len] = '\0';
+        strncpy(path, slash, MAXLINE - 1);
+        path[MAXLINE - 1] = '\0';
+    } else {
+        strncpy(hostport, p, sizeof(hostport) - 1);
+        hostport[sizeof(hostport) - 1] = '\0';
+        strcpy(path, "/");
+    }
+
+    colon = strchr(hostport, ':');
+    if (colon) {
+        size_t host_len = (size_t)(colon - hostport);
+        if (host_len >= MAXLINE) {
+            host_len = MAXLINE - 1;
+        }
+        memcpy(hostname, hostport, host_len);
+        hostname[host_len] = '\0';
+        strncpy(port, colon + 1, MAXLINE - 1);
+        port[MAXLINE - 1] = '\0';
+    } else {
+        strncpy(hostname, hostport, MAXLINE - 1);
+        hostname[MAXLINE - 1] = '\0';
+    }
+}
+
+void build_cache_key(char *key, const char *hostname, const char *port, const char *path)
+{
+    snprintf(key, MAXLINE, "%s:%s%s", hostname, port, path);
+}
+
+void normalize_host_from_header(const char *host_hdr, char *hostname, char *port)
+{
+    char tmp[MAXLINE];
+    char *p;
+    char *colon;
+
+    if (!host_hdr || !*host_hdr) {
+        return;
+    }
+
+    while (*host_hdr && isspace((unsigned char)*host_hdr)) {
+        host_hdr++;
+    }
+
+    strncpy(tmp, host_hdr, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+
+    p = tmp;
+    while (*p && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (!*p) {
+        return;
+    }
+
+    char *end = p + strlen(p);
+    while (end > p && (end[-1] == '\r' || end[-1] == '\n' || isspace((unsigned char)end[-1]))) {
+        end[-1] = '\0';
+        end--;
+    }
+
+    colon = strchr(p, ':');
+    if (colon) {
+        *colon = '\0';
+        strncpy(hostname, p, MAXLINE - 1);
+        hostname[MAXLINE - 1] = '\0';
+        strncpy(port, colon + 1, MAXLINE - 1);
+        port[MAXLINE - 1] = '\0';
+    } else {
+        strncpy(hostname, p, MAXLINE - 1);
+        hostname[MAXLINE - 1] = '\0';
+    }
+}
+
+static void iov_put(struct iovec *iov, int *n, const char *p, size_t len)
+{
+    iov[*n].iov_base = (void *)p;
+    iov[*n].iov_len = len;
+    (*n)++;
+}
+
+#define iov_put_lit(iov, n, s) iov_put(iov, n, s, sizeof(s) - 1)
+
+/*
+ * build_request_iov - Describe the request sent to the origin in iov,
+ *     which needs room for REQUEST_IOV_MAX entries, without copying a
+ *     byte: the pieces are the proxy's own strings, hostname, port and
+ *     path, and the client's forwarded header lines where req found
+ *     them. With keepalive set this is an HTTP/1.1 request that leaves
+ *     the connection open for reuse, otherwise an HTTP/1.0 request that
+ *     asks the origin to close it. A request that fills the cache passes
+ *     cond, the conditional headers it revalidates with, which may be
+ *     empty: the client's own are then left out, as a full response is
+ *     wanted for the cache, and so is Accept-Encoding if the proxy does
+ *     the compressing. Returns the number of iovecs used.
+ */
+int build_request_iov(struct iovec *iov, const char *hostname, const char *port,
+                      const char *path, const http_request_t *req, int keepalive,
+                      const char *cond)
+{
+    int n = 0;
+    int i;
+
+    iov_put_lit(iov, &n, "GET ");
+    iov_put(iov, &n, path, strlen(path));
+    if (keepalive) {
+        iov_put_lit(iov, &n, " HTTP/1.1\r\nHost: ");
+    } else {
+        iov_put_lit(iov, &n, " HTTP/1.0\r\nHost: ");
+    }
+    iov_put(iov, &n, hostname, strlen(hostname));
+    if (strcmp(port, "80")) {
+        iov_put_lit(iov, &n, ":");
+        iov_put(iov, &n, port, strlen(port));
+    }
+    iov_put_lit(iov, &n, "\r\n");
+    iov_put_lit(iov, &n, user_agent_hdr);
+    if (keepalive) {
+        iov_put_lit(iov, &n, "Connection: keep-alive\r\n");
+    } else {
+        iov_put_lit(iov, &n, "Connection: close\r\nProxy-Connection: close\r\n");
+    }
+    for (i = 0; i < req->nheaders; i++) {
+        int id = req->headers[i].id;
+
+        if (cond && (id == HDR_IF_NONE_MATCH || id == HDR_IF_MODIFIED_SINCE ||
+                     (id == HDR_ACCEPT_ENCODING && http_compression))) {
+            continue;
+        }
+        iov_put(iov, &n, req->headers[i].line.p, req->headers[i].line.len);
+    }
+    if (cond && *cond) {
+        iov_put(iov, &n, cond, strlen(cond));
+    }
+    iov_put_lit(iov, &n, "\r\n");
+    return n;
+}
+
+/*
+ * parse_status_line - Start a fresh http_response_t from the origin's
+ *     status line. Returns 0 on success, -1 if the line is malformed.
+ */
+int parse_status_line(const char *line, http_response_t *resp)
+{
+    int major, minor;
+
+    memset(resp, 0, sizeof(*resp));
+    resp->content_length = -1;
+    resp->max_age = resp->s_maxage = resp->swr = -1;
+    resp->date = resp->expires = resp->last_modified = resp->age = -1;
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &resp->status) != 3) {
+        return -1;
+    }
+    resp->http11 = major > 1 || (major == 1 && minor >= 1);
+    return 0;
+}
+
+/* The id of a header line's name, HDR_OTHER if it has no colon */
+static int line_header_id(const char *line, const char **value)
+{
+    const char *colon = strchr(line, ':');
+
+    if (!colon) {
+        return HDR_OTHER;
+    }
+    *value = colon + 1;
+    return http_header_id(line, colon - line);
+}
+
+/*
+ * http_date - Seconds since the epoch of an HTTP-date in any of its
+ *     three formats, or -1 if value is not one
+ */
+static long long http_date(const char *value)
+{
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S",   /* IMF-fixdate */
+        "%A, %d-%b-%y %H:%M:%S",   /* RFC 850 */
+        "%a %b %d %H:%M:%S %Y"     /* asctime() */
+    };
+    struct tm tm;
+    size_t i;
+
+    while (is_blank(*value)) {
+        value++;
+    }
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, formats[i], &tm)) {
+            return (long long)timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+/* The seconds of a delta-seconds value, -1 if there are none */
+static long long http_seconds(const char *p, const char *end)
+{
+    long long n = 0;
+
+    if (p == end || !isdigit((unsigned char)*p)) {
+        return -1;
+    }
+    while (p < end && isdigit((unsigned char)*p)) {
+        /* Anything past 68 years is as good as forever */
+        n = n < 0x7fffffff ? n * 10 + (*p - '0') : 0x7fffffff;
+        p++;
+    }
+    return n;
+}
+
+/*
+ * parse_cache_control - Record the Cache-Control directives a shared
+ *     cache acts on. Field names given to private and no-cache are not
+ *     told apart from the plain directives.
+ */
+static void parse_cache_control(const char *value, http_response_t *resp)
+{
+    const char *end = value + strlen(value);
+
+    while (value < end) {
+        const char *name, *eq, *next;
+        size_t n;
+
+        while (value < end && (isspace((unsigned char)*value) || *value == ',')) {
+            value++;
+        }
+        name = value;
+        while (value < end && *value != ',' && *value != '=' &&
+               !isspace((unsigned char)*value)) {
+            value++;
+        }
+        n = value - name;
+        eq = value < end && *value == '=' ? value + 1 : NULL;
+        if ((next = memchr(value, ',', end - value)) == NULL) {
+            next = end;
+        }
+        if (eq && *eq == '"') {
+            eq++;
+        }
+
+        if ((n == 8 && !strncasecmp(name, "no-store", 8)) ||
+            (n == 7 && !strncasecmp(name, "private", 7))) {
+            resp->no_store = 1;
+        } else if (n == 8 && !strncasecmp(name, "no-cache", 8)) {
+            resp->no_cache = 1;
+        } else if (n == 12 && !strncasecmp(name, "no-transform", 12)) {
+            resp->no_transform = 1;
+        } else if (n == 7 && !strncasecmp(name, "max-age", 7) && eq) {
+            resp->max_age = http_seconds(eq, next);
+        } else if (n == 8 && !strncasecmp(name, "s-maxage", 8) && eq) {
+            resp->s_maxage = http_seconds(eq, next);
+        } else if ((n == 15 && !strncasecmp(name, "must-revalidate", 15)) ||
+                   (n == 16 && !strncasecmp(name, "proxy-revalidate", 16))) {
+            resp->must_revalidate = 1;
+        } else if (n == 22 && !strncasecmp(name, "stale-while-revalidate", 22) && eq) {
+            resp->swr = http_seconds(eq, next);
+        }
+        value = next;
+    }
+}
+
+/* Whether a Content-Type value is text that compresses well */
+static int compressible_type(const char *value)
+{
+    static const char *types[] = {
+        "text/", "application/javascript", "application/x-javascript", "application/json",
+        "application/xml", "application/xhtml+xml", "application/rss+xml",
+        "application/atom+xml", "image/svg+xml", NULL
+    };
+    int i;
+
+    while (is_blank(*value)) {
+        value++;
+    }
+    for (i = 0; types[i]; i++) {
+        if (starts_with_icase(value, types[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Record the header line if it is one that says how long to cache, or
+ * whether the proxy may compress the response
+ */
+static void parse_freshness_header(const char *line, http_response_t *resp)
+{
+    const char *colon = strchr(line, ':');
+    const char *value;
+    size_t n;
+
+    if (!colon) {
+        return;
+    }
+    n = colon - line;
+    value = colon + 1;
+    if (n == 13 && !strncasecmp(line, "cache-control", 13)) {
+        parse_cache_control(value, resp);
+    } else if (n == 7 && !strncasecmp(line, "expires", 7)) {
+        /* An Expires that is not a date means already expired */
+        if ((resp->expires = http_date(value)) < 0) {
+            resp->expires = 0;
+        }
+    } else if (n == 4 && !strncasecmp(line, "date", 4)) {
+        resp->date = http_date(value);
+    } else if (n == 13 && !strncasecmp(line, "last-modified", 13)) {
+        resp->last_modified = http_date(value);
+    } else if (n == 12 && !strncasecmp(line, "content-type", 12)) {
+        resp->compressible = compressible_type(value);
+    } else if (n == 16 && !strncasecmp(line, "content-encoding", 16)) {
+        resp->encoded = !header_has_token(value, strlen(value), "identity");
+    } else if (n == 4 && !strncasecmp(line, "vary", 4)) {
+        /* Accept-Encoding is what the proxy's own variants vary on */
+        resp->vary_encoding |= header_has_token(value, strlen(value), "accept-encoding");
+        resp->varies |= vary_other(value);
+    } else if (n == 3 && !strncasecmp(line, "age", 3)) {
+        while (is_blank(*value)) {
+            value++;
+        }
+        resp->age = http_seconds(value, value + strlen(value));
+    }
+}
+
+/*
+ * parse_response_header - Record the framing headers of one header line,
+ *     and those that decide whether and how long it may be cached
+ */
+void parse_response_header(const char *line, http_response_t *resp)
+{
+    const char *value = NULL;
+
+    switch (line_header_id(line, &value)) {
+    case HDR_CONTENT_LENGTH:
+        resp->content_length = strtoll(value, NULL, 10);
+        break;
+    case HDR_TRANSFER_ENCODING:
+        resp->chunked = header_has_token(value, strlen(value), "chunked");
+        break;
+    case HDR_CONNECTION:
+        if (header_has_token(value, strlen(value), "close")) {
+            resp->conn_close = 1;
+        }
+        if (header_has_token(value, strlen(value), "keep-alive")) {
+            resp->conn_keepalive = 1;
+        }
+        break;
+    case HDR_OTHER:
+        parse_freshness_header(line, resp);
+        break;
+    }
+}
+
+/*
+ * response_header_forwarded - The per-hop connection headers of the
+ *     origin are not passed on; the proxy adds its own Connection
+ *     header for the client connection instead.
+ */
+int response_header_forwarded(const char *line)
+{
+    const char *value;
+
+    switch (line_header_id(line, &value)) {
+    case HDR_CONNECTION:
+    case HDR_KEEP_ALIVE:
+    case HDR_PROXY_CONNECTION:
+        return 0;
+    }
+    return 1;
+}
+
+/* response_has_body - 1xx, 204 and 304 responses never carry a body */
+int response_has_body(const http_response_t *resp)
+{
+    return !((resp->status >= 100 && resp->status < 200) ||
+             resp->status == 204 || resp->status == 304);
+}
+
+/* response_delimited - Can the end of the response be found without EOF? */
+int response_delimited(const http_response_t *resp)
+{
+    return !response_has_body(resp) || resp->chunked || resp->content_length >= 0;
+}
+
+/*
+ * response_keepalive - Can the origin connection carry another request
+ *     once this response has been read in full?
+ */
+int response_keepalive(const http_response_t *resp)
+{
+    if (resp->conn_close || !response_delimited(resp)) {
+        return 0;
+    }
+    return resp->http11 || resp->conn_keepalive;
+}
+
+/* Statuses a cache may keep without being told how long they stay fresh */
+static int heuristic_status(int status)
+{
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * response_expires - When the response goes stale, in seconds since the
+ *     epoch, or -1 if a shared cache must not store it at all. Its
+ *     lifetime is s-maxage, max-age or Expires, whichever comes first in
+ *     that order; failing those, a tenth of the time since Last-Modified,
+ *     up to HTTP_MAX_HEURISTIC_TTL, or the -T default. no-cache makes it
+ *     stale at once. The age it arrived with, from Age or its Date, is
+ *     already used up.
+ */
+long long response_expires(const http_response_t *resp)
+{
+    long long now = (long long)time(NULL);
+    long long date = resp->date >= 0 ? resp->date : now;
+    long long lifetime, age, expires;
+
+    if (resp->no_store || resp->status < 200 || resp->status == 206 || resp->status == 304) {
+        return -1;
+    }
+    if (resp->s_maxage >= 0) {
+        lifetime = resp->s_maxage;
+    } else if (resp->max_age >= 0) {
+        lifetime = resp->max_age;
+    } else if (resp->expires >= 0) {
+        lifetime = resp->expires - date;
+    } else if (!heuristic_status(resp->status)) {
+        return -1;
+    } else if (resp->last_modified >= 0 && resp->last_modified <= date) {
+        lifetime = (date - resp->last_modified) / 10;
+        if (lifetime > HTTP_MAX_HEURISTIC_TTL) {
+            lifetime = HTTP_MAX_HEURISTIC_TTL;
+        }
+    } else {
+        lifetime = http_default_ttl;
+    }
+    if (resp->no_cache) {
+        lifetime = 0;
+    }
+
+    age = date < now ? now - date : 0;
+    if (resp->age > age) {
+        age = resp->age;
+    }
+    expires = now + lifetime - age;
+    return expires > 0 ? expires : 0;
+}
+
+/*
+ * response_grace - How many seconds past its expiry the response may be
+ *     served stale while a revalidation runs: its stale-while-revalidate,
+ *     else the -W default. Responses that must be revalidated before they
+ *     are served stale, s-maxage ones included, get none.
+ */
+long long response_grace(const http_response_t *resp)
+{
+    if (resp->no_cache || resp->must_revalidate || resp->s_maxage >= 0) {
+        return 0;
+    }
+    return resp->swr >= 0 ? resp->swr : http_default_grace;
+}
+
+/*
+ * head_line - A NUL-terminated copy of the n-byte head line at p, in
+ *     buf if it fits in MAXLINE bytes, else in a Malloc()ed buffer the
+ *     caller frees. A long line is never cut short, as the rest of it
+ *     could then pass for a header line of its own.
+ */
+static char *head_line(const char *p, size_t n, char *buf)
+{
+    char *line = n < MAXLINE ? buf : Malloc(n + 1);
+
+    memcpy(line, p, n);
+    line[n] = '\0';
+    return line;
+}
+
+/*
+ * parse_response_head - Parse a stored response head, the first len
+ *     bytes of head, into resp. The blank line may be left off.
+ */
+void parse_response_head(const char *head, size_t len, http_response_t *resp)
+{
+    char buf[MAXLINE];
+    const char *p = head;
+    const char *end = head + len;
+    int first = 1;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = nl ? (size_t)(nl - p + 1) : (size_t)(end - p);
+        char *line = head_line(p, n, buf);
+        int rc = 0;
+
+        p += n;
+        if (first) {
+            rc = parse_status_line(line, resp);
+            first = 0;
+        } else {
+            parse_response_header(line, resp);
+        }
+        if (line != buf) {
+            Free(line);
+        }
+        if (rc < 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * response_update - Apply a 304 that revalidated the stored response:
+ *     the headers the 304 carries replace the stored ones, and its Date
+ *     and Age are the stored response's now.
+ */
+void response_update(http_response_t *stored, const http_response_t *resp)
+{
+    if (resp->no_store || resp->no_cache || resp->must_revalidate || resp->max_age >= 0 ||
+        resp->s_maxage >= 0 || resp->swr >= 0) {
+        stored->no_store = resp->no_store;
+        stored->no_cache = resp->no_cache;
+        stored->must_revalidate = resp->must_revalidate;
+        stored->max_age = resp->max_age;
+        stored->s_maxage = resp->s_maxage;
+        stored->swr = resp->swr;
+    }
+    if (resp->expires >= 0) {
+        stored->expires = resp->expires;
+    }
+    if (resp->last_modified >= 0) {
+        stored->last_modified = resp->last_modified;
+    }
+    stored->date = resp->date;
+    stored->age = resp->age;
+}
+
+/* Length of the name of the header line [p, eol), 0 if it has none */
+static size_t head_line_name(const char *p, const char *eol)
+{
+    const char *colon = memchr(p, ':', eol - p);
+
+    return colon ? (size_t)(colon - p) : 0;
+}
+
+/* Does the head [p, end), status line left off, have a header named [name, name + n)? */
+static int head_has_header(const char *p, const char *end, const char *name, size_t n)
+{
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl + 1 : end;
+
+        if (head_line_name(p, eol) == n && !strncasecmp(p, name, n)) {
+            return 1;
+        }
+        p = eol;
+    }
+    return 0;
+}
+
+/*
+ * revalidated_head - Write to out the stored head, the first slen bytes
+ *     of stored, as the 304 whose forwarded head is the first flen bytes
+ *     of fresh updates it: each header the 304 carries, Content-Length
+ *     aside, replaces the stored ones of that name (RFC 9111 section
+ *     3.2). Neither head has its blank line. out needs room for
+ *     slen + flen bytes. Returns the number of bytes written to out.
+ */
+size_t revalidated_head(const char *stored, size_t slen, const char *fresh, size_t flen,
+                        char *out)
+{
+    const char *send = stored + slen;
+    const char *fend = fresh + flen;
+    const char *p, *nl;
+    size_t out_len = 0;
+
+    /* Skip the 304's status line; the stored one is kept */
+    if ((nl = memchr(fresh, '\n', flen)) != NULL) {
+        fresh = nl + 1;
+    } else {
+        fresh = fend;
+    }
+    for (p = stored; p < send;) {
+        const char *eol = (nl = memchr(p, '\n', send - p)) != NULL ? nl + 1 : send;
+        size_t n = head_line_name(p, eol);
+
+        if (p == stored || !n || (n == 14 && !strncasecmp(p, "content-length", 14)) ||
+            !head_has_header(fresh, fend, p, n)) {
+            memcpy(out + out_len, p, eol - p);
+            out_len += eol - p;
+        }
+        p = eol;
+    }
+    for (p = fresh; p < fend;) {
+        const char *eol = (nl = memchr(p, '\n', fend - p)) != NULL ? nl + 1 : fend;
+        size_t n = head_line_name(p, eol);
+
+        if (n && !(n == 14 && !strncasecmp(p, "content-length", 14))) {
+            memcpy(out + out_len, p, eol - p);
+            out_len += eol - p;
+        }
+        p = eol;
+    }
+    return out_len;
+}
+
+/* Append a header line named name with the value [v, eol) to buf */
+static size_t put_validator(char *buf, size_t off, size_t size, const char *name,
+                            const char *v, const char *eol)
+{
+    size_t n;
+
+    while (v < eol && is_blank(*v)) {
+        v++;
+    }
+    while (eol > v && isspace((unsigned char)eol[-1])) {
+        eol--;
+    }
+    n = strlen(name) + (eol - v) + 2;
+    if (eol == v || off + n >= size) {
+        return off;
+    }
+    off += sprintf(buf + off, "%s%.*s\r\n", name, (int)(eol - v), v);
+    return off;
+}
+
+/*
+ * conditional_hdrs - Write to buf the request headers that revalidate
+ *     the stored response whose head is the first len bytes of head:
+ *     If-None-Match with its ETag and If-Modified-Since with its
+ *     Last-Modified. Returns the bytes written, 0 if it has neither.
+ */
+size_t conditional_hdrs(const char *head, size_t len, char *buf, size_t size)
+{
+    const char *p = head;
+    const char *end = head + len;
+    size_t off = 0;
+
+    buf[0] = '\0';
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+
+        if (eol - p > 5 && !strncasecmp(p, "etag:", 5)) {
+            off = put_validator(buf, off, size, "If-None-Match: ", p + 5, eol);
+        } else if (eol - p > 14 && !strncasecmp(p, "last-modified:", 14)) {
+            off = put_validator(buf, off, size, "If-Modified-Since: ", p + 14, eol);
+        }
+        p = eol + 1;
+    }
+    return off;
+}
+
+/*
+ * chunked_scan - Follow the next n bytes, p, of a chunked body whose
+ *     state ck started zeroed. Returns how many of them belong to the
+ *     body, fewer than n only if it ended among them; ck->state is then
+ *     CHUNK_DONE. A body that breaks the framing is left in CHUNK_BAD
+ *     and taken to run to EOF.
+ */
+size_t chunked_scan(http_chunked_t *ck, const char *p, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n && ck->state != CHUNK_DONE && ck->state != CHUNK_BAD) {
+        char ch = p[i];
+
+        if (ck->state == CHUNK_DATA) {
+            size_t m = (long long)(n - i) < ck->left ? n - i : (size_t)ck->left;
+
+            i += m;
+            if ((ck->left -= m) == 0) {
+                ck->state = CHUNK_DATA_END;
+            }
+            continue;
+        }
+        i++;
+        switch (ck->state) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)ch)) {
+                if (ck->digits == 15) {
+                    ck->state = CHUNK_BAD;  /* Too large to be meant */
+                    break;
+                }
+                ck->left = ck->left * 16 + (isdigit((unsigned char)ch) ? ch - '0'
+                                                                        : (ch | 0x20) - 'a' + 10);
+                ck->digits++;
+                break;
+            }
+            ck->state = CHUNK_EXT;
+            /* Fall through */
+        case CHUNK_EXT:
+            if (!ck->digits) {
+                ck->state = CHUNK_BAD;
+            } else if (ch == '\n') {
+                ck->state = ck->left ? CHUNK_DATA : CHUNK_TRAILER;
+                ck->blank = 1;
+            }
+            break;
+        case CHUNK_DATA_END:
+            if (ch == '\n') {
+                ck->state = CHUNK_SIZE;
+                ck->digits = 0;
+            } else if (ch != '\r') {
+                ck->state = CHUNK_BAD;
+            }
+            break;
+        case CHUNK_TRAILER:
+            if (ch == '\n') {
+                ck->state = ck->blank ? CHUNK_DONE : CHUNK_TRAILER;
+                ck->blank = 1;
+            } else if (ch != '\r') {
+                ck->blank = 0;
+            }
+            break;
+        }
+    }
+    return ck->state == CHUNK_BAD ? n : i;
+}
+
+/*
+ * response_vary_encoding - Whether resp is one the compressor may make
+ *     variants of but does not yet say so, in which case the identity
+ *     response needs VARY_ENCODING_HDR as much as the variants do
+ */
+int response_vary_encoding(const http_response_t *resp)
+{
+    return http_compression && resp->status == 200 && resp->compressible && !resp->encoded &&
+           !resp->varies && !resp->vary_encoding && !resp->no_transform && !resp->chunked &&
+           (resp->content_length < 0 || (size_t)resp->content_length >= http_compression);
+}
+
+/*
+ * connection_hdr - The Connection header the proxy sends the client at
+ *     the end of a response head.
+ */
+const char *connection_hdr(int keepalive)
+{
+    return keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
+/*
+ * rewrite_response_head - Parse the response head in the first len
+ *     bytes of head, blank line included, into resp and write the head
+ *     the client gets to out: the status line and end-to-end headers,
+ *     *hdr_len bytes in all, then the proxy's Connection header and the
+ *     blank line. *keepalive is cleared unless the response delimits
+ *     itself. out needs room for len + MAXLINE bytes. Returns the
+ *     number of bytes written to out.
+ */
+size_t rewrite_response_head(const char *head, size_t len, http_response_t *resp,
+                             int *keepalive, char *out, int *hdr_len)
+{
+    char buf[MAXLINE];
+    const char *p = head;
+    const char *end = head + len - 2; /* Up to the blank line */
+    const char *conn;
+    size_t out_len = 0;
+    int first = 1;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = nl ? (size_t)(nl - p + 1) : (size_t)(end - p);
+        char *line = head_line(p, n, buf);
+        int forward = 1;
+
+        if (first) {
+            parse_status_line(line, resp);
+            first = 0;
+        } else {
+            parse_response_header(line, resp);
+            forward = response_header_forwarded(line);
+        }
+        if (forward) {
+            memcpy(out + out_len, p, n);
+            out_len += n;
+        }
+        if (line != buf) {
+            Free(line);
+        }
+        p += n;
+    }
+    if (response_vary_encoding(resp)) {
+        memcpy(out + out_len, VARY_ENCODING_HDR, strlen(VARY_ENCODING_HDR));
+        out_len += strlen(VARY_ENCODING_HDR);
+    }
+    *hdr_len = (int)out_len;
+
+    *keepalive = *keepalive && response_delimited(resp);
+    conn = connection_hdr(*keepalive);
+    memcpy(out + out_len, conn, strlen(conn));
+    out_len += strlen(conn);
+    memcpy(out + out_len, "\r\n", 2);
+    return out_len + 2;
+}
+
+/*
+ * cached_head_hdrs - The headers served after a cached head: the
+ *     proxy's Connection header and, if the origin delimited the body
+ *     by closing, a Content-Length for the body_len bytes it sent.
+ *     body_len is -1 if that body is still arriving. Returns the number
+ *     of bytes written to buf.
+ */
+int cached_head_hdrs(char *buf, size_t size, int delimited, long long body_len, int keepalive)
+{
+    if (delimited || body_len < 0) {
+        return snprintf(buf, size, "%s", connection_hdr(keepalive));
+    }
+    return snprintf(buf, size, "Content-Length: %lld\r\n%s", body_len, connection_hdr(keepalive));
+}
@@ -0,0 +1,173 @@
+/*
+ * http.h - HTTP request parsing and rewriting shared by the proxy engines
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* Room for the headers cached_head_hdrs() adds to a cached head */
+#define MAX_CACHED_HDRS 96
+
+/* Room for the conditional headers conditional_hdrs() writes */
+#define MAX_CONDITIONAL_HDRS 1024
+
+/* Freshness of responses that state none, the default for -T */
+#define HTTP_DEFAULT_TTL 300
+
+/*
+ * How long past expiry a stale response may still be served while it is
+ * revalidated in the background, the default for -W
+ */
+#define HTTP_DEFAULT_GRACE 10
+
+/* Longest lifetime guessed from a response's Last-Modified */
+#define HTTP_MAX_HEURISTIC_TTL 86400
+
+/* How long a persistent client connection may sit idle between requests */
+#define KEEPALIVE_TIMEOUT_MS 5000
+
+/* Longest request head either engine buffers */
+#define HTTP_MAX_HEAD 40960
+
+/* Most forwarded headers kept from one request; later ones are dropped */
+#define HTTP_MAX_HEADERS 128
+
+/* Most iovecs build_request_iov() describes an origin request with */
+#define REQUEST_IOV_MAX (HTTP_MAX_HEADERS + 12)
+
+/* Content codings cached responses can be stored compressed with */
+enum {
+    HTTP_ENC_GZIP,
+    HTTP_ENC_BR,
+    HTTP_NENCODINGS
+};
+
+/* The header every response that may have compressed variants carries */
+#define VARY_ENCODING_HDR "Vary: Accept-Encoding\r\n"
+
+/* A run of bytes in a buffer, not NUL terminated */
+typedef struct {
+    const char *p;
+    size_t len;
+} http_span_t;
+
+/* Header names http_header_id() recognizes */
+enum {
+    HDR_OTHER,
+    HDR_HOST,
+    HDR_USER_AGENT,
+    HDR_CONNECTION,
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_CONTENT_LENGTH,
+    HDR_TRANSFER_ENCODING,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_NONE_MATCH,
+    HDR_ACCEPT_ENCODING
+};
+
+typedef struct {
+    int id;
+    http_span_t value;         /* Without surrounding blanks */
+    http_span_t line;          /* The whole line, line end included */
+} http_header_t;
+
+/* A parsed request head; every span points into the parsed buffer */
+typedef struct {
+    http_span_t method;
+    http_span_t uri;
+    http_span_t version;
+    int keepalive;             /* After the version and connection headers */
+    http_span_t host;          /* The Host header's value, empty if none */
+    int accept_encodings;      /* 1 << HTTP_ENC_* for each coding it takes */
+    int nheaders;
+    http_header_t headers[HTTP_MAX_HEADERS]; /* Those forwarded to the origin */
+} http_request_t;
+
+/* Framing and connection state of an origin response */
+typedef struct {
+    int status;
+    int http11;                /* Origin answered with HTTP/1.1 or later */
+    int chunked;               /* Transfer-Encoding: chunked */
+    long long content_length;  /* -1 if absent */
+    int conn_close;            /* Connection: close */
+    int conn_keepalive;        /* Connection: keep-alive */
+
+    /* What the cache needs to know, times in seconds since the epoch */
+    int no_store;              /* Cache-Control: no-store or private */
+    int no_cache;              /* Cache-Control: no-cache */
+    int must_revalidate;       /* must-revalidate or proxy-revalidate */
+    long long max_age;         /* Cache-Control: max-age, -1 if absent */
+    long long s_maxage;        /* Cache-Control: s-maxage, -1 if absent */
+    long long swr;             /* stale-while-revalidate, -1 if absent */
+    long long date;            /* These three are -1 if absent */
+    long long expires;         /* 0 if present but not a date */
+    long long last_modified;
+    long long age;             /* Age, -1 if absent */
+
+    /* Whether the proxy may compress it */
+    int no_transform;          /* Cache-Control: no-transform */
+    int encoded;               /* Content-Encoding other than identity */
+    int varies;                /* Vary on more than Accept-Encoding */
+    int vary_encoding;         /* Vary names Accept-Encoding */
+    int compressible;          /* Content-Type is text of some kind */
+} http_response_t;
+
+/* States of chunked_scan() */
+enum {
+    CHUNK_SIZE,                /* In a chunk-size line's digits */
+    CHUNK_EXT,                 /* In the rest of that line */
+    CHUNK_DATA,
+    CHUNK_DATA_END,            /* The line end after a chunk's data */
+    CHUNK_TRAILER,             /* After the last chunk, up to the blank line */
+    CHUNK_DONE,                /* The body is complete */
+    CHUNK_BAD                  /* Not chunked after all; it ends at EOF */
+};
+
+/* Where a chunked body ends, found as the body streams past */
+typedef struct {
+    int state;
+    int digits;                /* Of the chunk size read so far */
+    long long left;            /* Chunk size, then data bytes still to come */
+    int blank;                 /* The trailer line so far is empty */
+} http_chunked_t;
+
+void http_init(void);
+void http_set_default_ttl(long long secs);
+void http_set_default_grace(long long secs);
+void http_set_compression(size_t min_size);
+const char *http_find_lf(const char *p, const char *end);
+int http_header_id(const char *name, size_t len);
+int http_parse_request(const char *buf, size_t len, http_request_t *req);
+int read_request(rio_t *rp, http_request_t *req, char **spill);
+void http_span_copy(char *dst, size_t size, http_span_t s);
+
+int starts_with_icase(const char *s, const char *prefix);
+void parse_uri(const char *uri, char *hostname, char *port, char *path);
+void build_cache_key(char *key, const char *hostname, const char *port, const char *path);
+void normalize_host_from_header(const char *host_hdr, char *hostname, char *port);
+int build_request_iov(struct iovec *iov, const char *hostname, const char *port,
+                      const char *path, const http_request_t *req, int keepalive,
+                      const char *cond);
+int parse_status_line(const char *line, http_response_t *resp);
+void parse_response_header(const char *line, http_response_t *resp);
+int response_header_forwarded(const char *line);
+int response_has_body(const http_response_t *resp);
+int response_delimited(const http_response_t *resp);
+int response_keepalive(const http_response_t *resp);
+long long response_expires(const http_response_t *resp);
+long long response_grace(const http_response_t *resp);
+void parse_response_head(const char *head, size_t len, http_response_t *resp);
+void response_update(http_response_t *stored, const http_response_t *resp);
+size_t revalidated_head(const char *stored, size_t slen, const char *fresh, size_t flen,
+                        char *out);
+size_t conditional_hdrs(const char *head, size_t len, char *buf, size_t size);
+int response_vary_encoding(const http_response_t *resp);
+size_t chunked_scan(http_chunked_t *ck, const char *p, size_t n);
+const char *connection_hdr(int keepalive);
+size_t rewrite_response_head(const char *head, size_t len, http_response_t *resp,
+                             int *keepalive, char *out, int *hdr_len);
+int cached_head_hdrs(char *buf, size_t size, int delimited, long long body_len, int keepalive);
+
+#endif /* __HTTP_H__ */
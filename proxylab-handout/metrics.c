@@ -0,0 +1,347 @@
+/*
+ * metrics.c - per-thread counters and stage latency histograms
+ *
+ * Every thread that records anything gets its own block of counters
+ * and histograms, linked once into a global list. Only its thread
+ * writes a block, with relaxed loads and stores rather than locked
+ * increments, so recording costs a clock read and a few stores to a
+ * cache line no other thread writes. A scrape adds the blocks up as it
+ * finds them; it may see one counter a few updates ahead of another.
+ *
+ * The histograms are log-linear, in the manner of HDR histograms:
+ * nanosecond values fall into HIST_SUB buckets per power of two, so no
+ * bucket is wider than an eighth of its lower bound. Prometheus gets
+ * cumulative buckets at the powers of two from about 1us to a minute,
+ * and quantiles read from the finer buckets.
+ */
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "csapp.h"
+#include "cache.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)    /* Up to 2^41ns, about 40 minutes */
+#define HIST_EXPORT_MIN 10              /* Exported buckets, 2^10ns = 1.02us */
+#define HIST_EXPORT_MAX 36              /* to 2^36ns = 68.7s */
+
+typedef struct metrics_block {
+    atomic_ullong buckets[METRIC_NSTAGES][HIST_BUCKETS];
+    atomic_ullong sum[METRIC_NSTAGES];  /* Nanoseconds */
+    atomic_ullong counters[METRIC_NCOUNTERS];
+    struct metrics_block *next;
+} metrics_block_t;
+
+static const char *stage_names[METRIC_NSTAGES] = {
+    "parse", "cache_lookup", "connect", "first_byte", "relay", "total"
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_block_t *metrics_blocks = NULL;
+static __thread metrics_block_t *metrics_self = NULL;
+
+/* The calling thread's block, made and linked on first use */
+static metrics_block_t *metrics_block(void)
+{
+    metrics_block_t *b = metrics_self;
+
+    if (!b) {
+        b = Calloc(1, sizeof(metrics_block_t));
+        pthread_mutex_lock(&metrics_lock);
+        b->next = metrics_blocks;
+        metrics_blocks = b;
+        pthread_mutex_unlock(&metrics_lock);
+        metrics_self = b;
+    }
+    return b;
+}
+
+/* Add n to a counter only this thread writes */
+static void bump(atomic_ullong *v, unsigned long long n)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static int hist_bucket(unsigned long long v)
+{
+    int e, i;
+
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    e = 63 - __builtin_clzll(v);
+    i = (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/* The first value past bucket i */
+static unsigned long long hist_upper(int i)
+{
+    if (i < HIST_SUB) {
+        return i + 1;
+    }
+    return (unsigned long long)(HIST_SUB + (i & (HIST_SUB - 1)) + 1) << (i / HIST_SUB - 1);
+}
+
+/* metrics_now - Monotonic nanoseconds */
+long long metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * metrics_since - Record that stage took from start until now, and
+ *     return now, which is where the next stage starts
+ */
+long long metrics_since(int stage, long long start)
+{
+    metrics_block_t *b = metrics_block();
+    long long now = metrics_now();
+    unsigned long long ns = now > start ? (unsigned long long)(now - start) : 0;
+
+    bump(&b->buckets[stage][hist_bucket(ns)], 1);
+    bump(&b->sum[stage], ns);
+    trace_stage(stage, (long long)ns);
+    return now;
+}
+
+/* metrics_stage_name - The name stage is exported under */
+const char *metrics_stage_name(int stage)
+{
+    return stage_names[stage];
+}
+
+void metrics_count(int counter)
+{
+    bump(&metrics_block()->counters[counter], 1);
+}
+
+/* metrics_request - Whether req asks for the proxy's own metrics */
+int metrics_request(const http_request_t *req)
+{
+    size_t n = sizeof(METRICS_PATH) - 1;
+
+    return req->uri.len >= n && !memcmp(req->uri.p, METRICS_PATH, n) &&
+           (req->uri.len == n || req->uri.p[n] == '?');
+}
+
+/*
+ * Rendering
+ */
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} text_t;
+
+static void text_printf(text_t *t, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void text_printf(text_t *t, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+        if ((size_t)n < t->cap - t->len) {
+            break;
+        }
+        t->cap = t->cap * 2 > t->len + n + 1 ? t->cap * 2 : t->len + n + 1;
+        t->buf = Realloc(t->buf, t->cap);
+    }
+    t->len += n;
+}
+
+static void text_metric(text_t *t, const char *name, const char *type, const char *help,
+                        unsigned long long value)
+{
+    text_printf(t, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+                value);
+}
+
+static unsigned long long load(atomic_ullong *v)
+{
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+static void render_stages(text_t *t, metrics_block_t *blocks)
+{
+    unsigned long long (*counts)[HIST_BUCKETS] = Calloc(METRIC_NSTAGES, sizeof(*counts));
+    unsigned long long sums[METRIC_NSTAGES], total[METRIC_NSTAGES];
+    metrics_block_t *b;
+    int s, i, e;
+
+    memset(sums, 0, sizeof(sums));
+    memset(total, 0, sizeof(total));
+    for (b = blocks; b; b = b->next) {
+        for (s = 0; s < METRIC_NSTAGES; s++) {
+            for (i = 0; i < HIST_BUCKETS; i++) {
+                unsigned long long n = load(&b->buckets[s][i]);
+
+                counts[s][i] += n;
+                total[s] += n;
+            }
+            sums[s] += load(&b->sum[s]);
+        }
+    }
+
+    text_printf(t, "# HELP proxy_stage_duration_seconds Time spent in each stage of a "
+                "request.\n# TYPE proxy_stage_duration_seconds histogram\n");
+    for (s = 0; s < METRIC_NSTAGES; s++) {
+        unsigned long long below = 0;
+
+        i = 0;
+        for (e = HIST_EXPORT_MIN; e <= HIST_EXPORT_MAX; e++) {
+            for (; i < hist_bucket(1ULL << e); i++) {
+                below += counts[s][i];
+            }
+            text_printf(t, "proxy_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                        stage_names[s], (double)(1ULL << e) / 1e9, below);
+        }
+        text_printf(t, "proxy_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                    "proxy_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+                    "proxy_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                    stage_names[s], total[s], stage_names[s], sums[s] / 1e9,
+                    stage_names[s], total[s]);
+    }
+
+    text_printf(t, "# HELP proxy_stage_duration_quantile_seconds Upper bound of the "
+                "bucket holding each quantile of a stage's durations.\n"
+                "# TYPE proxy_stage_duration_quantile_seconds gauge\n");
+    for (s = 0; s < METRIC_NSTAGES; s++) {
+        for (e = 0; e < (int)(sizeof(quantiles) / sizeof(quantiles[0])); e++) {
+            unsigned long long rank = (unsigned long long)(quantiles[e] * total[s] + 0.999999);
+            unsigned long long seen = 0;
+
+            for (i = 0; i < HIST_BUCKETS - 1 && seen + counts[s][i] < rank; i++) {
+                seen += counts[s][i];
+            }
+            text_printf(t, "proxy_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} "
+                        "%.9g\n", stage_names[s], quantiles[e],
+                        total[s] ? hist_upper(i) / 1e9 : 0.0);
+        }
+    }
+    Free(counts);
+}
+
+/*
+ * metrics_response - A Malloc()ed HTTP response carrying every metric
+ *     in Prometheus text format, *len bytes long
+ */
+char *metrics_response(int keepalive, size_t *len)
+{
+    unsigned long long counters[METRIC_NCOUNTERS];
+    text_t body = { NULL, 0, 0 }, resp = { NULL, 0, 0 };
+    metrics_block_t *blocks, *b;
+    cache_stats_t st;
+    int i;
+
+    pthread_mutex_lock(&metrics_lock);
+    blocks = metrics_blocks;
+    pthread_mutex_unlock(&metrics_lock);
+
+    /* Closes first, so a connection is never counted closed but not open */
+    memset(counters, 0, sizeof(counters));
+    for (b = blocks; b; b = b->next) {
+        counters[METRIC_CONNS_CLOSED] += load(&b->counters[METRIC_CONNS_CLOSED]);
+    }
+    for (b = blocks; b; b = b->next) {
+        for (i = 0; i < METRIC_NCOUNTERS; i++) {
+            if (i != METRIC_CONNS_CLOSED) {
+                counters[i] += load(&b->counters[i]);
+            }
+        }
+    }
+
+    text_metric(&body, "proxy_requests_total", "counter", "Requests parsed from clients.",
+                counters[METRIC_REQUESTS]);
+    text_metric(&body, "proxy_client_connections_total", "counter",
+                "Client connections accepted.", counters[METRIC_CONNS_OPENED]);
+    text_metric(&body, "proxy_client_connections", "gauge", "Client connections open.",
+                counters[METRIC_CONNS_OPENED] - counters[METRIC_CONNS_CLOSED]);
+    text_metric(&body, "proxy_origin_connect_failures_total", "counter",
+                "Requests for which no origin connection could be made.",
+                counters[METRIC_CONNECT_FAILED]);
+    text_metric(&body, "proxy_shed_connections_total", "counter",
+                "Connections answered 503 because too many were open.",
+                counters[METRIC_SHED_CONNS]);
+    text_metric(&body, "proxy_shed_queued_total", "counter",
+                "Connections answered 503 because they waited past the queue target.",
+                counters[METRIC_SHED_QUEUED]);
+    text_metric(&body, "proxy_shed_fetches_total", "counter",
+                "Misses answered 503 because too many origin fetches were in flight.",
+                counters[METRIC_SHED_FETCHES]);
+    text_metric(&body, "proxy_rate_limited_total", "counter",
+                "Requests answered 429 because their client was over its rate.",
+                counters[METRIC_RATE_LIMITED]);
+    text_metric(&body, "proxy_origin_connect_timeouts_total", "counter",
+                "Connects to an origin address given up on after the timeout.",
+                counters[METRIC_CONNECT_TIMEOUTS]);
+    text_metric(&body, "proxy_origin_circuits_opened_total", "counter",
+                "Times an origin address failed often enough to be avoided.",
+                counters[METRIC_ORIGIN_BROKEN]);
+    text_metric(&body, "proxy_trace_dropped_total", "counter",
+                "Access log records dropped because their thread's ring was full.",
+                counters[METRIC_TRACE_DROPPED]);
+
+    cache_get_stats(&st);
+    text_metric(&body, "proxy_cache_lookups_total", "counter",
+                "Requests that consulted the cache.", st.lookups);
+    text_metric(&body, "proxy_cache_hits_total", "counter", "Requests served from the cache.",
+                st.hits);
+    text_metric(&body, "proxy_cache_misses_total", "counter",
+                "Requests the cache could not serve.", st.lookups - st.hits);
+    text_metric(&body, "proxy_cache_disk_hits_total", "counter",
+                "Hits found only in the disk tier.", st.disk_hits);
+    text_metric(&body, "proxy_cache_revalidations_total", "counter",
+                "Stale objects checked with the origin.", st.revalidations);
+    text_metric(&body, "proxy_cache_not_modified_total", "counter",
+                "Revalidations the origin answered with 304 Not Modified.", st.not_modified);
+    text_metric(&body, "proxy_cache_refreshes_total", "counter",
+                "Objects refreshed in the background.", st.refreshes);
+    text_metric(&body, "proxy_cache_stale_hits_total", "counter",
+                "Hits served stale while a refresh ran.", st.stale_hits);
+    text_metric(&body, "proxy_cache_variants_total", "counter",
+                "Compressed variants stored.", st.variants);
+    text_metric(&body, "proxy_cache_variant_hits_total", "counter",
+                "Hits served from a compressed variant.", st.variant_hits);
+    text_metric(&body, "proxy_cache_l1_hits_total", "counter",
+                "Hits answered by a thread's own L1 without the shared cache.", st.l1_hits);
+    text_metric(&body, "proxy_cache_evictions_total", "counter", "Objects evicted.",
+                st.evictions);
+    text_metric(&body, "proxy_cache_rejected_total", "counter",
+                "Misses the replacement policy did not admit.", st.rejected);
+    text_metric(&body, "proxy_cache_hit_bytes_total", "counter",
+                "Response bytes served from the cache.", st.bytes_hit);
+    text_metric(&body, "proxy_cache_miss_bytes_total", "counter",
+                "Response bytes fetched on misses.", st.bytes_missed);
+    text_metric(&body, "proxy_cache_entries", "gauge", "Objects in the cache.", st.entries);
+    text_metric(&body, "proxy_cache_bytes", "gauge", "Bytes the cache holds.", st.bytes);
+    text_metric(&body, "proxy_cache_capacity_bytes", "gauge", "The cache's budget.",
+                st.capacity);
+
+    render_stages(&body, blocks);
+
+    text_printf(&resp, "HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\n%s\r\n", body.len, connection_hdr(keepalive));
+    resp.buf = Realloc(resp.buf, resp.len + body.len);
+    memcpy(resp.buf + resp.len, body.buf, body.len);
+    resp.len += body.len;
+    Free(body.buf);
+    *len = resp.len;
+    return resp.buf;
+}
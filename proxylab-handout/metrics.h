@@ -0,0 +1,46 @@
+/*
+ * metrics.h - per-thread counters and stage latency histograms
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "http.h"
+
+/* The request path the proxy answers itself with its metrics */
+#define METRICS_PATH "/__proxy/metrics"
+
+/* Stages of a request, each with its own latency histogram */
+enum {
+    METRIC_PARSE,              /* Parsing the request head */
+    METRIC_LOOKUP,             /* Looking the object up in the cache */
+    METRIC_CONNECT,            /* Resolving and connecting to the origin */
+    METRIC_FIRST_BYTE,         /* Connected until the response starts */
+    METRIC_RELAY,              /* Relaying the response to the client */
+    METRIC_TOTAL,              /* Parsed request until response sent */
+    METRIC_NSTAGES
+};
+
+/* Counters, summed over threads */
+enum {
+    METRIC_REQUESTS,
+    METRIC_CONNS_OPENED,       /* Client connections */
+    METRIC_CONNS_CLOSED,
+    METRIC_CONNECT_FAILED,     /* Requests no origin connection was made for */
+    METRIC_SHED_CONNS,         /* Connections over the cap, see admit.c */
+    METRIC_SHED_QUEUED,        /* Connections that waited too long */
+    METRIC_SHED_FETCHES,       /* Misses over the fetch cap */
+    METRIC_RATE_LIMITED,       /* Requests over their client's rate */
+    METRIC_CONNECT_TIMEOUTS,   /* Origin connects that timed out */
+    METRIC_ORIGIN_BROKEN,      /* Origin addresses whose circuit opened */
+    METRIC_TRACE_DROPPED,      /* Trace records a full ring turned away */
+    METRIC_NCOUNTERS
+};
+
+long long metrics_now(void);
+long long metrics_since(int stage, long long start);
+const char *metrics_stage_name(int stage);
+void metrics_count(int counter);
+int metrics_request(const http_request_t *req);
+char *metrics_response(int keepalive, size_t *len);
+
+#endif /* __METRICS_H__ */
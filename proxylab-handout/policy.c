@@ -0,0 +1,380 @@
+/*
+ * policy.c - CLOCK, TinyLFU and S3-FIFO replacement for the cache
+ *
+ * clock    The default. A hit sets the object's reference bit; the
+ *          hand sweeps the ring, clearing bits and evicting the first
+ *          object whose bit is already clear. It approximates LRU
+ *          without relinking anything on a hit.
+ *
+ * tinylfu  CLOCK eviction behind a TinyLFU admission filter. Every
+ *          lookup is counted in a per-shard count-min sketch of 4-bit
+ *          counters that are halved every few samples per counter, so
+ *          old popularity fades. When a miss would need an eviction
+ *          it is only admitted if it has been asked for more often
+ *          than the object the hand would evict, so a scan of unique
+ *          URLs passes through without flushing the working set.
+ *
+ * s3fifo   S3-FIFO: new objects enter a small FIFO holding about a
+ *          tenth of the shard and are evicted from it unless they are
+ *          hit there, which promotes them to the main FIFO. Objects
+ *          leaving the main FIFO are reinserted while their 2-bit hit
+ *          count lasts. A ghost table remembers hashes evicted from
+ *          the small FIFO, so a quick return goes straight to main.
+ *
+ * Hits only touch per-object and sketch counters with relaxed atomics,
+ * so lookups still share the shard's read lock.
+ */
+#include "csapp.h"
+#include "policy.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15          /* 4-bit counters */
+#define SKETCH_RESET 10        /* Halve after this many samples per counter */
+#define TINYLFU_CANDIDATES 8   /* Objects from the hand an admission looks at */
+
+#define S3_SMALL 0
+#define S3_MAIN 1
+#define S3_MAX_FREQ 3
+
+static int obj_filling(cache_object_t *obj)
+{
+    return atomic_load_explicit(&obj->state, memory_order_relaxed) == CACHE_FILLING;
+}
+
+/* Smallest power of two of at least n */
+static size_t pow2_at_least(size_t n)
+{
+    size_t p = 1;
+
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/*
+ * CLOCK
+ */
+
+static void clock_init(cache_shard_t *s)
+{
+    s->hand = NULL;
+}
+
+/* Link obj into the ring just behind the hand, the last spot swept */
+static void clock_insert(cache_shard_t *s, cache_object_t *obj)
+{
+    if (!s->hand) {
+        obj->prev = obj;
+        obj->next = obj;
+        s->hand = obj;
+        return;
+    }
+    obj->next = s->hand;
+    obj->prev = s->hand->prev;
+    s->hand->prev->next = obj;
+    s->hand->prev = obj;
+}
+
+static void clock_remove(cache_shard_t *s, cache_object_t *obj)
+{
+    if (obj->next == obj) {
+        s->hand = NULL;
+    } else {
+        obj->prev->next = obj->next;
+        obj->next->prev = obj->prev;
+        if (s->hand == obj) {
+            s->hand = obj->next;
+        }
+    }
+    obj->prev = NULL;
+    obj->next = NULL;
+}
+
+static void clock_hit(cache_shard_t *s, cache_object_t *obj)
+{
+    if (!atomic_load_explicit(&obj->freq, memory_order_relaxed)) {
+        atomic_store_explicit(&obj->freq, 1, memory_order_relaxed);
+    }
+}
+
+static cache_object_t *clock_evict(cache_shard_t *s)
+{
+    size_t skipped = 0;
+
+    while (s->hand && skipped <= 2 * s->nentries) {
+        cache_object_t *obj = s->hand;
+
+        if (obj_filling(obj) ||
+            atomic_exchange_explicit(&obj->freq, 0, memory_order_relaxed)) {
+            s->hand = obj->next;
+            skipped++;
+            continue;
+        }
+        return obj;
+    }
+    return NULL;
+}
+
+/*
+ * TinyLFU
+ */
+
+static void sketch_index(cache_shard_t *s, uint64_t hash, size_t idx[SKETCH_DEPTH])
+{
+    uint64_t h1 = hash * 0x9e3779b97f4a7c15ULL;
+    uint64_t h2 = (h1 >> 32) | 1;
+    int r;
+
+    for (r = 0; r < SKETCH_DEPTH; r++) {
+        idx[r] = r * (s->sketch_mask + 1) + ((h1 + r * h2) & s->sketch_mask);
+    }
+}
+
+static int sketch_estimate(cache_shard_t *s, uint64_t hash)
+{
+    size_t idx[SKETCH_DEPTH];
+    int r, min = SKETCH_MAX;
+
+    sketch_index(s, hash, idx);
+    for (r = 0; r < SKETCH_DEPTH; r++) {
+        int c = atomic_load_explicit(&s->sketch[idx[r]], memory_order_relaxed);
+        if (c < min) {
+            min = c;
+        }
+    }
+    return min;
+}
+
+/* Count one access, only raising the counters that hold the minimum */
+static void sketch_add(cache_shard_t *s, uint64_t hash)
+{
+    size_t width = s->sketch_mask + 1;
+    size_t idx[SKETCH_DEPTH];
+    int r, min;
+
+    sketch_index(s, hash, idx);
+    min = sketch_estimate(s, hash);
+    if (min < SKETCH_MAX) {
+        for (r = 0; r < SKETCH_DEPTH; r++) {
+            if (atomic_load_explicit(&s->sketch[idx[r]], memory_order_relaxed) == min) {
+                atomic_store_explicit(&s->sketch[idx[r]], min + 1, memory_order_relaxed);
+            }
+        }
+    }
+
+    if (atomic_fetch_add_explicit(&s->sketch_samples, 1, memory_order_relaxed) + 1 ==
+        SKETCH_RESET * width) {
+        size_t i;
+
+        /* Races with concurrent adds only blur counts a little */
+        for (i = 0; i < SKETCH_DEPTH * width; i++) {
+            int c = atomic_load_explicit(&s->sketch[i], memory_order_relaxed);
+            atomic_store_explicit(&s->sketch[i], c >> 1, memory_order_relaxed);
+        }
+        atomic_store_explicit(&s->sketch_samples, 0, memory_order_relaxed);
+    }
+}
+
+static void tinylfu_init(cache_shard_t *s)
+{
+    size_t width = pow2_at_least(s->capacity / 1024 > 256 ? s->capacity / 1024 : 256);
+
+    clock_init(s);
+    s->sketch = Calloc(SKETCH_DEPTH * width, sizeof(atomic_uchar));
+    s->sketch_mask = width - 1;
+    atomic_init(&s->sketch_samples, 0);
+}
+
+static void tinylfu_hit(cache_shard_t *s, cache_object_t *obj)
+{
+    clock_hit(s, obj);
+    sketch_add(s, obj->hash);
+}
+
+static void tinylfu_miss(cache_shard_t *s, uint64_t hash)
+{
+    sketch_add(s, hash);
+}
+
+/*
+ * tinylfu_admit - Admit hash only if it is more popular than the object
+ *     the hand would evict next. Only the TINYLFU_CANDIDATES objects at
+ *     the hand are looked at, as this runs under the write lock: the
+ *     first one without its reference bit, else the one the sketch
+ *     rates lowest, skipping any still being filled.
+ */
+static int tinylfu_admit(cache_shard_t *s, uint64_t hash)
+{
+    cache_object_t *obj = s->hand;
+    cache_object_t *victim = NULL;
+    int victim_est = 0;
+    size_t i;
+
+    for (i = 0; obj && i < s->nentries && i < TINYLFU_CANDIDATES; i++, obj = obj->next) {
+        int est;
+
+        if (obj_filling(obj)) {
+            continue;
+        }
+        est = sketch_estimate(s, obj->hash);
+        if (!atomic_load_explicit(&obj->freq, memory_order_relaxed)) {
+            victim = obj;
+            victim_est = est;
+            break;
+        }
+        if (!victim || est < victim_est) {
+            victim = obj;
+            victim_est = est;
+        }
+    }
+    return !victim || sketch_estimate(s, hash) > victim_est;
+}
+
+/*
+ * S3-FIFO
+ */
+
+static void fifo_push(cache_shard_t *s, int q, cache_object_t *obj)
+{
+    obj->queue = q;
+    obj->prev = NULL;
+    obj->next = s->fifo_head[q];
+    if (s->fifo_head[q]) {
+        s->fifo_head[q]->prev = obj;
+    } else {
+        s->fifo_tail[q] = obj;
+    }
+    s->fifo_head[q] = obj;
+    s->fifo_bytes[q] += obj->charged;
+}
+
+static void fifo_unlink(cache_shard_t *s, cache_object_t *obj)
+{
+    int q = obj->queue;
+
+    if (obj->prev) {
+        obj->prev->next = obj->next;
+    } else {
+        s->fifo_head[q] = obj->next;
+    }
+    if (obj->next) {
+        obj->next->prev = obj->prev;
+    } else {
+        s->fifo_tail[q] = obj->prev;
+    }
+    obj->prev = NULL;
+    obj->next = NULL;
+    s->fifo_bytes[q] -= obj->charged;
+}
+
+static void s3fifo_init(cache_shard_t *s)
+{
+    size_t nghost = pow2_at_least(s->capacity / 4096 > 256 ? s->capacity / 4096 : 256);
+
+    s->ghost = Calloc(nghost, sizeof(uint64_t));
+    s->ghost_mask = nghost - 1;
+}
+
+static void s3fifo_insert(cache_shard_t *s, cache_object_t *obj)
+{
+    uint64_t *g = &s->ghost[obj->hash & s->ghost_mask];
+
+    if (*g == obj->hash) {
+        *g = 0;
+        fifo_push(s, S3_MAIN, obj);
+    } else {
+        fifo_push(s, S3_SMALL, obj);
+    }
+}
+
+static void s3fifo_remove(cache_shard_t *s, cache_object_t *obj)
+{
+    fifo_unlink(s, obj);
+}
+
+static void s3fifo_charge(cache_shard_t *s, cache_object_t *obj, long long delta)
+{
+    s->fifo_bytes[obj->queue] += delta;
+}
+
+static void s3fifo_hit(cache_shard_t *s, cache_object_t *obj)
+{
+    int f = atomic_load_explicit(&obj->freq, memory_order_relaxed);
+
+    if (f < S3_MAX_FREQ) {
+        atomic_store_explicit(&obj->freq, f + 1, memory_order_relaxed);
+    }
+}
+
+/* Move obj to the head of queue q */
+static void fifo_requeue(cache_shard_t *s, int q, cache_object_t *obj)
+{
+    fifo_unlink(s, obj);
+    fifo_push(s, q, obj);
+}
+
+static cache_object_t *s3fifo_evict(cache_shard_t *s)
+{
+    size_t tries = 2 * s->nentries + 2;
+
+    while (tries-- > 0) {
+        int q = s->fifo_bytes[S3_SMALL] > s->capacity / 10 || !s->fifo_tail[S3_MAIN]
+                ? S3_SMALL : S3_MAIN;
+        cache_object_t *obj = s->fifo_tail[q];
+        int f;
+
+        if (!obj) {
+            return NULL;
+        }
+        if (q == S3_SMALL && obj_filling(obj) && s->fifo_tail[S3_MAIN]) {
+            /* Let a fill in progress sit in small while main gives way */
+            q = S3_MAIN;
+            obj = s->fifo_tail[q];
+        }
+        if (obj_filling(obj)) {
+            fifo_requeue(s, q, obj);
+            continue;
+        }
+
+        f = atomic_load_explicit(&obj->freq, memory_order_relaxed);
+        if (q == S3_SMALL) {
+            if (f > 0) {
+                atomic_store_explicit(&obj->freq, 0, memory_order_relaxed);
+                fifo_requeue(s, S3_MAIN, obj);
+                continue;
+            }
+            s->ghost[obj->hash & s->ghost_mask] = obj->hash;
+            return obj;
+        }
+        if (f > 0) {
+            atomic_store_explicit(&obj->freq, f - 1, memory_order_relaxed);
+            fifo_requeue(s, S3_MAIN, obj);
+            continue;
+        }
+        return obj;
+    }
+    return NULL;
+}
+
+static const cache_policy_t cache_policies[] = {
+    { "clock", clock_init, clock_insert, clock_remove, NULL, clock_hit, NULL, NULL,
+      clock_evict },
+    { "tinylfu", tinylfu_init, clock_insert, clock_remove, NULL, tinylfu_hit, tinylfu_miss,
+      tinylfu_admit, clock_evict },
+    { "s3fifo", s3fifo_init, s3fifo_insert, s3fifo_remove, s3fifo_charge, s3fifo_hit, NULL,
+      NULL, s3fifo_evict },
+};
+
+/* cache_policy_find - Look a policy up by name, NULL if unknown */
+const cache_policy_t *cache_policy_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(cache_policies) / sizeof(cache_policies[0]); i++) {
+        if (!strcmp(cache_policies[i].name, name)) {
+            return &cache_policies[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * policy.h - replacement and admission policies behind the cache
+ *
+ * Only cache.c and policy.c include this; the rest of the proxy picks
+ * a policy by name with cache_set_policy().
+ */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "cache.h"
+
+/* One independently locked slice of the cache */
+typedef struct cache_shard {
+    pthread_rwlock_t lock;
+    cache_object_t **buckets;
+    size_t nbuckets;           /* Always a power of two */
+    size_t nentries;
+    size_t bytes;              /* Slab bytes charged to indexed objects */
+    size_t capacity;
+    uint64_t generation;       /* Last one given to an indexed object */
+    const struct cache_policy *policy;
+
+    /* CLOCK ring, also used by TinyLFU */
+    cache_object_t *hand;      /* Next candidate, NULL if empty */
+
+    /* S3-FIFO: small and main queues, newest at the head */
+    cache_object_t *fifo_head[2];
+    cache_object_t *fifo_tail[2];
+    size_t fifo_bytes[2];
+    uint64_t *ghost;           /* Hashes recently evicted from small */
+    size_t ghost_mask;
+
+    /* TinyLFU: count-min sketch of recent accesses */
+    atomic_uchar *sketch;
+    size_t sketch_mask;
+    atomic_size_t sketch_samples;
+
+    atomic_ullong lookups;
+    atomic_ullong hits;
+    atomic_ullong bytes_hit;
+    atomic_ullong bytes_missed;
+    atomic_ullong evictions;
+    atomic_ullong rejected;
+    atomic_ullong disk_hits;
+    atomic_ullong revalidations;
+    atomic_ullong not_modified;
+    atomic_ullong refreshes;
+    atomic_ullong stale_hits;
+    atomic_ullong variants;
+    atomic_ullong variant_hits;
+} __attribute__((aligned(64))) cache_shard_t;
+
+/*
+ * A policy orders the objects of a shard for eviction and may refuse
+ * to admit new ones. Everything but hit() and miss() runs under the
+ * shard's write lock. hit() runs under the read lock, or with none for
+ * an object a thread's L1 holds, and miss() with no lock at all,
+ * concurrently with each other, so both may only use atomics. evict()
+ * must never pick an object that is still filling, and returns NULL
+ * when nothing can be evicted; the cache then removes the victim,
+ * calling remove().
+ */
+typedef struct cache_policy {
+    const char *name;
+    void (*init)(cache_shard_t *s);
+    void (*insert)(cache_shard_t *s, cache_object_t *obj);
+    void (*remove)(cache_shard_t *s, cache_object_t *obj);
+    void (*charge)(cache_shard_t *s, cache_object_t *obj, long long delta);
+    void (*hit)(cache_shard_t *s, cache_object_t *obj);
+    void (*miss)(cache_shard_t *s, uint64_t hash);
+    int (*admit)(cache_shard_t *s, uint64_t hash);
+    cache_object_t *(*evict)(cache_shard_t *s);
+} cache_policy_t;
+
+const cache_policy_t *cache_policy_find(const char *name);
+
+#endif /* __POLICY_H__ */
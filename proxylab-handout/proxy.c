@@ -1,433 +1,1401 @@
+#define _GNU_SOURCE
+#include <poll.h>
 #include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "sbuf.h"
+#include "http.h"
+#include "event.h"
+#include "uring.h"
+#include "upstream.h"
+#include "balance.h"
+#include "dns.h"
+#include "disk.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "refresh.h"
+#include "compress.h"
+#include "admit.h"
+#include "trace.h"
+#include "config.h"
+#include "handoff.h"
+
+/* Default worker pool and connection queue sizes */
+#define NTHREADS_DEFAULT 32
+#define SBUFSIZE_DEFAULT 256
+
+/* The I/O engines -e selects from */
+enum {
+    ENGINE_THREADS,
+    ENGINE_EPOLL,
+    ENGINE_URING
+};
+
+/* How often an idle persistent connection checks for queued connections */
+#define KEEPALIVE_POLL_MS 100
+
+/* Stack size of the worker threads, see request_ctx_t */
+#define WORKER_STACK_SIZE (64 * 1024)
+
+/*
+ * One listening socket and the workers it feeds. Without -a there is a
+ * single acceptor running on the main thread; with -a N each acceptor
+ * owns an SO_REUSEPORT socket, its own queue and nthreads/N workers.
+ */
+typedef struct {
+    int listenfd;
+    sbuf_t connq;              /* Connected descriptors waiting for a worker */
+    int cpu;                   /* CPU its threads are pinned to, or -1 */
+    pthread_t tid;
+} acceptor_t;
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* The threaded engine's acceptors, once they all run, for a handoff */
+static acceptor_t *acceptors_running = NULL;
+static int nacceptors_running = 0;
 
-/* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr =
-    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
-    "Gecko/20120305 Firefox/10.0.3\r\n";
+/* rio_attach - Give rp a read buffer from the pool unless it has one */
+static void rio_attach(rio_t *rp)
+{
+    char *buf;
+    size_t size;
 
-typedef struct cache_entry {
-    char *key;
-    char *data;
-    int size;
-    struct cache_entry *prev;
-    struct cache_entry *next;
-} cache_entry_t;
+    if (!rp->rio_buf) {
+        buf = bufpool_get(bufpool_min(), &size);
+        rio_setbuf(rp, buf, size);
+    }
+}
 
-static cache_entry_t *cache_head = NULL;
-static cache_entry_t *cache_tail = NULL;
-static int cache_bytes = 0;
-static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* rio_release - Give rp's read buffer back, dropping anything unread */
+static void rio_release(rio_t *rp)
+{
+    size_t size = rp->rio_bufsize;
 
-static void cache_move_to_front(cache_entry_t *entry)
+    rp->rio_cnt = 0;
+    bufpool_put(rio_setbuf(rp, NULL, 0), size);
+}
+
+/* Response bytes on their way to the client and the object being filled */
+typedef struct {
+    int clientfd;              /* -1 when only the cache is filled */
+    char *out;                 /* Pending output, flushed when full */
+    size_t out_len;
+    size_t out_cap;            /* Grows while the body keeps filling it */
+    cache_object_t *obj;       /* Cache object to fill, or NULL */
+    size_t objsize;            /* Bytes given to obj so far */
+    int keepalive;             /* Client wants, and then gets, persistence */
+    cache_object_t *hit;       /* Stale object a 304 confirmed, to serve */
+} relay_t;
+
+/*
+ * What serving one request needs, kept off the stack so that workers
+ * run with WORKER_STACK_SIZE stacks. Every thread that serves requests
+ * or refreshes objects reuses one of its own, made on first use; a
+ * request only touches the parts it needs, so the rest stays unbacked.
+ */
+typedef struct {
+    http_request_t req;
+    char uri[MAXLINE];
+    char hostname[MAXLINE];
+    char port[MAXLINE];
+    char path[MAXLINE];
+    char host_hdr[MAXLINE];
+    char cache_key[MAXLINE];
+    char cond[MAX_CONDITIONAL_HDRS];
+    struct iovec iov[REQUEST_IOV_MAX];     /* The request for the origin */
+    int iovcnt;
+    struct iovec send[REQUEST_IOV_MAX];    /* What is left of it to send */
+    char line[MAXLINE];                    /* The origin's response lines */
+    uint64_t client;                       /* Rate limit key, see admit.c */
+    trace_record_t trace;                  /* The request's access log record */
+} request_ctx_t;
+
+static __thread request_ctx_t *request_self = NULL;
+
+/* The calling thread's request context */
+static request_ctx_t *request_ctx(void)
 {
-    if (!entry || entry == cache_head) {
-        return;
+    if (!request_self) {
+        request_self = Malloc(sizeof(request_ctx_t));
+        memset(&request_self->trace, 0, sizeof(request_self->trace));
     }
+    return request_self;
+}
 
-    if (entry->prev) {
-        entry->prev->next = entry->next;
-    }
-    if (entry->next) {
-        entry->next->prev = entry->prev;
-    }
-    if (entry == cache_tail) {
-        cache_tail = entry->prev;
+static int relay_flush(relay_t *r)
+{
+    if (r->out_len > 0 && r->clientfd >= 0 && rio_writen(r->clientfd, r->out, r->out_len) < 0) {
+        return -1;
     }
+    trace_bytes(r->out_len);
+    r->out_len = 0;
+    return 0;
+}
 
-    entry->prev = NULL;
-    entry->next = cache_head;
-    if (cache_head) {
-        cache_head->prev = entry;
+/* relay_commit - Account for n new bytes at the end of r->out */
+static int relay_commit(relay_t *r, size_t n)
+{
+    if (r->obj) {
+        cache_fill_append(r->obj, r->out + r->out_len, n);
+        r->objsize += n;
     }
-    cache_head = entry;
-    if (!cache_tail) {
-        cache_tail = entry;
+    r->out_len += n;
+    if (r->out_len == r->out_cap) {
+        if (relay_flush(r) < 0) {
+            return -1;
+        }
+        bufpool_grow(&r->out, &r->out_cap);
     }
+    return 0;
 }
 
-static void cache_remove_entry(cache_entry_t *entry)
+static int relay_emit(relay_t *r, const char *data, size_t n)
 {
-    if (!entry) {
-        return;
-    }
+    while (n > 0) {
+        size_t m = r->out_cap - r->out_len;
 
-    if (entry->prev) {
-        entry->prev->next = entry->next;
-    } else {
-        cache_head = entry->next;
+        if (m > n) {
+            m = n;
+        }
+        memcpy(r->out + r->out_len, data, m);
+        if (relay_commit(r, m) < 0) {
+            return -1;
+        }
+        data += m;
+        n -= m;
     }
+    return 0;
+}
 
-    if (entry->next) {
-        entry->next->prev = entry->prev;
-    } else {
-        cache_tail = entry->prev;
-    }
+/* relay_emit_hop - Emit bytes meant for this client only, not the cache */
+static int relay_emit_hop(relay_t *r, const char *data, size_t n)
+{
+    cache_object_t *obj = r->obj;
+    int rc;
 
-    cache_bytes -= entry->size;
-    Free(entry->key);
-    Free(entry->data);
-    Free(entry);
+    r->obj = NULL;
+    rc = relay_emit(r, data, n);
+    r->obj = obj;
+    return rc;
 }
 
-static void cache_evict_until_fit(int needed)
+/* relay_uncache - Give up filling the cache with this response */
+static void relay_uncache(relay_t *r)
 {
-    while (cache_tail && (cache_bytes + needed) > MAX_CACHE_SIZE) {
-        cache_remove_entry(cache_tail);
+    if (r->obj) {
+        cache_fill_end(r->obj, 0);
+        r->obj = NULL;
     }
 }
 
-static int cache_get_copy(const char *key, char **out_data, int *out_size)
+/*
+ * Each worker's pipe for splicing bodies from origin to client. Where
+ * splice() does not work the bodies go through buf instead, which is
+ * still much larger than a relay's out.
+ */
+#define RELAY_DIRECT_BUF (64 * 1024)
+
+typedef struct {
+    int fds[2];                /* -1 until first needed */
+    size_t size;               /* Capacity of the pipe */
+    int broken;                /* splice() is not available */
+    char *buf;                 /* RELAY_DIRECT_BUF bytes once broken */
+} relay_pipe_t;
+
+static __thread relay_pipe_t relay_pipe = { { -1, -1 }, 0, 0, NULL };
+
+/* relay_skip - Account for n bytes sent around r->obj */
+static void relay_skip(relay_t *r, size_t n)
 {
-    cache_entry_t *cur;
+    if (r->obj) {
+        cache_fill_skip(r->obj, n);
+        r->objsize += n;
+    }
+}
 
-    *out_data = NULL;
-    *out_size = 0;
+/*
+ * relay_pipe_drain - Splice the n bytes in the pipe to fd. On failure
+ *     the pipe is closed, since what is left in it belongs to a response
+ *     that will never be finished.
+ */
+static int relay_pipe_drain(relay_pipe_t *zp, int fd, size_t n, int more)
+{
+    while (n > 0) {
+        ssize_t m = splice(zp->fds[0], NULL, fd, NULL, n,
+                           SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0));
 
-    pthread_mutex_lock(&cache_mutex);
-    cur = cache_head;
-    while (cur) {
-        if (!strcmp(cur->key, key)) {
-            char *copy = Malloc(cur->size);
-            memcpy(copy, cur->data, cur->size);
-            *out_data = copy;
-            *out_size = cur->size;
-            cache_move_to_front(cur);
-            pthread_mutex_unlock(&cache_mutex);
-            return 1;
+        if (m < 0 && errno == EINTR) {
+            continue;
+        }
+        if (m <= 0) {
+            Close(zp->fds[0]);
+            Close(zp->fds[1]);
+            zp->fds[0] = zp->fds[1] = -1;
+            return -1;
         }
-        cur = cur->next;
+        n -= m;
     }
-    pthread_mutex_unlock(&cache_mutex);
     return 0;
 }
 
-static void cache_insert(const char *key, const char *data, int size)
+/*
+ * relay_direct - Relay n body bytes the cache does not want, or up to
+ *     EOF if n is negative, without copying them through r->out: spliced
+ *     from the origin through the worker's pipe, or if need be read and
+ *     written in large blocks. Whatever rio has read ahead goes first,
+ *     so the origin's rio buffer ends up empty.
+ */
+static int relay_direct(rio_t *rp, relay_t *r, long long n)
 {
-    cache_entry_t *cur;
-    cache_entry_t *entry;
+    relay_pipe_t *zp = &relay_pipe;
 
-    if (size <= 0 || size > MAX_OBJECT_SIZE) {
-        return;
+    if (r->clientfd < 0 || relay_flush(r) < 0) {
+        return -1;              /* Nobody wants the rest */
     }
+    if (rp->rio_cnt > 0) {
+        size_t m = rp->rio_cnt;
 
-    pthread_mutex_lock(&cache_mutex);
-
-    cur = cache_head;
-    while (cur) {
-        if (!strcmp(cur->key, key)) {
-            cache_remove_entry(cur);
-            break;
+        if (n >= 0 && (long long)m > n) {
+            m = (size_t)n;
+        }
+        if (rio_writen(r->clientfd, rp->rio_bufptr, m) < 0) {
+            return -1;
+        }
+        trace_bytes(m);
+        rp->rio_bufptr += m;
+        rp->rio_cnt -= m;
+        relay_skip(r, m);
+        if (n > 0) {
+            n -= m;
         }
-        cur = cur->next;
     }
 
-    cache_evict_until_fit(size);
-    if (size > MAX_CACHE_SIZE) {
-        pthread_mutex_unlock(&cache_mutex);
-        return;
+    while (n != 0) {
+        size_t want;
+        ssize_t got;
+
+        if (!zp->broken && zp->fds[0] < 0) {
+            int size = splice_pipe(zp->fds, 0);
+
+            if (size < 0) {
+                zp->broken = 1;
+            } else {
+                zp->size = (size_t)size;
+            }
+        }
+        if (zp->broken && !zp->buf) {
+            zp->buf = Malloc(RELAY_DIRECT_BUF);
+        }
+
+        want = zp->broken ? RELAY_DIRECT_BUF : zp->size;
+        if (n > 0 && (long long)want > n) {
+            want = (size_t)n;
+        }
+        if (!zp->broken) {
+            got = splice(rp->rio_fd, NULL, zp->fds[1], NULL, want,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (got < 0 && errno == EINVAL) {
+                zp->broken = 1;     /* The pipe is still empty */
+                continue;
+            }
+        } else {
+            got = read(rp->rio_fd, zp->buf, want);
+        }
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            return n < 0 ? 0 : -1;
+        }
+
+        if (n > 0) {
+            n -= got;
+        }
+        if (!zp->broken ? relay_pipe_drain(zp, r->clientfd, got, n != 0) < 0
+                        : rio_writen(r->clientfd, zp->buf, got) < 0) {
+            return -1;
+        }
+        trace_bytes(got);
+        relay_skip(r, got);
     }
+    return 0;
+}
 
-    entry = Malloc(sizeof(cache_entry_t));
-    entry->key = Malloc(strlen(key) + 1);
-    strcpy(entry->key, key);
-    entry->data = Malloc(size);
-    memcpy(entry->data, data, size);
-    entry->size = size;
-    entry->prev = NULL;
-    entry->next = cache_head;
-    if (cache_head) {
-        cache_head->prev = entry;
+/*
+ * relay_copy - Relay n body bytes, or everything up to EOF if n is
+ *     negative, reading straight into the output buffer and flushing it
+ *     whenever the next read would have to wait. Once the cache has
+ *     stopped keeping the response, long enough bodies are relayed
+ *     directly instead.
+ */
+static int relay_copy(rio_t *rp, relay_t *r, long long n)
+{
+    while (n != 0) {
+        size_t want = r->out_cap - r->out_len;
+        ssize_t got;
+
+        if ((n < 0 || n >= SPLICE_MIN) && (!r->obj || !cache_fill_storing(r->obj))) {
+            return relay_direct(rp, r, n);
+        }
+        if (n > 0 && (long long)want > n) {
+            want = (size_t)n;
+        }
+        if ((got = rio_readsomeb(rp, r->out + r->out_len, want)) < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            return n < 0 ? 0 : -1;
+        }
+        if (relay_commit(r, got) < 0) {
+            return -1;
+        }
+        if (n > 0) {
+            n -= got;
+        }
+        if (n != 0 && rp->rio_cnt == 0 && relay_flush(r) < 0) {
+            return -1;
+        }
     }
-    cache_head = entry;
-    if (!cache_tail) {
-        cache_tail = entry;
+    return 0;
+}
+
+/*
+ * line_rest - buf holds the n bytes rio_readlineb() read. If they are
+ *     the start of a line too long for buf, read the rest of it into a
+ *     Malloc()ed buffer, which the caller frees, and return that, with
+ *     its length in *n; else return buf. A line is never split, as its
+ *     rest could pass for a line of its own. Returns NULL on error or a
+ *     line longer than HTTP_MAX_HEAD.
+ */
+static char *line_rest(rio_t *rp, char *buf, ssize_t *n)
+{
+    size_t len = (size_t)*n, cap = 2 * MAXLINE;
+    char *line;
+    ssize_t m;
+
+    if (len < MAXLINE - 1 || buf[len - 1] == '\n') {
+        return buf;
     }
-    cache_bytes += size;
+    line = Malloc(cap);
+    memcpy(line, buf, len);
+    do {
+        if (len >= HTTP_MAX_HEAD) {
+            Free(line);
+            return NULL;
+        }
+        if (cap - len < MAXLINE) {
+            cap *= 2;
+            line = Realloc(line, cap);
+        }
+        if ((m = rio_readlineb(rp, line + len, MAXLINE)) <= 0) {
+            Free(line);
+            return NULL;
+        }
+        len += m;
+    } while (m == MAXLINE - 1 && line[len - 1] != '\n');
+    *n = (ssize_t)len;
+    return line;
+}
 
-    pthread_mutex_unlock(&cache_mutex);
+/* read_line - Read a whole line from rp, as line_rest() returns it */
+static char *read_line(rio_t *rp, char *buf, ssize_t *n)
+{
+    if ((*n = rio_readlineb(rp, buf, MAXLINE)) <= 0) {
+        return NULL;
+    }
+    return line_rest(rp, buf, n);
 }
 
-static int starts_with_icase(const char *s, const char *prefix)
+/* Free line unless it is buf */
+static void line_free(char *line, char *buf)
 {
-    size_t n = strlen(prefix);
-    return strncasecmp(s, prefix, n) == 0;
+    if (line != buf) {
+        Free(line);
+    }
 }
 
-static void parse_uri(const char *uri, char *hostname, char *port, char *path)
+static int relay_chunked(rio_t *rp, relay_t *r, char *buf)
 {
-    const char *p = uri;
-    const char *slash;
-    char hostport[MAXLINE];
-    const char *colon;
-    size_t hostport_len;
+    ssize_t n;
+    long long size;
+    char *line;
 
-    hostname[0] = '\0';
-    strcpy(port, "80");
-    strcpy(path, "/");
+    do {
+        if (!(line = read_line(rp, buf, &n))) {
+            return -1;
+        }
+        size = relay_emit(r, line, n) < 0 ? -1 : strtoll(line, NULL, 16);
+        line_free(line, buf);
+        if (size < 0) {
+            return -1;
+        }
+        /* Chunk data plus its trailing CRLF */
+        if (size > 0 && relay_copy(rp, r, size + 2) < 0) {
+            return -1;
+        }
+    } while (size > 0);
 
-    if (starts_with_icase(p, "http://")) {
-        p += 7;
-    }
+    /* Trailer section, ended by an empty line */
+    do {
+        if (!(line = read_line(rp, buf, &n))) {
+            return -1;
+        }
+        if (relay_emit(r, line, n) < 0) {
+            line_free(line, buf);
+            return -1;
+        }
+        line_free(line, buf);
+    } while (strcmp(buf, "\r\n"));
+    return 0;
+}
 
-    if (*p == '/') {
-        strncpy(path, p, MAXLINE - 1);
-        path[MAXLINE - 1] = '\0';
-        return;
+/* Append the n byte line to the head *head, *len bytes so far */
+static int head_add(char **head, size_t *len, const char *line, size_t n)
+{
+    *head = Realloc(*head, *len + n);
+    memcpy(*head + *len, line, n);
+    *len += n;
+    return 0;
+}
+
+/*
+ * relay_response - Relay one complete response whose status line is
+ *     already in buf, using its framing to find where it ends. The
+ *     origin's connection headers are replaced with the proxy's own,
+ *     and r->keepalive is cleared unless the client can find the end
+ *     of the response without EOF. A 304 to a revalidation is not
+ *     relayed; the object it confirms, under the head it updates, is
+ *     left in r->hit instead.
+ *     Returns 1 if the origin connection can carry another request, 0
+ *     if the response is complete but the connection is done, -1 on
+ *     error.
+ */
+static int relay_response(rio_t *rp, relay_t *r, char *buf, http_response_t *resp)
+{
+    const char *conn;
+    int hdr_len, revalidated, rc;
+    ssize_t n = (ssize_t)strlen(buf);
+    char *line, *fresh = NULL;
+    size_t fresh_len = 0;
+
+    if (!(line = line_rest(rp, buf, &n))) {
+        return -1;
+    }
+    if (parse_status_line(line, resp) < 0) {
+        /* Not HTTP/1.x, relay to EOF and keep it out of the cache */
+        relay_uncache(r);
+        r->keepalive = 0;
+        rc = relay_emit(r, line, n);
+        line_free(line, buf);
+        return rc < 0 ? -1 : relay_copy(rp, r, -1);
+    }
+    revalidated = resp->status == 304 && r->obj && cache_fill_stale(r->obj);
+    rc = revalidated ? head_add(&fresh, &fresh_len, line, n) : relay_emit(r, line, n);
+    line_free(line, buf);
+    if (rc < 0) {
+        return -1;
     }
 
-    slash = strchr(p, '/');
-    if (slash) {
-        hostport_len = (size_t)(slash - p);
-        if (hostport_len >= sizeof(hostport)) {
-            hostport_len = sizeof(hostport) - 1;
+    while (1) {
+        if (!(line = read_line(rp, buf, &n))) {
+            Free(fresh);
+            return -1;
+        }
+        if (!strcmp(line, "\r\n")) {
+            break;
         }
-        memcpy(hostport, p, hostport_len);
-        hostport[hostport_len] = '\0';
-        strncpy(path, slash, MAXLINE - 1);
-        path[MAXLINE - 1] = '\0';
-    } else {
-        strncpy(hostport, p, sizeof(hostport) - 1);
-        hostport[sizeof(hostport) - 1] = '\0';
-        strcpy(path, "/");
+        parse_response_header(line, resp);
+        rc = !response_header_forwarded(line) ? 0 :
+             revalidated ? head_add(&fresh, &fresh_len, line, n) : relay_emit(r, line, n);
+        line_free(line, buf);
+        if (rc < 0) {
+            Free(fresh);
+            return -1;
+        }
+    }
+    if (revalidated) {
+        /* The 304's headers update the stored head, which is served */
+        r->hit = fill_revalidated(r->obj, fresh, fresh_len, resp);
+        r->obj = NULL;
+        Free(fresh);
+        return response_keepalive(resp);
     }
 
-    colon = strchr(hostport, ':');
-    if (colon) {
-        size_t host_len = (size_t)(colon - hostport);
-        if (host_len >= MAXLINE) {
-            host_len = MAXLINE - 1;
+    if (response_vary_encoding(resp) &&
+        relay_emit(r, VARY_ENCODING_HDR, strlen(VARY_ENCODING_HDR)) < 0) {
+        return -1;
+    }
+    hdr_len = (int)r->objsize;
+    r->keepalive = r->keepalive && response_delimited(resp);
+    conn = connection_hdr(r->keepalive);
+    if (relay_emit_hop(r, conn, strlen(conn)) < 0 || relay_emit(r, "\r\n", 2) < 0) {
+        return -1;
+    }
+    if (r->obj) {
+        long long body_len = !response_has_body(resp) ? 0 :
+                             resp->chunked ? -1 : resp->content_length;
+        cache_fill_head(r->obj, hdr_len, response_delimited(resp), body_len,
+                        response_expires(resp), response_grace(resp));
+    }
+
+    if (!response_has_body(resp)) {
+        return response_keepalive(resp);
+    }
+    if (resp->chunked) {
+        if (relay_chunked(rp, r, buf) < 0) {
+            return -1;
         }
-        memcpy(hostname, hostport, host_len);
-        hostname[host_len] = '\0';
-        strncpy(port, colon + 1, MAXLINE - 1);
-        port[MAXLINE - 1] = '\0';
-    } else {
-        strncpy(hostname, hostport, MAXLINE - 1);
-        hostname[MAXLINE - 1] = '\0';
+    } else if (relay_copy(rp, r, resp->content_length) < 0) {
+        return -1;
     }
+    return response_keepalive(resp);
 }
 
-static void build_cache_key(char *key, const char *hostname, const char *port, const char *path)
+/* A thread blocked until an object it is reading grows or is complete */
+typedef struct {
+    cache_waiter_t w;          /* Must stay first */
+    sem_t done;
+} fill_waiter_t;
+
+static void fill_wake(cache_waiter_t *w)
 {
-    snprintf(key, MAXLINE, "%s:%s%s", hostname, port, path);
+    V(&((fill_waiter_t *)w)->done);
 }
 
-static void read_request_headers(rio_t *client_rio, char *other_hdrs, size_t other_sz,
-                                 char *host_hdr, size_t host_sz)
+/*
+ * serve_cached - Stream a pinned cache object to the client, waiting for
+ *     more of it while it is still being filled, then release it.
+ *     Returns 1 to keep the connection, 0 to close it, or -1 if the fill
+ *     failed before anything was sent.
+ */
+static int serve_cached(int clientfd, cache_object_t *obj, int keepalive)
 {
-    char buf[MAXLINE];
-
-    other_hdrs[0] = '\0';
-    host_hdr[0] = '\0';
+    struct iovec iov[CACHE_IOV_MAX + 1];
+    char hdrs[MAX_CACHED_HDRS];
+    cache_cursor_t cur = { NULL, 0, 0 };
+    fill_waiter_t waiter;
+    int head_sent = 0;
+    int rc;
+
+    waiter.w.wake = fill_wake;
+    Sem_init(&waiter.done, 0, 0);
+    while (1) {
+        int state;
+        size_t avail = cache_available(obj, &state);
 
-    while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
-        if (!strcmp(buf, "\r\n")) {
+        if (state == CACHE_ABORTED) {
+            rc = head_sent ? 0 : -1;
             break;
         }
-
-        if (starts_with_icase(buf, "Host:")) {
-            strncpy(host_hdr, buf + 5, host_sz - 1);
-            host_hdr[host_sz - 1] = '\0';
+        if (avail > 0 && (cur.off < avail || !head_sent)) {
+            /* The proxy's headers go between the head and the rest */
+            size_t end = head_sent ? avail : (size_t)obj->hdr_len;
+            int n = cache_object_iov(obj, &cur, end, iov, CACHE_IOV_MAX);
+            size_t len = 0, hdrs_len = 0;
+            int i;
+
+            for (i = 0; i < n; i++) {
+                len += iov[i].iov_len;
+            }
+            if (!head_sent && cur.off + len == end) {
+                long long body_len = state == CACHE_COMPLETE ? (long long)(avail - end - 2) : -1;
+                cache_cursor_t rest = cur;
+                int m;
+
+                keepalive = keepalive && (obj->delimited || body_len >= 0);
+                iov[n].iov_base = hdrs;
+                iov[n].iov_len = cached_head_hdrs(hdrs, sizeof(hdrs), obj->delimited,
+                                                  body_len, keepalive);
+                hdrs_len = iov[n].iov_len;
+                n++;
+                head_sent = 1;
+
+                cache_cursor_advance(obj, &rest, len);
+                m = cache_object_iov(obj, &rest, avail, iov + n, CACHE_IOV_MAX + 1 - n);
+                for (i = n; i < n + m; i++) {
+                    len += iov[i].iov_len;
+                }
+                n += m;
+            }
+            if (rio_writev(clientfd, iov, n) < 0) {
+                rc = 0;
+                break;
+            }
+            trace_bytes(len + hdrs_len);
+            cache_cursor_advance(obj, &cur, len);
             continue;
         }
-        if (starts_with_icase(buf, "User-Agent:")) {
-            continue;
+        if (state == CACHE_COMPLETE) {
+            rc = keepalive;
+            break;
         }
-        if (starts_with_icase(buf, "Connection:")) {
-            continue;
+        if (cache_wait(obj, avail, &waiter.w)) {
+            P(&waiter.done);
         }
-        if (starts_with_icase(buf, "Proxy-Connection:")) {
-            continue;
+    }
+    sem_destroy(&waiter.done);
+    cache_served(cur.off);
+    cache_release(obj);
+    return rc;
+}
+
+/*
+ * fetch_response - Send the request in ctx->iov to the origin at
+ *     ctx->hostname and ctx->port and relay the response to the
+ *     client, filling the cache object fill with it unless fill is
+ *     NULL, or if the origin confirms the stale object fill
+ *     revalidates, serve that, or its variant for a client taking
+ *     accept_encodings. With no client (clientfd -1) only fill is
+ *     filled. Returns 1 if the client connection should stay open for
+ *     another request, 0 if not, or -1 if the response could not be
+ *     fetched or relayed.
+ */
+static int fetch_response(request_ctx_t *ctx, int clientfd, cache_object_t *fill,
+                          int keepalive, int accept_encodings)
+{
+    const char *hostname = ctx->hostname;
+    const char *port = ctx->port;
+    rio_t server_rio;
+    balance_peer_t peer;
+    long long t, start;
+    int serverfd;
+
+    /*
+     * A pooled connection may have been closed by the origin just as we
+     * picked it up. Nothing has reached the client before the status
+     * line arrives, so it is safe to retry on another connection.
+     */
+    while (1) {
+        int reused;
+
+        start = t = metrics_now();
+        if ((serverfd = upstream_acquire(hostname, port, &reused, &peer)) < 0) {
+            metrics_count(METRIC_CONNECT_FAILED);
+            break;
+        }
+        t = metrics_since(METRIC_CONNECT, t);
+        trace_upstream(&peer);
+        Rio_readinitb(&server_rio, serverfd);
+        rio_attach(&server_rio);
+        /* rio_writev() consumes its iovecs, so a retry needs a fresh copy */
+        memcpy(ctx->send, ctx->iov, sizeof(struct iovec) * ctx->iovcnt);
+        if (rio_writev(serverfd, ctx->send, ctx->iovcnt) >= 0 &&
+            rio_readlineb(&server_rio, ctx->line, MAXLINE) > 0) {
+            t = metrics_since(METRIC_FIRST_BYTE, t);
+            balance_done(&peer, BALANCE_OK, t - start);
+            break;
+        }
+        /* A pooled connection failing says little about the origin */
+        balance_done(&peer, reused ? BALANCE_DROPPED : BALANCE_FAILED, 0);
+        rio_release(&server_rio);
+        close(serverfd);
+        serverfd = -1;
+        if (!reused) {
+            break;
+        }
+    }
+    if (serverfd < 0) {
+        if (fill) {
+            cache_fill_end(fill, 0);
         }
+        return -1;
+    }
 
-        if (strlen(other_hdrs) + strlen(buf) + 1 < other_sz) {
-            strcat(other_hdrs, buf);
+    {
+        http_response_t resp;
+        relay_t relay;
+        int rc;
+
+        relay.clientfd = clientfd;
+        relay.out = bufpool_get(bufpool_min(), &relay.out_cap);
+        relay.out_len = 0;
+        relay.obj = fill;
+        relay.objsize = 0;
+        relay.keepalive = keepalive;
+        relay.hit = NULL;
+
+        rc = relay_response(&server_rio, &relay, ctx->line, &resp);
+        if (rc >= 0 && relay_flush(&relay) < 0) {
+            rc = -1;
+        }
+        if (rc >= 0) {
+            metrics_since(METRIC_RELAY, t);
+        }
+        if (relay.obj) {
+            cache_fill_end(relay.obj, rc >= 0);
         }
+        bufpool_put(relay.out, relay.out_cap);
+
+        /* Bytes beyond the response would corrupt the next exchange */
+        upstream_release(hostname, port, serverfd, &peer, rc == 1 && server_rio.rio_cnt == 0);
+        rio_release(&server_rio);
+        if (relay.hit && clientfd < 0) {
+            cache_release(relay.hit);
+        } else if (relay.hit) {
+            trace_outcome(TRACE_REVALIDATED);
+            return serve_cached(clientfd, compress_variant(relay.hit, accept_encodings), keepalive);
+        }
+        return rc < 0 ? -1 : relay.keepalive;
     }
 }
 
-static void normalize_host_from_header(const char *host_hdr, char *hostname, char *port)
+/*
+ * serve_metrics - Answer a request for the proxy's metrics. Returns 1
+ *     if the client connection should stay open for another request.
+ */
+static int serve_metrics(int clientfd, int keepalive)
 {
-    char tmp[MAXLINE];
-    char *p;
-    char *colon;
+    size_t len;
+    char *resp = metrics_response(keepalive, &len);
+    int rc = rio_writen(clientfd, resp, len) >= 0 && keepalive;
 
-    if (!host_hdr || !*host_hdr) {
-        return;
-    }
+    trace_bytes(len);
+    Free(resp);
+    return rc;
+}
 
-    while (*host_hdr && isspace((unsigned char)*host_hdr)) {
-        host_hdr++;
+/*
+ * serve_refusal - Turn a request away with status, 429 or 503, closing
+ *     the connection afterwards
+ */
+static int serve_refusal(int clientfd, int status)
+{
+    size_t len;
+    char *resp = admit_response(status, &len);
+
+    if (rio_writen(clientfd, resp, len) >= 0) {
+        trace_bytes(len);
     }
+    trace_outcome(TRACE_REFUSED);
+    Free(resp);
+    return 0;
+}
 
-    strncpy(tmp, host_hdr, sizeof(tmp) - 1);
-    tmp[sizeof(tmp) - 1] = '\0';
+/*
+ * serve_request - Serve the request parsed into ctx->req, from the cache
+ *     or from the origin. A request for an object that is still being
+ *     fetched streams it from the cache as it arrives. Returns 1 if the
+ *     client connection should stay open for another request.
+ */
+static int serve_request(request_ctx_t *ctx, int clientfd)
+{
+    const http_request_t *req = &ctx->req;
+    int keepalive = req->keepalive && !handoff_draining();
+    long long start = metrics_now(), t;
+
+    cache_object_t *cached;
+    int fill, rc;
+
+    metrics_count(METRIC_REQUESTS);
+    trace_begin(&ctx->trace);
+    if (metrics_request(req)) {
+        trace_outcome(TRACE_LOCAL);
+        rc = serve_metrics(clientfd, keepalive);
+        metrics_since(METRIC_TOTAL, start);
+        return rc;
+    }
+    if (!admit_request(ctx->client)) {
+        return serve_refusal(clientfd, 429);
+    }
 
-    p = tmp;
-    while (*p && (*p == ' ' || *p == '\t')) {
-        p++;
+    http_span_copy(ctx->uri, sizeof(ctx->uri), req->uri);
+    parse_uri(ctx->uri, ctx->hostname, ctx->port, ctx->path);
+    if (ctx->hostname[0] == '\0' && req->host.p) {
+        http_span_copy(ctx->host_hdr, sizeof(ctx->host_hdr), req->host);
+        normalize_host_from_header(ctx->host_hdr, ctx->hostname, ctx->port);
     }
-    if (!*p) {
-        return;
+    if (ctx->hostname[0] == '\0') {
+        return 0;
     }
 
-    char *end = p + strlen(p);
-    while (end > p && (end[-1] == '\r' || end[-1] == '\n' || isspace((unsigned char)end[-1]))) {
-        end[-1] = '\0';
-        end--;
+    build_cache_key(ctx->cache_key, ctx->hostname, ctx->port, ctx->path);
+    trace_key(ctx->cache_key);
+    t = metrics_now();
+    cached = cache_lookup_fill(ctx->cache_key, &fill);
+    metrics_since(METRIC_LOOKUP, t);
+    if (!fill) {
+        trace_outcome(TRACE_HIT);
+        cached = compress_variant(cached, req->accept_encodings);
+        if ((rc = serve_cached(clientfd, cached, keepalive)) >= 0) {
+            metrics_since(METRIC_TOTAL, start);
+            return rc;
+        }
+        /* Its fill failed before anything was sent; fetch it uncached */
+        cached = NULL;
     }
+    trace_outcome(TRACE_MISS);
 
-    colon = strchr(p, ':');
-    if (colon) {
-        *colon = '\0';
-        strncpy(hostname, p, MAXLINE - 1);
-        hostname[MAXLINE - 1] = '\0';
-        strncpy(port, colon + 1, MAXLINE - 1);
-        port[MAXLINE - 1] = '\0';
-    } else {
-        strncpy(hostname, p, MAXLINE - 1);
-        hostname[MAXLINE - 1] = '\0';
+    if (!admit_fetch()) {
+        if (cached) {
+            cache_fill_end(cached, 0);
+        }
+        return serve_refusal(clientfd, 503);
     }
+    fill_conditional(cached, ctx->cond, sizeof(ctx->cond));
+    ctx->iovcnt = build_request_iov(ctx->iov, ctx->hostname, ctx->port, ctx->path, req, 1,
+                                    cached ? ctx->cond : NULL);
+    if ((rc = fetch_response(ctx, clientfd, cached, keepalive, req->accept_encodings)) >= 0) {
+        metrics_since(METRIC_TOTAL, start);
+    }
+    admit_fetch_done();
+    return rc > 0;
 }
 
-static void forward_request(int clientfd)
+/*
+ * refresh_fetch - Fill fill, which refreshes a cached object in the
+ *     background, from the origin, with nobody to relay the response to
+ */
+static void refresh_fetch(cache_object_t *fill)
 {
-    rio_t client_rio;
-    rio_t server_rio;
-    char buf[MAXLINE];
-    char method[MAXLINE];
-    char uri[MAXLINE];
-    char version[MAXLINE];
-    char hostname[MAXLINE];
-    char port[MAXLINE];
-    char path[MAXLINE];
-    char other_hdrs[32768];
-    char host_hdr[MAXLINE];
-    char request_hdrs[40960];
-    char cache_key[MAXLINE];
-
-    char *cached;
-    int cached_size;
+    request_ctx_t *ctx = request_ctx();
+
+    /* The key is host:port/path, the URI the object was fetched by */
+    snprintf(ctx->uri, sizeof(ctx->uri), "http://%s", fill->key);
+    parse_uri(ctx->uri, ctx->hostname, ctx->port, ctx->path);
+    ctx->req.nheaders = 0;
+    fill_conditional(fill, ctx->cond, sizeof(ctx->cond));
+    ctx->iovcnt = build_request_iov(ctx->iov, ctx->hostname, ctx->port, ctx->path, &ctx->req,
+                                    1, ctx->cond);
+    fetch_response(ctx, -1, fill, 0, 0);
+}
 
-    int serverfd;
+/*
+ * forward_request - Read one request from client_rio and serve it.
+ *     Returns 1 if the client connection should stay open for another.
+ */
+static int forward_request(int clientfd, rio_t *client_rio)
+{
+    request_ctx_t *ctx = request_ctx();
+    char *spill;
+    int rc = 0;
 
-    Rio_readinitb(&client_rio, clientfd);
-    if (Rio_readlineb(&client_rio, buf, MAXLINE) <= 0) {
-        return;
+    rio_attach(client_rio);
+    if (read_request(client_rio, &ctx->req, &spill) == 0) {
+        rc = serve_request(ctx, clientfd);
     }
+    trace_end(&ctx->trace);
+    Free(spill);
+    return rc;
+}
 
-    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
-        return;
+/*
+ * wait_next_request - Wait for the next request on a persistent client
+ *     connection. Pipelined requests already buffered are served at
+ *     once. Otherwise wait up to KEEPALIVE_TIMEOUT_MS, but give the
+ *     worker up as soon as other connections are queued for it, or the
+ *     listening sockets have been handed off. A connection still idle
+ *     after the first poll gives its read buffer back until the request
+ *     arrives.
+ */
+static int wait_next_request(rio_t *client_rio, acceptor_t *acc)
+{
+    struct pollfd pfd;
+    int waited, rc;
+
+    if (client_rio->rio_cnt > 0) {
+        return 1;
+    }
+    if (handoff_draining()) {
+        return 0;
     }
 
-    if (strcasecmp(method, "GET")) {
-        return;
+    pfd.fd = client_rio->rio_fd;
+    pfd.events = POLLIN;
+    for (waited = 0; waited < KEEPALIVE_TIMEOUT_MS; waited += KEEPALIVE_POLL_MS) {
+        if ((rc = poll(&pfd, 1, KEEPALIVE_POLL_MS)) > 0) {
+            return 1;
+        }
+        if (rc < 0 && errno != EINTR) {
+            return 0;
+        }
+        if (sbuf_waiting(&acc->connq) > 0 || handoff_draining()) {
+            return 0;
+        }
+        rio_release(client_rio);
     }
+    return 0;
+}
 
-    parse_uri(uri, hostname, port, path);
-    read_request_headers(&client_rio, other_hdrs, sizeof(other_hdrs), host_hdr, sizeof(host_hdr));
+/*
+ * fill_conditional - Write to buf the conditional headers that ask the
+ *     origin whether the stale object fill revalidates has changed; buf
+ *     is left empty if fill is NULL or an ordinary miss
+ */
+void fill_conditional(cache_object_t *fill, char *buf, size_t size)
+{
+    cache_object_t *stale = fill ? cache_fill_stale(fill) : NULL;
+    char head[MAXBUF];
 
-    if (hostname[0] == '\0') {
-        normalize_host_from_header(host_hdr, hostname, port);
-    }
-    if (hostname[0] == '\0') {
-        return;
+    buf[0] = '\0';
+    if (stale) {
+        conditional_hdrs(head, cache_object_head(stale, head, sizeof(head)), buf, size);
     }
+}
 
-    build_cache_key(cache_key, hostname, port, path);
-    if (cache_get_copy(cache_key, &cached, &cached_size)) {
-        Rio_writen(clientfd, cached, cached_size);
-        Free(cached);
-        return;
+/*
+ * fill_revalidated - If resp is the 304 the origin answered fill's
+ *     revalidation with, its forwarded head the first len bytes of head,
+ *     complete fill from the stale object under the stored head as the
+ *     304 updates it, and return the object for the caller to serve and
+ *     release. Returns NULL for any other response.
+ */
+cache_object_t *fill_revalidated(cache_object_t *fill, const char *head, size_t len,
+                                 const http_response_t *resp)
+{
+    cache_object_t *stale = fill ? cache_fill_stale(fill) : NULL;
+    http_response_t stored;
+    char *old, *new;
+    size_t old_len, new_len;
+
+    if (!stale || resp->status != 304) {
+        return NULL;
     }
+    old = Malloc(stale->hdr_len + 1);
+    old_len = cache_object_head(stale, old, stale->hdr_len + 1);
+    new = Malloc(old_len + len);
+    new_len = revalidated_head(old, old_len, head, len, new);
+    parse_response_head(new, new_len, &stored);
+    response_update(&stored, resp);
+    stale = cache_fill_revalidated(fill, new, (int)new_len, response_expires(&stored),
+                                   response_grace(&stored));
+    Free(new);
+    Free(old);
+    return stale;
+}
 
-    serverfd = Open_clientfd(hostname, port);
-    if (serverfd < 0) {
+/*
+ * pin_thread - Bind the calling thread to cpu (modulo the online CPUs).
+ *     A negative cpu leaves the thread unpinned.
+ */
+void pin_thread(int cpu)
+{
+    cpu_set_t set;
+    int rc;
+
+    if (cpu < 0) {
         return;
     }
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (int)sysconf(_SC_NPROCESSORS_ONLN), &set);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+        fprintf(stderr, "pthread_setaffinity_np failed: %s\n", strerror(rc));
+    }
+}
 
-    request_hdrs[0] = '\0';
-    snprintf(request_hdrs, sizeof(request_hdrs), "GET %s HTTP/1.0\r\n", path);
+/*
+ * splice_pipe - Make a pipe to splice response bodies through, with
+ *     flags such as O_NONBLOCK on both ends, grown to SPLICE_PIPE_SIZE
+ *     where the system allows. Returns its capacity, or -1 if no pipe
+ *     could be made.
+ */
+int splice_pipe(int fds[2], int flags)
+{
+    int size;
 
-    if (!strcmp(port, "80")) {
-        snprintf(request_hdrs + strlen(request_hdrs), sizeof(request_hdrs) - strlen(request_hdrs),
-                 "Host: %s\r\n", hostname);
-    } else {
-        snprintf(request_hdrs + strlen(request_hdrs), sizeof(request_hdrs) - strlen(request_hdrs),
-                 "Host: %s:%s\r\n", hostname, port);
+    if (pipe2(fds, O_CLOEXEC | flags) < 0) {
+        return -1;
+    }
+    if ((size = fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE)) < 0 &&
+        (size = fcntl(fds[1], F_GETPIPE_SZ)) < 0) {
+        size = 65536;           /* The default since Linux 2.6.11 */
     }
+    return size;
+}
+
+static void *thread_main(void *arg)
+{
+    acceptor_t *acc = arg;
 
-    snprintf(request_hdrs + strlen(request_hdrs), sizeof(request_hdrs) - strlen(request_hdrs),
-             "%s", user_agent_hdr);
-    snprintf(request_hdrs + strlen(request_hdrs), sizeof(request_hdrs) - strlen(request_hdrs),
-             "Connection: close\r\nProxy-Connection: close\r\n");
-    if (other_hdrs[0] != '\0') {
-        strncat(request_hdrs, other_hdrs, sizeof(request_hdrs) - strlen(request_hdrs) - 1);
+    Pthread_detach(Pthread_self());
+    pin_thread(acc->cpu);
+    trace_resume(&request_ctx()->trace);
+    while (1) {
+        long long waited;
+        int connfd = sbuf_remove(&acc->connq, &waited);
+        rio_t client_rio;
+
+        if (admit_late(waited)) {
+            admit_shed(connfd);
+            admit_conn_done();
+            continue;
+        }
+        request_ctx()->client = admit_client(connfd);
+        metrics_count(METRIC_CONNS_OPENED);
+        /* Requests on one connection are served, and answered, in order */
+        Rio_readinitb(&client_rio, connfd);
+        while (forward_request(connfd, &client_rio) && wait_next_request(&client_rio, acc)) {
+        }
+        rio_release(&client_rio);
+        Close(connfd);
+        admit_conn_done();
+        metrics_count(METRIC_CONNS_CLOSED);
     }
-    strncat(request_hdrs, "\r\n", sizeof(request_hdrs) - strlen(request_hdrs) - 1);
+    return NULL;
+}
 
-    Rio_writen(serverfd, request_hdrs, strlen(request_hdrs));
+static void *acceptor_main(void *arg)
+{
+    acceptor_t *acc = arg;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
 
-    Rio_readinitb(&server_rio, serverfd);
-    {
-        char objbuf[MAX_OBJECT_SIZE];
-        int objsize = 0;
-        int cacheable = 1;
-        ssize_t n;
-
-        while ((n = Rio_readnb(&server_rio, buf, MAXBUF)) > 0) {
-            Rio_writen(clientfd, buf, n);
-            if (cacheable) {
-                if (objsize + n <= MAX_OBJECT_SIZE) {
-                    memcpy(objbuf + objsize, buf, n);
-                    objsize += (int)n;
-                } else {
-                    cacheable = 0;
-                }
+    pin_thread(acc->cpu);
+    while (!handoff_draining()) {
+        int connfd;
+
+        clientlen = sizeof(clientaddr);
+        if ((connfd = accept(acc->listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;       /* Maybe woken by stop_acceptors() */
             }
+            unix_error("Accept error");
         }
-        if (cacheable && objsize > 0) {
-            cache_insert(cache_key, objbuf, objsize);
+        if (!admit_conn()) {
+            admit_shed(connfd);     /* Costs an accept, not a worker */
+            continue;
         }
+        sbuf_insert(&acc->connq, connfd); /* Blocks while every slot is taken */
     }
 
-    Close(serverfd);
+    /* The new process accepts now; the workers drain what is queued */
+    while (1) {
+        pause();
+    }
+    return NULL;
 }
 
-static void *thread_main(void *arg)
+static void wake_acceptor(int sig)
 {
-    int connfd = *((int *)arg);
-    Free(arg);
+}
 
-    Pthread_detach(Pthread_self());
-    forward_request(connfd);
-    Close(connfd);
+/*
+ * stop_acceptors - Interrupt acceptors blocked in accept() so that they
+ *     see the handoff. Called until the drain is done, as one may have
+ *     been about to block when it was first called.
+ */
+static void stop_acceptors(void)
+{
+    int i;
+
+    for (i = 0; i < nacceptors_running; i++) {
+        pthread_kill(acceptors_running[i].tid, SIGRTMIN);
+    }
+}
+
+/*
+ * stats_main - Print the cache's counters to stderr on every SIGUSR1,
+ *     reload the configuration file on SIGHUP, hand the listening
+ *     sockets to a new proxy on SIGUSR2, and on SIGTERM or SIGINT write
+ *     the cache to the disk tier and exit. All other threads keep these
+ *     signals blocked.
+ */
+static void *stats_main(void *arg)
+{
+    sigset_t *set = arg;
+
+    while (1) {
+        cache_stats_t st;
+        unsigned long long bytes;
+        int sig;
+
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGHUP) {
+            config_reload();
+            continue;
+        }
+        if (sig == SIGUSR2) {
+            handoff_begin(stop_acceptors);
+            continue;
+        }
+        if (sig != SIGUSR1) {
+            cache_flush();
+            exit(0);
+        }
+        cache_get_stats(&st);
+        bytes = st.bytes_hit + st.bytes_missed;
+        fprintf(stderr, "cache policy=%s lookups=%llu hits=%llu hit_ratio=%.4f "
+                "byte_hit_ratio=%.4f evictions=%llu rejected=%llu disk_hits=%llu "
+                "revalidations=%llu not_modified=%llu refreshes=%llu stale_hits=%llu "
+                "variants=%llu variant_hits=%llu l1_hits=%llu entries=%zu bytes=%zu/%zu\n",
+                st.policy, st.lookups, st.hits,
+                st.lookups ? (double)st.hits / st.lookups : 0.0,
+                bytes ? (double)st.bytes_hit / bytes : 0.0,
+                st.evictions, st.rejected, st.disk_hits, st.revalidations,
+                st.not_modified, st.refreshes, st.stale_hits, st.variants, st.variant_hits,
+                st.l1_hits, st.entries, st.bytes,
+                st.capacity);
+    }
     return NULL;
 }
 
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-e threads|epoll|uring] [-t threads] [-q queue] "
+            "[-a acceptors] [-p] [-c cache_bytes] [-m object_bytes]\n"
+            "       [-L l1_slots] [-P clock|tinylfu|s3fifo] [-d disk_file] "
+            "[-D disk_bytes]\n"
+            "       [-b buf_bytes] [-B buf_max_bytes] [-T default_ttl] [-W grace] "
+            "[-R refreshers]\n"
+            "       [-z gzip,br] [-C max_conns] [-F max_fetches] [-r rate[,burst]]\n"
+            "       [-Q queue_ms] [-O connect_ms] [-l trace_file] [-f json|binary]\n"
+            "       [-S sample[,slow_ms]] [-k config_file] <port>\n",
+            prog);
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
-    int listenfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int opt, i;
+    int engine = ENGINE_THREADS;
+    int nthreads = 0;
+    int queue_size = SBUFSIZE_DEFAULT;
+    int nacceptors = 0;
+    int nlisten;
+    int pin = 0;
+    config_t cfg;
+    char *config_path = NULL;
+    int l1_slots = CACHE_L1_SLOTS;
+    char *disk_path = NULL;
+    long long disk_size = DISK_SIZE_DEFAULT;
+    int nrefreshers = REFRESH_THREADS_DEFAULT;
+    int encodings = 0;
+    char *trace_path = NULL;
+    int trace_format = TRACE_JSON;
+    int *listenfds;
+    acceptor_t *acceptors;
+    sigset_t stats_signals;
+    struct sigaction wake;
+    pthread_attr_t worker_attr;
     pthread_t tid;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    config_defaults(&cfg);
+    while ((opt = getopt(argc, argv, "e:t:q:a:pc:m:L:P:d:D:b:B:T:W:R:z:C:F:r:Q:O:l:f:S:k:")) != -1) {
+        switch (opt) {
+        case 'e':
+            if (!strcmp(optarg, "epoll")) {
+                engine = ENGINE_EPOLL;
+            } else if (!strcmp(optarg, "uring")) {
+                engine = ENGINE_URING;
+            } else if (strcmp(optarg, "threads")) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        case 'a':
+            nacceptors = atoi(optarg);
+            break;
+        case 'p':
+            pin = 1;
+            break;
+        case 'c':
+            cfg.cache_bytes = config_parse_size(optarg);
+            break;
+        case 'm':
+            cfg.object_bytes = config_parse_size(optarg);
+            break;
+        case 'L':
+            l1_slots = atoi(optarg);
+            break;
+        case 'P':
+            if (cache_set_policy(optarg) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        case 'D':
+            disk_size = config_parse_size(optarg);
+            break;
+        case 'b':
+            cfg.buf_bytes = config_parse_size(optarg);
+            break;
+        case 'B':
+            cfg.buf_max_bytes = config_parse_size(optarg);
+            break;
+        case 'T':
+            cfg.default_ttl = atoll(optarg);
+            break;
+        case 'W':
+            cfg.grace = atoll(optarg);
+            break;
+        case 'R':
+            nrefreshers = atoi(optarg);
+            break;
+        case 'z':
+            if ((encodings = compress_parse(optarg)) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'C':
+            cfg.max_conns = atoi(optarg);
+            break;
+        case 'F':
+            cfg.max_fetches = atoi(optarg);
+            break;
+        case 'r':
+            if (admit_parse_rate(optarg, &cfg.rate, &cfg.burst) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'Q':
+            cfg.queue_ms = atoll(optarg);
+            break;
+        case 'O':
+            cfg.connect_ms = atoi(optarg);
+            break;
+        case 'l':
+            trace_path = optarg;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "binary")) {
+                trace_format = TRACE_BINARY;
+            } else if (strcmp(optarg, "json")) {
+                usage(argv[0]);
+            }
+            break;
+        case 'S':
+            if (trace_parse(optarg, &cfg.trace_sample, &cfg.trace_slow_ms) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            config_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    if (config_path && config_load(config_path, &cfg) < 0) {
         exit(1);
     }
+    if (nthreads < 0 || queue_size <= 0 || nacceptors < 0 || cfg.cache_bytes < 0 ||
+        cfg.object_bytes < 0 || l1_slots < 0 || disk_size <= 0 || cfg.buf_bytes <= 0 ||
+        cfg.buf_max_bytes < cfg.buf_bytes || cfg.default_ttl < 0 || cfg.grace < 0 ||
+        nrefreshers < 0 || cfg.max_conns < 0 || cfg.max_fetches < 0 || cfg.queue_ms < 0 ||
+        cfg.connect_ms <= 0) {
+        usage(argv[0]);
+    }
+    if (nthreads == 0) {
+        /* One event loop per core, or a fixed pool of blocking workers */
+        nthreads = engine != ENGINE_THREADS ? (int)sysconf(_SC_NPROCESSORS_ONLN)
+                                            : NTHREADS_DEFAULT;
+    }
+    if (engine == ENGINE_URING && !uring_supported()) {
+        fprintf(stderr, "io_uring is not available, using epoll\n");
+        engine = ENGINE_EPOLL;
+    }
+    if (nacceptors > nthreads) {
+        nacceptors = nthreads;
+    }
+
+    /* Blocked before any thread starts, so only stats_main() takes it */
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    sigaddset(&stats_signals, SIGHUP);
+    sigaddset(&stats_signals, SIGUSR2);
+    if (disk_path) {
+        sigaddset(&stats_signals, SIGTERM);
+        sigaddset(&stats_signals, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
 
     Signal(SIGPIPE, SIG_IGN);
-    listenfd = Open_listenfd(argv[1]);
 
-    while (1) {
-        int *connfdp = Malloc(sizeof(int));
-        clientlen = sizeof(clientaddr);
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, thread_main, connfdp);
+    /* No SA_RESTART, so that it takes an acceptor out of accept() */
+    memset(&wake, 0, sizeof(wake));
+    wake.sa_handler = wake_acceptor;
+    sigemptyset(&wake.sa_mask);
+    sigaction(SIGRTMIN, &wake, NULL);
+
+    bufpool_init((size_t)cfg.buf_bytes, (size_t)cfg.buf_max_bytes);
+    if (disk_path) {
+        disk_init(disk_path, (size_t)disk_size);
+    }
+    cache_set_l1((size_t)l1_slots);
+    cache_init((size_t)cfg.cache_bytes, (size_t)cfg.object_bytes);
+    Pthread_create(&tid, NULL, stats_main, &stats_signals);
+    Pthread_detach(tid);
+    http_init();
+    http_set_default_ttl(cfg.default_ttl);
+    http_set_default_grace(cfg.grace);
+    if (nrefreshers > 0) {
+        refresh_init(nrefreshers, refresh_fetch);
+        cache_set_refresher(refresh_submit);
+    }
+    if (encodings) {
+        compress_init(encodings);
     }
+    upstream_init();
+    dns_init();
+    balance_set_connect_timeout((int)cfg.connect_ms);
+    admit_init((int)cfg.max_conns, (int)cfg.max_fetches, cfg.rate, cfg.burst, cfg.queue_ms);
+    if (trace_path) {
+        trace_init(trace_path, trace_format, cfg.trace_sample, cfg.trace_slow_ms);
+    }
+
+    /*
+     * A proxy started by a handoff takes over its predecessor's sockets.
+     * Otherwise, without -a, a single plain listening socket feeds
+     * everything.
+     */
+    if ((nlisten = handoff_inherit(&listenfds)) == 0) {
+        nlisten = nacceptors ? nacceptors : 1;
+        listenfds = Malloc(sizeof(int) * nlisten);
+        for (i = 0; i < nlisten; i++) {
+            listenfds[i] = nacceptors ? Open_reuseport_listenfd(argv[optind])
+                                      : Open_listenfd(argv[optind]);
+        }
+    }
+    handoff_init(argv, listenfds, nlisten);
+    config_init(config_path, &cfg, listenfds, nlisten);
+
+    if (engine == ENGINE_URING) {
+        uring_run(listenfds, nlisten, nthreads, pin);
+    }
+    if (engine == ENGINE_EPOLL) {
+        event_run(listenfds, nlisten, nthreads, pin);
+    }
+
+    /* Workers keep their requests in a request_ctx_t, not on the stack */
+    pthread_attr_init(&worker_attr);
+    if (pthread_attr_setstacksize(&worker_attr, WORKER_STACK_SIZE) != 0) {
+        fprintf(stderr, "cannot use %d byte worker stacks\n", WORKER_STACK_SIZE);
+    }
+    acceptors = Calloc(nlisten, sizeof(acceptor_t));
+    for (i = 0; i < nlisten; i++) {
+        acceptor_t *acc = &acceptors[i];
+        int j;
+        /* Hand the remainder of an uneven split to the first acceptors */
+        int nworkers = nthreads / nlisten + (i < nthreads % nlisten);
+
+        acc->listenfd = listenfds[i];
+        acc->cpu = pin ? i : -1;
+        sbuf_init(&acc->connq, queue_size);
+        for (j = 0; j < nworkers; j++) {
+            Pthread_create(&tid, &worker_attr, thread_main, acc);
+        }
+    }
+
+    acceptors[0].tid = pthread_self();
+    for (i = 1; i < nlisten; i++) {
+        Pthread_create(&acceptors[i].tid, NULL, acceptor_main, &acceptors[i]);
+        Pthread_detach(acceptors[i].tid);
+    }
+    acceptors_running = acceptors;
+    nacceptors_running = nlisten;
+    acceptor_main(&acceptors[0]);
+    return 0;
 }
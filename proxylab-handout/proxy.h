@@ -0,0 +1,24 @@
+/*
+ * proxy.h - helpers proxy.c shares with the I/O engines
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "cache.h"
+#include "http.h"
+
+/*
+ * Response bodies the cache is not keeping are spliced from origin to
+ * client once at least SPLICE_MIN bytes remain; shorter ones are not
+ * worth the extra system calls.
+ */
+#define SPLICE_MIN (16 * 1024)
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+void pin_thread(int cpu);
+int splice_pipe(int fds[2], int flags);
+void fill_conditional(cache_object_t *fill, char *buf, size_t size);
+cache_object_t *fill_revalidated(cache_object_t *fill, const char *head, size_t len,
+                                 const http_response_t *resp);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,81 @@
+/*
+ * refresh.c - background refresh of cache objects
+ *
+ * The cache hands over the fills that refresh objects which are about
+ * to go stale, or have just gone stale, while lookups keep being served
+ * the old ones (see cache.c). This queues them for a few refresher
+ * threads, each of which fetches one at a time with the fetch function
+ * the proxy gave refresh_init(). The queue is not bounded: the cache
+ * holds one object per key, so it never holds more fills than the cache
+ * has objects.
+ */
+#include "csapp.h"
+#include "refresh.h"
+
+typedef struct refresh_job {
+    cache_object_t *fill;
+    struct refresh_job *next;
+} refresh_job_t;
+
+static refresh_job_t *refresh_head = NULL;
+static refresh_job_t *refresh_tail = NULL;
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_queued = PTHREAD_COND_INITIALIZER;
+static void (*refresh_fetch)(cache_object_t *fill);
+
+static void *refresh_main(void *arg)
+{
+    Pthread_detach(Pthread_self());
+    while (1) {
+        refresh_job_t *job;
+
+        pthread_mutex_lock(&refresh_mutex);
+        while (!refresh_head) {
+            pthread_cond_wait(&refresh_queued, &refresh_mutex);
+        }
+        job = refresh_head;
+        refresh_head = job->next;
+        if (!refresh_head) {
+            refresh_tail = NULL;
+        }
+        pthread_mutex_unlock(&refresh_mutex);
+
+        refresh_fetch(job->fill);
+        Free(job);
+    }
+    return NULL;
+}
+
+/*
+ * refresh_init - Start nthreads refresher threads, which fill what they
+ *     are given with fetch(). fetch() owns the filler's reference and
+ *     must end the fill.
+ */
+void refresh_init(int nthreads, void (*fetch)(cache_object_t *fill))
+{
+    pthread_t tid;
+    int i;
+
+    refresh_fetch = fetch;
+    for (i = 0; i < nthreads; i++) {
+        Pthread_create(&tid, NULL, refresh_main, NULL);
+    }
+}
+
+/* refresh_submit - Queue fill for the next free refresher thread */
+void refresh_submit(cache_object_t *fill)
+{
+    refresh_job_t *job = Malloc(sizeof(refresh_job_t));
+
+    job->fill = fill;
+    job->next = NULL;
+    pthread_mutex_lock(&refresh_mutex);
+    if (refresh_tail) {
+        refresh_tail->next = job;
+    } else {
+        refresh_head = job;
+    }
+    refresh_tail = job;
+    pthread_cond_signal(&refresh_queued);
+    pthread_mutex_unlock(&refresh_mutex);
+}
@@ -0,0 +1,14 @@
+/*
+ * refresh.h - background refresh of cache objects
+ */
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "cache.h"
+
+#define REFRESH_THREADS_DEFAULT 2   /* Refresher threads for -R */
+
+void refresh_init(int nthreads, void (*fetch)(cache_object_t *fill));
+void refresh_submit(cache_object_t *fill);
+
+#endif /* __REFRESH_H__ */
@@ -0,0 +1,86 @@
+/*
+ * sbuf.c - bounded producer/consumer FIFO built on Posix semaphores
+ *
+ * The acceptor inserts connected descriptors and the worker threads
+ * remove them. When every slot is taken sbuf_insert blocks, so the
+ * acceptor stops calling accept() and new connections back up in the
+ * kernel's listen queue instead of in proxy memory. Each descriptor
+ * remembers when it was inserted, so the worker that removes it knows
+ * how long it queued.
+ */
+#include <time.h>
+#include "sbuf.h"
+
+static long long sbuf_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->when = Calloc(n, sizeof(long long));
+    sp->n = n;                  /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;   /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1); /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n); /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0); /* Initially, buf has zero data items */
+}
+
+/* Clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->when);
+}
+
+/* Insert item onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    long long now = sbuf_now();             /* Waiting for a slot counts too */
+
+    P(&sp->slots);                          /* Wait for available slot */
+    P(&sp->mutex);                          /* Lock the buffer */
+    sp->rear = (sp->rear + 1) % sp->n;      /* Wrap instead of overflowing */
+    sp->buf[sp->rear] = item;               /* Insert the item */
+    sp->when[sp->rear] = now;
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+
+/*
+ * Remove and return the first item from buffer sp, setting *waited,
+ * unless waited is NULL, to the nanoseconds it spent in the buffer
+ */
+int sbuf_remove(sbuf_t *sp, long long *waited)
+{
+    long long when;
+    int item;
+
+    P(&sp->items);                           /* Wait for available item */
+    P(&sp->mutex);                           /* Lock the buffer */
+    sp->front = (sp->front + 1) % sp->n;     /* Wrap instead of overflowing */
+    item = sp->buf[sp->front];               /* Remove the item */
+    when = sp->when[sp->front];
+    V(&sp->mutex);                           /* Unlock the buffer */
+    V(&sp->slots);                           /* Announce available slot */
+    if (waited) {
+        *waited = sbuf_now() - when;
+    }
+    return item;
+}
+
+/* Return the number of items waiting to be removed from sp */
+int sbuf_waiting(sbuf_t *sp)
+{
+    int n;
+
+    if (sem_getvalue(&sp->items, &n) < 0) {
+        unix_error("sem_getvalue error");
+    }
+    return n;
+}
@@ -0,0 +1,261 @@
+/*
+ * slab.c - size-classed slab arena for cache objects and chunks
+ *
+ * The whole cache budget is mapped and touched once at startup, then
+ * cut into SLAB_PAGE_SIZE pages. A page is handed to one size class
+ * when that class runs out of free blocks and is carved into blocks of
+ * that size; it goes back to the free pages as soon as its last block
+ * is freed, so no class holds on to memory it no longer uses. Small
+ * classes step by about a quarter, and the classes from 1K up divide a
+ * page almost exactly, so neither blocks nor pages waste much.
+ *
+ * Every class has its own lock and only the rare page handoff takes
+ * the page lock. Callers ask for an exact class size, which is the
+ * size they charge against their budget, so the bytes they account for
+ * are the bytes the arena hands out. Blocks from the arena and from
+ * Malloc() can both be given to slab_free().
+ */
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "csapp.h"
+#include "slab.h"
+
+#define SLAB_MAX_CLASSES 48
+
+typedef struct slab_page {
+    void *free;                /* Free blocks, linked through their first word */
+    int cls;
+    int inuse;
+    struct slab_page *prev;    /* Neighbours on the class's partial list */
+    struct slab_page *next;
+} slab_page_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t size;
+    int per_page;
+    slab_page_t *partial;      /* Pages with at least one free block */
+} __attribute__((aligned(64))) slab_class_t;
+
+static slab_class_t slab_classes[SLAB_MAX_CLASSES];
+static int slab_nclasses = 0;
+static char *slab_arena = NULL;
+static size_t slab_npages = 0;
+static slab_page_t *slab_pages;
+static slab_page_t *slab_free_pages = NULL;
+static pthread_mutex_t slab_page_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t slab_bytes_used;
+
+static void slab_add_class(size_t size)
+{
+    slab_class_t *c = &slab_classes[slab_nclasses++];
+
+    pthread_mutex_init(&c->lock, NULL);
+    c->size = size;
+    c->per_page = SLAB_PAGE_SIZE / size;
+    c->partial = NULL;
+}
+
+/*
+ * slab_init - Preallocate an arena of budget bytes, rounded up to whole
+ *     pages. With a zero budget every slab_alloc() fails.
+ */
+void slab_init(size_t budget)
+{
+    size_t size, i;
+    int n;
+
+    for (size = SLAB_MIN_BLOCK; size < 1024; size = (size * 5 / 4 + 15) & ~(size_t)15) {
+        slab_add_class(size);
+    }
+    for (n = SLAB_PAGE_SIZE / 1024; n >= 1; n--) {
+        slab_add_class((SLAB_PAGE_SIZE / n) & ~(size_t)15);
+    }
+
+    slab_npages = (budget + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+    if (slab_npages == 0) {
+        return;
+    }
+    slab_arena = Mmap(NULL, slab_npages * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    slab_pages = Calloc(slab_npages, sizeof(slab_page_t));
+    for (i = slab_npages; i-- > 0; ) {
+        slab_pages[i].next = slab_free_pages;
+        slab_free_pages = &slab_pages[i];
+    }
+}
+
+/* Index of the smallest class of at least size bytes, or -1 */
+static int slab_class_index(size_t size)
+{
+    int lo = 0, hi = slab_nclasses;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (slab_classes[mid].size < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < slab_nclasses ? lo : -1;
+}
+
+/* slab_block_size - The block a size byte request takes, 0 if too big */
+size_t slab_block_size(size_t size)
+{
+    int i = slab_class_index(size);
+
+    return i < 0 ? 0 : slab_classes[i].size;
+}
+
+/* slab_block_below - The largest block of at most size bytes, or 0 */
+size_t slab_block_below(size_t size)
+{
+    int i = slab_class_index(size);
+
+    if (i < 0) {
+        return slab_classes[slab_nclasses - 1].size;
+    }
+    if (slab_classes[i].size == size) {
+        return size;
+    }
+    return i > 0 ? slab_classes[i - 1].size : 0;
+}
+
+static void slab_partial_add(slab_class_t *c, slab_page_t *pg)
+{
+    pg->prev = NULL;
+    pg->next = c->partial;
+    if (c->partial) {
+        c->partial->prev = pg;
+    }
+    c->partial = pg;
+}
+
+static void slab_partial_remove(slab_class_t *c, slab_page_t *pg)
+{
+    if (pg->prev) {
+        pg->prev->next = pg->next;
+    } else {
+        c->partial = pg->next;
+    }
+    if (pg->next) {
+        pg->next->prev = pg->prev;
+    }
+    pg->prev = NULL;
+    pg->next = NULL;
+}
+
+/* Take a free page for class cls and carve it into blocks */
+static slab_page_t *slab_page_get(int cls)
+{
+    slab_class_t *c = &slab_classes[cls];
+    slab_page_t *pg;
+    char *base;
+    int i;
+
+    pthread_mutex_lock(&slab_page_lock);
+    if ((pg = slab_free_pages) != NULL) {
+        slab_free_pages = pg->next;
+    }
+    pthread_mutex_unlock(&slab_page_lock);
+    if (!pg) {
+        return NULL;
+    }
+
+    base = slab_arena + (size_t)(pg - slab_pages) * SLAB_PAGE_SIZE;
+    pg->cls = cls;
+    pg->inuse = 0;
+    pg->free = NULL;
+    for (i = c->per_page; i-- > 0; ) {
+        void **b = (void **)(base + i * c->size);
+        *b = pg->free;
+        pg->free = b;
+    }
+    return pg;
+}
+
+/*
+ * slab_alloc - Return a block of exactly block bytes, which must be a
+ *     size from slab_block_size() or slab_block_below(), or NULL if the
+ *     arena has no room for it.
+ */
+void *slab_alloc(size_t block)
+{
+    int cls = slab_class_index(block);
+    slab_class_t *c;
+    slab_page_t *pg;
+    void **b;
+
+    if (!slab_arena || cls < 0) {
+        return NULL;
+    }
+    c = &slab_classes[cls];
+
+    pthread_mutex_lock(&c->lock);
+    if ((pg = c->partial) == NULL) {
+        if ((pg = slab_page_get(cls)) == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        slab_partial_add(c, pg);
+    }
+    b = pg->free;
+    pg->free = *b;
+    pg->inuse++;
+    if (!pg->free) {
+        slab_partial_remove(c, pg);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    atomic_fetch_add_explicit(&slab_bytes_used, c->size, memory_order_relaxed);
+    return b;
+}
+
+/* slab_free - Free a block from slab_alloc(), or from Malloc() */
+void slab_free(void *p)
+{
+    slab_page_t *pg;
+    slab_class_t *c;
+    int empty;
+
+    if (!p) {
+        return;
+    }
+    if ((char *)p < slab_arena || (char *)p >= slab_arena + slab_npages * SLAB_PAGE_SIZE) {
+        Free(p);
+        return;
+    }
+
+    /* The page cannot change class while p is allocated from it */
+    pg = &slab_pages[((char *)p - slab_arena) / SLAB_PAGE_SIZE];
+    c = &slab_classes[pg->cls];
+
+    pthread_mutex_lock(&c->lock);
+    if (!pg->free) {
+        slab_partial_add(c, pg);
+    }
+    *(void **)p = pg->free;
+    pg->free = p;
+    empty = --pg->inuse == 0;
+    if (empty) {
+        slab_partial_remove(c, pg);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    atomic_fetch_sub_explicit(&slab_bytes_used, c->size, memory_order_relaxed);
+    if (empty) {
+        pthread_mutex_lock(&slab_page_lock);
+        pg->next = slab_free_pages;
+        slab_free_pages = pg;
+        pthread_mutex_unlock(&slab_page_lock);
+    }
+}
+
+/* slab_used - Bytes of the arena currently allocated */
+size_t slab_used(void)
+{
+    return atomic_load_explicit(&slab_bytes_used, memory_order_relaxed);
+}
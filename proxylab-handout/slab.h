@@ -0,0 +1,21 @@
+/*
+ * slab.h - size-classed slab arena for cache objects and chunks
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+/* The arena is carved into pages, each holding blocks of one class */
+#define SLAB_PAGE_SIZE 16384
+#define SLAB_MIN_BLOCK 64
+#define SLAB_MAX_BLOCK SLAB_PAGE_SIZE
+
+void slab_init(size_t budget);
+size_t slab_block_size(size_t size);
+size_t slab_block_below(size_t size);
+void *slab_alloc(size_t block);
+void slab_free(void *p);
+size_t slab_used(void);
+
+#endif /* __SLAB_H__ */
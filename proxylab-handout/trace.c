@@ -0,0 +1,331 @@
+/*
+ * trace.c - per-request access log
+ *
+ * With -l, every request the proxy serves leaves a record: when it
+ * started, its cache key, how it was answered, the bytes sent, the
+ * origin address it went to and the time spent in each stage. Writing
+ * those with stdio from the threads serving requests would make them
+ * queue on the stream's lock, so instead:
+ *
+ *   - A request fills in a trace_record_t of its own as it goes. The
+ *     engines make it the thread's current record while they work on
+ *     the request, so metrics_since() and the relay code can add their
+ *     stage times and byte counts to it without being handed it.
+ *   - trace_end() copies a finished record into the ring of the thread
+ *     that served it. A ring has one writer, its thread, and one
+ *     reader, the log writer, so it takes no lock: each side owns one
+ *     index and publishes it with a release store. A full ring drops
+ *     the record and counts it rather than make the request wait.
+ *   - The log writer thread drains every ring each TRACE_FLUSH_MS and
+ *     writes the batch with one write(), as JSON lines or as raw
+ *     records behind TRACE_MAGIC.
+ *
+ * -S n[,slow_ms] keeps one in n of each thread's requests, counted
+ * without sharing a counter, and every request that took slow_ms or
+ * longer, so tracing of the slow tail can stay on at peak load. Rings
+ * are made on a thread's first kept record, and live as long as the
+ * process, as the threads do.
+ */
+#include <stdatomic.h>
+#include <time.h>
+#include "csapp.h"
+#include "trace.h"
+
+#define TRACE_BATCH (64 * 1024)        /* Bytes the writer gathers per write() */
+
+typedef struct trace_ring {
+    atomic_uint head;          /* Next slot the thread fills */
+    atomic_uint tail;          /* Next slot the writer drains */
+    trace_record_t recs[TRACE_RING];
+    struct trace_ring *next;
+} trace_ring_t;
+
+static int trace_on = 0;
+static int trace_fd = -1;
+static int trace_format = TRACE_JSON;
+static unsigned trace_sample = 1;
+static long long trace_slow_ns = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trace_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings = NULL;
+static __thread trace_ring_t *trace_self = NULL;
+static __thread trace_record_t *trace_current = NULL;
+static __thread unsigned trace_count = 0;
+
+static const char *outcome_names[] = { "miss", "hit", "revalidated", "refused", "local" };
+
+/*
+ * trace_parse - Parse -S's "n[,slow_ms]". Returns -1 if s is not one.
+ */
+int trace_parse(const char *s, unsigned *sample, long long *slow_ms)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if (end == s || n < 1) {
+        return -1;
+    }
+    *sample = (unsigned)n;
+    *slow_ms = 0;
+    if (*end == ',') {
+        s = end + 1;
+        *slow_ms = strtoll(s, &end, 10);
+        if (end == s || *slow_ms < 0) {
+            return -1;
+        }
+    }
+    return *end ? -1 : 0;
+}
+
+/* trace_resume - Make r, or with NULL no record, the thread's current one */
+void trace_resume(trace_record_t *r)
+{
+    trace_current = trace_on ? r : NULL;
+}
+
+/* trace_begin - r is the record of a request that starts now */
+void trace_begin(trace_record_t *r)
+{
+    struct timespec ts;
+
+    if (!trace_on) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->time = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* trace_push - Queue r on the calling thread's ring, or drop it */
+static void trace_push(const trace_record_t *r)
+{
+    trace_ring_t *ring = trace_self;
+    unsigned head;
+
+    if (!ring) {
+        ring = Calloc(1, sizeof(trace_ring_t));
+        pthread_mutex_lock(&trace_lock);
+        ring->next = trace_rings;
+        trace_rings = ring;
+        pthread_mutex_unlock(&trace_lock);
+        trace_self = ring;
+    }
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING) {
+        metrics_count(METRIC_TRACE_DROPPED);
+        return;
+    }
+    ring->recs[head % TRACE_RING] = *r;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * trace_end - The request r is the record of is over. Log it if it is
+ *     sampled or slow, and clear r for the next request.
+ */
+void trace_end(trace_record_t *r)
+{
+    if (!trace_on) {
+        return;
+    }
+    if (r->time && (++trace_count % trace_sample == 0 ||
+                    (trace_slow_ns > 0 && r->stage[METRIC_TOTAL] >= trace_slow_ns))) {
+        trace_push(r);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+void trace_key(const char *key)
+{
+    if (trace_current) {
+        strncpy(trace_current->key, key, TRACE_KEY_MAX - 1);
+        trace_current->key[TRACE_KEY_MAX - 1] = '\0';
+    }
+}
+
+void trace_outcome(int outcome)
+{
+    if (trace_current) {
+        trace_current->outcome = (unsigned char)outcome;
+    }
+}
+
+void trace_upstream(const balance_peer_t *peer)
+{
+    trace_record_t *r = trace_current;
+
+    if (!r) {
+        return;
+    }
+    r->family = (unsigned char)peer->addr.ss_family;
+    if (peer->addr.ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)&peer->addr;
+
+        memcpy(r->addr, &sin->sin_addr, 4);
+        r->port = ntohs(sin->sin_port);
+    } else if (peer->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&peer->addr;
+
+        memcpy(r->addr, &sin6->sin6_addr, 16);
+        r->port = ntohs(sin6->sin6_port);
+    }
+}
+
+void trace_bytes(size_t n)
+{
+    if (trace_current) {
+        trace_current->bytes += n;
+    }
+}
+
+/* trace_stage - Called by metrics_since() with each stage's time */
+void trace_stage(int stage, long long ns)
+{
+    if (trace_current) {
+        trace_current->stage[stage] += ns;
+    }
+}
+
+/* Append r to buf as one JSON line; returns the bytes written */
+static size_t trace_json(char *buf, size_t size, const trace_record_t *r)
+{
+    char addr[INET6_ADDRSTRLEN] = "";
+    size_t n = 0;
+    const char *k;
+    int s;
+
+    n += snprintf(buf + n, size - n, "{\"time\":%lld.%06lld,\"key\":\"",
+                  r->time / 1000000000LL, r->time % 1000000000LL / 1000);
+    for (k = r->key; *k && n < size - 8; k++) {
+        unsigned char ch = (unsigned char)*k;
+
+        if (ch == '"' || ch == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = ch;
+        } else if (ch < 0x20 || ch >= 0x7f) {
+            n += snprintf(buf + n, size - n, "\\u%04x", ch);
+        } else {
+            buf[n++] = ch;
+        }
+    }
+    n += snprintf(buf + n, size - n, "\",\"cache\":\"%s\",\"bytes\":%llu",
+                  outcome_names[r->outcome], r->bytes);
+    if (r->family) {
+        inet_ntop(r->family, r->addr, addr, sizeof(addr));
+        n += snprintf(buf + n, size - n, r->family == AF_INET6 ? ",\"upstream\":\"[%s]:%u\""
+                                                              : ",\"upstream\":\"%s:%u\"",
+                      addr, r->port);
+    }
+    for (s = 0; s < METRIC_NSTAGES; s++) {
+        n += snprintf(buf + n, size - n, ",\"%s_us\":%lld", metrics_stage_name(s),
+                      r->stage[s] / 1000);
+    }
+    n += snprintf(buf + n, size - n, "}\n");
+    return n < size ? n : size - 1;
+}
+
+static void trace_write(const char *buf, size_t n)
+{
+    if (n > 0 && rio_writen(trace_fd, (void *)buf, n) < 0) {
+        fprintf(stderr, "trace log write failed: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * trace_drain - Write out every record queued on the rings. Whoever
+ *     calls it holds trace_drain_lock, so each ring keeps one reader.
+ */
+static void trace_drain(char *buf)
+{
+    trace_ring_t *ring;
+    size_t len = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    ring = trace_rings;
+    pthread_mutex_unlock(&trace_lock);
+
+    /* Rings are only ever added at the head, so the rest is stable */
+    for (; ring; ring = ring->next) {
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            const trace_record_t *r = &ring->recs[tail % TRACE_RING];
+
+            /* Room for the longest JSON line, and so for a record */
+            if (TRACE_BATCH - len < MAXLINE) {
+                trace_write(buf, len);
+                len = 0;
+            }
+            if (trace_format == TRACE_BINARY) {
+                memcpy(buf + len, r, sizeof(*r));
+                len += sizeof(*r);
+            } else {
+                len += trace_json(buf + len, TRACE_BATCH - len, r);
+            }
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    trace_write(buf, len);
+}
+
+static void *trace_writer(void *arg)
+{
+    char *buf = Malloc(TRACE_BATCH);
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        usleep(TRACE_FLUSH_MS * 1000);
+        pthread_mutex_lock(&trace_drain_lock);
+        trace_drain(buf);
+        pthread_mutex_unlock(&trace_drain_lock);
+    }
+    return NULL;
+}
+
+/* trace_flush - Write out what is queued now, before the process exits */
+void trace_flush(void)
+{
+    char *buf;
+
+    if (!trace_on) {
+        return;
+    }
+    buf = Malloc(TRACE_BATCH);
+    pthread_mutex_lock(&trace_drain_lock);
+    trace_drain(buf);
+    pthread_mutex_unlock(&trace_drain_lock);
+    Free(buf);
+}
+
+/*
+ * trace_set_sample - Log one in sample of each thread's requests, and
+ *     any that took slow_ms or more if that is not 0. A reload may call
+ *     it while requests are being logged.
+ */
+void trace_set_sample(unsigned sample, long long slow_ms)
+{
+    trace_sample = sample;
+    trace_slow_ns = slow_ms * 1000000;
+}
+
+/*
+ * trace_init - Log requests, sampled as trace_set_sample() says, to the
+ *     file path in format, appending to what is there
+ */
+void trace_init(const char *path, int format, unsigned sample, long long slow_ms)
+{
+    pthread_t tid;
+    struct stat st;
+
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        unix_error("cannot open trace log");
+    }
+    if (format == TRACE_BINARY && fstat(trace_fd, &st) == 0 && st.st_size == 0) {
+        trace_write(TRACE_MAGIC, strlen(TRACE_MAGIC));
+    }
+    trace_format = format;
+    trace_set_sample(sample, slow_ms);
+    trace_on = 1;
+    Pthread_create(&tid, NULL, trace_writer, NULL);
+}
@@ -0,0 +1,59 @@
+/*
+ * trace.h - per-request access log records, written off the hot path
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include "metrics.h"
+#include "balance.h"
+
+#define TRACE_KEY_MAX 160              /* Bytes of the cache key kept */
+#define TRACE_RING 256                 /* Records each thread may have queued */
+#define TRACE_FLUSH_MS 50              /* How often the writer drains the rings */
+
+/* How a request was answered */
+enum {
+    TRACE_MISS,                /* Fetched from the origin */
+    TRACE_HIT,                 /* Served from the cache */
+    TRACE_REVALIDATED,         /* Served from the cache after a 304 */
+    TRACE_REFUSED,             /* Turned away by admission control */
+    TRACE_LOCAL                /* Answered by the proxy, e.g. metrics */
+};
+
+/* Log formats */
+enum {
+    TRACE_JSON,                /* One JSON object per line */
+    TRACE_BINARY               /* TRACE_MAGIC, then trace_record_t as is */
+};
+
+#define TRACE_MAGIC "PXTRACE1"
+
+/* One request; also the binary log's record, in host byte order */
+typedef struct {
+    long long time;            /* When it started, ns since the epoch; 0 before */
+    long long stage[METRIC_NSTAGES]; /* Nanoseconds spent in each stage */
+    unsigned long long bytes;  /* Response bytes sent to the client */
+    unsigned char outcome;
+    unsigned char family;      /* Upstream's AF_INET or AF_INET6, 0 if none */
+    unsigned short port;       /* Upstream port */
+    unsigned char addr[16];    /* Upstream address */
+    char key[TRACE_KEY_MAX];
+} trace_record_t;
+
+void trace_init(const char *path, int format, unsigned sample, long long slow_ms);
+int trace_parse(const char *s, unsigned *sample, long long *slow_ms);
+void trace_set_sample(unsigned sample, long long slow_ms);
+void trace_flush(void);
+
+void trace_resume(trace_record_t *r);
+void trace_begin(trace_record_t *r);
+void trace_end(trace_record_t *r);
+
+void trace_key(const char *key);
+void trace_outcome(int outcome);
+void trace_upstream(const balance_peer_t *peer);
+void trace_bytes(size_t n);
+void trace_stage(int stage, long long ns);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,256 @@
+/*
+ * upstream.c - pool of idle keep-alive connections to origin servers
+ *
+ * Idle connections are kept per host:port in a small chained hash
+ * table, most recently used first. upstream_acquire() hands out the
+ * freshest idle connection that passes a health check and only opens
+ * a new one, to the address of the name's DNS cache entry balance.c
+ * picks, when none is left. Every connection remembers its address,
+ * so requests on reused ones count towards that address's load too. A
+ * reaper thread closes connections that have been idle for longer
+ * than the idle timeout, well before a typical origin gives up on
+ * them, and forgets origins with nothing left in the pool.
+ *
+ * All three engines share the pool. The threaded and io_uring engines
+ * use their connections blocking and the epoll one non-blocking, so
+ * each is put in the mode the engine taking it wants.
+ */
+#include <time.h>
+#include "csapp.h"
+#include "dns.h"
+#include "balance.h"
+#include "upstream.h"
+
+#define UPSTREAM_BUCKETS 256
+
+typedef struct idle_conn {
+    int fd;
+    balance_peer_t peer;       /* The address it is connected to */
+    time_t since;              /* When it was returned to the pool */
+    struct idle_conn *next;
+} idle_conn_t;
+
+typedef struct upstream_host {
+    char *key;                 /* "host:port" */
+    idle_conn_t *idle;         /* Most recently used first */
+    int nidle;
+    struct upstream_host *next;
+} upstream_host_t;
+
+static upstream_host_t *upstream_buckets[UPSTREAM_BUCKETS];
+static int upstream_nidle = 0;
+static pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned upstream_hash(const char *s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Find, or with create set, add the entry for key. Caller holds the lock */
+static upstream_host_t *upstream_host(const char *key, int create)
+{
+    upstream_host_t **bucket = &upstream_buckets[upstream_hash(key) % UPSTREAM_BUCKETS];
+    upstream_host_t *h;
+
+    for (h = *bucket; h; h = h->next) {
+        if (!strcmp(h->key, key)) {
+            return h;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    h = Calloc(1, sizeof(upstream_host_t));
+    h->key = Malloc(strlen(key) + 1);
+    strcpy(h->key, key);
+    h->next = *bucket;
+    *bucket = h;
+    return h;
+}
+
+/*
+ * upstream_alive - An idle connection is healthy only if the origin
+ *     has neither closed it nor sent anything unsolicited.
+ */
+static int upstream_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Close every connection idle since before cutoff. Caller holds the lock */
+static void upstream_expire(upstream_host_t *h, time_t cutoff)
+{
+    idle_conn_t **pp = &h->idle;
+
+    while (*pp) {
+        idle_conn_t *ic = *pp;
+        if (ic->since < cutoff) {
+            *pp = ic->next;
+            close(ic->fd);
+            Free(ic);
+            h->nidle--;
+            upstream_nidle--;
+        } else {
+            pp = &ic->next;
+        }
+    }
+}
+
+static void *upstream_reaper(void *arg)
+{
+    Pthread_detach(Pthread_self());
+    while (1) {
+        int i;
+        time_t cutoff;
+
+        sleep(UPSTREAM_IDLE_TIMEOUT / 2 > 0 ? UPSTREAM_IDLE_TIMEOUT / 2 : 1);
+        cutoff = time(NULL) - UPSTREAM_IDLE_TIMEOUT;
+
+        pthread_mutex_lock(&upstream_mutex);
+        for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+            upstream_host_t **pp = &upstream_buckets[i];
+            while (*pp) {
+                upstream_host_t *h = *pp;
+                upstream_expire(h, cutoff);
+                if (h->nidle == 0) {
+                    /* Forget origins we no longer hold connections to */
+                    *pp = h->next;
+                    Free(h->key);
+                    Free(h);
+                } else {
+                    pp = &h->next;
+                }
+            }
+        }
+        pthread_mutex_unlock(&upstream_mutex);
+    }
+    return NULL;
+}
+
+void upstream_init(void)
+{
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, upstream_reaper, NULL);
+}
+
+/* Put fd in blocking or non-blocking mode, whichever its user wants */
+static void upstream_set_nonblock(int fd, int nonblock)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags >= 0 && !!(flags & O_NONBLOCK) != nonblock) {
+        fcntl(fd, F_SETFL, nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+    }
+}
+
+/*
+ * upstream_take - Return an idle pooled connection to hostname:port
+ *     that passes a health check, in blocking or non-blocking mode as
+ *     nonblock says, or -1 if there is none. Unlike upstream_acquire()
+ *     it never connects, so the event engines can do that themselves
+ *     without blocking. The request on it is begun with balance_begin()
+ *     on the address left in peer.
+ */
+int upstream_take(const char *hostname, const char *port, balance_peer_t *peer, int nonblock)
+{
+    char key[MAXLINE];
+    upstream_host_t *h;
+    int fd;
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+
+    pthread_mutex_lock(&upstream_mutex);
+    if ((h = upstream_host(key, 0)) != NULL) {
+        while (h->idle) {
+            idle_conn_t *ic = h->idle;
+
+            h->idle = ic->next;
+            h->nidle--;
+            upstream_nidle--;
+            fd = ic->fd;
+            *peer = ic->peer;
+            Free(ic);
+
+            if (upstream_alive(fd)) {
+                pthread_mutex_unlock(&upstream_mutex);
+                upstream_set_nonblock(fd, nonblock);
+                balance_begin(peer);
+                return fd;
+            }
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+    return -1;
+}
+
+/*
+ * upstream_acquire - Return a blocking connection to hostname:port,
+ *     reusing an idle pooled one when possible. *reused tells the caller
+ *     whether the origin may have closed it in the meantime, in which
+ *     case a failed exchange is worth one retry. The request on it is
+ *     begun with balance_begin() on the address left in peer; the caller
+ *     reports how it went with balance_done(). Returns -1 on error.
+ */
+int upstream_acquire(const char *hostname, const char *port, int *reused, balance_peer_t *peer)
+{
+    dns_addrs_t *addrs;
+    int fd;
+
+    if ((fd = upstream_take(hostname, port, peer, 0)) >= 0) {
+        *reused = 1;
+        return fd;
+    }
+    *reused = 0;
+    addrs = dns_lookup(hostname, port);
+    fd = balance_connect(addrs->list, peer);
+    dns_release(addrs);
+    return fd < 0 ? -1 : fd;
+}
+
+/*
+ * upstream_release - Give fd back once a response has been read in
+ *     full. Connections that cannot carry another request, or that do
+ *     not fit within the pool limits, are closed.
+ */
+void upstream_release(const char *hostname, const char *port, int fd, const balance_peer_t *peer,
+                      int reusable)
+{
+    char key[MAXLINE];
+    upstream_host_t *h;
+    idle_conn_t *ic;
+
+    if (!reusable) {
+        close(fd);
+        return;
+    }
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+
+    pthread_mutex_lock(&upstream_mutex);
+    h = upstream_host(key, 1);
+    if (h->nidle >= UPSTREAM_MAX_IDLE_PER_HOST || upstream_nidle >= UPSTREAM_MAX_IDLE) {
+        pthread_mutex_unlock(&upstream_mutex);
+        close(fd);
+        return;
+    }
+    ic = Malloc(sizeof(idle_conn_t));
+    ic->fd = fd;
+    ic->peer = *peer;
+    ic->since = time(NULL);
+    ic->next = h->idle;
+    h->idle = ic;
+    h->nidle++;
+    upstream_nidle++;
+    pthread_mutex_unlock(&upstream_mutex);
+}
@@ -0,0 +1,20 @@
+/*
+ * upstream.h - pool of idle keep-alive connections to origin servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "balance.h"
+
+/* Pool limits */
+#define UPSTREAM_MAX_IDLE_PER_HOST 8   /* Idle connections kept per host:port */
+#define UPSTREAM_MAX_IDLE 256          /* Idle connections kept in total */
+#define UPSTREAM_IDLE_TIMEOUT 10       /* Seconds before an idle one is closed */
+
+void upstream_init(void);
+int upstream_take(const char *hostname, const char *port, balance_peer_t *peer, int nonblock);
+int upstream_acquire(const char *hostname, const char *port, int *reused, balance_peer_t *peer);
+void upstream_release(const char *hostname, const char *port, int fd, const balance_peer_t *peer,
+                      int reusable);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,1756 @@
+/*
+ * uring.c - io_uring based proxy engine
+ *
+ * Each loop owns an io_uring, set up and driven with raw system calls,
+ * and runs on its own thread. Where the epoll engine waits until a
+ * socket is ready and then reads or writes it, this one queues the
+ * reads and writes themselves and acts on their completions. One
+ * io_uring_enter() submits everything the last batch of completions
+ * asked for, over all of the loop's connections, and waits for the
+ * next batch.
+ *
+ *   - Each loop keeps one multishot accept on its listening socket,
+ *     which posts a completion for every new connection.
+ *   - Each loop registers a pool of relay buffers with the kernel, so
+ *     body reads and writes through them do not map the pages anew
+ *     every time. A connection holds one while it relays a response.
+ *   - Operations that must follow one another are linked: a connect
+ *     with a timeout and the origin request, and every write of body
+ *     bytes to the client with the next read from the origin into the
+ *     same buffer. A short write cancels the read linked to it, and the
+ *     rest of the bytes go out linked to a new one.
+ *
+ * Connections go through the same states as in the epoll engine, with
+ * the same request parsing, cache, DNS cache, admission control,
+ * keep-alive rules and origin connection pool. A hit on an object that
+ * is still filling waits in its waiter list; the filling thread queues
+ * it on the loop and signals the loop's eventfd, which always has a
+ * read pending.
+ *
+ * Buffers handed to the kernel must outlive the operations using them,
+ * so a connection is only freed once every operation it queued has
+ * completed. Closing it cancels what is in flight and leaves it on the
+ * loop's dead list until the last completion arrives.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+#include "http.h"
+#include "proxy.h"
+#include "uring.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "compress.h"
+#include "admit.h"
+#include "balance.h"
+#include "trace.h"
+#include "handoff.h"
+#include "upstream.h"
+
+#define UR_SQ_ENTRIES 1024
+#define UR_CQ_ENTRIES 8192
+#define UR_TICK_MS 1000
+#define UR_INIT_HDRS 2048
+#define UR_MAX_HDRS HTTP_MAX_HEAD
+#define UR_NBUFS 64                /* Registered relay buffers per loop */
+#define UR_BUF_SIZE (32 * 1024)
+
+/* What a connection's completion is for, kept in its user_data's low bits */
+enum {
+    OP_CLIENT_READ = 1,
+    OP_CLIENT_WRITE,
+    OP_CONNECT,
+    OP_SERVER_WRITE,
+    OP_SERVER_READ,
+    OP_CONNECT_TIMEOUT,
+    OP_MASK = 7
+};
+
+/* Completions of the loop's own operations, whose user_data has no conn */
+enum {
+    LOOP_ACCEPT = 1,
+    LOOP_WAKE,
+    LOOP_TICK,
+    LOOP_IGNORE
+};
+
+enum {
+    CONN_READ_REQ,
+    CONN_WRITE_HIT,
+    CONN_CONNECT,              /* Connect and origin request in flight */
+    CONN_RELAY
+};
+
+typedef struct conn conn_t;
+typedef struct ur_loop ur_loop_t;
+
+/* The rings shared with the kernel, mapped in one piece */
+typedef struct {
+    int fd;
+    void *map;
+    size_t map_size;
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail;          /* Entries filled in, published on submit */
+    unsigned sq_submitted;     /* Entries the kernel has taken */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_cqe *stash; /* Completions taken off to make room, oldest first */
+    unsigned stash_head;
+    unsigned stash_len;
+    unsigned stash_cap;
+} ur_ring_t;
+
+struct conn {
+    ur_loop_t *loop;
+    int state;
+    int closed;
+    conn_t *next_dead;
+    conn_t *idle_prev;         /* On the loop's idle list, oldest first */
+    conn_t *idle_next;
+    int idle_linked;
+    long long idle_since;
+
+    int client_fd;
+    int server_fd;             /* -1 while there is no origin connection */
+    int client_ops;            /* Operations in flight on each descriptor */
+    int server_ops;
+    int connect_failed;        /* Waiting for the linked request to drop */
+
+    char *in;                  /* Request bytes read from the client */
+    size_t in_len;
+    size_t in_cap;
+    size_t req_len;            /* Bytes of in taken by the current request */
+    int keepalive;             /* Keep the client connection afterwards */
+    int accept_encodings;      /* The request's, for picking a variant */
+    long long t_start;         /* When the request was parsed, see metrics.h */
+    long long t_stage;         /* When its current stage began */
+
+    char *out;                 /* Origin request, then the rewritten head */
+    size_t out_len;
+    size_t out_cap;
+
+    char *wbuf;                /* What the client write in flight sends */
+    size_t wlen;
+    size_t woff;
+    int wfixed;                /* wbuf's registered buffer, or -1 */
+
+    cache_object_t *hit;       /* Pinned object on a cache hit */
+    cache_cursor_t cur;        /* Next byte of hit to send */
+    int head_sent;             /* hit's head and the proxy's headers are out */
+    struct iovec iov[CACHE_IOV_MAX + 1]; /* Batch being sent from hit */
+    int iovcnt;                /* Unsent iovecs, from iov + iov_idx */
+    int iov_idx;
+    size_t batch_len;          /* Bytes of hit in the batch */
+    struct msghdr msg;
+    char hdrs[MAX_CACHED_HDRS];
+    cache_waiter_t waiter;     /* Queued on hit while it fills */
+    conn_t *next_woken;
+    int bypass;                /* Fetch without the cache */
+    uint64_t client;           /* Rate limit key, see admit.c */
+    int fetching;              /* Holds one of admit_fetch()'s slots */
+    trace_record_t trace;      /* The request's access log record */
+
+    cache_object_t *fill;      /* Object this response fills, or NULL */
+    char *host;                /* The origin, whose pool its connection joins */
+    char *port;
+    int reused;                /* The origin connection came from the pool */
+    dns_addrs_t *addrs;        /* Origin addresses, in order to try */
+    struct addrinfo *order[BALANCE_MAX_ADDRS];
+    int naddrs;
+    int next_addr;
+    balance_peer_t peer;       /* The address being tried */
+    int balancing;             /* peer's request is begun, not done */
+    long long t_origin;        /* When that was */
+
+    char *head;                /* Response head as read from the origin */
+    size_t head_len;
+    size_t head_cap;
+    int head_done;             /* Head rewritten and on its way to the client */
+    int parsed;                /* Origin answered with an HTTP/1.x head */
+    int resp_done;             /* Whole response read from the origin */
+    http_response_t resp;
+    long long body_len;        /* Body bytes read so far */
+    http_chunked_t chunks;     /* Where a chunked body ends */
+    int overrun;               /* The origin sent more than the response */
+    char *body;                /* Relay buffer for the body */
+    size_t body_cap;
+    int buf;                   /* body's registered buffer, or -1 */
+};
+
+struct ur_loop {
+    ur_ring_t ring;
+    int cpu;                   /* CPU to pin the loop to, or -1 */
+    int listenfd;
+    int multishot;             /* Accept is multishot, else rearmed each time */
+    int accepting;             /* Clear once the sockets are handed off */
+    int wakefd;                /* eventfd signalled when objects grow */
+    uint64_t wake_count;
+    struct __kernel_timespec tick;
+    struct __kernel_timespec connect_timeout;
+    pthread_mutex_t woken_lock;
+    conn_t *woken;             /* Hits whose object has grown or ended */
+    conn_t *idle_head;
+    conn_t *idle_tail;
+    conn_t *dead;              /* Closed, freed once nothing is in flight */
+    char *bufs;                /* The registered relay buffers */
+    int nbufs;                 /* 0 if they could not be registered */
+    int free_bufs[UR_NBUFS];
+    int nfree;
+    long long lag;             /* How long the last batch took, in ns */
+};
+
+static void conn_close(ur_loop_t *loop, conn_t *c);
+static int conn_scan_request(ur_loop_t *loop, conn_t *c);
+static void conn_write_hit(ur_loop_t *loop, conn_t *c);
+static void conn_wake(cache_waiter_t *w);
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The ring
+ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * ring_init - Make an io_uring for the calling thread and map it.
+ *     Returns -1 if the kernel will not make one this engine can use.
+ */
+static int ring_init(ur_ring_t *r)
+{
+    unsigned flags[] = {
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_SUBMIT_ALL,   /* Before 6.1 */
+    };
+    struct io_uring_params p;
+    unsigned *array, i;
+    size_t sq_size, cq_size;
+    char *map;
+
+    r->fd = -1;
+    r->stash = NULL;
+    r->stash_head = r->stash_len = r->stash_cap = 0;
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]) && r->fd < 0; i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = flags[i] | IORING_SETUP_CQSIZE;
+        p.cq_entries = UR_CQ_ENTRIES;
+        r->fd = sys_io_uring_setup(UR_SQ_ENTRIES, &p);
+    }
+    if (r->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        Close(r->fd);
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->map_size = sq_size > cq_size ? sq_size : cq_size;
+    map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        unix_error("io_uring mmap error");
+    }
+    r->map = map;
+
+    r->sq_khead = (unsigned *)(map + p.sq_off.head);
+    r->sq_ktail = (unsigned *)(map + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(map + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_tail = r->sq_submitted = *r->sq_ktail;
+    /* Entry i of the array always names sqe i */
+    array = (unsigned *)(map + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    r->cq_khead = (unsigned *)(map + p.cq_off.head);
+    r->cq_ktail = (unsigned *)(map + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(map + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_exit(ur_ring_t *r)
+{
+    Munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    Munmap(r->map, r->map_size);
+    Close(r->fd);
+    Free(r->stash);
+}
+
+/*
+ * ring_submit - Hand the queued entries to the kernel and, if wait is
+ *     set, wait for at least one completion. Returns -1 if the kernel
+ *     takes none until completions are reaped (EBUSY, EAGAIN), or the
+ *     wait was interrupted.
+ */
+static int ring_submit(ur_ring_t *r, int wait)
+{
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    while (1) {
+        int n = sys_io_uring_enter(r->fd, r->sq_tail - r->sq_submitted, wait ? 1 : 0,
+                                   wait ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) {
+            r->sq_submitted += n;
+            return 0;
+        }
+        if (errno == EINTR && !wait) {
+            continue;
+        }
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return -1;
+        }
+        unix_error("io_uring_enter error");
+    }
+}
+
+/*
+ * ring_stash - Take the completions waiting in the ring off it, into
+ *     r->stash, so the kernel has room to post more and will take
+ *     submissions again. Waits for one if there are none, which also
+ *     flushes completions the kernel held back for want of room. The
+ *     loop handles the stash before the ring.
+ */
+static void ring_stash(ur_ring_t *r)
+{
+    unsigned head = *r->cq_khead;
+    unsigned tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        if (sys_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            unix_error("io_uring_enter error");
+        }
+        tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+    }
+    for (; head != tail; head++) {
+        if (r->stash_head + r->stash_len == r->stash_cap) {
+            if (r->stash_head > 0) {
+                memmove(r->stash, r->stash + r->stash_head,
+                        r->stash_len * sizeof(struct io_uring_cqe));
+                r->stash_head = 0;
+            } else {
+                r->stash_cap = r->stash_cap ? r->stash_cap * 2 : r->cq_mask + 1;
+                r->stash = Realloc(r->stash, r->stash_cap * sizeof(struct io_uring_cqe));
+            }
+        }
+        r->stash[r->stash_head + r->stash_len++] = r->cqes[head & r->cq_mask];
+    }
+    __atomic_store_n(r->cq_khead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_next_cqe - Take the next completion, from the stash first, into
+ *     *cqe. Returns 0 if there is none.
+ */
+static int ring_next_cqe(ur_ring_t *r, struct io_uring_cqe *cqe)
+{
+    unsigned head;
+
+    if (r->stash_len > 0) {
+        *cqe = r->stash[r->stash_head++];
+        if (--r->stash_len == 0) {
+            r->stash_head = 0;
+        }
+        return 1;
+    }
+    head = *r->cq_khead;
+    if (head == __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *cqe = r->cqes[head & r->cq_mask];
+    /* Free the entry first; handling it may queue more */
+    __atomic_store_n(r->cq_khead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * ring_reserve - Make room for n entries that must be queued together.
+ *     If the kernel takes no more until completions are reaped, they
+ *     are stashed, as this may run while one is being handled.
+ */
+static void ring_reserve(ur_ring_t *r, unsigned n)
+{
+    while (r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) + n > r->sq_entries) {
+        if (ring_submit(r, 0) < 0) {
+            ring_stash(r);
+        }
+    }
+}
+
+/* ring_sqe - Queue a zeroed submission entry */
+static struct io_uring_sqe *ring_sqe(ur_ring_t *r)
+{
+    struct io_uring_sqe *sqe;
+
+    ring_reserve(r, 1);
+    sqe = &r->sqes[r->sq_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_tail++;
+    return sqe;
+}
+
+/* The opcodes the engine needs; IORING_OP_SOCKET came with the rest, in 5.19 */
+static const int ur_needed_ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_RECV, IORING_OP_SEND,
+    IORING_OP_SENDMSG, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+    IORING_OP_WRITE_FIXED, IORING_OP_TIMEOUT, IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+    IORING_OP_SOCKET,
+};
+
+/*
+ * uring_supported - Whether the kernel provides what the engine needs:
+ *     multishot accept and cancelling by descriptor, both from 5.19.
+ */
+int uring_supported(void)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe;
+    ur_ring_t r;
+    size_t i;
+    int ok;
+
+    if (ring_init(&r) < 0) {
+        return 0;
+    }
+    probe = Calloc(1, size);
+    ok = sys_io_uring_register(r.fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    for (i = 0; ok && i < sizeof(ur_needed_ops) / sizeof(ur_needed_ops[0]); i++) {
+        int op = ur_needed_ops[i];
+
+        ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    Free(probe);
+    ring_exit(&r);
+    return ok;
+}
+
+/*
+ * Connections
+ */
+
+static struct io_uring_sqe *conn_sqe(ur_loop_t *loop, conn_t *c, int op)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    sqe->user_data = (uint64_t)(uintptr_t)c | op;
+    if (op == OP_CLIENT_READ || op == OP_CLIENT_WRITE) {
+        c->client_ops++;
+    } else {
+        c->server_ops++;
+    }
+    return sqe;
+}
+
+static struct io_uring_sqe *loop_sqe(ur_loop_t *loop, int op)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    sqe->user_data = op;
+    return sqe;
+}
+
+static void idle_append(ur_loop_t *loop, conn_t *c)
+{
+    if (c->idle_linked) {
+        return;
+    }
+    c->idle_linked = 1;
+    c->idle_next = NULL;
+    c->idle_prev = loop->idle_tail;
+    if (loop->idle_tail) {
+        loop->idle_tail->idle_next = c;
+    } else {
+        loop->idle_head = c;
+    }
+    loop->idle_tail = c;
+}
+
+static void idle_remove(ur_loop_t *loop, conn_t *c)
+{
+    if (!c->idle_linked) {
+        return;
+    }
+    if (c->idle_prev) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        loop->idle_head = c->idle_next;
+    }
+    if (c->idle_next) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        loop->idle_tail = c->idle_prev;
+    }
+    c->idle_linked = 0;
+}
+
+/* Add response bytes to the object being filled, if any */
+static void conn_cache_append(conn_t *c, const void *data, size_t n)
+{
+    if (c->fill) {
+        cache_fill_append(c->fill, data, n);
+    }
+}
+
+/* conn_uncache - Give up filling the cache with this response */
+static void conn_uncache(conn_t *c)
+{
+    if (c->fill) {
+        cache_fill_end(c->fill, 0);
+        c->fill = NULL;
+    }
+}
+
+/* conn_body_left - Body bytes still to come, or -1 if it ends at EOF */
+static long long conn_body_left(conn_t *c)
+{
+    if (!c->parsed || c->resp.chunked || c->resp.content_length < 0) {
+        return -1;
+    }
+    return c->resp.content_length - c->body_len;
+}
+
+/*
+ * conn_body_scan - Of the n bytes p the origin sent after body_len
+ *     bytes of the body, the number that belong to the response. Marks
+ *     the response done once they complete it, and overrun if more
+ *     followed, which keeps the connection out of the pool.
+ */
+static size_t conn_body_scan(conn_t *c, const char *p, size_t n)
+{
+    long long left = response_has_body(&c->resp) ? conn_body_left(c) : 0;
+    size_t used = n;
+
+    if (c->resp.chunked && left) {
+        used = chunked_scan(&c->chunks, p, n);
+        c->resp_done = c->chunks.state == CHUNK_DONE;
+    } else if (left >= 0) {
+        used = (long long)n > left ? (size_t)left : n;
+        c->resp_done = (long long)used == left;
+    }
+    c->overrun = used < n;
+    return used;
+}
+
+/* A registered relay buffer if one is free, else one from the pool */
+static void conn_take_buf(ur_loop_t *loop, conn_t *c)
+{
+    if (loop->nfree > 0) {
+        c->buf = loop->free_bufs[--loop->nfree];
+        c->body = loop->bufs + (size_t)c->buf * UR_BUF_SIZE;
+        c->body_cap = UR_BUF_SIZE;
+    } else {
+        c->buf = -1;
+        c->body = bufpool_get(UR_BUF_SIZE, &c->body_cap);
+    }
+}
+
+static void conn_put_buf(ur_loop_t *loop, conn_t *c)
+{
+    if (!c->body) {
+        return;
+    }
+    if (c->buf >= 0) {
+        loop->free_bufs[loop->nfree++] = c->buf;
+    } else {
+        bufpool_put(c->body, c->body_cap);
+    }
+    c->body = NULL;
+    c->buf = -1;
+}
+
+/*
+ * conn_close_server - Close the origin connection. Only called with
+ *     nothing in flight on it.
+ */
+static void conn_close_server(conn_t *c)
+{
+    if (c->server_fd >= 0) {
+        Close(c->server_fd);
+        c->server_fd = -1;
+    }
+}
+
+/*
+ * conn_release_server - Done with the origin connection: back to the
+ *     pool if the response ended where its framing said, with nothing
+ *     after it, and the origin keeps the connection open, else closed.
+ *     Only called with nothing in flight on it.
+ */
+static void conn_release_server(conn_t *c)
+{
+    if (c->server_fd < 0 || !c->resp_done || c->overrun || !c->parsed ||
+        !response_keepalive(&c->resp)) {
+        conn_close_server(c);
+        return;
+    }
+    upstream_release(c->host, c->port, c->server_fd, &c->peer, 1);
+    c->server_fd = -1;
+}
+
+/* conn_origin_done - Tell balance.c how the request to c->peer ended */
+static void conn_origin_done(conn_t *c, int outcome)
+{
+    if (c->balancing) {
+        balance_done(&c->peer, outcome, metrics_now() - c->t_origin);
+        c->balancing = 0;
+    }
+}
+
+/* conn_reset_request - Drop all state belonging to the current request */
+static void conn_reset_request(ur_loop_t *loop, conn_t *c)
+{
+    conn_origin_done(c, BALANCE_DROPPED);
+    conn_close_server(c);
+    if (c->hit) {
+        cache_served(c->cur.off);
+        cache_release(c->hit);
+        c->hit = NULL;
+    }
+    memset(&c->cur, 0, sizeof(c->cur));
+    c->head_sent = 0;
+    c->iovcnt = 0;
+    c->bypass = 0;
+    if (c->addrs) {
+        dns_release(c->addrs);
+        c->addrs = NULL;
+        c->naddrs = c->next_addr = 0;
+    }
+    conn_uncache(c);
+    if (c->fetching) {
+        admit_fetch_done();
+        c->fetching = 0;
+    }
+    conn_put_buf(loop, c);
+    Free(c->out);
+    Free(c->head);
+    Free(c->host);
+    Free(c->port);
+    c->out = NULL;
+    c->out_len = c->out_cap = 0;
+    c->head = NULL;
+    c->head_len = c->head_cap = 0;
+    c->host = c->port = NULL;
+    c->head_done = c->parsed = c->resp_done = 0;
+    c->body_len = 0;
+    c->connect_failed = 0;
+    c->reused = c->overrun = 0;
+    memset(&c->chunks, 0, sizeof(c->chunks));
+}
+
+/* Cancel everything in flight on fd; its completions still arrive */
+static void loop_cancel_fd(ur_loop_t *loop, int fd)
+{
+    struct io_uring_sqe *sqe = loop_sqe(loop, LOOP_IGNORE);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+/*
+ * conn_close - Stop serving c. Its requests are cancelled and it is
+ *     freed by loop_reap() once all of them have completed.
+ */
+static void conn_close(ur_loop_t *loop, conn_t *c)
+{
+    if (c->closed) {
+        return;
+    }
+    c->closed = 1;
+    trace_end(&c->trace);
+    admit_conn_done();
+    metrics_count(METRIC_CONNS_CLOSED);
+    idle_remove(loop, c);
+    if (c->client_ops > 0) {
+        loop_cancel_fd(loop, c->client_fd);
+    }
+    if (c->server_ops > 0) {
+        loop_cancel_fd(loop, c->server_fd);
+    }
+    c->next_dead = loop->dead;
+    loop->dead = c;
+}
+
+/* loop_reap - Free the closed connections the kernel is done with */
+static void loop_reap(ur_loop_t *loop)
+{
+    conn_t **pp = &loop->dead;
+
+    while (*pp) {
+        conn_t *c = *pp;
+
+        if (c->client_ops > 0 || c->server_ops > 0) {
+            pp = &c->next_dead;
+            continue;
+        }
+        *pp = c->next_dead;
+        conn_reset_request(loop, c);
+        Close(c->client_fd);
+        Free(c->in);
+        Free(c);
+    }
+}
+
+static void conn_read_request(ur_loop_t *loop, conn_t *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if (c->in_len == c->in_cap) {
+        if (c->in_cap >= UR_MAX_HDRS) {
+            conn_close(loop, c);
+            return;
+        }
+        c->in_cap *= 2;
+        c->in = Realloc(c->in, c->in_cap);
+    }
+    sqe = conn_sqe(loop, c, OP_CLIENT_READ);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->client_fd;
+    sqe->addr = (uintptr_t)(c->in + c->in_len);
+    sqe->len = c->in_cap - c->in_len;
+}
+
+/*
+ * conn_wait_request - Wait for the next request on c, starting it
+ *     at once if it has already been read.
+ */
+static void conn_wait_request(ur_loop_t *loop, conn_t *c)
+{
+    /* A large head is no reason to keep a large buffer while idle */
+    if (c->in_len == 0 && c->in_cap > UR_INIT_HDRS) {
+        Free(c->in);
+        c->in_cap = UR_INIT_HDRS;
+        c->in = Malloc(c->in_cap);
+    }
+    c->state = CONN_READ_REQ;
+    c->idle_since = now_ms();
+    idle_append(loop, c);
+    if (c->in_len == 0 || !conn_scan_request(loop, c)) {
+        conn_read_request(loop, c);
+    }
+}
+
+static void conn_request_read(ur_loop_t *loop, conn_t *c, int res)
+{
+    if (res <= 0) {
+        conn_close(loop, c);
+        return;
+    }
+
+    /* The head can only have ended if a line did */
+    c->in_len += res;
+    if (http_find_lf(c->in + c->in_len - res, c->in + c->in_len) &&
+        conn_scan_request(loop, c)) {
+        return;
+    }
+    conn_read_request(loop, c);
+}
+
+/*
+ * conn_next_request - The response has been sent. Close the connection
+ *     or keep it for the next request, which may already be buffered.
+ */
+static void conn_next_request(ur_loop_t *loop, conn_t *c)
+{
+    metrics_since(METRIC_TOTAL, c->t_start);
+    trace_end(&c->trace);
+    if (!c->keepalive || (handoff_draining() && c->in_len == c->req_len)) {
+        conn_close(loop, c);
+        return;
+    }
+    conn_reset_request(loop, c);
+
+    memmove(c->in, c->in + c->req_len, c->in_len - c->req_len);
+    c->in_len -= c->req_len;
+    c->req_len = 0;
+    conn_wait_request(loop, c);
+}
+
+/* conn_hit_batch - Queue the next run of hit's available bytes */
+static void conn_hit_batch(conn_t *c, size_t avail, int state)
+{
+    /* The proxy's headers go between the head and the rest */
+    size_t end = c->head_sent ? avail : (size_t)c->hit->hdr_len;
+    int n = cache_object_iov(c->hit, &c->cur, end, c->iov, CACHE_IOV_MAX);
+    int i;
+
+    c->batch_len = 0;
+    for (i = 0; i < n; i++) {
+        c->batch_len += c->iov[i].iov_len;
+    }
+    if (!c->head_sent && c->cur.off + c->batch_len == end) {
+        long long body_len = state == CACHE_COMPLETE ? (long long)(avail - end - 2) : -1;
+        cache_cursor_t rest = c->cur;
+        int m;
+
+        c->keepalive = c->keepalive && (c->hit->delimited || body_len >= 0);
+        c->iov[n].iov_base = c->hdrs;
+        c->iov[n].iov_len = cached_head_hdrs(c->hdrs, sizeof(c->hdrs), c->hit->delimited,
+                                             body_len, c->keepalive);
+        n++;
+        c->head_sent = 1;
+
+        cache_cursor_advance(c->hit, &rest, c->batch_len);
+        m = cache_object_iov(c->hit, &rest, avail, c->iov + n, CACHE_IOV_MAX + 1 - n);
+        for (i = n; i < n + m; i++) {
+            c->batch_len += c->iov[i].iov_len;
+        }
+        n += m;
+    }
+    c->iovcnt = n;
+    c->iov_idx = 0;
+}
+
+/* conn_send_batch - Send the unsent part of the hit batch */
+static void conn_send_batch(ur_loop_t *loop, conn_t *c)
+{
+    struct io_uring_sqe *sqe = conn_sqe(loop, c, OP_CLIENT_WRITE);
+
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = &c->iov[c->iov_idx];
+    c->msg.msg_iovlen = c->iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->client_fd;
+    sqe->addr = (uintptr_t)&c->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/*
+ * conn_write_hit - Send hit to the client as far as it has arrived.
+ *     While the object is filling, wait in its waiter list for
+ *     conn_wake().
+ */
+static void conn_write_hit(ur_loop_t *loop, conn_t *c)
+{
+    while (1) {
+        int state;
+        size_t avail = cache_available(c->hit, &state);
+
+        if (state == CACHE_ABORTED) {
+            if (c->head_sent) {
+                conn_close(loop, c);
+                return;
+            }
+            /* Its fill failed before anything was sent; fetch it uncached */
+            cache_release(c->hit);
+            c->hit = NULL;
+            memset(&c->cur, 0, sizeof(c->cur));
+            c->bypass = 1;
+            conn_scan_request(loop, c);
+            return;
+        }
+        if (avail > 0 && (c->cur.off < avail || !c->head_sent)) {
+            conn_hit_batch(c, avail, state);
+            conn_send_batch(loop, c);
+            return;
+        }
+        if (state == CACHE_COMPLETE) {
+            conn_next_request(loop, c);
+            return;
+        }
+        if (cache_wait(c->hit, avail, &c->waiter)) {
+            return;
+        }
+    }
+}
+
+static void conn_hit_written(ur_loop_t *loop, conn_t *c, int res)
+{
+    struct iovec *iov = &c->iov[c->iov_idx];
+    size_t n;
+
+    if (res <= 0) {
+        conn_close(loop, c);
+        return;
+    }
+    trace_bytes(res);
+    n = (size_t)res;
+    while (c->iovcnt > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        c->iov_idx++;
+        c->iovcnt--;
+    }
+    if (c->iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+        conn_send_batch(loop, c);
+        return;
+    }
+    cache_cursor_advance(c->hit, &c->cur, c->batch_len);
+    c->batch_len = 0;
+    conn_write_hit(loop, c);
+}
+
+/*
+ * conn_connect_next - Connect to the next origin address, with a
+ *     timeout on the connect and the request linked to go out once it
+ *     succeeds. Closes the connection once every address has failed.
+ */
+static void conn_connect_next(ur_loop_t *loop, conn_t *c)
+{
+    struct io_uring_sqe *sqe;
+    struct addrinfo *p = NULL;
+    int fd = -1;
+
+    while (c->next_addr < c->naddrs) {
+        p = c->order[c->next_addr++];
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) >= 0) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        metrics_count(METRIC_CONNECT_FAILED);
+        conn_close(loop, c);
+        return;
+    }
+    c->server_fd = fd;
+    c->state = CONN_CONNECT;
+    balance_peer(&c->peer, p);
+    balance_begin(&c->peer);
+    trace_upstream(&c->peer);
+    c->balancing = 1;
+    c->t_origin = metrics_now();
+
+    ring_reserve(&loop->ring, 3);
+    sqe = conn_sqe(loop, c, OP_CONNECT);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)p->ai_addr;
+    sqe->off = p->ai_addrlen;
+    sqe->flags = IOSQE_IO_LINK;
+
+    /* Bounds the connect only; the chain goes on to the request */
+    sqe = conn_sqe(loop, c, OP_CONNECT_TIMEOUT);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->connect_timeout;
+    sqe->len = 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = conn_sqe(loop, c, OP_SERVER_WRITE);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)c->out;
+    sqe->len = c->out_len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+}
+
+/*
+ * conn_connect_failed - The connect failed or timed out, which also
+ *     cancels the request linked to it. Try the next address once every
+ *     operation of the attempt is back.
+ */
+static void conn_connect_failed(ur_loop_t *loop, conn_t *c)
+{
+    conn_origin_done(c, BALANCE_FAILED);
+    if (c->server_ops > 0) {
+        return;
+    }
+    conn_close_server(c);
+    c->connect_failed = 0;
+    conn_connect_next(loop, c);
+}
+
+/*
+ * conn_connect_pooled - Send the request on an idle pooled connection to
+ *     the origin, if there is one. Returns 0 if a new one is needed.
+ */
+static int conn_connect_pooled(ur_loop_t *loop, conn_t *c)
+{
+    struct io_uring_sqe *sqe;
+    int fd = upstream_take(c->host, c->port, &c->peer, 0);
+
+    if (fd < 0) {
+        return 0;
+    }
+    c->server_fd = fd;
+    c->state = CONN_CONNECT;
+    c->reused = 1;
+    trace_upstream(&c->peer);
+    c->balancing = 1;
+    c->t_origin = metrics_now();
+    c->t_stage = metrics_since(METRIC_CONNECT, c->t_stage);
+
+    sqe = conn_sqe(loop, c, OP_SERVER_WRITE);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)c->out;
+    sqe->len = c->out_len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    return 1;
+}
+
+/*
+ * conn_retry - A pooled connection the origin closed before answering
+ *     says little about the origin, and nothing has reached the client,
+ *     so send the request, still in out, again on a new connection.
+ *     Returns 0 if the connection was not a reused one, which leaves the
+ *     failure to the caller. Only called with nothing in flight on it.
+ */
+static int conn_retry(ur_loop_t *loop, conn_t *c)
+{
+    if (!c->reused || c->head_len > 0) {
+        return 0;
+    }
+    conn_origin_done(c, BALANCE_DROPPED);
+    conn_close_server(c);
+    conn_put_buf(loop, c);
+    c->reused = 0;
+    c->addrs = dns_lookup(c->host, c->port);
+    c->naddrs = balance_order(c->addrs->list, c->order);
+    c->next_addr = 0;
+    conn_connect_next(loop, c);
+    return 1;
+}
+
+/* Read more of the response head from the origin */
+static void conn_read_head(ur_loop_t *loop, conn_t *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if (c->head_len == c->head_cap) {
+        if (c->head_cap >= UR_MAX_HDRS) {
+            conn_close(loop, c);
+            return;
+        }
+        c->head_cap = c->head_cap ? c->head_cap * 2 : MAXBUF;
+        c->head = Realloc(c->head, c->head_cap);
+    }
+    sqe = conn_sqe(loop, c, OP_SERVER_READ);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->server_fd;
+    sqe->addr = (uintptr_t)(c->head + c->head_len);
+    sqe->len = c->head_cap - c->head_len;
+}
+
+static void conn_request_sent(ur_loop_t *loop, conn_t *c, int res)
+{
+    if (c->connect_failed) {
+        conn_connect_failed(loop, c);
+        return;
+    }
+    if (res < 0 || (size_t)res < c->out_len) {
+        if (!conn_retry(loop, c)) {
+            conn_close(loop, c);
+        }
+        return;
+    }
+
+    if (c->addrs) {
+        dns_release(c->addrs);
+        c->addrs = NULL;
+        c->naddrs = c->next_addr = 0;
+    }
+    conn_take_buf(loop, c);
+    c->state = CONN_RELAY;
+    conn_read_head(loop, c);
+}
+
+/* Queue a read of the next body bytes into the relay buffer */
+static void conn_read_body(ur_loop_t *loop, conn_t *c)
+{
+    long long left = conn_body_left(c);
+    size_t want = left >= 0 && left < (long long)c->body_cap ? (size_t)left : c->body_cap;
+    struct io_uring_sqe *sqe = conn_sqe(loop, c, OP_SERVER_READ);
+
+    sqe->opcode = c->buf >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = c->server_fd;
+    sqe->addr = (uintptr_t)c->body;
+    sqe->len = want;
+    sqe->buf_index = c->buf >= 0 ? c->buf : 0;
+}
+
+/*
+ * conn_write_out - Write the rest of wbuf to the client, linked with
+ *     the next read from the origin unless the response is all in
+ */
+static void conn_write_out(ur_loop_t *loop, conn_t *c)
+{
+    int link = !c->resp_done;
+    struct io_uring_sqe *sqe;
+
+    ring_reserve(&loop->ring, link ? 2 : 1);
+    sqe = conn_sqe(loop, c, OP_CLIENT_WRITE);
+    sqe->opcode = c->wfixed >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = c->client_fd;
+    sqe->addr = (uintptr_t)(c->wbuf + c->woff);
+    sqe->len = c->wlen - c->woff;
+    sqe->buf_index = c->wfixed >= 0 ? c->wfixed : 0;
+    if (link) {
+        sqe->flags = IOSQE_IO_LINK;
+        conn_read_body(loop, c);
+    }
+}
+
+static void conn_write(ur_loop_t *loop, conn_t *c, char *buf, size_t len, int fixed)
+{
+    c->wbuf = buf;
+    c->wlen = len;
+    c->woff = 0;
+    c->wfixed = fixed;
+    conn_write_out(loop, c);
+}
+
+/*
+ * conn_response_done - The origin is finished with the response. Complete
+ *     its cache object and move on to the next request.
+ */
+static void conn_response_done(ur_loop_t *loop, conn_t *c)
+{
+    int fetched = c->server_fd >= 0;
+
+    conn_release_server(c);
+    if (c->parsed && !c->resp.chunked && c->resp.content_length >= 0 &&
+        response_has_body(&c->resp) && c->body_len < c->resp.content_length) {
+        /* Truncated by the origin; the client cannot reuse the connection */
+        conn_close(loop, c);
+        return;
+    }
+    if (fetched) {
+        metrics_since(METRIC_RELAY, c->t_stage);
+    }
+    if (c->fill) {
+        cache_fill_end(c->fill, 1);
+        c->fill = NULL;
+    }
+    conn_next_request(loop, c);
+}
+
+/*
+ * conn_rewrite_head - The response head occupies the first head_end
+ *     bytes of head. Send it to the client with the origin's hop-by-hop
+ *     headers replaced by the proxy's Connection header, add it to the
+ *     cache object, and send the body bytes that arrived with it. A 304
+ *     confirming the stale object c->fill revalidates is not passed on;
+ *     that object is served instead, under the head the 304 updates.
+ */
+static void conn_rewrite_head(ur_loop_t *loop, conn_t *c, size_t head_end)
+{
+    size_t rest = c->head_len - head_end;
+    size_t n;
+    int hdr_len;
+
+    if (c->out_cap < head_end + MAXLINE + rest) {
+        c->out_cap = head_end + MAXLINE + rest;
+        c->out = Realloc(c->out, c->out_cap);
+    }
+    n = rewrite_response_head(c->head, head_end, &c->resp, &c->keepalive, c->out, &hdr_len);
+    if ((c->hit = fill_revalidated(c->fill, c->out, hdr_len, &c->resp)) != NULL) {
+        trace_outcome(TRACE_REVALIDATED);
+        c->hit = compress_variant(c->hit, c->accept_encodings);
+        c->fill = NULL;
+        c->resp_done = 1;
+        c->overrun = rest > 0;
+        conn_release_server(c);
+        c->state = CONN_WRITE_HIT;
+        conn_write_hit(loop, c);
+        return;
+    }
+    conn_cache_append(c, c->out, hdr_len);
+    conn_cache_append(c, "\r\n", 2);
+    if (c->fill) {
+        long long body_len = !response_has_body(&c->resp) ? 0 :
+                             c->resp.chunked ? -1 : c->resp.content_length;
+        cache_fill_head(c->fill, hdr_len, response_delimited(&c->resp), body_len,
+                        response_expires(&c->resp), response_grace(&c->resp));
+    }
+
+    rest = conn_body_scan(c, c->head + head_end, rest);
+    memcpy(c->out + n, c->head + head_end, rest);
+    conn_cache_append(c, c->head + head_end, rest);
+    c->out_len = n + rest;
+    c->body_len = rest;
+    c->head_done = 1;
+    conn_write(loop, c, c->out, c->out_len, -1);
+}
+
+/*
+ * conn_head_read - Buffer the response head until the blank line, then
+ *     rewrite it. Anything that is not HTTP/1.x is relayed untouched to
+ *     EOF and kept out of the cache, as in the other engines.
+ */
+static void conn_head_read(ur_loop_t *loop, conn_t *c, int res)
+{
+    size_t from, scan;
+    char *nl;
+
+    if (res <= 0) {
+        if (!conn_retry(loop, c)) {
+            conn_origin_done(c, BALANCE_FAILED);
+            conn_close(loop, c);
+        }
+        return;
+    }
+    if (c->head_len == 0) {
+        c->t_stage = metrics_since(METRIC_FIRST_BYTE, c->t_stage);
+        conn_origin_done(c, BALANCE_OK);
+    }
+    from = c->head_len > 3 ? c->head_len - 3 : 0;
+    c->head_len += res;
+
+    if (!c->parsed && (nl = memchr(c->head, '\n', c->head_len)) != NULL) {
+        char line[MAXLINE];
+        size_t len = nl - c->head + 1;
+
+        if (len >= sizeof(line)) {
+            len = sizeof(line) - 1;
+        }
+        memcpy(line, c->head, len);
+        line[len] = '\0';
+        if (parse_status_line(line, &c->resp) < 0) {
+            conn_uncache(c);
+            c->keepalive = 0;
+            c->head_done = 1;
+            conn_write(loop, c, c->head, c->head_len, -1);
+            return;
+        }
+        c->parsed = 1;
+    }
+
+    for (scan = from; c->parsed && scan + 4 <= c->head_len; scan++) {
+        if (!memcmp(c->head + scan, "\r\n\r\n", 4)) {
+            conn_rewrite_head(loop, c, scan + 4);
+            return;
+        }
+    }
+    conn_read_head(loop, c);
+}
+
+static void conn_body_read(ur_loop_t *loop, conn_t *c, int res)
+{
+    if (res == -ECANCELED) {
+        return;                 /* Its write came up short and relinked */
+    }
+    if (res < 0) {
+        conn_close(loop, c);
+        return;
+    }
+    if (res == 0 || (res = (int)conn_body_scan(c, c->body, res)) == 0) {
+        conn_response_done(loop, c);
+        return;
+    }
+
+    conn_cache_append(c, c->body, res);
+    c->body_len += res;
+    conn_write(loop, c, c->body, res, c->buf);
+}
+
+static void conn_relay_written(ur_loop_t *loop, conn_t *c, int res)
+{
+    if (res <= 0) {
+        conn_close(loop, c);
+        return;
+    }
+    trace_bytes(res);
+    c->woff += res;
+    if (c->woff < c->wlen) {
+        /* A short write cancelled the read linked to it */
+        conn_write_out(loop, c);
+        return;
+    }
+    if (c->resp_done) {
+        conn_response_done(loop, c);
+    }
+}
+
+/* conn_serve_metrics - Answer with the proxy's metrics, as if relayed */
+static void conn_serve_metrics(ur_loop_t *loop, conn_t *c)
+{
+    trace_outcome(TRACE_LOCAL);
+    c->out = metrics_response(c->keepalive, &c->out_len);
+    c->out_cap = c->out_len;
+    c->head_done = 1;
+    c->resp_done = 1;
+    c->state = CONN_RELAY;
+    conn_write(loop, c, c->out, c->out_len, -1);
+}
+
+/* conn_refuse - Answer with status, 429 or 503, and close afterwards */
+static void conn_refuse(ur_loop_t *loop, conn_t *c, int status)
+{
+    c->keepalive = 0;
+    trace_outcome(TRACE_REFUSED);
+    c->out = admit_response(status, &c->out_len);
+    c->out_cap = c->out_len;
+    c->head_done = 1;
+    c->resp_done = 1;
+    c->state = CONN_RELAY;
+    conn_write(loop, c, c->out, c->out_len, -1);
+}
+
+/*
+ * conn_start_request - Serve the request req parsed from the head of in,
+ *     from the cache, or start fetching it from the origin.
+ */
+static void conn_start_request(ur_loop_t *loop, conn_t *c, const http_request_t *req)
+{
+    char uri[MAXLINE];
+    char hostname[MAXLINE];
+    char port[MAXLINE];
+    char path[MAXLINE];
+    char host_hdr[MAXLINE];
+    char cache_key[MAXLINE];
+    char cond[MAX_CONDITIONAL_HDRS];
+    struct iovec iov[REQUEST_IOV_MAX];
+    int iovcnt, i;
+
+    idle_remove(loop, c);
+    c->keepalive = req->keepalive && !handoff_draining();
+    c->accept_encodings = req->accept_encodings;
+    if (!c->bypass) {
+        c->t_start = metrics_now();
+        metrics_count(METRIC_REQUESTS);
+        trace_begin(&c->trace);
+    }
+    if (metrics_request(req)) {
+        conn_serve_metrics(loop, c);
+        return;
+    }
+    if (!c->bypass && !admit_request(c->client)) {
+        conn_refuse(loop, c, 429);
+        return;
+    }
+
+    http_span_copy(uri, sizeof(uri), req->uri);
+    parse_uri(uri, hostname, port, path);
+    if (hostname[0] == '\0' && req->host.p) {
+        http_span_copy(host_hdr, sizeof(host_hdr), req->host);
+        normalize_host_from_header(host_hdr, hostname, port);
+    }
+    if (hostname[0] == '\0') {
+        conn_close(loop, c);
+        return;
+    }
+
+    build_cache_key(cache_key, hostname, port, path);
+    trace_key(cache_key);
+    if (!c->bypass) {
+        cache_object_t *obj;
+        int fill;
+
+        c->t_stage = metrics_now();
+        obj = cache_lookup_fill(cache_key, &fill);
+        metrics_since(METRIC_LOOKUP, c->t_stage);
+        if (!fill) {
+            trace_outcome(TRACE_HIT);
+            c->hit = compress_variant(obj, c->accept_encodings);
+            c->state = CONN_WRITE_HIT;
+            conn_write_hit(loop, c);
+            return;
+        }
+        c->fill = obj;
+    }
+    if (!admit_fetch()) {
+        conn_uncache(c);
+        conn_refuse(loop, c, 503);
+        return;
+    }
+    c->fetching = 1;
+    trace_outcome(TRACE_MISS);
+
+    /* The request goes out after this returns, so gather it, once */
+    fill_conditional(c->fill, cond, sizeof(cond));
+    iovcnt = build_request_iov(iov, hostname, port, path, req, 1, c->fill ? cond : NULL);
+    c->out_len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        c->out_len += iov[i].iov_len;
+    }
+    c->out_cap = c->out_len;
+    c->out = Malloc(c->out_cap);
+    c->out_len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(c->out + c->out_len, iov[i].iov_base, iov[i].iov_len);
+        c->out_len += iov[i].iov_len;
+    }
+
+    c->host = Malloc(strlen(hostname) + 1);
+    strcpy(c->host, hostname);
+    c->port = Malloc(strlen(port) + 1);
+    strcpy(c->port, port);
+
+    c->t_stage = metrics_now();
+    if (conn_connect_pooled(loop, c)) {
+        return;
+    }
+    c->addrs = dns_lookup(hostname, port);
+    c->naddrs = balance_order(c->addrs->list, c->order);
+    c->next_addr = 0;
+    conn_connect_next(loop, c);
+}
+
+/* conn_scan_request - Start the request if in holds all of its head */
+static int conn_scan_request(ur_loop_t *loop, conn_t *c)
+{
+    http_request_t req;
+    long long t = metrics_now();
+    int n = http_parse_request(c->in, c->in_len, &req);
+
+    if (n == 0) {
+        return 0;
+    }
+    if (n < 0) {
+        conn_close(loop, c);
+        return 1;
+    }
+    metrics_since(METRIC_PARSE, t);
+    c->req_len = n;
+    conn_start_request(loop, c, &req);
+    return 1;
+}
+
+/* conn_complete - Act on the completion of one of c's operations */
+static void conn_complete(ur_loop_t *loop, conn_t *c, int op, int res)
+{
+    if (op == OP_CLIENT_READ || op == OP_CLIENT_WRITE) {
+        c->client_ops--;
+    } else {
+        c->server_ops--;
+    }
+    if (c->closed) {
+        return;
+    }
+
+    trace_resume(&c->trace);
+    switch (op) {
+    case OP_CLIENT_READ:
+        conn_request_read(loop, c, res);
+        break;
+    case OP_CLIENT_WRITE:
+        if (c->state == CONN_WRITE_HIT) {
+            conn_hit_written(loop, c, res);
+        } else {
+            conn_relay_written(loop, c, res);
+        }
+        break;
+    case OP_CONNECT:
+        if (res < 0) {
+            c->connect_failed = 1;
+            conn_connect_failed(loop, c);
+        } else {
+            c->t_stage = metrics_since(METRIC_CONNECT, c->t_stage);
+        }
+        break;
+    case OP_CONNECT_TIMEOUT:
+        if (res == -ETIME) {
+            metrics_count(METRIC_CONNECT_TIMEOUTS);
+        }
+        if (c->connect_failed) {
+            conn_connect_failed(loop, c);
+        }
+        break;
+    case OP_SERVER_WRITE:
+        conn_request_sent(loop, c, res);
+        break;
+    case OP_SERVER_READ:
+        if (c->head_done) {
+            conn_body_read(loop, c, res);
+        } else {
+            conn_head_read(loop, c, res);
+        }
+        break;
+    }
+    trace_resume(NULL);
+}
+
+/*
+ * The loop
+ */
+
+static void loop_set_connect_timeout(ur_loop_t *loop)
+{
+    int ms = balance_connect_timeout();
+
+    loop->connect_timeout.tv_sec = ms / 1000;
+    loop->connect_timeout.tv_nsec = (ms % 1000) * 1000000LL;
+}
+
+static void loop_arm_accept(ur_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = loop_sqe(loop, LOOP_ACCEPT);
+
+    loop->accepting = 1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (loop->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+static void loop_accepted(ur_loop_t *loop, int res, unsigned flags)
+{
+    if (res >= 0 && !admit_conn()) {
+        admit_shed(res);
+    } else if (res >= 0 && admit_late(loop->lag)) {
+        admit_conn_done();
+        admit_shed(res);
+    } else if (res >= 0) {
+        conn_t *c = Calloc(1, sizeof(conn_t));
+
+        c->loop = loop;
+        c->client_fd = res;
+        c->server_fd = -1;
+        c->buf = -1;
+        c->waiter.wake = conn_wake;
+        c->in_cap = UR_INIT_HDRS;
+        c->in = Malloc(c->in_cap);
+        c->client = admit_client(res);
+        metrics_count(METRIC_CONNS_OPENED);
+        conn_wait_request(loop, c);
+    } else if (res == -EINVAL && loop->multishot) {
+        loop->multishot = 0;    /* Older kernel, accept one at a time */
+    } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+        fprintf(stderr, "accept failed: %s\n", strerror(-res));
+    }
+    if (!(flags & IORING_CQE_F_MORE) && loop->accepting && !handoff_draining()) {
+        loop_arm_accept(loop);
+    }
+}
+
+static void loop_arm_wake(ur_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = loop_sqe(loop, LOOP_WAKE);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wakefd;
+    sqe->addr = (uintptr_t)&loop->wake_count;
+    sqe->len = sizeof(loop->wake_count);
+}
+
+static void loop_arm_tick(ur_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = loop_sqe(loop, LOOP_TICK);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->tick;
+    sqe->len = 1;
+}
+
+/*
+ * conn_wake - Called from the thread filling the object c is waiting
+ *     for once it has grown or its fill has ended. Hand c back to its
+ *     own loop, which picks it up in loop_run_woken().
+ */
+static void conn_wake(cache_waiter_t *w)
+{
+    conn_t *c = (conn_t *)((char *)w - offsetof(conn_t, waiter));
+    ur_loop_t *loop = c->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->woken_lock);
+    c->next_woken = loop->woken;
+    loop->woken = c;
+    pthread_mutex_unlock(&loop->woken_lock);
+
+    if (write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        unix_error("eventfd write error");
+    }
+}
+
+/* loop_run_woken - Carry on sending the objects woken hits wait for */
+static void loop_run_woken(ur_loop_t *loop)
+{
+    conn_t *c;
+
+    pthread_mutex_lock(&loop->woken_lock);
+    c = loop->woken;
+    loop->woken = NULL;
+    pthread_mutex_unlock(&loop->woken_lock);
+
+    while (c) {
+        conn_t *next = c->next_woken;
+
+        if (!c->closed && c->state == CONN_WRITE_HIT) {
+            trace_resume(&c->trace);
+            conn_write_hit(loop, c);
+            trace_resume(NULL);
+        }
+        c = next;
+    }
+    loop_arm_wake(loop);
+}
+
+/*
+ * loop_drain - The sockets have been handed off. Stop accepting, and
+ *     close the connections waiting for another request; a response
+ *     leaves keepalive set on its connection, while one just accepted
+ *     still gets its first request answered. Requests being served
+ *     are answered with Connection: close.
+ */
+static void loop_drain(ur_loop_t *loop)
+{
+    conn_t *c = loop->idle_head;
+
+    loop_cancel_fd(loop, loop->listenfd);
+    loop->accepting = 0;
+    while (c) {
+        conn_t *next = c->idle_next;
+
+        if (c->keepalive && c->in_len == 0) {
+            conn_close(loop, c);
+        }
+        c = next;
+    }
+}
+
+static void loop_expire_idle(ur_loop_t *loop)
+{
+    long long cutoff = now_ms() - KEEPALIVE_TIMEOUT_MS;
+
+    while (loop->idle_head && loop->idle_head->idle_since < cutoff) {
+        conn_close(loop, loop->idle_head);
+    }
+    loop_arm_tick(loop);
+}
+
+/* Register the relay buffers; the loop runs without them if it cannot */
+static void loop_register_bufs(ur_loop_t *loop)
+{
+    struct iovec iov[UR_NBUFS];
+    int i;
+
+    loop->bufs = Mmap(NULL, (size_t)UR_NBUFS * UR_BUF_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    for (i = 0; i < UR_NBUFS; i++) {
+        iov[i].iov_base = loop->bufs + (size_t)i * UR_BUF_SIZE;
+        iov[i].iov_len = UR_BUF_SIZE;
+    }
+    if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, iov, UR_NBUFS) < 0) {
+        fprintf(stderr, "io_uring buffer registration failed: %s\n", strerror(errno));
+        Munmap(loop->bufs, (size_t)UR_NBUFS * UR_BUF_SIZE);
+        loop->bufs = NULL;
+        return;
+    }
+    loop->nbufs = UR_NBUFS;
+    for (i = 0; i < UR_NBUFS; i++) {
+        loop->free_bufs[i] = UR_NBUFS - 1 - i;
+    }
+    loop->nfree = UR_NBUFS;
+}
+
+static void *uring_loop(void *arg)
+{
+    ur_loop_t *loop = arg;
+    ur_ring_t *r = &loop->ring;
+
+    pin_thread(loop->cpu);
+    /* Made here, as a single-issuer ring only takes its creator's submissions */
+    if (ring_init(r) < 0) {
+        unix_error("io_uring_setup error");
+    }
+    loop_register_bufs(loop);
+    loop_arm_accept(loop);
+    loop_arm_wake(loop);
+    loop_arm_tick(loop);
+
+    while (1) {
+        struct io_uring_cqe cqe;
+        long long t;
+
+        ring_submit(r, 1);
+        t = metrics_now();
+        while (ring_next_cqe(r, &cqe)) {
+            uint64_t ud = cqe.user_data;
+            int res = cqe.res;
+            unsigned flags = cqe.flags;
+            conn_t *c = (conn_t *)(uintptr_t)(ud & ~(uint64_t)OP_MASK);
+
+            if (c) {
+                conn_complete(loop, c, (int)(ud & OP_MASK), res);
+                continue;
+            }
+            switch (ud) {
+            case LOOP_ACCEPT:
+                loop_accepted(loop, res, flags);
+                break;
+            case LOOP_WAKE:
+                loop_run_woken(loop);
+                break;
+            case LOOP_TICK:
+                /* A reload may have changed it */
+                loop_set_connect_timeout(loop);
+                if (loop->accepting && handoff_draining()) {
+                    loop_drain(loop);
+                }
+                loop_expire_idle(loop);
+                break;
+            }
+        }
+        loop_reap(loop);
+        loop->lag = metrics_now() - t;
+    }
+    return NULL;
+}
+
+/*
+ * uring_run - Run nloops io_uring loops over the nlisten sockets in
+ *     listenfds, pinning loop i to CPU i if pin is set. The calling
+ *     thread becomes the last loop and never returns. The caller checks
+ *     uring_supported() first.
+ */
+void uring_run(int *listenfds, int nlisten, int nloops, int pin)
+{
+    ur_loop_t *loops = Calloc(nloops, sizeof(ur_loop_t));
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < nloops; i++) {
+        ur_loop_t *loop = &loops[i];
+
+        loop->cpu = pin ? i : -1;
+        loop->listenfd = listenfds[i % nlisten];
+        loop->multishot = 1;
+        /* Blocking, or its pending read would fail instead of waiting */
+        if ((loop->wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            unix_error("eventfd error");
+        }
+        loop->tick.tv_sec = UR_TICK_MS / 1000;
+        loop->tick.tv_nsec = (UR_TICK_MS % 1000) * 1000000LL;
+        loop_set_connect_timeout(loop);
+        pthread_mutex_init(&loop->woken_lock, NULL);
+    }
+
+    for (i = 0; i < nloops - 1; i++) {
+        Pthread_create(&tid, NULL, uring_loop, &loops[i]);
+        Pthread_detach(tid);
+    }
+    uring_loop(&loops[nloops - 1]);
+}
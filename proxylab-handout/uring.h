@@ -0,0 +1,10 @@
+/*
+ * uring.h - io_uring based proxy engine
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+int uring_supported(void);
+void uring_run(int *listenfds, int nlisten, int nloops, int pin);
+
+#endif /* __URING_H__ */